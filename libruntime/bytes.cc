@@ -0,0 +1,423 @@
+/*!
+ * Kernels on the bytes of byte objects (Strings, Symbols and the like): to
+ * compare, hash and search them. Each has a scalar version, and on x86 SSE2
+ * and AVX2 versions; the best the CPU supports is chosen on first use.
+ *
+ * Copying and filling are left to memmove() and memset(), which the C library
+ * already dispatches to vector code of its own.
+ */
+
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VTRT_BYTES_X86
+#endif
+
+#include "runtime.hh"
+
+/*
+ * The hash is defined so that every version computes the same value: eight
+ * 32-bit lanes, each mixing in one little-endian word of every 32-byte block,
+ * which are then mixed together with the length and the remaining bytes.
+ */
+static const size_t hashBlock = 32;
+static const uint32_t hashLaneSeed = 0x9e3779b9;
+
+static inline uint32_t
+rotl32(uint32_t x, int n)
+{
+	return x << n | x >> (32 - n);
+}
+
+static inline uint32_t
+hashMix(uint32_t h, uint32_t word)
+{
+	return rotl32(h ^ word, 13) * 5 + 0xe6546b64;
+}
+
+struct BytesKernels {
+	const char *name;
+	/* the index of the first byte in which a and b differ, else n */
+	size_t (*mismatch)(const uint8_t *a, const uint8_t *b, size_t n);
+	/* the index of the first byte equal to c, else n */
+	size_t (*indexOf)(const uint8_t *bytes, size_t n, uint8_t c);
+	/* the index of the first occurrence of needle (m > 1), else n */
+	size_t (*find)(const uint8_t *haystack, size_t n, const uint8_t *needle,
+	    size_t m);
+	/* seed the lanes, and mix the n / hashBlock whole blocks into them */
+	void (*hashBlocks)(const uint8_t *bytes, size_t n, uint32_t lanes[8]);
+};
+
+/*
+ * scalar
+ */
+static size_t
+mismatchScalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+static size_t
+indexOfScalar(const uint8_t *bytes, size_t n, uint8_t c)
+{
+	size_t i = 0;
+
+	while (i < n && bytes[i] != c)
+		i++;
+	return i;
+}
+
+static size_t
+findScalar(const uint8_t *haystack, size_t n, const uint8_t *needle, size_t m)
+{
+	for (size_t i = 0; i + m <= n; i++)
+		if (haystack[i] == needle[0] &&
+		    !memcmp(haystack + i + 1, needle + 1, m - 1))
+			return i;
+	return n;
+}
+
+static void
+hashBlocksScalar(const uint8_t *bytes, size_t n, uint32_t lanes[8])
+{
+	for (int lane = 0; lane < 8; lane++)
+		lanes[lane] = hashLaneSeed * (lane + 1);
+	for (size_t i = 0; i + hashBlock <= n; i += hashBlock)
+		for (int lane = 0; lane < 8; lane++) {
+			const uint8_t *w = bytes + i + lane * 4;
+
+			lanes[lane] = hashMix(lanes[lane],
+			    w[0] | w[1] << 8 | w[2] << 16 | (uint32_t)w[3] << 24);
+		}
+}
+
+static const BytesKernels scalarKernels = { "scalar", mismatchScalar,
+	indexOfScalar, findScalar, hashBlocksScalar };
+
+#ifdef VTRT_BYTES_X86
+/*
+ * SSE2, 16 bytes at a time
+ */
+__attribute__((target("sse2"))) static size_t
+mismatchSSE2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned equal = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+		if (equal != 0xffff)
+			return i + __builtin_ctz(~equal);
+	}
+	return i + mismatchScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static size_t
+indexOfSSE2(const uint8_t *bytes, size_t n, uint8_t c)
+{
+	__m128i pattern = _mm_set1_epi8(c);
+	size_t i = 0;
+
+	/* 64 bytes at a time, until there is a match in them */
+	for (; i + 64 <= n; i += 64) {
+		const __m128i *p = (const __m128i *)(bytes + i);
+		__m128i any = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), pattern),
+			_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), pattern)),
+		    _mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), pattern),
+			_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), pattern)));
+
+		if (_mm_movemask_epi8(any))
+			break;
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(bytes + i));
+		unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(x, pattern));
+
+		if (found)
+			return i + __builtin_ctz(found);
+	}
+	return i + indexOfScalar(bytes + i, n - i, c);
+}
+
+/*
+ * Candidates are the positions whose first and last bytes match the needle's,
+ * found 16 at a time; only they are compared in full.
+ */
+__attribute__((target("sse2"))) static size_t
+findSSE2(const uint8_t *haystack, size_t n, const uint8_t *needle, size_t m)
+{
+	__m128i first = _mm_set1_epi8(needle[0]);
+	__m128i last = _mm_set1_epi8(needle[m - 1]);
+	size_t i = 0, found;
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(haystack + i));
+		__m128i y = _mm_loadu_si128(
+		    (const __m128i *)(haystack + i + m - 1));
+		unsigned candidates = _mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+
+		for (; candidates; candidates &= candidates - 1) {
+			size_t at = i + __builtin_ctz(candidates);
+
+			if (!memcmp(haystack + at + 1, needle + 1, m - 2))
+				return at;
+		}
+	}
+	found = findScalar(haystack + i, n - i, needle, m);
+	return found == n - i ? n : i + found;
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+hashMixSSE2(__m128i h, __m128i word)
+{
+	h = _mm_xor_si128(h, word);
+	h = _mm_or_si128(_mm_slli_epi32(h, 13), _mm_srli_epi32(h, 19));
+	h = _mm_add_epi32(_mm_slli_epi32(h, 2), h);
+	return _mm_add_epi32(h, _mm_set1_epi32(0xe6546b64));
+}
+
+__attribute__((target("sse2"))) static void
+hashBlocksSSE2(const uint8_t *bytes, size_t n, uint32_t lanes[8])
+{
+	__m128i low = _mm_setr_epi32(hashLaneSeed, hashLaneSeed * 2,
+	    hashLaneSeed * 3, hashLaneSeed * 4);
+	__m128i high = _mm_setr_epi32(hashLaneSeed * 5, hashLaneSeed * 6,
+	    hashLaneSeed * 7, hashLaneSeed * 8);
+
+	for (size_t i = 0; i + hashBlock <= n; i += hashBlock) {
+		low = hashMixSSE2(low,
+		    _mm_loadu_si128((const __m128i *)(bytes + i)));
+		high = hashMixSSE2(high,
+		    _mm_loadu_si128((const __m128i *)(bytes + i + 16)));
+	}
+	_mm_storeu_si128((__m128i *)lanes, low);
+	_mm_storeu_si128((__m128i *)(lanes + 4), high);
+}
+
+static const BytesKernels sse2Kernels = { "sse2", mismatchSSE2, indexOfSSE2,
+	findSSE2, hashBlocksSSE2 };
+
+/*
+ * AVX2, 32 bytes at a time; as for SSE2, which finishes the last few. (Going
+ * from AVX to SSE code without clearing the upper halves of the registers
+ * costs a stall on many CPUs.)
+ */
+__attribute__((target("avx2"))) static size_t
+mismatchAVX2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+		if (equal != 0xffffffff)
+			return i + __builtin_ctz(~equal);
+	}
+	_mm256_zeroupper();
+	return i + mismatchSSE2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+indexOfAVX2(const uint8_t *bytes, size_t n, uint8_t c)
+{
+	__m256i pattern = _mm256_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 128 <= n; i += 128) {
+		const __m256i *p = (const __m256i *)(bytes + i);
+		__m256i any = _mm256_or_si256(
+		    _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p), pattern),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), pattern)),
+		    _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 2), pattern),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 3), pattern)));
+
+		if (_mm256_movemask_epi8(any))
+			break;
+	}
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(bytes + i));
+		uint32_t found =
+		    _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, pattern));
+
+		if (found)
+			return i + __builtin_ctz(found);
+	}
+	_mm256_zeroupper();
+	return i + indexOfSSE2(bytes + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) static size_t
+findAVX2(const uint8_t *haystack, size_t n, const uint8_t *needle, size_t m)
+{
+	__m256i first = _mm256_set1_epi8(needle[0]);
+	__m256i last = _mm256_set1_epi8(needle[m - 1]);
+	size_t i = 0, found;
+
+	for (; i + m - 1 + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(haystack + i));
+		__m256i y = _mm256_loadu_si256(
+		    (const __m256i *)(haystack + i + m - 1));
+		uint32_t candidates = _mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(x, first), _mm256_cmpeq_epi8(y, last)));
+
+		for (; candidates; candidates &= candidates - 1) {
+			size_t at = i + __builtin_ctz(candidates);
+
+			if (!memcmp(haystack + at + 1, needle + 1, m - 2))
+				return at;
+		}
+	}
+	_mm256_zeroupper();
+	found = findSSE2(haystack + i, n - i, needle, m);
+	return found == n - i ? n : i + found;
+}
+
+__attribute__((target("avx2"))) static void
+hashBlocksAVX2(const uint8_t *bytes, size_t n, uint32_t lanes[8])
+{
+	__m256i h = _mm256_setr_epi32(hashLaneSeed, hashLaneSeed * 2,
+	    hashLaneSeed * 3, hashLaneSeed * 4, hashLaneSeed * 5,
+	    hashLaneSeed * 6, hashLaneSeed * 7, hashLaneSeed * 8);
+	__m256i add = _mm256_set1_epi32(0xe6546b64);
+
+	for (size_t i = 0; i + hashBlock <= n; i += hashBlock) {
+		h = _mm256_xor_si256(h,
+		    _mm256_loadu_si256((const __m256i *)(bytes + i)));
+		h = _mm256_or_si256(_mm256_slli_epi32(h, 13),
+		    _mm256_srli_epi32(h, 19));
+		h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h, 2),
+					 h),
+		    add);
+	}
+	_mm256_storeu_si256((__m256i *)lanes, h);
+}
+
+static const BytesKernels avx2Kernels = { "avx2", mismatchAVX2, indexOfAVX2,
+	findAVX2, hashBlocksAVX2 };
+#endif /* VTRT_BYTES_X86 */
+
+/*
+ * dispatch
+ */
+static bool
+supported(const BytesKernels *candidate)
+{
+#ifdef VTRT_BYTES_X86
+	__builtin_cpu_init();
+	if (candidate == &avx2Kernels)
+		return __builtin_cpu_supports("avx2");
+	else if (candidate == &sse2Kernels)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return candidate == &scalarKernels;
+}
+
+/* (best first) */
+static const BytesKernels *const allKernels[] = {
+#ifdef VTRT_BYTES_X86
+	&avx2Kernels,
+	&sse2Kernels,
+#endif
+	&scalarKernels,
+};
+
+static const BytesKernels *
+bestKernels()
+{
+	for (auto candidate : allKernels)
+		if (supported(candidate))
+			return candidate;
+	return &scalarKernels;
+}
+
+static const BytesKernels *kernels = bestKernels();
+
+bool
+selectBytesKernels(const std::string &name)
+{
+	for (auto candidate : allKernels)
+		if (name == candidate->name && supported(candidate)) {
+			kernels = candidate;
+			return true;
+		}
+	return false;
+}
+
+const char *
+bytesKernelsName()
+{
+	return kernels->name;
+}
+
+/*
+ * the vtrt.h interface
+ */
+int
+vtrt_bytesCompare(const uint8_t *a, size_t na, const uint8_t *b, size_t nb)
+{
+	size_t n = na < nb ? na : nb;
+	size_t i = kernels->mismatch(a, b, n);
+
+	if (i < n)
+		return a[i] < b[i] ? -1 : 1;
+	return na < nb ? -1 : na > nb ? 1 : 0;
+}
+
+uint32_t
+vtrt_bytesHash(const uint8_t *bytes, size_t n)
+{
+	uint32_t lanes[8], h = n;
+	size_t i = n - n % hashBlock;
+
+	kernels->hashBlocks(bytes, n, lanes);
+
+	for (int lane = 0; lane < 8; lane++)
+		h = hashMix(h, lanes[lane]);
+	for (; i < n; i++)
+		h = (h ^ bytes[i]) * 0x01000193;
+
+	/* (MurmurHash3's finalizer) */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	return h ^ h >> 16;
+}
+
+intptr_t
+vtrt_bytesIndexOf(const uint8_t *bytes, size_t n, uint8_t c)
+{
+	size_t i = kernels->indexOf(bytes, n, c);
+
+	return i == n ? -1 : (intptr_t)i;
+}
+
+intptr_t
+vtrt_bytesFind(const uint8_t *haystack, size_t n, const uint8_t *needle,
+    size_t m)
+{
+	size_t i;
+
+	if (m == 0)
+		return 0;
+	else if (m > n)
+		return -1;
+	else if (m == 1)
+		return vtrt_bytesIndexOf(haystack, n, needle[0]);
+	i = kernels->find(haystack, n, needle, m);
+	return i == n ? -1 : (intptr_t)i;
+}
@@ -0,0 +1,101 @@
+/*!
+ * Throughput of the byte object kernels of bytes.cc, in bytes per second, for
+ * each set the CPU can run: bytesbench [size ...]
+ *
+ * Every operation is timed on its worst case, scanning the whole of its
+ * operands: equal strings compared, a byte not there sought.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "runtime.hh"
+
+/* (keeps the compiler from discarding the work) */
+static volatile uintptr_t sink;
+
+/* Time op over enough repetitions to take about a tenth of a second. */
+template <class Op>
+static double
+bytesPerSecond(size_t size, Op op)
+{
+	typedef std::chrono::steady_clock Clock;
+	size_t reps = 1;
+
+	for (;;) {
+		Clock::time_point start = Clock::now();
+		double seconds;
+
+		for (size_t i = 0; i < reps; i++)
+			op();
+		seconds = std::chrono::duration<double>(Clock::now() - start)
+			      .count();
+		if (seconds > 0.1)
+			return (double)size * reps / seconds;
+		reps *= 2;
+	}
+}
+
+static void
+report(const char *operation, size_t size, double rate)
+{
+	printf("%-10s %-10s %10zu %10.2f GB/s\n", bytesKernelsName(),
+	    operation, size, rate / 1e9);
+}
+
+static void
+bench(size_t size)
+{
+	std::vector<uint8_t> a(size), b(size);
+	/* a needle whose first and last bytes are common, but never matches */
+	const uint8_t needle[] = "abcdefgX";
+
+	for (size_t i = 0; i < size; i++)
+		a[i] = b[i] = 'a' + i % 7;
+
+	report("compare", size, bytesPerSecond(size, [&]() {
+		sink += vtrt_bytesCompare(a.data(), size, b.data(), size);
+	}));
+	report("hash", size, bytesPerSecond(size, [&]() {
+		sink += vtrt_bytesHash(a.data(), size);
+	}));
+	report("indexOf", size, bytesPerSecond(size, [&]() {
+		sink += vtrt_bytesIndexOf(a.data(), size, 'z');
+	}));
+	report("find", size, bytesPerSecond(size, [&]() {
+		sink += vtrt_bytesFind(a.data(), size, needle,
+		    sizeof(needle) - 1);
+	}));
+	report("copy", size, bytesPerSecond(size, [&]() {
+		memmove(b.data(), a.data(), size);
+		sink += b[size - 1];
+	}));
+	report("fill", size, bytesPerSecond(size, [&]() {
+		memset(b.data(), (int)sink, size);
+		sink += b[size - 1];
+	}));
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<size_t> sizes;
+	const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+	for (int i = 1; i < argc; i++)
+		sizes.push_back(strtoul(argv[i], NULL, 0));
+	if (sizes.empty())
+		sizes = { 16, 256, 4096, 65536, 1 << 20 };
+
+	for (const char *name : kernels) {
+		if (!selectBytesKernels(name))
+			continue;
+		for (size_t size : sizes)
+			if (size > 0)
+				bench(size);
+	}
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*!
+ * Throughput of writing and reading object graphs (serialize.cc), against a
+ * naive recursive encoder: graphbench [depth]
+ *
+ * The graph is a binary tree of Nodes, of the given depth, each with a String
+ * label, one of a few Symbols as key, and a SmallInteger value. The naive
+ * encoder writes each object where it is referred to, with the name of its
+ * class, and its reader finds the class by name each time; the Symbols are
+ * written as often as they are referred to. Each is timed on its best of a few
+ * runs, in objects and in bytes of the encoding per second, and the copies
+ * read back are checked against the tree.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "psc.hh"
+#include "runtime.hh"
+
+static const int nRuns = 5;
+static const int nKeys = 16;
+
+/* (Node's instance variables) */
+enum { kLeft, kRight, kLabel, kKey, kValue, kNodeSize };
+
+static struct vtrt_classTemplate object, symbol, string, node;
+
+static void
+registerClass(struct vtrt_classTemplate &templ, const char *name,
+    const char *superName, size_t instanceSize, enum vtrt_slotsKind kind)
+{
+	templ.name = name;
+	templ.superName = superName;
+	templ.instanceSize = instanceSize;
+	templ.instanceKind = kind;
+	vtrt_registerClass(name, &templ);
+}
+
+static oop
+newString(const std::string &contents)
+{
+	oop string = vtrt_alloc(::string.cls, contents.size(), kSlotsBytes);
+
+	memcpy(string.ptr->vns->oops, contents.data(), contents.size());
+	return string;
+}
+
+static oop
+tree(int depth, intptr_t &n)
+{
+	oop node = vtrt_alloc(::node.cls, kNodeSize, kSlotsOops);
+	oop *ivars = vtrt_ivars(node);
+
+	ivars[kValue] = vtrt_smi(n++);
+	ivars[kLabel] = newString("node " + std::to_string(n));
+	ivars[kKey].ptr = (vtrt_memoop_t)intern("key" +
+	    std::to_string(n % nKeys)).m_ptr;
+	if (depth > 1) {
+		ivars[kLeft] = tree(depth - 1, n);
+		ivars[kRight] = tree(depth - 1, n);
+	}
+	return node;
+}
+
+/* A sum over the tree of its values and labels' sizes, and its key count. */
+static intptr_t
+checksum(oop node)
+{
+	oop *ivars;
+
+	if (node.ptr == NULL)
+		return 0;
+	ivars = vtrt_ivars(node);
+	return vtrt_smiValue(ivars[kValue]) + ivars[kLabel].ptr->vns->size +
+	    (ivars[kKey].ptr->isa.ptr == symbol.cls.ptr) +
+	    checksum(ivars[kLeft]) + checksum(ivars[kRight]);
+}
+
+static void
+put(std::vector<uint8_t> &out, const void *bytes, size_t size)
+{
+	out.insert(out.end(), (const uint8_t *)bytes,
+	    (const uint8_t *)bytes + size);
+}
+
+static void
+naiveStore(Oop value, std::vector<uint8_t> &out)
+{
+	MemOop object = value.m_ptr;
+	std::string name;
+	uint8_t tag = value.isPtr() && !value.isNil();
+	uintptr_t size;
+
+	put(out, &tag, 1);
+	if (!tag) {
+		put(out, &value.m_ptr, sizeof value.m_ptr);
+		return;
+	}
+	name = className(object->isa);
+	size = name.size();
+	put(out, &size, sizeof size);
+	put(out, name.data(), size);
+	size = object->vns ? object->vns->size : 0;
+	put(out, &size, sizeof size);
+	if (object->vns && object->vns->kind == MemDesc::kBytes)
+		put(out, object->vns->bytes, size);
+	else
+		for (uintptr_t i = 0; i < size; i++)
+			naiveStore(object->vns->oops[i], out);
+}
+
+static Oop
+naiveLoad(const uint8_t *&at)
+{
+	uintptr_t size;
+	std::string name;
+	ClassOop cls;
+	oop object;
+
+	if (!*at++) {
+		Oop value;
+
+		memcpy(&value.m_ptr, at, sizeof value.m_ptr);
+		at += sizeof value.m_ptr;
+		return value;
+	}
+	memcpy(&size, at, sizeof size);
+	name.assign((const char *)at + sizeof size, size);
+	at += sizeof size + size;
+	cls = findClass(name);
+	memcpy(&size, at, sizeof size);
+	at += sizeof size;
+	if (isBytesClass(cls)) {
+		std::string bytes((const char *)at, size);
+
+		at += size;
+		if (cls.m_ptr == (void *)symbol.cls.ptr)
+			return intern(bytes);
+		object = vtrt_alloc({ (vtrt_memoop_t)cls.m_ptr }, size,
+		    kSlotsBytes);
+		memcpy(object.ptr->vns->oops, bytes.data(), size);
+		return object.ptr;
+	}
+	object = vtrt_alloc({ (vtrt_memoop_t)cls.m_ptr }, size, kSlotsOops);
+	for (uintptr_t i = 0; i < size; i++)
+		((Oop *)object.ptr->vns->oops)[i] = naiveLoad(at);
+	return object.ptr;
+}
+
+/* The best time of op, in seconds. */
+template <class Op>
+static double
+best(Op op)
+{
+	typedef std::chrono::steady_clock Clock;
+	double fastest = 0;
+
+	for (int i = 0; i < nRuns; i++) {
+		Clock::time_point start = Clock::now();
+		double seconds;
+
+		op();
+		seconds = std::chrono::duration<double>(Clock::now() - start)
+			      .count();
+		if (i == 0 || seconds < fastest)
+			fastest = seconds;
+	}
+	return fastest;
+}
+
+static void
+report(const char *encoder, const char *operation, size_t nObjects,
+    size_t size, double seconds)
+{
+	printf("%-6s %-12s %8zu objects %10zu bytes %8.2f Mobjects/s "
+	       "%8.1f MB/s\n",
+	    encoder, operation, nObjects, size, nObjects / seconds / 1e6,
+	    size / seconds / 1e6);
+}
+
+static void
+check(const char *what, oop root, intptr_t expected)
+{
+	if (checksum(root) != expected) {
+		fprintf(stderr, "graphbench: %s read back wrong\n", what);
+		exit(1);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[] = "/tmp/graphbenchXXXXXX";
+	int depth = argc > 1 ? atoi(argv[1]) : 17, fd;
+	std::vector<uint8_t> graph, naive;
+	size_t nObjects;
+	intptr_t n = 0, sum;
+	double seconds;
+	Oop root, copy;
+
+	registerClass(object, "Object", "nil", 0, kSlotsOops);
+	registerClass(symbol, "Symbol", "Object", 0, kSlotsBytes);
+	registerClass(string, "String", "Object", 0, kSlotsBytes);
+	registerClass(node, "Node", "Object", kNodeSize, kSlotsOops);
+	vtrt_main(argc, argv);
+
+	root = tree(depth, n).ptr;
+	sum = checksum({ (vtrt_memoop_t)root.m_ptr });
+	/* Nodes and their labels; the Symbols once each */
+	nObjects = 2 * n + nKeys;
+
+	seconds = best([&]() { storeGraph(root, graph); });
+	report("graph", "store", nObjects, graph.size(), seconds);
+	seconds = best([&]() {
+		loadGraph(graph.data(), graph.size(), false, copy);
+	});
+	report("graph", "load", nObjects, graph.size(), seconds);
+	check("graph", { (vtrt_memoop_t)copy.m_ptr }, sum);
+
+	if ((fd = mkstemp(path)) < 0 ||
+	    write(fd, graph.data(), graph.size()) != (ssize_t)graph.size()) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+	seconds = best([&]() {
+		struct vtrt_slots *slots = pscMapFile(path);
+
+		loadGraph((const uint8_t *)slots->oops, slots->size, true,
+		    copy);
+	});
+	report("graph", "load mapped", nObjects, graph.size(), seconds);
+	check("mapped graph", { (vtrt_memoop_t)copy.m_ptr }, sum);
+	unlink(path);
+
+	seconds = best([&]() {
+		naive.clear();
+		naiveStore(root, naive);
+	});
+	report("naive", "store", nObjects, naive.size(), seconds);
+	seconds = best([&]() {
+		const uint8_t *at = naive.data();
+
+		copy = naiveLoad(at);
+	});
+	report("naive", "load", nObjects, naive.size(), seconds);
+	check("naive", { (vtrt_memoop_t)copy.m_ptr }, sum);
+	return 0;
+}
@@ -0,0 +1,416 @@
+/*!
+ * The hash tables of Dictionary, IdentityDictionary and Set.
+ *
+ * A table is the indexed slots of its object: first the number of entries,
+ * then a power-of-two number of entries of three slots each, the key's hash
+ * (nil if the entry is empty), the key and the value. Keeping the hash means
+ * growing the table needn't compute any again.
+ *
+ * Collisions are resolved by Robin Hood linear probing: an entry is placed
+ * ahead of any which is nearer its home, so no entry is ever far from its own,
+ * and a lookup can stop as soon as it passes where the key would have been.
+ * Removal shifts the entries after back, so there are no tombstones.
+ *
+ * A table grows in place: its object's slots are replaced by bigger ones, so
+ * it keeps its identity. For that reason the classes using it mustn't have
+ * named instance variables, as a method could be holding a pointer to the old
+ * slots. (The old slots are left for the collector.)
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "runtime.hh"
+
+/* three slots per entry */
+enum { kHash, kKey, kValue, kEntrySize };
+
+static const size_t initialCapacity = 8;
+
+struct Table {
+	/* the tally, then the entries */
+	oop *slots;
+	size_t capacity;
+
+	oop &tally() { return slots[0]; }
+	oop *entry(size_t i) { return slots + 1 + i * kEntrySize; }
+};
+
+/*
+ * The table of an object; its capacity is 0 if its slots haven't been set up
+ * yet. False if the object's indexed slots aren't laid out as a table.
+ */
+static bool
+tableOf(oop object, Table &table)
+{
+	intptr_t size = vtrt_indexedSize(object);
+
+	if (!VT_isPtr(object.value) || object.ptr == NULL ||
+	    (object.ptr->vns != NULL && object.ptr->vns->kind != kSlotsOops))
+		return false;
+	table.capacity = size == 0 ? 0 : (size - 1) / kEntrySize;
+	if (size != 0 && (size - 1) % kEntrySize != 0)
+		return false;
+	else if (table.capacity & (table.capacity - 1))
+		return false;
+	table.slots = size == 0 ? NULL :
+	    object.ptr->vns->oops + object.ptr->vns->size - size;
+	return true;
+}
+
+/*
+ * Keys are equal as the kernel classes' #= has them: by value for immediates
+ * and for byte objects (Strings, LargeIntegers, boxed Floats) of one class, but
+ * Symbols, which are unique, and all other objects by identity. In an identity
+ * table, all are by identity.
+ */
+static bool
+hashesByBytes(oop key)
+{
+	return key.ptr->vns != NULL && key.ptr->vns->kind == kSlotsBytes &&
+	    key.ptr->isa.ptr != (vtrt_memoop_t)wellKnown.symbol.m_ptr;
+}
+
+static uint32_t
+keyHash(oop key, bool identity)
+{
+	if (!VT_isPtr(key.value))
+		return (uint32_t)(key.value >> VT_tagBits ^
+		    key.value >> (32 + VT_tagBits));
+	else if (!identity && hashesByBytes(key))
+		return vtrt_bytesHash((const uint8_t *)key.ptr->vns->oops,
+		    key.ptr->vns->size);
+	return vtrt_identityHash(key.ptr);
+}
+
+static bool
+keysEqual(oop a, oop b, bool identity)
+{
+	if (a.value == b.value)
+		return true;
+	else if (identity || !VT_isPtr(a.value) || !VT_isPtr(b.value) ||
+	    a.ptr->isa.value != b.ptr->isa.value || !hashesByBytes(a))
+		return false;
+	return a.ptr->vns->size == b.ptr->vns->size &&
+	    !vtrt_bytesCompare((const uint8_t *)a.ptr->vns->oops,
+		a.ptr->vns->size, (const uint8_t *)b.ptr->vns->oops,
+		b.ptr->vns->size);
+}
+
+/* The entry where a hash would be if there were no collisions. */
+static inline size_t
+home(uint32_t hash, size_t capacity)
+{
+	/* (so keys differing only in their high bits are spread too) */
+	hash *= 0x9e3779b9;
+	return (hash ^ hash >> 16) & (capacity - 1);
+}
+
+/* How far the entry at i is from its home. */
+static inline size_t
+distance(Table &table, size_t i)
+{
+	uint32_t hash = vtrt_smiValue(table.entry(i)[kHash]);
+
+	return (i - home(hash, table.capacity)) & (table.capacity - 1);
+}
+
+/* The index of the entry for key, or -1 if there is none. */
+static intptr_t
+find(Table &table, oop key, uint32_t hash, bool identity)
+{
+	if (table.capacity == 0)
+		return -1;
+	for (size_t i = home(hash, table.capacity), dist = 0;;
+	     i = (i + 1) & (table.capacity - 1), dist++) {
+		oop *entry = table.entry(i);
+
+		if (entry[kHash].value == vtrt_nil.value ||
+		    distance(table, i) < dist)
+			return -1;
+		else if (entry[kHash].value == vtrt_smi(hash).value &&
+		    keysEqual(entry[kKey], key, identity))
+			return i;
+	}
+}
+
+/* Add an entry for a key not already in the table, which has room for it. */
+static void
+insert(Table &table, oop hash, oop key, oop value)
+{
+	for (size_t i = home(vtrt_smiValue(hash), table.capacity), dist = 0;;
+	     i = (i + 1) & (table.capacity - 1), dist++) {
+		oop *entry = table.entry(i);
+		size_t theirs;
+
+		if (entry[kHash].value == vtrt_nil.value) {
+			entry[kHash] = hash;
+			entry[kKey] = key;
+			entry[kValue] = value;
+			return;
+		} else if ((theirs = distance(table, i)) < dist) {
+			/* take the place of the entry nearer its home */
+			std::swap(entry[kHash], hash);
+			std::swap(entry[kKey], key);
+			std::swap(entry[kValue], value);
+			dist = theirs;
+		}
+	}
+}
+
+/* Give the object a table of twice the capacity, with the same entries. */
+static void
+grow(oop object, Table &table)
+{
+	size_t capacity = table.capacity ? table.capacity * 2 : initialCapacity;
+	struct vtrt_slots *old = object.ptr->vns, *slots;
+	size_t nNamed = old ? old->size - vtrt_indexedSize(object) : 0;
+	size_t size = nNamed + 1 + capacity * kEntrySize;
+	Table bigger;
+
+	if (!(slots = (struct vtrt_slots *)calloc(1,
+		  sizeof(struct vtrt_slots) + size * sizeof(oop))))
+		throw std::bad_alloc();
+	slots->size = size;
+	slots->kind = kSlotsOops;
+	if (nNamed)
+		memcpy(slots->oops, old->oops, nNamed * sizeof(oop));
+
+	bigger.slots = slots->oops + nNamed;
+	bigger.capacity = capacity;
+	bigger.tally() = vtrt_smi(0);
+	for (size_t i = 0; i < table.capacity; i++) {
+		oop *entry = table.entry(i);
+
+		if (entry[kHash].value != vtrt_nil.value)
+			insert(bigger, entry[kHash], entry[kKey],
+			    entry[kValue]);
+	}
+	if (table.capacity)
+		bigger.tally() = table.tally();
+
+	object.ptr->vns = slots;
+	table = bigger;
+}
+
+static size_t
+tallyOf(Table &table)
+{
+	return table.capacity ? vtrt_smiValue(table.tally()) : 0;
+}
+
+static oop
+at(oop self, oop key, bool identity, bool *failed)
+{
+	Table table;
+	intptr_t i;
+
+	if (!tableOf(self, table) || key.value == vtrt_nil.value ||
+	    (i = find(table, key, keyHash(key, identity), identity)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return table.entry(i)[kValue];
+}
+
+static oop
+atPut(oop self, oop key, oop value, bool identity, bool *failed)
+{
+	Table table;
+	uint32_t hash;
+	intptr_t i;
+
+	if (!tableOf(self, table) || key.value == vtrt_nil.value) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	hash = keyHash(key, identity);
+	if ((i = find(table, key, hash, identity)) >= 0) {
+		vtrt_writeBarrier(self, value);
+		return table.entry(i)[kValue] = value;
+	}
+
+	/* at most seven eighths full */
+	if ((tallyOf(table) + 1) * 8 > table.capacity * 7)
+		grow(self, table);
+	vtrt_writeBarrier(self, key);
+	vtrt_writeBarrier(self, value);
+	insert(table, vtrt_smi(hash), key, value);
+	table.tally() = vtrt_smi(tallyOf(table) + 1);
+	return value;
+}
+
+static oop
+removeKey(oop self, oop key, bool identity, bool *failed)
+{
+	Table table;
+	intptr_t i;
+	size_t next;
+	oop value;
+
+	if (!tableOf(self, table) || key.value == vtrt_nil.value ||
+	    (i = find(table, key, keyHash(key, identity), identity)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	value = table.entry(i)[kValue];
+
+	/* shift back the entries after which aren't at their homes */
+	for (next = (i + 1) & (table.capacity - 1);
+	     table.entry(next)[kHash].value != vtrt_nil.value &&
+	     distance(table, next) != 0;
+	     i = next, next = (next + 1) & (table.capacity - 1))
+		memcpy(table.entry(i), table.entry(next),
+		    kEntrySize * sizeof(oop));
+	memset(table.entry(i), 0, kEntrySize * sizeof(oop));
+	table.tally() = vtrt_smi(tallyOf(table) - 1);
+	return value;
+}
+
+static oop
+includesKey(oop self, oop key, bool identity, bool *failed)
+{
+	Table table;
+
+	if (!tableOf(self, table)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_bool(key.value != vtrt_nil.value &&
+	    find(table, key, keyHash(key, identity), identity) >= 0);
+}
+
+/*
+ * the primitives: those for lookup by equality and by identity differ only in
+ * how they compare keys
+ */
+#define HASH_TABLE_PRIMITIVES(prefix, identity)				\
+	oop								\
+	vtrt_prim_##prefix##At_(oop self, oop key, bool *failed)	\
+	{								\
+		return at(self, key, identity, failed);			\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##At_ifAbsent_(oop self, oop key, oop block,	\
+	    bool *failed)						\
+	{								\
+		return at(self, key, identity, failed);			\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##At_put_(oop self, oop key, oop value,	\
+	    bool *failed)						\
+	{								\
+		return atPut(self, key, value, identity, failed);	\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##Add_(oop self, oop key, bool *failed)	\
+	{								\
+		return atPut(self, key, key, identity, failed);		\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##RemoveKey_(oop self, oop key, bool *failed)	\
+	{								\
+		return removeKey(self, key, identity, failed);		\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##RemoveKey_ifAbsent_(oop self, oop key,	\
+	    oop block, bool *failed)					\
+	{								\
+		return removeKey(self, key, identity, failed);		\
+	}								\
+	oop								\
+	vtrt_prim_##prefix##IncludesKey_(oop self, oop key, bool *failed) \
+	{								\
+		return includesKey(self, key, identity, failed);	\
+	}
+
+HASH_TABLE_PRIMITIVES(hash, false)
+HASH_TABLE_PRIMITIVES(identity, true)
+
+oop
+vtrt_prim_hashTally(oop self, bool *failed)
+{
+	Table table;
+
+	if (!tableOf(self, table)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(tallyOf(table));
+}
+
+oop
+vtrt_prim_hashCapacity(oop self, bool *failed)
+{
+	Table table;
+
+	if (!tableOf(self, table)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(table.capacity);
+}
+
+/* The entry at index (from 1), or NULL; fails if there's no such entry. */
+static oop *
+entryAt(oop self, oop index, bool *failed)
+{
+	Table table;
+	intptr_t i;
+
+	if (!tableOf(self, table) || !VT_isSmi(index.value) ||
+	    (i = vtrt_smiValue(index)) < 1 || i > (intptr_t)table.capacity) {
+		*failed = true;
+		return NULL;
+	}
+	return table.entry(i - 1);
+}
+
+/* (nil where the entry is empty, as keys are never nil) */
+oop
+vtrt_prim_hashKeyAt_(oop self, oop index, bool *failed)
+{
+	oop *entry = entryAt(self, index, failed);
+
+	return entry ? entry[kKey] : vtrt_nil;
+}
+
+oop
+vtrt_prim_hashValueAt_(oop self, oop index, bool *failed)
+{
+	oop *entry = entryAt(self, index, failed);
+
+	return entry ? entry[kValue] : vtrt_nil;
+}
+
+bool
+rehashTable(Oop object, bool identity)
+{
+	oop self = { (vtrt_memoop_t)object.m_ptr };
+	std::vector<oop> entries;
+	Table table;
+	bool failed = false;
+
+	if (!tableOf(self, table))
+		return false;
+	for (size_t i = 0; i < table.capacity; i++) {
+		oop *entry = table.entry(i);
+
+		if (entry[kHash].value != vtrt_nil.value &&
+		    entry[kKey].value != vtrt_nil.value) {
+			entries.push_back(entry[kKey]);
+			entries.push_back(entry[kValue]);
+		}
+		memset(entry, 0, kEntrySize * sizeof(oop));
+	}
+	if (table.capacity)
+		table.tally() = vtrt_smi(0);
+
+	/* (so a key in twice is in once, and the table grows as it fills) */
+	for (size_t i = 0; i < entries.size(); i += 2)
+		atPut(self, entries[i], entries[i + 1], identity, &failed);
+	return true;
+}
@@ -0,0 +1,603 @@
+/*!
+ * LargeIntegers: integers beyond SmallInteger range, as instances of
+ * LargePositiveInteger or LargeNegativeInteger holding their magnitude.
+ *
+ * The magnitude is held as 64-bit limbs, least significant first, in the
+ * machine's byte order. Results are normalised: the most significant limb is
+ * never zero, and a value in SmallInteger range is always a SmallInteger. The
+ * kernels work on bare limb arrays; the vtrt_integer functions, which take
+ * SmallIntegers and LargeIntegers alike, are built on them.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "runtime.hh"
+
+typedef uint64_t Limb;
+typedef unsigned __int128 DoubleLimb;
+typedef std::vector<Limb> Magnitude;
+
+static const int limbBits = 64;
+
+/* Below this many limbs in either operand, multiply the schoolbook way. */
+static const size_t karatsubaThreshold = 32;
+
+/*
+ * kernels
+ */
+
+/* The length of a[0, n) less its leading zero limbs. */
+static size_t
+significant(const Limb *a, size_t n)
+{
+	while (n > 0 && a[n - 1] == 0)
+		n--;
+	return n;
+}
+
+static int
+compareLimbs(const Limb *a, size_t na, const Limb *b, size_t nb)
+{
+	na = significant(a, na);
+	nb = significant(b, nb);
+	if (na != nb)
+		return na < nb ? -1 : 1;
+	while (na-- > 0)
+		if (a[na] != b[na])
+			return a[na] < b[na] ? -1 : 1;
+	return 0;
+}
+
+/* r[0, n) += a[0, na), where n >= na; answers the carry out. */
+static Limb
+addLimbs(Limb *r, size_t n, const Limb *a, size_t na)
+{
+	Limb carry = 0;
+	size_t i;
+
+	for (i = 0; i < na; i++) {
+		DoubleLimb sum = (DoubleLimb)r[i] + a[i] + carry;
+
+		r[i] = (Limb)sum;
+		carry = sum >> limbBits;
+	}
+	for (; carry && i < n; i++)
+		carry = ++r[i] == 0;
+	return carry;
+}
+
+/* r[0, n) -= a[0, na), where n >= na; answers the borrow out. */
+static Limb
+subLimbs(Limb *r, size_t n, const Limb *a, size_t na)
+{
+	Limb borrow = 0;
+	size_t i;
+
+	for (i = 0; i < na; i++) {
+		Limb ri = r[i];
+
+		r[i] = ri - a[i] - borrow;
+		borrow = ri < a[i] || ri - a[i] < borrow;
+	}
+	for (; borrow && i < n; i++)
+		borrow = r[i]-- == 0;
+	return borrow;
+}
+
+/* a[0, n) = a * m + c, answering the limb carried out. */
+static Limb
+mulAddLimb(Limb *a, size_t n, Limb m, Limb c)
+{
+	for (size_t i = 0; i < n; i++) {
+		DoubleLimb product = (DoubleLimb)a[i] * m + c;
+
+		a[i] = (Limb)product;
+		c = product >> limbBits;
+	}
+	return c;
+}
+
+/* r[0, na + nb) = a * b, the schoolbook way. */
+static void
+mulSchoolbook(Limb *r, const Limb *a, size_t na, const Limb *b, size_t nb)
+{
+	memset(r, 0, (na + nb) * sizeof(Limb));
+	for (size_t i = 0; i < nb; i++) {
+		Limb carry = 0;
+
+		if (b[i] == 0)
+			continue;
+		for (size_t j = 0; j < na; j++) {
+			DoubleLimb product =
+			    (DoubleLimb)a[j] * b[i] + r[i + j] + carry;
+
+			r[i + j] = (Limb)product;
+			carry = product >> limbBits;
+		}
+		r[i + na] = carry;
+	}
+}
+
+static void mulLimbs(Limb *r, const Limb *a, size_t na, const Limb *b,
+    size_t nb);
+
+/*
+ * r[0, na + nb) = a * b by Karatsuba's method, where na >= nb > (na + 1) / 2:
+ * a and b are split at m limbs, into a1:a0 and b1:b0, and the product made of
+ * three half-size products rather than four.
+ */
+static void
+mulKaratsuba(Limb *r, const Limb *a, size_t na, const Limb *b, size_t nb)
+{
+	size_t m = (na + 1) / 2, na1 = na - m, nb1 = nb - m;
+	Magnitude sa(m + 1), sb(m + 1), z1(2 * m + 2);
+
+	/* z0 = a0 * b0 and z2 = a1 * b1, straight into r's halves */
+	mulLimbs(r, a, m, b, m);
+	mulLimbs(r + 2 * m, a + m, na1, b + m, nb1);
+
+	/* z1 = (a0 + a1) * (b0 + b1) - z0 - z2 */
+	memcpy(sa.data(), a, m * sizeof(Limb));
+	sa[m] = addLimbs(sa.data(), m, a + m, na1);
+	memcpy(sb.data(), b, m * sizeof(Limb));
+	sb[m] = addLimbs(sb.data(), m, b + m, nb1);
+	mulLimbs(z1.data(), sa.data(), m + 1, sb.data(), m + 1);
+	subLimbs(z1.data(), z1.size(), r, 2 * m);
+	subLimbs(z1.data(), z1.size(), r + 2 * m, na1 + nb1);
+
+	addLimbs(r + m, na + nb - m, z1.data(),
+	    significant(z1.data(), z1.size()));
+}
+
+/* r[0, na + nb) = a * b; r mustn't overlap a or b. */
+static void
+mulLimbs(Limb *r, const Limb *a, size_t na, const Limb *b, size_t nb)
+{
+	if (na < nb) {
+		std::swap(a, b);
+		std::swap(na, nb);
+	}
+
+	if (nb < karatsubaThreshold)
+		mulSchoolbook(r, a, na, b, nb);
+	else if (nb > (na + 1) / 2)
+		mulKaratsuba(r, a, na, b, nb);
+	else {
+		/* a is much the longer, so is multiplied in b-sized pieces */
+		Magnitude piece(2 * nb);
+
+		memset(r, 0, (na + nb) * sizeof(Limb));
+		for (size_t i = 0; i < na; i += nb) {
+			size_t n = std::min(nb, na - i);
+
+			mulLimbs(piece.data(), a + i, n, b, nb);
+			addLimbs(r + i, na + nb - i, piece.data(), n + nb);
+		}
+	}
+}
+
+/* q[0, n) = a / d, answering a % d; q may be a. */
+static Limb
+divLimb(Limb *q, const Limb *a, size_t n, Limb d)
+{
+	DoubleLimb rem = 0;
+
+	while (n-- > 0) {
+		DoubleLimb dividend = rem << limbBits | a[n];
+
+		q[n] = (Limb)(dividend / d);
+		rem = dividend % d;
+	}
+	return (Limb)rem;
+}
+
+/* r[0, n) = a << shift, answering the bits shifted out; shift < limbBits. */
+static Limb
+shiftLeft(Limb *r, const Limb *a, size_t n, int shift)
+{
+	Limb out = 0;
+
+	if (shift == 0) {
+		memmove(r, a, n * sizeof(Limb));
+		return 0;
+	}
+	for (size_t i = 0; i < n; i++) {
+		Limb ai = a[i];
+
+		r[i] = ai << shift | out;
+		out = ai >> (limbBits - shift);
+	}
+	return out;
+}
+
+/* r[0, n) = a >> shift; shift < limbBits. */
+static void
+shiftRight(Limb *r, const Limb *a, size_t n, int shift)
+{
+	if (shift == 0) {
+		memmove(r, a, n * sizeof(Limb));
+		return;
+	}
+	for (size_t i = 0; i < n; i++)
+		r[i] = a[i] >> shift |
+		    (i + 1 < n ? a[i + 1] << (limbBits - shift) : 0);
+}
+
+/*
+ * q[0, na - nb + 1) = a / b and r[0, nb) = a % b, by Knuth's Algorithm D
+ * (TAOCP vol. 2, 4.3.1), where na >= nb > 1 and b[nb - 1] isn't zero.
+ */
+static void
+divLimbs(Limb *q, Limb *r, const Limb *a, size_t na, const Limb *b,
+    size_t nb)
+{
+	int shift = __builtin_clzll(b[nb - 1]);
+	Magnitude u(na + 1), v(nb);
+
+	/* normalise, so that the divisor's top bit is set */
+	shiftLeft(v.data(), b, nb, shift);
+	u[na] = shiftLeft(u.data(), a, na, shift);
+
+	for (size_t j = na - nb + 1; j-- > 0;) {
+		DoubleLimb top =
+		    (DoubleLimb)u[j + nb] << limbBits | u[j + nb - 1];
+		DoubleLimb qhat = top / v[nb - 1], rhat = top % v[nb - 1];
+		Limb borrow = 0, carry = 0, last;
+
+		/* an estimate, at most one too big when this is done */
+		while (qhat >> limbBits ||
+		    qhat * v[nb - 2] > (rhat << limbBits | u[j + nb - 2])) {
+			qhat--;
+			rhat += v[nb - 1];
+			if (rhat >> limbBits)
+				break;
+		}
+
+		/* u[j, j + nb] -= qhat * v */
+		for (size_t i = 0; i < nb; i++) {
+			DoubleLimb product = qhat * v[i] + carry;
+			Limb low = (Limb)product, ui = u[i + j];
+
+			carry = product >> limbBits;
+			u[i + j] = ui - low - borrow;
+			borrow = ui < low || ui - low < borrow;
+		}
+		last = u[j + nb];
+		u[j + nb] = last - carry - borrow;
+
+		/* and if that went negative, add one v back */
+		if (last < carry || last - carry < borrow) {
+			qhat--;
+			addLimbs(&u[j], nb + 1, v.data(), nb);
+		}
+		q[j] = (Limb)qhat;
+	}
+
+	shiftRight(r, u.data(), nb, shift);
+}
+
+/* The truncated quotient and the remainder of magnitudes; b isn't zero. */
+static void
+divMagnitudes(const Limb *a, size_t na, const Limb *b, size_t nb,
+    Magnitude &q, Magnitude &r)
+{
+	if (compareLimbs(a, na, b, nb) < 0) {
+		q.clear();
+		r.assign(a, a + na);
+	} else if (nb == 1) {
+		q.assign(na, 0);
+		r.assign(1, divLimb(q.data(), a, na, b[0]));
+	} else {
+		q.assign(na - nb + 1, 0);
+		r.assign(nb, 0);
+		divLimbs(q.data(), r.data(), a, na, b, nb);
+	}
+}
+
+/*
+ * integers
+ */
+
+/* A SmallInteger or LargeInteger, seen as a sign and a magnitude. */
+struct Operand {
+	bool negative;
+	size_t n;
+	/* (a SmallInteger's magnitude is held here) */
+	Limb small;
+	const Limb *large;
+
+	Operand(oop value)
+	{
+		if (VT_isSmi(value.value)) {
+			intptr_t smi = vtrt_smiValue(value);
+
+			negative = smi < 0;
+			small = negative ? -(Limb)smi : (Limb)smi;
+			n = small != 0;
+			large = NULL;
+		} else {
+			negative = value.ptr->isa.ptr ==
+			    (vtrt_memoop_t)wellKnown.largeNegativeInteger.m_ptr;
+			n = value.ptr->vns->size / sizeof(Limb);
+			large = (const Limb *)value.ptr->vns->oops;
+		}
+	}
+
+	const Limb *limbs() const { return large ? large : &small; }
+};
+
+/* The integer of sign and magnitude, normalised. */
+static oop
+integer(bool negative, const Limb *limbs, size_t n)
+{
+	ClassOop cls = negative ? wellKnown.largeNegativeInteger :
+				  wellKnown.largePositiveInteger;
+	oop result;
+
+	n = significant(limbs, n);
+	if (n == 0)
+		return vtrt_smi(0);
+	else if (n == 1 && limbs[0] <= (Limb)VTRT_SMI_MAX + negative)
+		return vtrt_smi(negative ? -(intptr_t)(limbs[0] - 1) - 1 :
+					   (intptr_t)limbs[0]);
+
+	result = vtrt_alloc({ (vtrt_memoop_t)cls.m_ptr }, n * sizeof(Limb),
+	    kSlotsBytes);
+	memcpy(result.ptr->vns->oops, limbs, n * sizeof(Limb));
+	return result;
+}
+
+static oop
+integer(bool negative, const Magnitude &limbs)
+{
+	return integer(negative, limbs.data(), limbs.size());
+}
+
+static oop
+addSigned(const Limb *a, size_t na, bool aNegative, const Limb *b, size_t nb,
+    bool bNegative)
+{
+	Magnitude sum;
+
+	na = significant(a, na);
+	nb = significant(b, nb);
+
+	/* of the same sign, the magnitudes add */
+	if (aNegative == bNegative) {
+		if (na < nb) {
+			std::swap(a, b);
+			std::swap(na, nb);
+		}
+		sum.assign(a, a + na);
+		sum.push_back(addLimbs(sum.data(), na, b, nb));
+		return integer(aNegative, sum);
+	}
+
+	/* else the lesser is taken from the greater, whose sign it keeps */
+	if (compareLimbs(a, na, b, nb) < 0) {
+		std::swap(a, b);
+		std::swap(na, nb);
+		std::swap(aNegative, bNegative);
+	}
+	sum.assign(a, a + na);
+	subLimbs(sum.data(), na, b, nb);
+	return integer(aNegative, sum);
+}
+
+bool
+vtrt_isLargeInteger(oop value)
+{
+	return VT_isPtr(value.value) && value.ptr != NULL &&
+	    (value.ptr->isa.ptr ==
+		    (vtrt_memoop_t)wellKnown.largePositiveInteger.m_ptr ||
+		value.ptr->isa.ptr ==
+		    (vtrt_memoop_t)wellKnown.largeNegativeInteger.m_ptr);
+}
+
+bool
+isLargeIntegerMagnitude(bool negative, const uint8_t *bytes, size_t size)
+{
+	size_t n = size / sizeof(Limb);
+	Limb top;
+
+	if (n == 0 || size % sizeof(Limb) != 0)
+		return false;
+	memcpy(&top, bytes + size - sizeof(Limb), sizeof top);
+	return top != 0 && (n > 1 || top > (Limb)VTRT_SMI_MAX + negative);
+}
+
+oop
+vtrt_integerAdd(oop a, oop b)
+{
+	Operand x(a), y(b);
+
+	return addSigned(x.limbs(), x.n, x.negative, y.limbs(), y.n,
+	    y.negative);
+}
+
+oop
+vtrt_integerSub(oop a, oop b)
+{
+	Operand x(a), y(b);
+
+	return addSigned(x.limbs(), x.n, x.negative, y.limbs(), y.n,
+	    !y.negative);
+}
+
+oop
+vtrt_integerMul(oop a, oop b)
+{
+	Operand x(a), y(b);
+	Magnitude product(x.n + y.n);
+
+	mulLimbs(product.data(), x.limbs(), x.n, y.limbs(), y.n);
+	return integer(x.negative != y.negative, product);
+}
+
+/*
+ * The quotient rounded towards negative infinity, and the remainder that goes
+ * with it, which takes the sign of the divisor (so, #// and #\\).
+ */
+static void
+divFloored(oop a, oop b, oop *quotient, oop *remainder)
+{
+	static const Limb one = 1;
+	Operand x(a), y(b);
+	bool negative = x.negative != y.negative;
+	Magnitude q, r;
+
+	if (y.n == 0)
+		vtrt_zeroDivide(a);
+
+	divMagnitudes(x.limbs(), x.n, y.limbs(), y.n, q, r);
+	if (negative && significant(r.data(), r.size()) != 0) {
+		/* the truncated quotient is one too big in magnitude */
+		q.push_back(0);
+		addLimbs(q.data(), q.size(), &one, 1);
+		*remainder = addSigned(r.data(), r.size(), x.negative,
+		    y.limbs(), y.n, y.negative);
+	} else
+		*remainder = integer(x.negative, r);
+	*quotient = integer(negative, q);
+}
+
+oop
+vtrt_integerDiv(oop a, oop b)
+{
+	oop quotient, remainder;
+
+	divFloored(a, b, &quotient, &remainder);
+	return quotient;
+}
+
+oop
+vtrt_integerMod(oop a, oop b)
+{
+	oop quotient, remainder;
+
+	divFloored(a, b, &quotient, &remainder);
+	return remainder;
+}
+
+int
+vtrt_integerCompare(oop a, oop b)
+{
+	Operand x(a), y(b);
+	int magnitude;
+
+	if (x.negative != y.negative)
+		return x.negative ? -1 : 1;
+	magnitude = compareLimbs(x.limbs(), x.n, y.limbs(), y.n);
+	return x.negative ? -magnitude : magnitude;
+}
+
+double
+vtrt_integerAsDouble(oop value)
+{
+	Operand x(value);
+	const Limb *limbs = x.limbs();
+	double result = 0;
+
+	for (size_t i = x.n; i-- > 0;)
+		result = result * 0x1p64 + (double)limbs[i];
+	return x.negative ? -result : result;
+}
+
+/* The greatest power of base that fits in a limb, and its exponent. */
+static Limb
+chunkOf(int base, int &digits)
+{
+	Limb chunk = base;
+
+	for (digits = 1; chunk <= UINT64_MAX / base; digits++)
+		chunk *= base;
+	return chunk;
+}
+
+oop
+vtrt_integerPrintString(oop value, int base)
+{
+	static const char digitChars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	Operand x(value);
+	Magnitude m(x.limbs(), x.limbs() + x.n);
+	size_t n = m.size();
+	int chunkDigits;
+	Limb chunk = chunkOf(base, chunkDigits);
+	std::string digits;
+	oop string;
+
+	/* a chunk of digits at a time, from the least significant */
+	while (n > 0) {
+		Limb rem = divLimb(m.data(), m.data(), n, chunk);
+
+		n = significant(m.data(), n);
+		for (int i = 0; i < chunkDigits && (n > 0 || rem != 0); i++) {
+			digits += digitChars[rem % base];
+			rem /= base;
+		}
+	}
+	if (digits.empty())
+		digits = "0";
+	else if (x.negative)
+		digits += '-';
+	std::reverse(digits.begin(), digits.end());
+
+	string = vtrt_alloc({ (vtrt_memoop_t)wellKnown.stringClass.m_ptr },
+	    digits.size(), kSlotsBytes);
+	memcpy(string.ptr->vns->oops, digits.data(), digits.size());
+	return string;
+}
+
+oop
+vtrt_integerFromString(const char *string, size_t length, int base,
+    bool *failed)
+{
+	bool negative = length > 0 && string[0] == '-';
+	size_t i = negative;
+	int chunkDigits;
+	Magnitude m;
+
+	chunkOf(base, chunkDigits);
+	if (i == length) {
+		*failed = true;
+		return vtrt_nil;
+	}
+
+	/* a chunk of digits at a time, from the most significant */
+	while (i < length) {
+		Limb scale = 1, chunk = 0, carry;
+
+		for (int d = 0; d < chunkDigits && i < length; d++, i++) {
+			char c = string[i];
+			int digit = c >= '0' && c <= '9' ? c - '0' :
+			    c >= 'A' && c <= 'Z'	 ? c - 'A' + 10 :
+			    c >= 'a' && c <= 'z'	 ? c - 'a' + 10 :
+							   base;
+
+			if (digit >= base) {
+				*failed = true;
+				return vtrt_nil;
+			}
+			chunk = chunk * base + digit;
+			scale *= base;
+		}
+		/* (into an empty magnitude, the chunk is all carried out) */
+		carry = mulAddLimb(m.data(), m.size(), scale, chunk);
+		if (carry || m.empty())
+			m.push_back(carry);
+	}
+	return integer(negative, m);
+}
+
+void
+vtrt_zeroDivide(oop value)
+{
+	fprintf(stderr, "Runtime: ZeroDivide: %s divided by zero\n",
+	    className(Oop(value.ptr).isa()).c_str());
+	abort();
+}
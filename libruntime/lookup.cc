@@ -0,0 +1,273 @@
+/*!
+ * Message lookup: the method a class has for a selector, through the global
+ * method cache.
+ *
+ * A miss walks the class and its superclasses, searching each's compiled
+ * methods as its template lists them (the class side's for a metaclass), and
+ * fills the cache line the class and selector hash to. Reads take no lock, as
+ * a send may be made on any worker thread: each line has a sequence number,
+ * odd while it is being filled, and a reader which sees it change retries.
+ * Fills are made under a lock.
+ *
+ * A class with no method for a selector, but one for doesNotUnderstand:, has
+ * forward() cached for it instead: the send is made to it as to any method, and
+ * it sends doesNotUnderstand: a Message of the selector and arguments. The
+ * selector isn't among its arguments, so the lookup which found it leaves it
+ * in a per-thread variable, read before the thread can run anything else.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "runtime.hh"
+
+/* lines, a power of two */
+static const size_t cacheSize = 4096;
+
+struct CacheLine {
+	std::atomic<uint32_t> sequence;
+	std::atomic<uintptr_t> cls;
+	std::atomic<uintptr_t> selector;
+	std::atomic<vtrt_method_fn_t> method;
+};
+
+static CacheLine cache[cacheSize];
+static std::mutex fillLock;
+/* the selector of the send last looked up to forward() on this thread */
+static __thread oop missedSelector;
+
+static inline size_t
+lineOf(uintptr_t cls, uintptr_t selector)
+{
+	uintptr_t hash = (cls ^ selector * 0x9e3779b97f4a7c15) >> VT_tagBits;
+
+	return (hash ^ hash >> 20) & (cacheSize - 1);
+}
+
+/* The method of cls (or a superclass) for selector, or NULL. */
+static vtrt_method_fn_t
+findMethod(ClassOop cls, const char *selector)
+{
+	for (; !cls.isNil(); cls = cls->vns->m_superclass) {
+		ClassMapEntry *entry;
+		struct vtrt_methodArray *methods;
+		size_t nMethods;
+		bool meta;
+
+		if (!(entry = classEntry(cls, meta)))
+			continue;
+		methods = meta ? entry->templ->classMethods :
+				 entry->templ->instanceMethods;
+		nMethods = meta ? entry->templ->nClassMethods :
+				  entry->templ->nInstanceMethods;
+		for (size_t i = 0; i < nMethods; i++)
+			if (!strcmp(methods[i].name, selector))
+				return (vtrt_method_fn_t)methods[i].function;
+	}
+	return NULL;
+}
+
+/* The number of arguments a selector takes. */
+static size_t
+arity(oop selector)
+{
+	const char *name = (const char *)selector.ptr->vns->oops;
+	size_t size = selector.ptr->vns->size;
+
+	if (size == 0 || !(isalpha(name[0]) || name[0] == '_'))
+		return 1;
+	return std::count(name, name + size, ':');
+}
+
+static Oop
+doesNotUnderstand()
+{
+	static Oop selector = intern("doesNotUnderstand:");
+
+	return selector;
+}
+
+static oop
+forward(void *sender, oop self, ...)
+{
+	oop selector = missedSelector;
+	size_t nArguments = arity(selector);
+	oop arguments, message;
+	va_list list;
+	bool failed = false;
+
+	arguments = vtrt_alloc({ (vtrt_memoop_t)wellKnown.array.m_ptr },
+	    nArguments, kSlotsOops);
+	va_start(list, self);
+	for (size_t i = 0; i < nArguments; i++)
+		arguments.ptr->vns->oops[i] = va_arg(list, oop);
+	va_end(list);
+	message = vtrt_prim_basicNew(
+	    { (vtrt_memoop_t)wellKnown.message.m_ptr }, &failed);
+	MessageOop(message.ptr)->vns->m_selector = selector.ptr;
+	MessageOop(message.ptr)->vns->m_arguments = arguments.ptr;
+	return msgLookup(self, { (vtrt_memoop_t)doesNotUnderstand().m_ptr })(
+	    sender, self, message);
+}
+
+/* The method for selector, cached; forward() or NULL if there is none. */
+static vtrt_method_fn_t
+lookupMiss(ClassOop cls, oop selector, CacheLine &line)
+{
+	const char *name = (const char *)selector.ptr->vns->oops;
+	vtrt_method_fn_t method = findMethod(cls, name);
+
+	if (!method && !wellKnown.message.isNil() &&
+	    findMethod(cls, "doesNotUnderstand:"))
+		method = forward;
+	if (!method)
+		return NULL;
+
+	std::lock_guard<std::mutex> guard(fillLock);
+	uint32_t sequence = line.sequence.load(std::memory_order_relaxed);
+
+	line.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	line.cls.store((uintptr_t)cls.m_ptr, std::memory_order_relaxed);
+	line.selector.store(selector.value, std::memory_order_relaxed);
+	line.method.store(method, std::memory_order_relaxed);
+	line.sequence.store(sequence + 2, std::memory_order_release);
+	return method;
+}
+
+static inline vtrt_method_fn_t
+lookup(ClassOop cls, oop selector)
+{
+	CacheLine &line = cache[lineOf((uintptr_t)cls.m_ptr, selector.value)];
+
+	for (;;) {
+		uint32_t sequence = line.sequence.load(std::memory_order_acquire);
+		uintptr_t lineCls = line.cls.load(std::memory_order_relaxed);
+		uintptr_t lineSelector = line.selector.load(
+		    std::memory_order_relaxed);
+		vtrt_method_fn_t method = line.method.load(
+		    std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (sequence & 1 ||
+		    line.sequence.load(std::memory_order_relaxed) != sequence)
+			continue;
+		if (vtrt_likely(lineCls == (uintptr_t)cls.m_ptr &&
+			lineSelector == selector.value))
+			return method;
+		return lookupMiss(cls, selector, line);
+	}
+}
+
+static void
+notUnderstood(ClassOop cls, oop selector)
+{
+	fprintf(stderr, "Runtime: a %s does not understand #%s\n",
+	    className(cls).c_str(), (const char *)selector.ptr->vns->oops);
+	abort();
+}
+
+vtrt_method_fn_t
+msgLookup(oop receiver, oop selector)
+{
+	ClassOop cls = Oop(receiver.ptr).isa();
+	vtrt_method_fn_t method = lookup(cls, selector);
+
+	if (method == forward)
+		missedSelector = selector;
+	else if (!method)
+		notUnderstood(cls, selector);
+	return method;
+}
+
+bool
+respondsTo(Oop receiver, Oop selector)
+{
+	vtrt_method_fn_t method;
+
+	if (selector.isa() != wellKnown.symbol)
+		return false;
+	method = lookup(receiver.isa(), { (vtrt_memoop_t)selector.m_ptr });
+	return method != NULL && method != forward;
+}
+
+bool
+perform(Oop receiver, Oop selector, const Oop *arguments, size_t nArguments,
+    Oop &result)
+{
+	oop self = { (vtrt_memoop_t)receiver.m_ptr }, a[maxPerformArguments];
+	vtrt_method_fn_t method;
+
+	if (selector.isa() != wellKnown.symbol ||
+	    nArguments > maxPerformArguments ||
+	    arity({ (vtrt_memoop_t)selector.m_ptr }) != nArguments)
+		return false;
+	for (size_t i = 0; i < nArguments; i++)
+		a[i].ptr = (vtrt_memoop_t)arguments[i].m_ptr;
+	method = msgLookup(self, { (vtrt_memoop_t)selector.m_ptr });
+	switch (nArguments) {
+	case 0:
+		result = method(NULL, self).ptr;
+		break;
+	case 1:
+		result = method(NULL, self, a[0]).ptr;
+		break;
+	case 2:
+		result = method(NULL, self, a[0], a[1]).ptr;
+		break;
+	case 3:
+		result = method(NULL, self, a[0], a[1], a[2]).ptr;
+		break;
+	case 4:
+		result = method(NULL, self, a[0], a[1], a[2], a[3]).ptr;
+		break;
+	case 5:
+		result = method(NULL, self, a[0], a[1], a[2], a[3], a[4]).ptr;
+		break;
+	default:
+		result = method(NULL, self, a[0], a[1], a[2], a[3], a[4], a[5])
+			     .ptr;
+	}
+	return true;
+}
+
+oop
+vtrt_prim_perform_withArguments_(oop self, oop selector, oop arguments,
+    bool *failed)
+{
+	struct vtrt_slots *slots;
+	Oop result;
+
+	if (!VT_isPtr(arguments.value) || arguments.ptr == NULL ||
+	    !isKindOf(arguments.ptr, wellKnown.array) ||
+	    ((slots = arguments.ptr->vns) != NULL &&
+		slots->kind != kSlotsOops) ||
+	    !perform(self.ptr, selector.ptr,
+		slots ? (const Oop *)slots->oops : NULL, slots ? slots->size : 0,
+		result)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return { (vtrt_memoop_t)result.m_ptr };
+}
+
+oop
+vtrt_prim_doesNotUnderstand_(oop self, oop message, bool *failed)
+{
+	Oop selector;
+
+	if (Oop(message.ptr).isa() != wellKnown.message ||
+	    (selector = MessageOop(message.ptr)->vns->m_selector).isa() !=
+		wellKnown.symbol) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	notUnderstood(Oop(self.ptr).isa(), { (vtrt_memoop_t)selector.m_ptr });
+	return vtrt_nil;
+}
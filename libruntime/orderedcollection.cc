@@ -0,0 +1,444 @@
+/*!
+ * The ring buffers of OrderedCollections.
+ *
+ * A ring is the indexed slots of its object: the position of the first
+ * element, the number of elements, and then the slots of the elements, which
+ * run from the first around to the start again. So adding or removing at
+ * either end moves nothing else. When the ring is full it grows to twice the
+ * size, in place as a Dictionary's table does (see hashtable.cc), and so for
+ * the same reason OrderedCollection has no named instance variables.
+ *
+ * Any run of elements is in at most two runs of slots, so the bulk operations
+ * are a few memmove()s, with one write barrier for each.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "runtime.hh"
+
+static const size_t initialCapacity = 8;
+
+/* Some slots holding consecutive elements. */
+struct Run {
+	oop *slots;
+	size_t size;
+};
+
+struct Ring {
+	/* the first position and the tally, then the elements */
+	oop *slots;
+	size_t capacity;
+	size_t first;
+	size_t tally;
+
+	oop *elements() { return slots + 2; }
+
+	oop &at(size_t i)
+	{
+		size_t j = first + i;
+
+		return elements()[j < capacity ? j : j - capacity];
+	}
+
+	/* the slots of the n elements from the i'th (from 0) */
+	int runs(size_t i, size_t n, Run runs[2])
+	{
+		size_t j = first + i;
+
+		if (j >= capacity)
+			j -= capacity;
+		if (j + n <= capacity) {
+			runs[0] = { elements() + j, n };
+			return 1;
+		}
+		runs[0] = { elements() + j, capacity - j };
+		runs[1] = { elements(), n - (capacity - j) };
+		return 2;
+	}
+
+	void store()
+	{
+		slots[0] = vtrt_smi(first);
+		slots[1] = vtrt_smi(tally);
+	}
+};
+
+/* (a fresh object's slots are nil until first stored) */
+static size_t
+sizeSlot(oop value)
+{
+	return VT_isSmi(value.value) ? vtrt_smiValue(value) : 0;
+}
+
+/*
+ * The ring of an object; its capacity is 0 if it hasn't any slots yet. False
+ * if the object's indexed slots aren't laid out as a ring.
+ */
+static bool
+ringOf(oop object, Ring &ring)
+{
+	intptr_t size = vtrt_indexedSize(object);
+
+	if (!VT_isPtr(object.value) || object.ptr == NULL ||
+	    (object.ptr->vns != NULL && object.ptr->vns->kind != kSlotsOops) ||
+	    size == 1)
+		return false;
+	else if (size == 0) {
+		ring = { NULL, 0, 0, 0 };
+		return true;
+	}
+	ring.slots = object.ptr->vns->oops + object.ptr->vns->size - size;
+	ring.capacity = size - 2;
+	ring.first = sizeSlot(ring.slots[0]);
+	ring.tally = sizeSlot(ring.slots[1]);
+	return (ring.first < ring.capacity || ring.capacity == 0) &&
+	    ring.tally <= ring.capacity;
+}
+
+static bool
+isOrderedCollection(oop object)
+{
+	return isKindOf(object.ptr, wellKnown.orderedCollection);
+}
+
+/* The number of named instance variables of an object of cls. */
+static size_t
+namedSlots(oop cls)
+{
+	return vtrt_smiValue(vtrt_ivars(cls)[VTRT_CLASS_INSTANCE_SIZE]);
+}
+
+/* Copy n elements into the ring, from the i'th on. */
+static void
+copyIn(oop object, Ring &ring, size_t i, const oop *from, size_t n)
+{
+	Run runs[2];
+	int nRuns = ring.runs(i, n, runs);
+
+	for (int r = 0; r < nRuns; r++) {
+		memmove(runs[r].slots, from, runs[r].size * sizeof(oop));
+		vtrt_writeBarrierSlots(object, runs[r].slots, runs[r].size);
+		from += runs[r].size;
+	}
+}
+
+/* Copy n elements out of the ring, from the i'th on. */
+static void
+copyOut(Ring &ring, size_t i, oop *to, size_t n)
+{
+	Run runs[2];
+	int nRuns = ring.runs(i, n, runs);
+
+	for (int r = 0; r < nRuns; r++) {
+		memmove(to, runs[r].slots, runs[r].size * sizeof(oop));
+		to += runs[r].size;
+	}
+}
+
+/* Give the object a ring with room for at least n elements. */
+static void
+reserve(oop object, Ring &ring, size_t n)
+{
+	size_t capacity = ring.capacity ? ring.capacity : initialCapacity;
+	struct vtrt_slots *old = object.ptr->vns, *slots;
+	size_t nNamed, size;
+	Ring bigger;
+
+	if (n <= ring.capacity)
+		return;
+	while (capacity < n)
+		capacity *= 2;
+	nNamed = old ? old->size - vtrt_indexedSize(object) : 0;
+	size = nNamed + 2 + capacity;
+	if (!(slots = (struct vtrt_slots *)calloc(1,
+		  sizeof(struct vtrt_slots) + size * sizeof(oop))))
+		throw std::bad_alloc();
+	slots->size = size;
+	slots->kind = kSlotsOops;
+	if (nNamed)
+		memcpy(slots->oops, old->oops, nNamed * sizeof(oop));
+
+	bigger = { slots->oops + nNamed, capacity, 0, ring.tally };
+	if (ring.tally)
+		copyOut(ring, 0, bigger.elements(), ring.tally);
+	bigger.store();
+
+	/* (the old slots are left for the collector) */
+	object.ptr->vns = slots;
+	ring = bigger;
+}
+
+/*
+ * The slots of n elements of a collection, from the i'th: of an
+ * OrderedCollection, or an Array or other object of indexed slots. The
+ * receiver's own elements are first copied to buffer, as copying them into it
+ * might overwrite them. Answers the number of runs, or -1 if the collection
+ * hasn't so many elements.
+ */
+static int
+elementsOf(oop self, oop collection, size_t i, size_t n,
+    std::vector<oop> &buffer, Run runs[2])
+{
+	Ring ring;
+	intptr_t size;
+	oop *slots;
+
+	if (!VT_isPtr(collection.value) || collection.ptr == NULL)
+		return -1;
+	else if (isOrderedCollection(collection)) {
+		if (!ringOf(collection, ring) || i + n > ring.tally)
+			return -1;
+		else if (n == 0)
+			return 0;
+		else if (collection.value != self.value)
+			return ring.runs(i, n, runs);
+		buffer.resize(n);
+		copyOut(ring, i, buffer.data(), n);
+		runs[0] = { buffer.data(), n };
+		return 1;
+	}
+
+	size = vtrt_indexedSize(collection);
+	if (i + n > (size_t)size ||
+	    (n && collection.ptr->vns->kind != kSlotsOops))
+		return -1;
+	else if (n == 0)
+		return 0;
+	slots = collection.ptr->vns->oops + collection.ptr->vns->size - size;
+	runs[0] = { slots + i, n };
+	return 1;
+}
+
+/* The number of elements of a collection, as elementsOf() takes it, or -1. */
+static intptr_t
+sizeOf(oop collection)
+{
+	Ring ring;
+
+	if (isOrderedCollection(collection))
+		return ringOf(collection, ring) ? (intptr_t)ring.tally : -1;
+	return vtrt_indexedSize(collection);
+}
+
+/* Copy the elements of runs into the ring, from the i'th on. */
+static void
+copyRunsIn(oop object, Ring &ring, size_t i, Run *runs, int nRuns)
+{
+	for (int r = 0; r < nRuns; r++) {
+		copyIn(object, ring, i, runs[r].slots, runs[r].size);
+		i += runs[r].size;
+	}
+}
+
+oop
+vtrt_prim_orderedSize(oop self, bool *failed)
+{
+	Ring ring;
+
+	if (!ringOf(self, ring)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(ring.tally);
+}
+
+/* The index (from 1) of an element as an offset from the first, or -1. */
+static intptr_t
+offsetOf(Ring &ring, oop index)
+{
+	intptr_t i;
+
+	if (!VT_isSmi(index.value) || (i = vtrt_smiValue(index)) < 1 ||
+	    i > (intptr_t)ring.tally)
+		return -1;
+	return i - 1;
+}
+
+oop
+vtrt_prim_orderedAt_(oop self, oop index, bool *failed)
+{
+	Ring ring;
+	intptr_t i;
+
+	if (!ringOf(self, ring) || (i = offsetOf(ring, index)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return ring.at(i);
+}
+
+oop
+vtrt_prim_orderedAt_put_(oop self, oop index, oop value, bool *failed)
+{
+	Ring ring;
+	intptr_t i;
+
+	if (!ringOf(self, ring) || (i = offsetOf(ring, index)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	vtrt_writeBarrier(self, value);
+	return ring.at(i) = value;
+}
+
+oop
+vtrt_prim_orderedAddFirst_(oop self, oop value, bool *failed)
+{
+	Ring ring;
+
+	if (!ringOf(self, ring)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	reserve(self, ring, ring.tally + 1);
+	ring.first = ring.first ? ring.first - 1 : ring.capacity - 1;
+	ring.tally++;
+	vtrt_writeBarrier(self, value);
+	ring.at(0) = value;
+	ring.store();
+	return value;
+}
+
+oop
+vtrt_prim_orderedAddLast_(oop self, oop value, bool *failed)
+{
+	Ring ring;
+
+	if (!ringOf(self, ring)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	reserve(self, ring, ring.tally + 1);
+	vtrt_writeBarrier(self, value);
+	ring.at(ring.tally++) = value;
+	ring.store();
+	return value;
+}
+
+/* (the slot vacated is cleared, so as not to keep the element alive) */
+oop
+vtrt_prim_orderedRemoveFirst(oop self, bool *failed)
+{
+	Ring ring;
+	oop value;
+
+	if (!ringOf(self, ring) || ring.tally == 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	value = ring.at(0);
+	ring.at(0) = vtrt_nil;
+	ring.first = ring.first + 1 < ring.capacity ? ring.first + 1 : 0;
+	ring.tally--;
+	ring.store();
+	return value;
+}
+
+oop
+vtrt_prim_orderedRemoveLast(oop self, bool *failed)
+{
+	Ring ring;
+	oop value;
+
+	if (!ringOf(self, ring) || ring.tally == 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	value = ring.at(ring.tally - 1);
+	ring.at(--ring.tally) = vtrt_nil;
+	ring.store();
+	return value;
+}
+
+oop
+vtrt_prim_orderedAddAll_(oop self, oop collection, bool *failed)
+{
+	std::vector<oop> buffer;
+	Run runs[2];
+	int nRuns;
+	Ring ring;
+	intptr_t n;
+
+	if (!ringOf(self, ring) || (n = sizeOf(collection)) < 0 ||
+	    (nRuns = elementsOf(self, collection, 0, n, buffer, runs)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	} else if (n == 0)
+		return collection;
+
+	reserve(self, ring, ring.tally + n);
+	copyRunsIn(self, ring, ring.tally, runs, nRuns);
+	ring.tally += n;
+	ring.store();
+	return collection;
+}
+
+/* The bounds start and stop (from 1) as an offset and a count, or false. */
+static bool
+range(Ring &ring, oop start, oop stop, size_t &i, size_t &n)
+{
+	intptr_t first, last;
+
+	if (!VT_isSmi(start.value) || !VT_isSmi(stop.value))
+		return false;
+	first = vtrt_smiValue(start);
+	last = vtrt_smiValue(stop);
+	/* (an empty range may start just past the end) */
+	if (first < 1 || last < first - 1 || last > (intptr_t)ring.tally)
+		return false;
+	i = first - 1;
+	n = last - first + 1;
+	return true;
+}
+
+oop
+vtrt_prim_orderedCopyFrom_to_(oop self, oop start, oop stop, bool *failed)
+{
+	oop cls = vtrt_classOf(self), copy;
+	size_t nNamed = namedSlots(cls), i, n;
+	Ring ring, copied;
+
+	if (!ringOf(self, ring) || !range(ring, start, stop, i, n)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	copy = vtrt_alloc(cls, nNamed + 2 + n, kSlotsOops);
+	copied = { copy.ptr->vns->oops + nNamed, n, 0, n };
+	copied.store();
+	if (n)
+		copyOut(ring, i, copied.elements(), n);
+	vtrt_writeBarrierSlots(copy, copied.elements(), n);
+	return copy;
+}
+
+/* replacement has exactly as many elements as are replaced */
+oop
+vtrt_prim_orderedReplaceFrom_to_with_(oop self, oop start, oop stop,
+    oop replacement, bool *failed)
+{
+	std::vector<oop> buffer;
+	Run runs[2];
+	int nRuns;
+	Ring ring;
+	size_t i, n;
+
+	if (!ringOf(self, ring) || !range(ring, start, stop, i, n) ||
+	    sizeOf(replacement) != (intptr_t)n ||
+	    (nRuns = elementsOf(self, replacement, 0, n, buffer, runs)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	copyRunsIn(self, ring, i, runs, nRuns);
+	return self;
+}
+
+bool
+isRing(Oop object)
+{
+	Ring ring;
+
+	return ringOf({ (vtrt_memoop_t)object.m_ptr }, ring);
+}
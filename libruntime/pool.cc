@@ -0,0 +1,207 @@
+/*!
+ * The pool of worker threads which runs parallel loops.
+ *
+ * A loop is cut into chunks of consecutive elements, dealt out in order among
+ * the pool's workers and the thread running the loop: each takes its own from
+ * the front, so works through adjacent elements, and when it has run out takes
+ * from the back of another's, so no thread idles while another has a backlog.
+ * Each worker's chunks are guarded by a lock of its own; a chunk is at least
+ * minGrain elements, so that is little traffic beside the work.
+ *
+ * A chunk knows its loop, so a worker late finishing one loop that takes a
+ * chunk of the next runs it correctly. The thread running a loop waits until
+ * all of its chunks have finished, and only then returns.
+ *
+ * Allocation regions and identity hashing are per thread already;
+ * a chunk's code mustn't do anything else which isn't thread-safe, so the
+ * compiler only makes a block parallel if it assigns to no variable outside
+ * itself.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "runtime.hh"
+
+/* Chunks are no smaller than this many elements. */
+static const intptr_t minGrain = 64;
+
+namespace {
+
+struct Loop {
+	struct vtrt_parallelLoop *loop;
+	vtrt_chunkFunction body;
+	intptr_t grain;
+	/* chunks not yet finished */
+	std::atomic<size_t> remaining;
+};
+
+struct Chunk {
+	Loop *loop;
+	size_t index;
+};
+
+struct Worker {
+	std::mutex lock;
+	std::deque<Chunk> chunks;
+};
+
+/*
+ * (never destroyed, as the workers are waiting on it when the program exits)
+ */
+struct Pool {
+	/* the workers' queues; the last is that of the thread running the loop */
+	std::vector<std::unique_ptr<Worker>> workers;
+	/* held by the thread whose loop the pool is running */
+	std::mutex busy;
+	/* for waking workers when there are chunks, the loop's thread when done */
+	std::mutex wakeLock;
+	std::condition_variable wake, done;
+	uint64_t generation = 0;
+};
+
+} /* namespace */
+
+static Pool *pool;
+static std::once_flag started;
+/* Is this thread running chunks? A loop within one is run there. */
+static __thread bool inLoop;
+
+size_t
+vtrt_parallelChunks(intptr_t size)
+{
+	if (size <= 0)
+		return 0;
+	return std::min<intptr_t>(VTRT_PARALLEL_MAX_CHUNKS,
+	    (size + minGrain - 1) / minGrain);
+}
+
+static void
+runChunk(Chunk chunk)
+{
+	Loop *loop = chunk.loop;
+	intptr_t begin = chunk.index * loop->grain;
+	intptr_t end = std::min(begin + loop->grain, loop->loop->size);
+
+	loop->body(loop->loop, chunk.index, begin, end);
+	/* (after which loop may be gone) */
+	if (loop->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		std::lock_guard<std::mutex> guard(pool->wakeLock);
+		pool->done.notify_all();
+	}
+}
+
+/* Take the first of worker i's chunks, else the last of another's. */
+static bool
+takeChunk(size_t i, Chunk &chunk)
+{
+	size_t nWorkers = pool->workers.size();
+
+	for (size_t n = 0; n < nWorkers; n++) {
+		Worker &victim = *pool->workers[(i + n) % nWorkers];
+		std::lock_guard<std::mutex> guard(victim.lock);
+
+		if (victim.chunks.empty())
+			continue;
+		if (n == 0) {
+			chunk = victim.chunks.front();
+			victim.chunks.pop_front();
+		} else {
+			chunk = victim.chunks.back();
+			victim.chunks.pop_back();
+		}
+		return true;
+	}
+	return false;
+}
+
+static void
+work(size_t i)
+{
+	uint64_t seen = 0;
+	Chunk chunk;
+
+	inLoop = true;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(pool->wakeLock);
+			pool->wake.wait(guard,
+			    [&] { return pool->generation != seen; });
+			seen = pool->generation;
+		}
+		while (takeChunk(i, chunk))
+			runChunk(chunk);
+	}
+}
+
+/*
+ * As many workers as there are processors, less one for the thread running a
+ * loop; or as OOPSILON_THREADS says, counting that thread.
+ */
+static void
+startWorkers()
+{
+	const char *setting = getenv("OOPSILON_THREADS");
+	size_t nThreads = setting ? strtoul(setting, NULL, 10) :
+				    std::thread::hardware_concurrency();
+
+	pool = new Pool;
+	for (size_t i = 0; i < std::max<size_t>(nThreads, 1); i++)
+		pool->workers.emplace_back(new Worker);
+	for (size_t i = 0; i + 1 < pool->workers.size(); i++)
+		std::thread(work, i).detach();
+}
+
+void
+vtrt_parallelFor(struct vtrt_parallelLoop *loop, vtrt_chunkFunction body)
+{
+	size_t nChunks = vtrt_parallelChunks(loop->size), self;
+	intptr_t grain = nChunks ? (loop->size + nChunks - 1) / nChunks : 0;
+	Loop theLoop { loop, body, grain, { nChunks } };
+	std::unique_lock<std::mutex> running;
+	Chunk chunk;
+
+	if (nChunks > 1 && !inLoop) {
+		std::call_once(started, startWorkers);
+		running = std::unique_lock<std::mutex>(pool->busy,
+		    std::try_to_lock);
+	}
+	if (!running.owns_lock() || pool->workers.size() == 1) {
+		for (size_t i = 0; i < nChunks; i++)
+			body(loop, i, i * grain,
+			    std::min<intptr_t>((i + 1) * grain, loop->size));
+		return;
+	}
+
+	/* deal the chunks out in order, so each thread's are adjacent */
+	for (size_t w = 0, i = 0; w < pool->workers.size(); w++) {
+		Worker &worker = *pool->workers[w];
+		std::lock_guard<std::mutex> guard(worker.lock);
+
+		for (; i < nChunks * (w + 1) / pool->workers.size(); i++)
+			worker.chunks.push_back({ &theLoop, i });
+	}
+	{
+		std::lock_guard<std::mutex> guard(pool->wakeLock);
+		pool->generation++;
+		pool->wake.notify_all();
+	}
+
+	inLoop = true;
+	self = pool->workers.size() - 1;
+	while (takeChunk(self, chunk))
+		runChunk(chunk);
+	inLoop = false;
+
+	std::unique_lock<std::mutex> guard(pool->wakeLock);
+	pool->done.wait(guard, [&] {
+		return theLoop.remaining.load(std::memory_order_acquire) == 0;
+	});
+}
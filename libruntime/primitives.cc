@@ -0,0 +1,429 @@
+/*!
+ * The primitive table, and those primitives too big to be inline in vtrt.h.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "runtime.hh"
+
+#define PRIMITIVE(name, function) { name, (void *)function }
+
+const struct vtrt_primitive vtrt_primitives[] = {
+	PRIMITIVE("identical:", vtrt_prim_identical_),
+	PRIMITIVE("identityHash", vtrt_prim_identityHash),
+	PRIMITIVE("class", vtrt_prim_class),
+	PRIMITIVE("basicSize", vtrt_prim_basicSize),
+	PRIMITIVE("basicAt:", vtrt_prim_basicAt_),
+	PRIMITIVE("basicAt:put:", vtrt_prim_basicAt_put_),
+	PRIMITIVE("characterAt:", vtrt_prim_characterAt_),
+	PRIMITIVE("characterAt:put:", vtrt_prim_characterAt_put_),
+	PRIMITIVE("charValue", vtrt_prim_charValue),
+	PRIMITIVE("smiAsCharacter", vtrt_prim_smiAsCharacter),
+	PRIMITIVE("characterValue:", vtrt_prim_characterValue_),
+	PRIMITIVE("smiAdd:", vtrt_prim_smiAdd_),
+	PRIMITIVE("smiSub:", vtrt_prim_smiSub_),
+	PRIMITIVE("smiMul:", vtrt_prim_smiMul_),
+	PRIMITIVE("smiDiv:", vtrt_prim_smiDiv_),
+	PRIMITIVE("smiMod:", vtrt_prim_smiMod_),
+	PRIMITIVE("smiLess:", vtrt_prim_smiLess_),
+	PRIMITIVE("smiGreater:", vtrt_prim_smiGreater_),
+	PRIMITIVE("smiLessOrEqual:", vtrt_prim_smiLessOrEqual_),
+	PRIMITIVE("smiGreaterOrEqual:", vtrt_prim_smiGreaterOrEqual_),
+	PRIMITIVE("smiEqual:", vtrt_prim_smiEqual_),
+	PRIMITIVE("smiNotEqual:", vtrt_prim_smiNotEqual_),
+	PRIMITIVE("smiAsFloat", vtrt_prim_smiAsFloat),
+	PRIMITIVE("integerAdd:", vtrt_prim_integerAdd_),
+	PRIMITIVE("integerSub:", vtrt_prim_integerSub_),
+	PRIMITIVE("integerMul:", vtrt_prim_integerMul_),
+	PRIMITIVE("integerDiv:", vtrt_prim_integerDiv_),
+	PRIMITIVE("integerMod:", vtrt_prim_integerMod_),
+	PRIMITIVE("integerLess:", vtrt_prim_integerLess_),
+	PRIMITIVE("integerGreater:", vtrt_prim_integerGreater_),
+	PRIMITIVE("integerLessOrEqual:", vtrt_prim_integerLessOrEqual_),
+	PRIMITIVE("integerGreaterOrEqual:", vtrt_prim_integerGreaterOrEqual_),
+	PRIMITIVE("integerEqual:", vtrt_prim_integerEqual_),
+	PRIMITIVE("integerNotEqual:", vtrt_prim_integerNotEqual_),
+	PRIMITIVE("integerAsFloat", vtrt_prim_integerAsFloat),
+	PRIMITIVE("integerPrintString:", vtrt_prim_integerPrintString_),
+	PRIMITIVE("stringAsInteger:", vtrt_prim_stringAsInteger_),
+	PRIMITIVE("floatAdd:", vtrt_prim_floatAdd_),
+	PRIMITIVE("floatSub:", vtrt_prim_floatSub_),
+	PRIMITIVE("floatMul:", vtrt_prim_floatMul_),
+	PRIMITIVE("floatDiv:", vtrt_prim_floatDiv_),
+	PRIMITIVE("floatLess:", vtrt_prim_floatLess_),
+	PRIMITIVE("floatGreater:", vtrt_prim_floatGreater_),
+	PRIMITIVE("floatLessOrEqual:", vtrt_prim_floatLessOrEqual_),
+	PRIMITIVE("floatGreaterOrEqual:", vtrt_prim_floatGreaterOrEqual_),
+	PRIMITIVE("floatEqual:", vtrt_prim_floatEqual_),
+	PRIMITIVE("floatNotEqual:", vtrt_prim_floatNotEqual_),
+	PRIMITIVE("floatSqrt", vtrt_prim_floatSqrt),
+	PRIMITIVE("bytesEqual:", vtrt_prim_bytesEqual_),
+	PRIMITIVE("bytesCompare:", vtrt_prim_bytesCompare_),
+	PRIMITIVE("bytesHash", vtrt_prim_bytesHash),
+	PRIMITIVE("bytesIndexOf:startingAt:",
+	    vtrt_prim_bytesIndexOf_startingAt_),
+	PRIMITIVE("bytesIndexOfSubCollection:startingAt:",
+	    vtrt_prim_bytesIndexOfSubCollection_startingAt_),
+	PRIMITIVE("bytesReplaceFrom:to:with:startingAt:",
+	    vtrt_prim_bytesReplaceFrom_to_with_startingAt_),
+	PRIMITIVE("bytesFill:", vtrt_prim_bytesFill_),
+	PRIMITIVE("hashAt:", vtrt_prim_hashAt_),
+	PRIMITIVE("hashAt:ifAbsent:", vtrt_prim_hashAt_ifAbsent_),
+	PRIMITIVE("hashAt:put:", vtrt_prim_hashAt_put_),
+	PRIMITIVE("hashAdd:", vtrt_prim_hashAdd_),
+	PRIMITIVE("hashRemoveKey:", vtrt_prim_hashRemoveKey_),
+	PRIMITIVE("hashRemoveKey:ifAbsent:", vtrt_prim_hashRemoveKey_ifAbsent_),
+	PRIMITIVE("hashIncludesKey:", vtrt_prim_hashIncludesKey_),
+	PRIMITIVE("identityAt:", vtrt_prim_identityAt_),
+	PRIMITIVE("identityAt:ifAbsent:", vtrt_prim_identityAt_ifAbsent_),
+	PRIMITIVE("identityAt:put:", vtrt_prim_identityAt_put_),
+	PRIMITIVE("identityAdd:", vtrt_prim_identityAdd_),
+	PRIMITIVE("identityRemoveKey:", vtrt_prim_identityRemoveKey_),
+	PRIMITIVE("identityRemoveKey:ifAbsent:",
+	    vtrt_prim_identityRemoveKey_ifAbsent_),
+	PRIMITIVE("identityIncludesKey:", vtrt_prim_identityIncludesKey_),
+	PRIMITIVE("hashTally", vtrt_prim_hashTally),
+	PRIMITIVE("hashCapacity", vtrt_prim_hashCapacity),
+	PRIMITIVE("hashKeyAt:", vtrt_prim_hashKeyAt_),
+	PRIMITIVE("hashValueAt:", vtrt_prim_hashValueAt_),
+	PRIMITIVE("orderedSize", vtrt_prim_orderedSize),
+	PRIMITIVE("orderedAt:", vtrt_prim_orderedAt_),
+	PRIMITIVE("orderedAt:put:", vtrt_prim_orderedAt_put_),
+	PRIMITIVE("orderedAddFirst:", vtrt_prim_orderedAddFirst_),
+	PRIMITIVE("orderedAddLast:", vtrt_prim_orderedAddLast_),
+	PRIMITIVE("orderedRemoveFirst", vtrt_prim_orderedRemoveFirst),
+	PRIMITIVE("orderedRemoveLast", vtrt_prim_orderedRemoveLast),
+	PRIMITIVE("orderedAddAll:", vtrt_prim_orderedAddAll_),
+	PRIMITIVE("orderedCopyFrom:to:", vtrt_prim_orderedCopyFrom_to_),
+	PRIMITIVE("orderedReplaceFrom:to:with:",
+	    vtrt_prim_orderedReplaceFrom_to_with_),
+	PRIMITIVE("basicNew", vtrt_prim_basicNew),
+	PRIMITIVE("basicNew:", vtrt_prim_basicNew_),
+	PRIMITIVE("processReceiver:selector:",
+	    vtrt_prim_processReceiver_selector_),
+	PRIMITIVE("processResume", vtrt_prim_processResume),
+	PRIMITIVE("processSuspend", vtrt_prim_processSuspend),
+	PRIMITIVE("processTerminate", vtrt_prim_processTerminate),
+	PRIMITIVE("processPriority:", vtrt_prim_processPriority_),
+	PRIMITIVE("processorYield", vtrt_prim_processorYield),
+	PRIMITIVE("processorActiveProcess", vtrt_prim_processorActiveProcess),
+	PRIMITIVE("semaphoreWait", vtrt_prim_semaphoreWait),
+	PRIMITIVE("semaphoreSignal", vtrt_prim_semaphoreSignal),
+	PRIMITIVE("delayWait", vtrt_prim_delayWait),
+	PRIMITIVE("fdOpenRead:", vtrt_prim_fdOpenRead_),
+	PRIMITIVE("fdOpenWrite:", vtrt_prim_fdOpenWrite_),
+	PRIMITIVE("fdPipeTo:", vtrt_prim_fdPipeTo_),
+	PRIMITIVE("fdListenOn:", vtrt_prim_fdListenOn_),
+	PRIMITIVE("fdConnectTo:port:", vtrt_prim_fdConnectTo_port_),
+	PRIMITIVE("fdListenOnPath:", vtrt_prim_fdListenOnPath_),
+	PRIMITIVE("fdConnectToPath:", vtrt_prim_fdConnectToPath_),
+	PRIMITIVE("fdAcceptInto:", vtrt_prim_fdAcceptInto_),
+	PRIMITIVE("fdLocalPort", vtrt_prim_fdLocalPort),
+	PRIMITIVE("fdReadInto:startingAt:count:",
+	    vtrt_prim_fdReadInto_startingAt_count_),
+	PRIMITIVE("fdWrite:startingAt:count:",
+	    vtrt_prim_fdWrite_startingAt_count_),
+	PRIMITIVE("fdClose", vtrt_prim_fdClose),
+	PRIMITIVE("bytesMapFile:", vtrt_prim_bytesMapFile_),
+	PRIMITIVE("bytesGraphOf:", vtrt_prim_bytesGraphOf_),
+	PRIMITIVE("bytesLoadGraph", vtrt_prim_bytesLoadGraph),
+	PRIMITIVE("bytesLoadGraphFile:", vtrt_prim_bytesLoadGraphFile_),
+	PRIMITIVE("connectionOn:", vtrt_prim_connectionOn_),
+	PRIMITIVE("connectionFlush", vtrt_prim_connectionFlush),
+	PRIMITIVE("connectionClose", vtrt_prim_connectionClose),
+	PRIMITIVE("connectionReceive", vtrt_prim_connectionReceive),
+	PRIMITIVE("connectionServe:", vtrt_prim_connectionServe_),
+	PRIMITIVE("remoteSend:", vtrt_prim_remoteSend_),
+	PRIMITIVE("promiseWait", vtrt_prim_promiseWait),
+	PRIMITIVE("promiseValue", vtrt_prim_promiseValue),
+	PRIMITIVE("promiseRelease", vtrt_prim_promiseRelease),
+	PRIMITIVE("perform:withArguments:", vtrt_prim_perform_withArguments_),
+	PRIMITIVE("doesNotUnderstand:", vtrt_prim_doesNotUnderstand_),
+	PRIMITIVE("primitiveFailed", vtrt_prim_primitiveFailed),
+};
+
+const size_t vtrt_nPrimitives =
+    sizeof(vtrt_primitives) / sizeof(vtrt_primitives[0]);
+
+void *
+vtrt_findPrimitive(const char *name)
+{
+	for (size_t i = 0; i < vtrt_nPrimitives; i++)
+		if (!strcmp(vtrt_primitives[i].name, name))
+			return vtrt_primitives[i].function;
+	return NULL;
+}
+
+oop
+vtrt_prim_basicNew(oop self, bool *failed)
+{
+	return vtrt_prim_basicNew_(self, vtrt_smi(0), failed);
+}
+
+oop
+vtrt_prim_basicNew_(oop self, oop size, bool *failed)
+{
+	ClassOop cls(self.ptr);
+
+	if (isBytesClass(cls))
+		return vtrt_allocIndexed(self, 0, kSlotsBytes, size, failed);
+	return vtrt_allocIndexed(self, cls->vns->m_instanceSize.smi(),
+	    kSlotsOops, size, failed);
+}
+
+#define INTEGER_ARITHMETIC_PRIMITIVE(name, function)			\
+	oop								\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!vtrt_isInteger(self) || !vtrt_isInteger(arg)) {	\
+			*failed = true;					\
+			return vtrt_nil;				\
+		}							\
+		return function(self, arg);				\
+	}
+/* (zero is always a SmallInteger) */
+#define INTEGER_DIVISION_PRIMITIVE(name, function)			\
+	oop								\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!vtrt_isInteger(self) || !vtrt_isInteger(arg) ||	\
+		    arg.value == vtrt_smi(0).value) {			\
+			*failed = true;					\
+			return vtrt_nil;				\
+		}							\
+		return function(self, arg);				\
+	}
+#define INTEGER_COMPARISON_PRIMITIVE(name, operator)			\
+	oop								\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!vtrt_isInteger(self) || !vtrt_isInteger(arg)) {	\
+			*failed = true;					\
+			return vtrt_nil;				\
+		}							\
+		return vtrt_bool(					\
+		    vtrt_integerCompare(self, arg) operator 0);		\
+	}
+
+INTEGER_ARITHMETIC_PRIMITIVE(integerAdd_, vtrt_integerAdd)
+INTEGER_ARITHMETIC_PRIMITIVE(integerSub_, vtrt_integerSub)
+INTEGER_ARITHMETIC_PRIMITIVE(integerMul_, vtrt_integerMul)
+INTEGER_DIVISION_PRIMITIVE(integerDiv_, vtrt_integerDiv)
+INTEGER_DIVISION_PRIMITIVE(integerMod_, vtrt_integerMod)
+INTEGER_COMPARISON_PRIMITIVE(integerLess_, <)
+INTEGER_COMPARISON_PRIMITIVE(integerGreater_, >)
+INTEGER_COMPARISON_PRIMITIVE(integerLessOrEqual_, <=)
+INTEGER_COMPARISON_PRIMITIVE(integerGreaterOrEqual_, >=)
+INTEGER_COMPARISON_PRIMITIVE(integerEqual_, ==)
+INTEGER_COMPARISON_PRIMITIVE(integerNotEqual_, !=)
+
+oop
+vtrt_prim_integerAsFloat(oop self, bool *failed)
+{
+	if (!vtrt_isInteger(self)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_float(vtrt_numberValue(self));
+}
+
+/* Is base a SmallInteger radix, 2 to 36? */
+static bool
+isRadix(oop base)
+{
+	return VT_isSmi(base.value) && vtrt_smiValue(base) >= 2 &&
+	    vtrt_smiValue(base) <= 36;
+}
+
+oop
+vtrt_prim_integerPrintString_(oop self, oop base, bool *failed)
+{
+	if (!vtrt_isInteger(self) || !isRadix(base)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_integerPrintString(self, vtrt_smiValue(base));
+}
+
+oop
+vtrt_prim_stringAsInteger_(oop self, oop base, bool *failed)
+{
+	if (!VT_isPtr(self.value) || self.ptr == NULL ||
+	    self.ptr->vns == NULL || self.ptr->vns->kind != kSlotsBytes ||
+	    !isRadix(base)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_integerFromString((const char *)self.ptr->vns->oops,
+	    self.ptr->vns->size, vtrt_smiValue(base), failed);
+}
+
+/* The slots of a byte object, or NULL if value isn't one. */
+static struct vtrt_slots *
+byteSlots(oop value)
+{
+	if (!VT_isPtr(value.value) || value.ptr == NULL ||
+	    value.ptr->vns == NULL || value.ptr->vns->kind != kSlotsBytes)
+		return NULL;
+	return value.ptr->vns;
+}
+
+static inline uint8_t *
+bytesOf(struct vtrt_slots *slots)
+{
+	return (uint8_t *)slots->oops;
+}
+
+/* A String is never equal to a Symbol or a ByteArray of the same bytes. */
+oop
+vtrt_prim_bytesEqual_(oop self, oop arg, bool *failed)
+{
+	struct vtrt_slots *a = byteSlots(self), *b;
+
+	if (a == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	} else if ((b = byteSlots(arg)) == NULL ||
+	    self.ptr->isa.value != arg.ptr->isa.value || a->size != b->size)
+		return vtrt_bool(false);
+	return vtrt_bool(
+	    !vtrt_bytesCompare(bytesOf(a), a->size, bytesOf(b), b->size));
+}
+
+oop
+vtrt_prim_bytesCompare_(oop self, oop arg, bool *failed)
+{
+	struct vtrt_slots *a = byteSlots(self), *b = byteSlots(arg);
+	int order;
+
+	if (a == NULL || b == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	order = vtrt_bytesCompare(bytesOf(a), a->size, bytesOf(b), b->size);
+	return vtrt_smi(order < 0 ? -1 : order > 0 ? 1 : 0);
+}
+
+oop
+vtrt_prim_bytesHash(oop self, bool *failed)
+{
+	struct vtrt_slots *slots = byteSlots(self);
+
+	if (slots == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(vtrt_bytesHash(bytesOf(slots), slots->size));
+}
+
+/* Is start a SmallInteger from 1 to size + 1? */
+static bool
+isStartIndex(oop start, size_t size)
+{
+	return VT_isSmi(start.value) && vtrt_smiValue(start) >= 1 &&
+	    vtrt_smiValue(start) <= (intptr_t)size + 1;
+}
+
+oop
+vtrt_prim_bytesIndexOf_startingAt_(oop self, oop value, oop start,
+    bool *failed)
+{
+	struct vtrt_slots *slots = byteSlots(self);
+	intptr_t byte, from, found;
+
+	if (VT_isChar(value.value))
+		byte = vtrt_charValue(value);
+	else if (VT_isSmi(value.value))
+		byte = vtrt_smiValue(value);
+	else
+		byte = -1;
+	if (slots == NULL || !isStartIndex(start, slots->size)) {
+		*failed = true;
+		return vtrt_nil;
+	} else if (byte < 0 || byte > 255)
+		return vtrt_smi(0);
+	from = vtrt_smiValue(start) - 1;
+	found = vtrt_bytesIndexOf(bytesOf(slots) + from, slots->size - from,
+	    byte);
+	return vtrt_smi(found < 0 ? 0 : from + found + 1);
+}
+
+oop
+vtrt_prim_bytesIndexOfSubCollection_startingAt_(oop self, oop sub,
+    oop start, bool *failed)
+{
+	struct vtrt_slots *slots = byteSlots(self), *needle = byteSlots(sub);
+	intptr_t from, found;
+
+	if (slots == NULL || needle == NULL ||
+	    !isStartIndex(start, slots->size)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	from = vtrt_smiValue(start) - 1;
+	found = vtrt_bytesFind(bytesOf(slots) + from, slots->size - from,
+	    bytesOf(needle), needle->size);
+	return vtrt_smi(found < 0 ? 0 : from + found + 1);
+}
+
+/* (the two may be the same object, and overlap) */
+oop
+vtrt_prim_bytesReplaceFrom_to_with_startingAt_(oop self, oop start,
+    oop stop, oop replacement, oop repStart, bool *failed)
+{
+	struct vtrt_slots *slots = byteSlots(self);
+	struct vtrt_slots *from = byteSlots(replacement);
+	intptr_t first, last, repFirst;
+
+	if (slots == NULL || slots->immutable || from == NULL ||
+	    !VT_isSmi(start.value) || !VT_isSmi(stop.value) ||
+	    !VT_isSmi(repStart.value)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	first = vtrt_smiValue(start);
+	last = vtrt_smiValue(stop);
+	repFirst = vtrt_smiValue(repStart);
+	if (last == first - 1 && first >= 1 &&
+	    first <= (intptr_t)slots->size + 1)
+		return self;
+	if (first < 1 || last < first || last > (intptr_t)slots->size ||
+	    repFirst < 1 ||
+	    repFirst + (last - first) > (intptr_t)from->size) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	memmove(bytesOf(slots) + first - 1, bytesOf(from) + repFirst - 1,
+	    last - first + 1);
+	return self;
+}
+
+oop
+vtrt_prim_bytesFill_(oop self, oop value, bool *failed)
+{
+	struct vtrt_slots *slots = byteSlots(self);
+	intptr_t byte;
+
+	if (VT_isChar(value.value))
+		byte = vtrt_charValue(value);
+	else if (VT_isSmi(value.value))
+		byte = vtrt_smiValue(value);
+	else
+		byte = -1;
+	if (slots == NULL || slots->immutable || byte < 0 || byte > 255) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	memset(bytesOf(slots), byte, slots->size);
+	return self;
+}
+
+oop
+vtrt_prim_primitiveFailed(oop self, bool *failed)
+{
+	fprintf(stderr, "Runtime: a primitive failed on a %s\n",
+	    className(Oop(self.ptr).isa()).c_str());
+	abort();
+}
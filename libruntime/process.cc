@@ -0,0 +1,1204 @@
+/*!
+ * Processes: green threads, each running on a small stack of its own, which
+ * a number of worker threads switch between.
+ *
+ * A Process's stack is reserved as address space, but memory is committed only
+ * for the pages it touches, so one which doesn't recurse deeply costs a few
+ * kilobytes. A guard page below catches overflow. The stacks of terminated
+ * Processes are kept for reuse, with what they had touched beyond their top
+ * pages given back.
+ *
+ * Switching saves the registers the C ABI has preserved across a call on the
+ * stack being left, and restores those of the stack being resumed: a dozen
+ * instructions, and no system call (as swapcontext() makes, for the signal
+ * mask).
+ *
+ * There are as many workers as processors, or as OOPSILON_THREADS says; they
+ * are started by the first thread to use Processes, which is one, its stack
+ * being the first Process's. Each worker has a list of ready Processes for
+ * each priority, and runs the first of its highest; one preempted goes back to
+ * the front of its list, so keeps its turn. A Process made ready goes on the
+ * lists of the worker which made it so, where what it shares with what woke it
+ * is at hand. A worker with none ready takes one from another's lists, and
+ * with none to take there either, sleeps until one is made ready; a worker
+ * wakes one only when it has more than one ready, so one Process signalling
+ * another back and forth stays on one worker. Scheduling is as Smalltalk-80's
+ * for each worker: the active Process runs until it waits, yields, or resumes
+ * one of higher priority, which runs in its place. Another worker may be
+ * running one of lower priority meanwhile.
+ *
+ * A Process may be taken by another worker while the one which ran it is still
+ * switching away from its stack, so it is marked saved only once that has
+ * been left; the worker taking it waits until then. The first Process is only
+ * ever run by its thread, the stack being that thread's; that worker's own
+ * loop runs on a stack made for it, as others' run on their threads'.
+ *
+ * Processes waiting on a Semaphore are linked through their nextLink, from its
+ * firstLink to its lastLink, so are signalled in the order they waited; each
+ * Semaphore is guarded by one of a set of locks, chosen by its address. Those
+ * waiting on a Delay are kept by the worker they waited on, in a heap by
+ * deadline, and made ready at its first switch after it; an idle worker sleeps
+ * until its first is due.
+ *
+ * Those waiting on I/O are watched by the poller (psc/poll.cc). A worker polls
+ * without waiting when it has no Process ready, and every so often when it
+ * has, so they aren't kept waiting by a busy one; and one idle worker at a time
+ * waits in the poller rather than sleeping, to be interrupted when a Process
+ * is made ready. If every worker is idle and no Process waits on a Delay or on
+ * I/O, every Process is waiting on a Semaphore nothing can signal, which is
+ * reported as a deadlock.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "psc.hh"
+#include "runtime.hh"
+
+/* Each stack is this much address space, its guard page included. */
+static const size_t stackReserve = 256 * 1024;
+/* memory kept committed at the top of a stack being reused */
+static const size_t stackKeep = 16 * 1024;
+/* that of the first Process; keep in sync with libstkern/Processor.st */
+static const intptr_t userSchedulingPriority = 4;
+/* Semaphores are guarded by this many locks */
+static const size_t nSemaphoreLocks = 64;
+/* a busy worker polls for I/O at every this many switches */
+static const unsigned pollInterval = 64;
+
+enum State {
+	kSuspended,
+	kReady,
+	kRunning,
+	kWaiting,
+	kSleeping,
+	/* waiting on I/O */
+	kBlocked,
+	kTerminated,
+};
+
+/* Wait a moment for another thread, spinning. */
+static inline void
+relax()
+{
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+namespace {
+
+/* A lock only ever held for a few instructions, so spun on. */
+class SpinLock {
+	std::atomic<bool> held { false };
+
+    public:
+	void lock()
+	{
+		while (held.exchange(true, std::memory_order_acquire))
+			while (held.load(std::memory_order_relaxed))
+				relax();
+	}
+	void unlock() { held.store(false, std::memory_order_release); }
+};
+
+struct Worker;
+
+/* The runtime's side of a Process: its stack, and where it is scheduled. */
+struct Fiber {
+	/* the stack pointer, saved while it isn't running */
+	void *sp;
+	/* the stack's mapping; NULL for a thread's own stack */
+	char *memory;
+	/* nil for a worker's loop */
+	ProcessOop process;
+	/*
+	 * its State in the low byte, above which it counts its sleeps, so a
+	 * Delay it was taken from can't wake it
+	 */
+	std::atomic<uint64_t> status;
+	/* clear from when it is taken to run until it has been switched from */
+	std::atomic<bool> saved;
+	/* the worker whose lists it is ready on, and at what priority */
+	std::atomic<Worker *> queue;
+	size_t queuePriority;
+	/* the only worker which may run it, if any */
+	Worker *pinned;
+};
+
+/* A Process waiting on a Delay. */
+struct Sleeper {
+	uint64_t deadline;
+	Fiber *fiber;
+	/* its status while sleeping */
+	uint64_t status;
+
+	/* (so the heap has the soonest first) */
+	bool operator<(const Sleeper &other) const
+	{
+		return deadline > other.deadline;
+	}
+};
+
+struct Worker {
+	/* guards the ready lists */
+	SpinLock lock;
+	/* the ready Processes of each priority, first and last */
+	ProcessOop ready[VTRT_PROCESS_PRIORITIES][2];
+	/* bit p - 1 is set if there are ready Processes of priority p */
+	std::atomic<unsigned> readyMask;
+	/* how many of them another worker may take */
+	std::atomic<size_t> nStealable;
+
+	/* the rest only the worker itself touches */
+	ProcessOop active;
+	/* its loop, which finds it a Process to run or sleeps */
+	Fiber *loop;
+	/* the Fiber it has just switched from, and whether it terminated */
+	Fiber *left;
+	bool leftDead;
+	std::vector<Sleeper> sleepers;
+	std::vector<Fiber *> freeFibers;
+	size_t index;
+	/* switches, to poll for I/O every pollInterval */
+	unsigned ticks;
+};
+
+/*
+ * (never destroyed, as the workers are waiting on it when the program exits)
+ */
+struct Machine {
+	std::vector<Worker *> workers;
+	/* for idle workers to wait on until a Process is ready */
+	std::mutex idleLock;
+	std::condition_variable idle;
+	std::atomic<size_t> nIdle { 0 };
+	/* Processes waiting on Delays, on all workers */
+	std::atomic<size_t> nSleepers { 0 };
+	/* Processes waiting on I/O */
+	std::atomic<size_t> nBlocked { 0 };
+	/* Is an idle worker waiting in the poller? (guarded by idleLock) */
+	bool polling = false;
+	SpinLock semaphoreLocks[nSemaphoreLocks];
+};
+
+} /* namespace */
+
+static Machine *machine;
+static std::once_flag started;
+static __thread Worker *current;
+
+extern "C" {
+/* Save the registers and stack pointer in *save, and resume at to. */
+void vtrt_switchStack(void **save, void *to);
+/* where a new stack starts: calls its entry with its Fiber */
+void vtrt_startStack();
+}
+
+/*
+ * Only the registers a callee must preserve are saved, as vtrt_switchStack()
+ * is called like any function; not the floating point control words, which
+ * nothing changes. A new stack starts out as if it had switched away at the
+ * start of vtrt_startStack(), with its Fiber and entry in saved registers.
+ */
+#if defined(__x86_64__)
+asm(".text\n"
+    ".globl vtrt_switchStack\n"
+    ".hidden vtrt_switchStack\n"
+    ".type vtrt_switchStack, @function\n"
+    "vtrt_switchStack:\n"
+    "	pushq %rbp\n"
+    "	pushq %rbx\n"
+    "	pushq %r12\n"
+    "	pushq %r13\n"
+    "	pushq %r14\n"
+    "	pushq %r15\n"
+    "	movq %rsp, (%rdi)\n"
+    "	movq %rsi, %rsp\n"
+    "	popq %r15\n"
+    "	popq %r14\n"
+    "	popq %r13\n"
+    "	popq %r12\n"
+    "	popq %rbx\n"
+    "	popq %rbp\n"
+    "	ret\n"
+    ".size vtrt_switchStack, .-vtrt_switchStack\n"
+    ".globl vtrt_startStack\n"
+    ".hidden vtrt_startStack\n"
+    ".type vtrt_startStack, @function\n"
+    "vtrt_startStack:\n"
+    "	movq %r12, %rdi\n"
+    "	callq *%r13\n"
+    "	ud2\n"
+    ".size vtrt_startStack, .-vtrt_startStack\n");
+
+/*
+ * r15, r14, r13 (entry), r12 (fiber), rbx, rbp, the return address, and two
+ * words so the stack is aligned for the call
+ */
+enum { kFrameSize = 9, kFrameFiber = 3, kFrameEntry = 2, kFrameReturn = 6 };
+#elif defined(__aarch64__)
+asm(".text\n"
+    ".globl vtrt_switchStack\n"
+    ".hidden vtrt_switchStack\n"
+    ".type vtrt_switchStack, %function\n"
+    "vtrt_switchStack:\n"
+    "	sub sp, sp, #160\n"
+    "	stp x19, x20, [sp, #0]\n"
+    "	stp x21, x22, [sp, #16]\n"
+    "	stp x23, x24, [sp, #32]\n"
+    "	stp x25, x26, [sp, #48]\n"
+    "	stp x27, x28, [sp, #64]\n"
+    "	stp x29, x30, [sp, #80]\n"
+    "	stp d8, d9, [sp, #96]\n"
+    "	stp d10, d11, [sp, #112]\n"
+    "	stp d12, d13, [sp, #128]\n"
+    "	stp d14, d15, [sp, #144]\n"
+    "	mov x2, sp\n"
+    "	str x2, [x0]\n"
+    "	mov sp, x1\n"
+    "	ldp x19, x20, [sp, #0]\n"
+    "	ldp x21, x22, [sp, #16]\n"
+    "	ldp x23, x24, [sp, #32]\n"
+    "	ldp x25, x26, [sp, #48]\n"
+    "	ldp x27, x28, [sp, #64]\n"
+    "	ldp x29, x30, [sp, #80]\n"
+    "	ldp d8, d9, [sp, #96]\n"
+    "	ldp d10, d11, [sp, #112]\n"
+    "	ldp d12, d13, [sp, #128]\n"
+    "	ldp d14, d15, [sp, #144]\n"
+    "	add sp, sp, #160\n"
+    "	ret\n"
+    ".size vtrt_switchStack, .-vtrt_switchStack\n"
+    ".globl vtrt_startStack\n"
+    ".hidden vtrt_startStack\n"
+    ".type vtrt_startStack, %function\n"
+    "vtrt_startStack:\n"
+    "	mov x0, x19\n"
+    "	blr x20\n"
+    "	brk #0\n"
+    ".size vtrt_startStack, .-vtrt_startStack\n");
+
+/* x19 (fiber), x20 (entry) ... x29, x30 (return address), d8 ... d15 */
+enum { kFrameSize = 20, kFrameFiber = 0, kFrameEntry = 1, kFrameReturn = 11 };
+#else
+#error "no stack switching for this architecture"
+#endif
+
+static size_t
+pageSize()
+{
+	static const size_t size = sysconf(_SC_PAGESIZE);
+
+	return size;
+}
+
+static uint64_t
+now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch())
+	    .count();
+}
+
+/*
+ * The worker running this Process. That can change at any switch, and a
+ * compiler may keep the address of a thread-local variable across calls, so
+ * after one it is looked up afresh, out of line.
+ */
+static __attribute__((noinline)) Worker *
+thisWorker()
+{
+	return current;
+}
+
+/* The address of a Fiber is kept in its Process as a SmallInteger. */
+static Fiber *
+fiberOf(ProcessOop process)
+{
+	Oop stack = process->vns->m_stack;
+
+	return stack.isSmi() ? (Fiber *)((uintptr_t)stack.m_ptr & ~VT_tagMask) :
+			       NULL;
+}
+
+static void
+setFiber(ProcessOop process, Fiber *fiber)
+{
+	process->vns->m_stack = fiber ? Oop((void *)((uintptr_t)fiber | 1)) :
+					Oop::nil();
+}
+
+static size_t
+priorityOf(ProcessOop process)
+{
+	return process->vns->m_priority.smi();
+}
+
+static State
+stateOf(Fiber *fiber)
+{
+	return State(fiber->status.load(std::memory_order_acquire) & 0xff);
+}
+
+/* Set the state of a Fiber no other thread may change the state of. */
+static void
+setState(Fiber *fiber, State state)
+{
+	uint64_t status = fiber->status.load(std::memory_order_relaxed);
+
+	fiber->status.store((status & ~UINT64_C(0xff)) | state,
+	    std::memory_order_release);
+}
+
+/* Change the state of a Fiber another thread may also be changing. */
+static bool
+changeState(Fiber *fiber, State from, State to)
+{
+	uint64_t status = fiber->status.load(std::memory_order_acquire);
+
+	return (status & 0xff) == from &&
+	    fiber->status.compare_exchange_strong(status,
+		(status & ~UINT64_C(0xff)) | to, std::memory_order_acq_rel);
+}
+
+/*
+ * the Process lists, of ready Processes and those waiting on a Semaphore,
+ * linked through their nextLink
+ */
+static void
+addLast(ProcessOop &first, ProcessOop &last, ProcessOop process)
+{
+	process->vns->m_nextLink = ProcessOop::nil();
+	if (first.isNil())
+		first = process;
+	else
+		last->vns->m_nextLink = process;
+	last = process;
+}
+
+static void
+addFirst(ProcessOop &first, ProcessOop &last, ProcessOop process)
+{
+	process->vns->m_nextLink = first;
+	if (first.isNil())
+		last = process;
+	first = process;
+}
+
+static ProcessOop
+removeFirst(ProcessOop &first, ProcessOop &last)
+{
+	ProcessOop process = first;
+
+	first = process->vns->m_nextLink;
+	if (first.isNil())
+		last = ProcessOop::nil();
+	process->vns->m_nextLink = ProcessOop::nil();
+	return process;
+}
+
+static void
+remove(ProcessOop &first, ProcessOop &last, ProcessOop process)
+{
+	ProcessOop previous;
+
+	if (first == process) {
+		removeFirst(first, last);
+		return;
+	}
+	for (previous = first; previous->vns->m_nextLink != process;)
+		previous = previous->vns->m_nextLink;
+	previous->vns->m_nextLink = process->vns->m_nextLink;
+	if (last == process)
+		last = previous;
+	process->vns->m_nextLink = ProcessOop::nil();
+}
+
+/* the ready lists; with the worker's lock held */
+static void
+enqueue(Worker *worker, Fiber *fiber, bool first)
+{
+	size_t priority = priorityOf(fiber->process);
+	ProcessOop *list = worker->ready[priority - 1];
+
+	if (first)
+		addFirst(list[0], list[1], fiber->process);
+	else
+		addLast(list[0], list[1], fiber->process);
+	worker->readyMask.store(worker->readyMask.load(
+				    std::memory_order_relaxed) |
+		1u << (priority - 1),
+	    std::memory_order_relaxed);
+	if (!fiber->pinned)
+		worker->nStealable.fetch_add(1, std::memory_order_relaxed);
+	fiber->queue.store(worker, std::memory_order_relaxed);
+	fiber->queuePriority = priority;
+	setState(fiber, kReady);
+}
+
+static void
+dequeue(Worker *worker, Fiber *fiber)
+{
+	size_t priority = fiber->queuePriority;
+	ProcessOop *list = worker->ready[priority - 1];
+
+	remove(list[0], list[1], fiber->process);
+	if (list[0].isNil())
+		worker->readyMask.store(worker->readyMask.load(
+					    std::memory_order_relaxed) &
+			~(1u << (priority - 1)),
+		    std::memory_order_relaxed);
+	if (!fiber->pinned)
+		worker->nStealable.fetch_sub(1, std::memory_order_relaxed);
+	fiber->queue.store(NULL, std::memory_order_relaxed);
+}
+
+/*
+ * The first ready Process of the highest priority, to run; another worker
+ * takes only one it may. NULL if there is none.
+ */
+static Fiber *
+takeReady(Worker *worker, bool stealing)
+{
+	unsigned mask = worker->readyMask.load(std::memory_order_relaxed);
+
+	while (mask) {
+		size_t priority = 32 - __builtin_clz(mask);
+		ProcessOop process = worker->ready[priority - 1][0];
+
+		for (; !process.isNil(); process = process->vns->m_nextLink) {
+			Fiber *fiber = fiberOf(process);
+
+			if (stealing && fiber->pinned)
+				continue;
+			dequeue(worker, fiber);
+			setState(fiber, kRunning);
+			return fiber;
+		}
+		mask &= ~(1u << (priority - 1));
+	}
+	return NULL;
+}
+
+/* Wake a sleeping worker, or all, if any is. */
+static void
+wakeWorkers(bool all)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (machine->nIdle.load(std::memory_order_relaxed) == 0)
+		return;
+	std::lock_guard<std::mutex> guard(machine->idleLock);
+	if (all)
+		machine->idle.notify_all();
+	else
+		machine->idle.notify_one();
+	if (machine->polling && (all || machine->nIdle.load() == 1))
+		pscInterrupt();
+}
+
+/*
+ * Put a Process no other thread is scheduling on the ready lists of this
+ * worker, or of the one it is pinned to.
+ */
+static void
+makeReady(Worker *worker, Fiber *fiber, bool first = false)
+{
+	Worker *queue = fiber->pinned ? fiber->pinned : worker;
+	bool others;
+
+	{
+		std::lock_guard<SpinLock> guard(queue->lock);
+
+		others = queue->readyMask.load(std::memory_order_relaxed) != 0;
+		enqueue(queue, fiber, first);
+	}
+	if (queue != worker)
+		wakeWorkers(true);
+	else if (others)
+		wakeWorkers(false);
+}
+
+/* Make ready the Processes whose Delays on this worker are past. */
+static void
+wakeSleepers(Worker *worker)
+{
+	uint64_t time;
+
+	if (worker->sleepers.empty())
+		return;
+	time = now();
+	while (!worker->sleepers.empty() &&
+	    worker->sleepers.front().deadline <= time) {
+		Sleeper sleeper = worker->sleepers.front();
+
+		std::pop_heap(worker->sleepers.begin(), worker->sleepers.end());
+		worker->sleepers.pop_back();
+		machine->nSleepers.fetch_sub(1, std::memory_order_relaxed);
+		if (sleeper.fiber->status.compare_exchange_strong(sleeper.status,
+			(sleeper.status & ~UINT64_C(0xff)) | kReady,
+			std::memory_order_acq_rel))
+			makeReady(worker, sleeper.fiber);
+	}
+}
+
+/* The poller's: make ready a Process whose descriptor is. */
+static void
+unblock(void *waiter)
+{
+	Fiber *fiber = (Fiber *)waiter;
+
+	if (changeState(fiber, kBlocked, kReady)) {
+		machine->nBlocked.fetch_sub(1, std::memory_order_relaxed);
+		makeReady(thisWorker(), fiber);
+	}
+}
+
+/* The next Process to run: this worker's, else another's; or NULL. */
+static Fiber *
+findWork(Worker *worker)
+{
+	size_t nWorkers = machine->workers.size();
+	Fiber *fiber = NULL;
+
+	wakeSleepers(worker);
+	if (machine->nBlocked.load(std::memory_order_relaxed) &&
+	    (!worker->readyMask.load(std::memory_order_relaxed) ||
+		++worker->ticks % pollInterval == 0))
+		pscPoll(0, unblock);
+	if (worker->readyMask.load(std::memory_order_relaxed)) {
+		std::lock_guard<SpinLock> guard(worker->lock);
+
+		fiber = takeReady(worker, false);
+	}
+	for (size_t i = 1; fiber == NULL && i < nWorkers; i++) {
+		Worker *victim = machine->workers[(worker->index + i) % nWorkers];
+		bool more;
+
+		if (victim->nStealable.load(std::memory_order_relaxed) == 0)
+			continue;
+		{
+			std::lock_guard<SpinLock> guard(victim->lock);
+
+			fiber = takeReady(victim, true);
+			more = victim->nStealable.load(
+				   std::memory_order_relaxed) != 0;
+		}
+		/* (so the rest of a backlog is shared out too) */
+		if (fiber && more)
+			wakeWorkers(false);
+	}
+	return fiber;
+}
+
+/* Is there a Process this worker could run? */
+static bool
+anyReady(Worker *worker)
+{
+	if (worker->readyMask.load(std::memory_order_relaxed))
+		return true;
+	for (Worker *other : machine->workers)
+		if (other->nStealable.load(std::memory_order_relaxed))
+			return true;
+	return false;
+}
+
+/* Is any Process ready, on any worker? */
+static bool
+anyQueued()
+{
+	for (Worker *other : machine->workers)
+		if (other->readyMask.load(std::memory_order_relaxed))
+			return true;
+	return false;
+}
+
+/*
+ * Sleep until a Process might be ready for this worker. (One just woken
+ * counts as idle until it has the lock again, so it may have Processes ready
+ * for it.)
+ */
+static void
+park(Worker *worker)
+{
+	std::unique_lock<std::mutex> guard(machine->idleLock);
+	size_t nIdle = machine->nIdle.fetch_add(1) + 1;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (anyReady(worker))
+		;
+	else if (machine->nBlocked.load() && !machine->polling) {
+		int64_t timeout = -1;
+
+		if (!worker->sleepers.empty())
+			timeout = std::max<int64_t>(
+			    worker->sleepers.front().deadline - now(), 0);
+		machine->polling = true;
+		guard.unlock();
+		pscPoll(timeout, unblock);
+		guard.lock();
+		machine->polling = false;
+	} else if (!worker->sleepers.empty())
+		machine->idle.wait_until(guard,
+		    std::chrono::steady_clock::time_point(
+			std::chrono::nanoseconds(
+			    worker->sleepers.front().deadline)));
+	else if (nIdle == machine->workers.size() &&
+	    machine->nSleepers.load() == 0 && machine->nBlocked.load() == 0 &&
+	    !anyQueued()) {
+		fprintf(stderr, "Runtime: deadlock: every Process is "
+				"waiting on a Semaphore\n");
+		abort();
+	} else
+		machine->idle.wait(guard);
+	machine->nIdle.fetch_sub(1);
+}
+
+/* Keep a terminated Process's stack for another. */
+static void
+freeFiber(Worker *worker, Fiber *fiber)
+{
+	madvise(fiber->memory + pageSize(),
+	    stackReserve - pageSize() - stackKeep, MADV_DONTNEED);
+	worker->freeFibers.push_back(fiber);
+}
+
+/*
+ * On a new stack: mark that left saved, or free it if it terminated, now that
+ * the worker is off it.
+ */
+static void
+afterSwitch()
+{
+	Worker *worker = thisWorker();
+	Fiber *left = worker->left;
+
+	worker->left = NULL;
+	if (worker->leftDead) {
+		worker->leftDead = false;
+		freeFiber(worker, left);
+	} else if (left)
+		left->saved.store(true, std::memory_order_release);
+}
+
+/* Leave from (which has been put wherever it waits) for to. */
+static void
+switchTo(Worker *worker, Fiber *from, Fiber *to)
+{
+	if (to == from)
+		return;
+	while (!to->saved.load(std::memory_order_acquire))
+		relax();
+	to->saved.store(false, std::memory_order_relaxed);
+	worker->active = to->process;
+	worker->left = from;
+	vtrt_switchStack(&from->sp, to->sp);
+	afterSwitch();
+}
+
+/* The active Process, from, has been put wherever it waits; run another. */
+static void
+switchAway(Worker *worker, Fiber *from)
+{
+	Fiber *to = findWork(worker);
+
+	switchTo(worker, from, to ? to : worker->loop);
+}
+
+/* A worker's loop: find a Process to run, or sleep until there is one. */
+static void
+loop(Worker *worker)
+{
+	for (;;) {
+		Fiber *fiber = findWork(worker);
+
+		if (fiber)
+			switchTo(worker, worker->loop, fiber);
+		else
+			park(worker);
+	}
+}
+
+/*
+ * Make a Process which was suspended or waiting, and which this thread now
+ * has the scheduling of, ready; if its priority is higher than the active
+ * one's, it runs now.
+ */
+static void
+resume(Worker *worker, Fiber *fiber)
+{
+	Fiber *active = fiberOf(worker->active);
+
+	if ((fiber->pinned && fiber->pinned != worker) ||
+	    priorityOf(fiber->process) <= priorityOf(worker->active)) {
+		makeReady(worker, fiber);
+		return;
+	}
+	makeReady(worker, active, true);
+	setState(fiber, kRunning);
+	switchTo(worker, active, fiber);
+}
+
+/* Where a new Process starts, with its Fiber. */
+static void
+run(Fiber *fiber)
+{
+	ProcessOop process = fiber->process;
+	oop receiver = { (vtrt_memoop_t)process->vns->m_receiver.m_ptr };
+	oop selector = { (vtrt_memoop_t)process->vns->m_selector.m_ptr };
+	Worker *worker;
+
+	afterSwitch();
+	msgLookup(receiver, selector)(NULL, receiver);
+
+	/* (a stack can't be freed while on it, so the next Fiber does) */
+	worker = thisWorker();
+	setState(fiber, kTerminated);
+	setFiber(process, NULL);
+	worker->leftDead = true;
+	switchAway(worker, fiber);
+	abort();
+}
+
+/* Where the loop of the first thread's worker starts. */
+static void
+runLoop(Fiber *fiber)
+{
+	afterSwitch();
+	loop(fiber->pinned);
+}
+
+/* A Fiber with a stack set up to start at entry. */
+static Fiber *
+newFiber(Worker *worker, void (*entry)(Fiber *))
+{
+	Fiber *fiber;
+	void **frame;
+
+	if (!worker->freeFibers.empty()) {
+		fiber = worker->freeFibers.back();
+		worker->freeFibers.pop_back();
+	} else {
+		fiber = new Fiber();
+		fiber->memory = (char *)mmap(NULL, stackReserve,
+		    PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+		    0);
+		if (fiber->memory == MAP_FAILED) {
+			delete fiber;
+			throw std::bad_alloc();
+		}
+		mprotect(fiber->memory, pageSize(), PROT_NONE);
+	}
+
+	frame = (void **)(((uintptr_t)fiber->memory + stackReserve) & ~15) -
+	    kFrameSize;
+	frame[kFrameFiber] = fiber;
+	frame[kFrameEntry] = (void *)entry;
+	frame[kFrameReturn] = (void *)vtrt_startStack;
+	fiber->sp = frame;
+	setState(fiber, kSuspended);
+	fiber->saved.store(true, std::memory_order_relaxed);
+	fiber->pinned = NULL;
+	return fiber;
+}
+
+/* A worker's thread, whose own stack runs its loop. */
+static void
+work(Worker *worker)
+{
+	current = worker;
+	worker->loop = new Fiber();
+	worker->loop->pinned = worker;
+	loop(worker);
+}
+
+/*
+ * Start the workers: this thread is the first, and its stack is the first
+ * Process's.
+ */
+static void
+startWorkers()
+{
+	const char *setting = getenv("OOPSILON_THREADS");
+	size_t nThreads = setting ? strtoul(setting, NULL, 10) :
+				    std::thread::hardware_concurrency();
+	Worker *first;
+	Fiber *fiber;
+
+	machine = new Machine;
+	for (size_t i = 0; i < std::max<size_t>(nThreads, 1); i++) {
+		machine->workers.push_back(new Worker());
+		machine->workers.back()->index = i;
+	}
+
+	first = current = machine->workers[0];
+	fiber = new Fiber();
+	fiber->process = vtrt_alloc({ (vtrt_memoop_t)wellKnown.process.m_ptr },
+	    sizeOfInstance<ProcessDesc>(), kSlotsOops)
+			     .ptr;
+	fiber->process->vns->m_priority = SmiOop(userSchedulingPriority);
+	fiber->pinned = first;
+	setState(fiber, kRunning);
+	setFiber(fiber->process, fiber);
+	first->active = fiber->process;
+	first->loop = newFiber(first, runLoop);
+	first->loop->pinned = first;
+
+	for (size_t i = 1; i < machine->workers.size(); i++)
+		std::thread(work, machine->workers[i]).detach();
+}
+
+/* The worker running this Process, starting the workers if need be. */
+static Worker *
+activeWorker()
+{
+	Worker *worker = thisWorker();
+
+	if (vtrt_likely(worker != NULL))
+		return worker;
+	std::call_once(started, startWorkers);
+	if (!(worker = thisWorker())) {
+		fprintf(stderr, "Runtime: Processes can only be used by the "
+				"thread which first used them\n");
+		abort();
+	}
+	return worker;
+}
+
+/* The Fiber of a primitive's Process; NULL, failing, if it has terminated. */
+static Fiber *
+processFiber(oop process, bool *failed)
+{
+	Fiber *fiber = NULL;
+
+	if (!isKindOf(process.ptr, wellKnown.process) ||
+	    !(fiber = fiberOf(ProcessOop(process.ptr))))
+		*failed = true;
+	return fiber;
+}
+
+static SpinLock &
+semaphoreLock(SemaphoreOop semaphore)
+{
+	uintptr_t address = (uintptr_t)semaphore.m_ptr >> 4;
+
+	return machine->semaphoreLocks[(address ^ address >> 8) %
+	    nSemaphoreLocks];
+}
+
+/*
+ * Take a Process which is not running off whatever it is waiting on, leaving
+ * it suspended. Fails if it is running: on another worker, if not this one's
+ * active Process.
+ */
+static bool
+suspendOther(Fiber *fiber)
+{
+	for (;;) {
+		switch (stateOf(fiber)) {
+		case kSuspended:
+			return true;
+
+		case kSleeping:
+			if (changeState(fiber, kSleeping, kSuspended))
+				return true;
+			break;
+
+		case kBlocked:
+			if (changeState(fiber, kBlocked, kSuspended)) {
+				machine->nBlocked.fetch_sub(1,
+				    std::memory_order_relaxed);
+				return true;
+			}
+			break;
+
+		case kReady: {
+			Worker *queue = fiber->queue.load(
+			    std::memory_order_relaxed);
+
+			if (!queue)
+				break;
+			std::lock_guard<SpinLock> guard(queue->lock);
+			if (stateOf(fiber) == kReady &&
+			    fiber->queue.load(std::memory_order_relaxed) == queue) {
+				dequeue(queue, fiber);
+				setState(fiber, kSuspended);
+				return true;
+			}
+			break;
+		}
+
+		case kWaiting: {
+			SemaphoreOop semaphore = fiber->process->vns->m_myList;
+
+			if (semaphore.isNil())
+				break;
+			std::lock_guard<SpinLock> guard(semaphoreLock(semaphore));
+			if (stateOf(fiber) == kWaiting &&
+			    fiber->process->vns->m_myList == semaphore) {
+				remove(semaphore->vns->m_firstLink,
+				    semaphore->vns->m_lastLink, fiber->process);
+				fiber->process->vns->m_myList =
+				    SemaphoreOop::nil();
+				setState(fiber, kSuspended);
+				return true;
+			}
+			break;
+		}
+
+		default:
+			return false;
+		}
+		relax();
+	}
+}
+
+oop
+vtrt_prim_processReceiver_selector_(oop self, oop receiver, oop selector,
+    bool *failed)
+{
+	Worker *worker = activeWorker();
+	oop object = vtrt_prim_basicNew(self, failed);
+	ProcessOop process(object.ptr);
+	Fiber *fiber;
+
+	if (*failed || !isKindOf(process, wellKnown.process)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	fiber = newFiber(worker, run);
+	fiber->process = process;
+	process->vns->m_priority = worker->active->vns->m_priority;
+	process->vns->m_receiver = receiver.ptr;
+	process->vns->m_selector = selector.ptr;
+	setFiber(process, fiber);
+	return object;
+}
+
+oop
+vtrt_prim_processResume(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	Fiber *fiber = processFiber(self, failed);
+
+	if (fiber == NULL || !changeState(fiber, kSuspended, kReady)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	resume(worker, fiber);
+	return self;
+}
+
+oop
+vtrt_prim_processSuspend(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	Fiber *fiber = processFiber(self, failed);
+
+	if (fiber == NULL)
+		return vtrt_nil;
+	if (fiber->process == worker->active) {
+		setState(fiber, kSuspended);
+		switchAway(worker, fiber);
+	} else if (!suspendOther(fiber))
+		*failed = true;
+	return self;
+}
+
+/* (the first Process, being on its thread's stack, can't be) */
+oop
+vtrt_prim_processTerminate(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	Fiber *fiber = processFiber(self, failed);
+
+	if (fiber == NULL || fiber->memory == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	if (fiber->process == worker->active) {
+		setState(fiber, kTerminated);
+		setFiber(fiber->process, NULL);
+		worker->leftDead = true;
+		switchAway(worker, fiber);
+		abort();
+	}
+	if (!suspendOther(fiber)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	setState(fiber, kTerminated);
+	setFiber(fiber->process, NULL);
+	/* (it may have just waited, and its worker not yet be off its stack) */
+	while (!fiber->saved.load(std::memory_order_acquire))
+		relax();
+	freeFiber(worker, fiber);
+	return self;
+}
+
+/*
+ * A ready Process is moved to the list of its new priority; others go on
+ * theirs when next made ready.
+ */
+oop
+vtrt_prim_processPriority_(oop self, oop priority, bool *failed)
+{
+	Fiber *fiber = processFiber(self, failed);
+	Worker *queue;
+
+	if (fiber == NULL || !VT_isSmi(priority.value) ||
+	    vtrt_smiValue(priority) < 1 ||
+	    vtrt_smiValue(priority) > VTRT_PROCESS_PRIORITIES) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	if (!(queue = fiber->queue.load(std::memory_order_relaxed))) {
+		fiber->process->vns->m_priority = priority.ptr;
+		return self;
+	}
+	std::lock_guard<SpinLock> guard(queue->lock);
+	if (stateOf(fiber) == kReady &&
+	    fiber->queue.load(std::memory_order_relaxed) == queue) {
+		dequeue(queue, fiber);
+		fiber->process->vns->m_priority = priority.ptr;
+		enqueue(queue, fiber, false);
+	} else
+		fiber->process->vns->m_priority = priority.ptr;
+	return self;
+}
+
+/* Run the others ready at the active Process's priority, if any. */
+oop
+vtrt_prim_processorYield(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	Fiber *fiber = fiberOf(worker->active);
+
+	wakeSleepers(worker);
+	if (worker->readyMask.load(std::memory_order_relaxed) >>
+	    (priorityOf(worker->active) - 1)) {
+		makeReady(worker, fiber);
+		switchAway(worker, fiber);
+	}
+	return self;
+}
+
+oop
+vtrt_prim_processorActiveProcess(oop self, bool *failed)
+{
+	return { (vtrt_memoop_t)activeWorker()->active.m_ptr };
+}
+
+/* (a new Semaphore's slots are nil, which counts as no excess signals) */
+static intptr_t
+excessSignals(SemaphoreOop semaphore)
+{
+	SmiOop signals = semaphore->vns->m_excessSignals;
+
+	return signals.isSmi() ? signals.smi() : 0;
+}
+
+oop
+vtrt_prim_semaphoreWait(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	SemaphoreOop semaphore(self.ptr);
+	Fiber *fiber = fiberOf(worker->active);
+
+	{
+		std::lock_guard<SpinLock> guard(semaphoreLock(semaphore));
+		intptr_t signals = excessSignals(semaphore);
+
+		if (signals > 0) {
+			semaphore->vns->m_excessSignals = SmiOop(signals - 1);
+			return self;
+		}
+		addLast(semaphore->vns->m_firstLink, semaphore->vns->m_lastLink,
+		    worker->active);
+		worker->active->vns->m_myList = semaphore;
+		setState(fiber, kWaiting);
+	}
+	switchAway(worker, fiber);
+	return self;
+}
+
+oop
+vtrt_prim_semaphoreSignal(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	SemaphoreOop semaphore(self.ptr);
+	ProcessOop process;
+
+	{
+		std::lock_guard<SpinLock> guard(semaphoreLock(semaphore));
+
+		if (semaphore->vns->m_firstLink.isNil()) {
+			semaphore->vns->m_excessSignals = SmiOop(
+			    excessSignals(semaphore) + 1);
+			return self;
+		}
+		process = removeFirst(semaphore->vns->m_firstLink,
+		    semaphore->vns->m_lastLink);
+		process->vns->m_myList = SemaphoreOop::nil();
+	}
+	resume(worker, fiberOf(process));
+	return self;
+}
+
+oop
+vtrt_prim_delayWait(oop self, bool *failed)
+{
+	Worker *worker = activeWorker();
+	DelayOop delay(self.ptr);
+	Fiber *fiber = fiberOf(worker->active);
+	uint64_t status;
+
+	if (!delay->vns->m_duration.isSmi()) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	status = ((fiber->status.load(std::memory_order_relaxed) >> 8) + 1)
+		<< 8 |
+	    kSleeping;
+	fiber->status.store(status, std::memory_order_release);
+	worker->sleepers.push_back({ now() +
+		delay->vns->m_duration.smi() * UINT64_C(1000000),
+	    fiber, status });
+	std::push_heap(worker->sleepers.begin(), worker->sleepers.end());
+	machine->nSleepers.fetch_add(1, std::memory_order_relaxed);
+	switchAway(worker, fiber);
+	return self;
+}
+
+bool
+waitForIO(int fd, bool write)
+{
+	Worker *worker = activeWorker();
+	Fiber *fiber = fiberOf(worker->active);
+	bool watched;
+
+	setState(fiber, kBlocked);
+	machine->nBlocked.fetch_add(1, std::memory_order_relaxed);
+	if (!(watched = pscWatch(fd, write, fiber)) &&
+	    changeState(fiber, kBlocked, kRunning)) {
+		machine->nBlocked.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+	/* (if it couldn't be watched, it was suspended meanwhile) */
+	switchAway(worker, fiber);
+	return watched;
+}
@@ -0,0 +1,129 @@
+/*!
+ * Receiver-class profiling for instrumented builds (vm --instrument).
+ *
+ * The counters are written out when the process exits to the file named by
+ * OOPSILON_PROFILE (by default "oopsilon.profile"), adding to whatever counts
+ * that file already holds, so that several runs accumulate into one profile.
+ * vm --profile=FILE reads it back. Each line is tab-separated, one of:
+ *	send <method> <site index> <selector> <receiver class> <count>
+ *	entry <method> <count>
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <vector>
+
+#include "runtime.hh"
+
+static std::vector<struct vtrt_profile *> profiles;
+
+/*
+ * Sends may be profiled on several worker threads at once: a slot is claimed
+ * for a class by swapping it in for NULL, and the counts are bumped
+ * atomically. (Relaxed; they are only read once the program has exited.)
+ */
+void
+vtrt_profileSend(struct vtrt_sendSite *site, oop receiver)
+{
+	oop cls = vtrt_classOf(receiver);
+
+	for (int i = 0; i < VTRT_PROFILE_WIDTH; i++) {
+		vtrt_memoop_t expected = NULL;
+
+		if (__atomic_compare_exchange_n(&site->receivers[i].cls.ptr,
+			&expected, cls.ptr, false, __ATOMIC_RELAXED,
+			__ATOMIC_RELAXED) ||
+		    expected == cls.ptr) {
+			__atomic_fetch_add(&site->receivers[i].count, 1,
+			    __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	__atomic_fetch_add(&site->megamorphic, 1, __ATOMIC_RELAXED);
+}
+
+/* (kind, method, index, selector, class) -> count */
+typedef std::tuple<std::string, std::string, std::string, std::string,
+    std::string>
+    ProfileKey;
+
+static void
+readProfile(const char *path, std::map<ProfileKey, uint64_t> &counts)
+{
+	std::ifstream in(path);
+	std::string line;
+
+	while (std::getline(in, line)) {
+		std::vector<std::string> fields;
+		std::stringstream stream(line);
+		std::string field;
+
+		while (std::getline(stream, field, '\t'))
+			fields.push_back(field);
+
+		if (fields.size() == 6 && fields[0] == "send")
+			counts[{ fields[0], fields[1], fields[2], fields[3],
+			    fields[4] }] += std::stoull(fields[5]);
+		else if (fields.size() == 3 && fields[0] == "entry")
+			counts[{ fields[0], fields[1], "", "", "" }] +=
+			    std::stoull(fields[2]);
+	}
+}
+
+static void
+writeProfile()
+{
+	const char *path = getenv("OOPSILON_PROFILE");
+	std::map<ProfileKey, uint64_t> counts;
+
+	if (!path)
+		path = "oopsilon.profile";
+
+	readProfile(path, counts);
+
+	for (auto profile : profiles) {
+		for (size_t i = 0; i < profile->nSendSites; i++) {
+			auto &site = profile->sendSites[i];
+			std::string index = std::to_string(site.index);
+
+			for (auto &receiver : site.receivers)
+				if (receiver.count)
+					counts[{ "send", site.method, index,
+					    site.selector,
+					    className(receiver.cls.ptr) }] +=
+					    receiver.count;
+			if (site.megamorphic)
+				counts[{ "send", site.method, index,
+				    site.selector, "*" }] += site.megamorphic;
+		}
+		for (size_t i = 0; i < profile->nEntryCounters; i++)
+			if (profile->entryCounters[i].count)
+				counts[{ "entry",
+				    profile->entryCounters[i].method, "", "",
+				    "" }] += profile->entryCounters[i].count;
+	}
+
+	std::ofstream out(path);
+	for (auto &count : counts) {
+		auto &[kind, method, index, selector, cls] = count.first;
+
+		if (kind == "send")
+			out << kind << "\t" << method << "\t" << index << "\t"
+			    << selector << "\t" << cls << "\t" << count.second
+			    << "\n";
+		else
+			out << kind << "\t" << method << "\t" << count.second
+			    << "\n";
+	}
+}
+
+void
+registerProfile(struct vtrt_profile *profile)
+{
+	if (profiles.empty())
+		atexit(writeProfile);
+	profiles.push_back(profile);
+}
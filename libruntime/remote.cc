@@ -0,0 +1,744 @@
+/*!
+ * Remote sends: messages sent over a socket to objects another program
+ * serves, answering Promises.
+ *
+ * A RemoteObject stands for an object on the other side of a Connection, and
+ * sends the messages it doesn't understand there. Each send is given the
+ * number of its answer and answers at once a Promise of that number, so the
+ * sender needn't wait for it; the Promise stands in turn for the answer, on
+ * the other side, so messages sent to it go there too, naming it as their
+ * receiver by its number. A chain of sends each to the answer of the last so
+ * goes in one round trip, the server performing them in order as they come.
+ * Arguments which are RemoteObjects of the same Connection are sent as such;
+ * others, and answers, are copied as object graphs (see serialize.cc).
+ *
+ * Sends are framed into an outbox, written out as a batch once it holds
+ * batchSize bytes, when a Promise is waited on, or when the Connection is
+ * flushed: a chain of small sends goes in one write. The server writes the
+ * answers to each batch of sends it reads together, in one write too.
+ *
+ * A frame is a Frame header, then, of a send, the references of its arguments
+ * sent as references, then a graph of the Message. Both sides must be of the
+ * same word size and byte order, as graphs are. A reference is what the
+ * sender knows an object on the other side by: the object served, 0, or the
+ * number of an answer, shifted and tagged.
+ *
+ * A client's answers are read by a Process of their own (Connection>>receive),
+ * which resolves each's Promise and signals its Semaphore. The answer is
+ * copied into the Promise if it can be, else only known to be there; and a
+ * send which couldn't be performed (the receiver having no method for it, its
+ * arguments not being readable, or the receiver being the answer of another
+ * such) is answered as broken. A Connection closed or failed breaks the
+ * Promises it has yet to resolve, and any made after.
+ *
+ * The reader and writer of a Connection each have a descriptor of their own
+ * for the socket, a descriptor having only one waiter at a time (see
+ * psc/poll.cc). Its state is guarded by a mutex, never held across a wait.
+ * A server keeps each answer it has made, as the client may yet send to it,
+ * until the client releases its Promise (Promise>>release), or the Connection
+ * is closed: there is no collector to say when a Promise is gone. Nor, for the
+ * same reason, is a Connection's state freed, as Promises may outlive it.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "runtime.hh"
+
+namespace {
+
+/* an outbox this full is written out */
+const size_t batchSize = 16 * 1024;
+/* read from the socket at once */
+const size_t readSize = 64 * 1024;
+/* frames bigger are taken as garbage, and the Connection closed */
+const uint64_t maxFrameSize = 1 << 30;
+
+enum FrameType {
+	/* a Message to be sent to target, to be answered as answer */
+	kSend,
+	/* the answer to one, copied */
+	kAnswer,
+	/* the answer to one, which couldn't be copied */
+	kAnswerHeld,
+	/* no answer to one, its send having failed */
+	kAnswerBroken,
+	/* answer will be sent no more messages, so needn't be kept */
+	kRelease,
+};
+
+/* keep in sync with Promise>>state */
+enum PromiseState {
+	kPending,
+	kCopied,
+	kHeld,
+	kBroken,
+};
+
+struct Frame {
+	/* the bytes after the header, a multiple of 8 */
+	uint64_t size;
+	uint64_t type;
+	uint64_t answer;
+	/* of a send, the reference of its receiver */
+	uint64_t target;
+	/* of a send, how many Arguments follow */
+	uint64_t nArguments;
+};
+
+/* an argument of a send, sent as a reference */
+struct Argument {
+	uint64_t index;
+	uint64_t reference;
+};
+
+/* The reference of an object served (0, the root) or of an answer. */
+uint64_t
+reference(uint64_t id, bool answer)
+{
+	return id << 1 | answer;
+}
+
+size_t
+padded(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+struct Connection {
+	/* read by the reader, and written by the writer */
+	int fd, writeFd;
+	std::mutex lock;
+	/* frames yet to be written, and those being written */
+	std::vector<uint8_t> outbox, sending;
+	/* whether a Process is writing the outbox out */
+	bool writing = false;
+	/* whether closed, or failed */
+	bool closed = false;
+	/* a graph being framed */
+	std::vector<uint8_t> graph;
+	/* read, from start to end */
+	std::vector<uint8_t> inbox;
+	size_t start = 0, end = 0;
+	/* a client's Promises yet to be resolved, and its last answer's number */
+	std::unordered_map<uint64_t, Oop> promises;
+	uint64_t lastAnswer = 0;
+	/* a server's answers */
+	std::unordered_map<uint64_t, Oop> answers;
+};
+
+ClassOop connectionClass, remoteObjectClass, promiseClass;
+std::once_flag classesFound;
+
+void
+findClasses()
+{
+	connectionClass = findClass("Connection");
+	remoteObjectClass = findClass("RemoteObject");
+	promiseClass = findClass("Promise");
+}
+
+/* The state of a Connection, or NULL if it isn't one, on a socket. */
+Connection *
+connectionOf(Oop value)
+{
+	Oop state;
+
+	std::call_once(classesFound, findClasses);
+	if (!isKindOf(value, connectionClass))
+		return NULL;
+	state = ConnectionOop(value.m_ptr)->vns->m_state;
+	return state.isSmi() ? (Connection *)((uintptr_t)state.m_ptr &
+		       ~VT_tagMask) :
+			       NULL;
+}
+
+/* Close writeFd once it is done with; with the lock held. */
+void
+release(Connection *connection)
+{
+	if (connection->closed && !connection->writing &&
+	    connection->writeFd >= 0) {
+		close(connection->writeFd);
+		connection->writeFd = -1;
+	}
+}
+
+/* Mark connection closed, so the reader reads no more; with the lock held. */
+void
+fail(Connection *connection)
+{
+	if (!connection->closed && connection->writeFd >= 0)
+		shutdown(connection->writeFd, SHUT_RDWR);
+	connection->closed = true;
+	release(connection);
+}
+
+bool
+writeAll(int fd, const uint8_t *bytes, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, bytes, size);
+
+		if (n >= 0) {
+			bytes += n;
+			size -= n;
+		} else if (errno != EINTR &&
+		    ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+			!waitForIO(fd, true)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Write out the outbox, unless another Process is writing it already (which
+ * then writes what was added meanwhile, too).
+ */
+void
+flush(Connection *connection)
+{
+	std::unique_lock<std::mutex> guard(connection->lock);
+
+	if (connection->writing)
+		return;
+	connection->writing = true;
+	while (!connection->outbox.empty() && !connection->closed) {
+		bool written;
+
+		connection->sending.swap(connection->outbox);
+		guard.unlock();
+		written = writeAll(connection->writeFd,
+		    connection->sending.data(), connection->sending.size());
+		guard.lock();
+		connection->sending.clear();
+		if (!written)
+			fail(connection);
+	}
+	connection->writing = false;
+	release(connection);
+}
+
+/* Add a frame to the outbox; with the lock held. */
+void
+post(Connection *connection, FrameType type, uint64_t answer,
+    uint64_t target, const std::vector<Argument> &arguments,
+    const std::vector<uint8_t> *graph)
+{
+	size_t graphSize = graph ? padded(graph->size()) : 0;
+	Frame frame = { arguments.size() * sizeof(Argument) + graphSize,
+		(uint64_t)type, answer, target, arguments.size() };
+	std::vector<uint8_t> &outbox = connection->outbox;
+	size_t at = outbox.size();
+
+	outbox.resize(at + sizeof(frame) + frame.size);
+	memcpy(&outbox[at], &frame, sizeof(frame));
+	at += sizeof(frame);
+	if (!arguments.empty())
+		memcpy(&outbox[at], arguments.data(),
+		    arguments.size() * sizeof(Argument));
+	at += arguments.size() * sizeof(Argument);
+	if (graph && !graph->empty())
+		memcpy(&outbox[at], graph->data(), graph->size());
+}
+
+/*
+ * Read until a whole frame is in the inbox, from start; false at the end, or
+ * on an error.
+ */
+bool
+readFrame(Connection *connection)
+{
+	std::vector<uint8_t> &inbox = connection->inbox;
+
+	for (;;) {
+		size_t held = connection->end - connection->start, wanted;
+		Frame frame;
+		ssize_t n;
+
+		if (held >= sizeof(frame)) {
+			memcpy(&frame, &inbox[connection->start], sizeof(frame));
+			if (frame.size > maxFrameSize || frame.size % 8 != 0 ||
+			    frame.nArguments > frame.size / sizeof(Argument))
+				return false;
+			if (held >= sizeof(frame) + frame.size)
+				return true;
+			wanted = sizeof(frame) + frame.size;
+		} else
+			wanted = sizeof(frame);
+
+		/* keep the frame at the start, with room to read the rest */
+		if (connection->start != 0) {
+			memmove(inbox.data(), &inbox[connection->start], held);
+			connection->start = 0;
+			connection->end = held;
+		}
+		if (inbox.size() < std::max(wanted, held + readSize))
+			inbox.resize(std::max(wanted, held + readSize));
+		while ((n = read(connection->fd, &inbox[connection->end],
+			    inbox.size() - connection->end)) < 0 &&
+		    (errno == EINTR ||
+			((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    waitForIO(connection->fd, false))))
+			;
+		if (n <= 0)
+			return false;
+		connection->end += n;
+	}
+}
+
+/* The frame at the start of the inbox; it is taken by the next read. */
+const Frame &
+nextFrame(Connection *connection, const uint8_t *&body)
+{
+	const Frame *frame = (const Frame *)&connection->inbox[connection->start];
+
+	body = (const uint8_t *)(frame + 1);
+	connection->start += sizeof(Frame) + frame->size;
+	return *frame;
+}
+
+/* Is there another whole frame in the inbox already? */
+bool
+frameHeld(Connection *connection)
+{
+	size_t held = connection->end - connection->start;
+	Frame frame;
+
+	if (held < sizeof(frame))
+		return false;
+	memcpy(&frame, &connection->inbox[connection->start], sizeof(frame));
+	return held >= sizeof(frame) + frame.size;
+}
+
+/* Close the reader's descriptor and the socket, once done reading. */
+void
+closeReader(Connection *connection, oop self)
+{
+	std::lock_guard<std::mutex> guard(connection->lock);
+
+	fail(connection);
+	close(connection->fd);
+	connection->fd = -1;
+	connection->inbox = std::vector<uint8_t>();
+	connection->start = connection->end = 0;
+	ConnectionOop(self.ptr)->vns->m_socket->vns->m_fd = SmiOop::nil();
+}
+
+/* Resolve a Promise; with the lock held. */
+void
+resolve(PromiseOop promise, PromiseState state, Oop value)
+{
+	promise->vns->m_value = value;
+	promise->vns->m_state = SmiOop(state);
+}
+
+/*
+ * Wake what waits on a Promise resolved; without the lock held, as the waiter
+ * may run at once.
+ */
+void
+wake(PromiseOop promise)
+{
+	bool failed = false;
+
+	vtrt_prim_semaphoreSignal(
+	    { (vtrt_memoop_t)promise->vns->m_semaphore.m_ptr }, &failed);
+}
+
+/* The object on this side a reference from the other names, or false. */
+bool
+referent(Connection *connection, Oop root, uint64_t reference, Oop &object)
+{
+	if (reference == 0) {
+		object = root;
+		return true;
+	} else if (!(reference & 1))
+		return false;
+	auto answer = connection->answers.find(reference >> 1);
+
+	if (answer == connection->answers.end())
+		return false;
+	object = answer->second;
+	return true;
+}
+
+/*
+ * Perform a send read from the client: false if it couldn't be, the frame
+ * being good but for that.
+ */
+bool
+performSend(Connection *connection, Oop root, const Frame &frame,
+    const uint8_t *body, Oop &result)
+{
+	const Argument *arguments = (const Argument *)body;
+	size_t graphOffset = frame.nArguments * sizeof(Argument);
+	struct vtrt_slots *slots;
+	Oop receiver, message;
+	MessageOop send;
+
+	if (!referent(connection, root, frame.target, receiver) ||
+	    !loadGraph(body + graphOffset, frame.size - graphOffset, false,
+		message) ||
+	    message.isa() != wellKnown.message)
+		return false;
+	send = message.m_ptr;
+	if (send->vns->m_arguments.isNil())
+		slots = NULL;
+	else if (send->vns->m_arguments.isa() != wellKnown.array)
+		return false;
+	else
+		slots = (struct vtrt_slots *)send->vns->m_arguments->vns;
+	for (uint64_t i = 0; i < frame.nArguments; i++)
+		if (slots == NULL || arguments[i].index >= slots->size ||
+		    !referent(connection, root, arguments[i].reference,
+			((Oop *)slots->oops)[arguments[i].index]))
+			return false;
+	return respondsTo(receiver, send->vns->m_selector) &&
+	    ::perform(receiver, send->vns->m_selector,
+		slots ? (const Oop *)slots->oops : NULL,
+		slots ? slots->size : 0, result);
+}
+
+/* The Connection of a RemoteObject, or NULL if value isn't one. */
+Connection *
+remoteConnectionOf(Oop value)
+{
+	std::call_once(classesFound, findClasses);
+	if (!isKindOf(value, remoteObjectClass) ||
+	    !RemoteObjectOop(value.m_ptr)->vns->m_id.isSmi())
+		return NULL;
+	return connectionOf(RemoteObjectOop(value.m_ptr)->vns->m_connection);
+}
+
+/* The reference of a RemoteObject of connection, or false. */
+bool
+referenceOf(Connection *connection, Oop value, uint64_t &reference)
+{
+	if (remoteConnectionOf(value) != connection)
+		return false;
+	reference = ::reference(RemoteObjectOop(value.m_ptr)->vns->m_id.smi(),
+	    isKindOf(value, promiseClass));
+	return true;
+}
+
+} /* namespace */
+
+oop
+vtrt_prim_connectionOn_(oop self, oop socket, bool *failed)
+{
+	FileDescriptorOop descriptor(socket.ptr);
+	Connection *connection;
+	int fd, writeFd, on = 1;
+
+	if (!VT_isPtr(socket.value) || socket.ptr == NULL ||
+	    !isKindOf(descriptor, findClass("FileDescriptor")) ||
+	    !descriptor->vns->m_fd.isSmi() ||
+	    (writeFd = fcntl(fd = descriptor->vns->m_fd.smi(), F_DUPFD_CLOEXEC,
+		 0)) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	/* (sends are batched here, so are best not delayed further) */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	connection = new Connection;
+	connection->fd = fd;
+	connection->writeFd = writeFd;
+	ConnectionOop(self.ptr)->vns->m_socket = descriptor;
+	ConnectionOop(self.ptr)->vns->m_state = Oop(
+	    (void *)((uintptr_t)connection | 1));
+	return self;
+}
+
+oop
+vtrt_prim_connectionFlush(oop self, bool *failed)
+{
+	Connection *connection = connectionOf(self.ptr);
+
+	if (connection == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	flush(connection);
+	return self;
+}
+
+/* Sends made already are still answered. */
+oop
+vtrt_prim_connectionClose(oop self, bool *failed)
+{
+	Connection *connection = connectionOf(self.ptr);
+
+	if (connection == NULL) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	flush(connection);
+	std::lock_guard<std::mutex> guard(connection->lock);
+	if (!connection->closed && connection->writeFd >= 0)
+		shutdown(connection->writeFd, SHUT_WR);
+	connection->closed = true;
+	release(connection);
+	return self;
+}
+
+/* Resolve the client's Promises as their answers come, until it closes. */
+oop
+vtrt_prim_connectionReceive(oop self, bool *failed)
+{
+	Connection *connection = connectionOf(self.ptr);
+
+	if (connection == NULL || connection->fd < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	while (readFrame(connection)) {
+		const uint8_t *body;
+		const Frame &frame = nextFrame(connection, body);
+		PromiseState state = kBroken;
+		Oop value;
+		PromiseOop resolved;
+
+		if (frame.type == kAnswer &&
+		    loadGraph(body, frame.size, false, value))
+			state = kCopied;
+		else if (frame.type == kAnswer || frame.type == kAnswerHeld)
+			state = kHeld;
+		{
+			std::lock_guard<std::mutex> guard(connection->lock);
+			auto promise = connection->promises.find(frame.answer);
+
+			if (frame.type == kSend || frame.type == kRelease ||
+			    promise == connection->promises.end())
+				break;
+			resolved = promise->second.m_ptr;
+			resolve(resolved, state, value);
+			connection->promises.erase(promise);
+		}
+		wake(resolved);
+	}
+
+	std::unordered_map<uint64_t, Oop> broken;
+
+	closeReader(connection, self);
+	{
+		std::lock_guard<std::mutex> guard(connection->lock);
+
+		broken.swap(connection->promises);
+		for (auto &promise : broken)
+			resolve(promise.second.m_ptr, kBroken, Oop::nil());
+	}
+	for (auto &promise : broken)
+		wake(promise.second.m_ptr);
+	return self;
+}
+
+/* Perform the client's sends, to root or their answers, until it closes. */
+oop
+vtrt_prim_connectionServe_(oop self, oop root, bool *failed)
+{
+	Connection *connection = connectionOf(self.ptr);
+	static const std::vector<Argument> none;
+	bool serving = true;
+
+	if (connection == NULL || connection->fd < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	while (serving && readFrame(connection)) {
+		do {
+			const uint8_t *body;
+			const Frame &frame = nextFrame(connection, body);
+			Oop result;
+
+			if (frame.type == kRelease) {
+				std::lock_guard<std::mutex> guard(
+				    connection->lock);
+
+				connection->answers.erase(frame.answer);
+				continue;
+			} else if (frame.type != kSend) {
+				serving = false;
+				break;
+			} else if (!performSend(connection, root.ptr, frame,
+				       body, result)) {
+				std::lock_guard<std::mutex> guard(
+				    connection->lock);
+
+				post(connection, kAnswerBroken, frame.answer, 0,
+				    none, NULL);
+				continue;
+			}
+
+			std::lock_guard<std::mutex> guard(connection->lock);
+			connection->answers[frame.answer] = result;
+			if (storeGraph(result, connection->graph))
+				post(connection, kAnswer, frame.answer, 0, none,
+				    &connection->graph);
+			else
+				post(connection, kAnswerHeld, frame.answer, 0,
+				    none, NULL);
+		} while (frameHeld(connection));
+		flush(connection);
+	}
+	closeReader(connection, self);
+	connection->answers.clear();
+	return self;
+}
+
+oop
+vtrt_prim_remoteSend_(oop self, oop message, bool *failed)
+{
+	RemoteObjectOop remote(self.ptr);
+	MessageOop send(message.ptr);
+	Connection *connection;
+	std::vector<Argument> references;
+	uint64_t target;
+	oop promise, semaphore;
+	size_t size;
+
+	if ((connection = remoteConnectionOf(remote)) == NULL ||
+	    promiseClass.isNil() || !referenceOf(connection, remote, target) ||
+	    send.isa() != wellKnown.message ||
+	    send->vns->m_arguments.isa() != wellKnown.array) {
+		*failed = true;
+		return vtrt_nil;
+	}
+
+	/* arguments of the Connection are sent as references, nil in the graph */
+	size = send->vns->m_arguments->vns ?
+	    send->vns->m_arguments->vns->size :
+	    0;
+	for (size_t i = 0; i < size; i++) {
+		uint64_t reference;
+
+		if (referenceOf(connection, send->vns->m_arguments->vns->oops[i],
+			reference))
+			references.push_back({ i, reference });
+	}
+	if (!references.empty()) {
+		oop arguments = vtrt_alloc(
+		    { (vtrt_memoop_t)wellKnown.array.m_ptr }, size, kSlotsOops);
+
+		memcpy(arguments.ptr->vns->oops,
+		    send->vns->m_arguments->vns->oops, size * sizeof(oop));
+		for (auto &argument : references)
+			arguments.ptr->vns->oops[argument.index] = vtrt_nil;
+		send = vtrt_prim_basicNew(
+		    { (vtrt_memoop_t)wellKnown.message.m_ptr }, failed)
+			   .ptr;
+		send->vns->m_selector = MessageOop(message.ptr)->vns->m_selector;
+		send->vns->m_arguments = arguments.ptr;
+	}
+
+	promise = vtrt_prim_basicNew(
+	    { (vtrt_memoop_t)promiseClass.m_ptr }, failed);
+	semaphore = vtrt_prim_basicNew(
+	    { (vtrt_memoop_t)wellKnown.semaphore.m_ptr }, failed);
+	PromiseOop(promise.ptr)->vns->m_connection =
+	    remote->vns->m_connection;
+	PromiseOop(promise.ptr)->vns->m_state = SmiOop(kPending);
+	PromiseOop(promise.ptr)->vns->m_semaphore = semaphore.ptr;
+	{
+		std::lock_guard<std::mutex> guard(connection->lock);
+		uint64_t answer = ++connection->lastAnswer;
+
+		PromiseOop(promise.ptr)->vns->m_id = SmiOop(answer);
+		if (connection->closed) {
+			resolve(promise.ptr, kBroken, Oop::nil());
+			wake(promise.ptr);
+			return promise;
+		} else if (!storeGraph(send, connection->graph)) {
+			*failed = true;
+			return vtrt_nil;
+		}
+		post(connection, kSend, answer, target, references,
+		    &connection->graph);
+		connection->promises[answer] = promise.ptr;
+		if (connection->outbox.size() < batchSize)
+			return promise;
+	}
+	flush(connection);
+	return promise;
+}
+
+/* Answers self once its answer has come. */
+oop
+vtrt_prim_promiseWait(oop self, bool *failed)
+{
+	PromiseOop promise(self.ptr);
+	Connection *connection;
+
+	if ((connection = remoteConnectionOf(promise)) == NULL ||
+	    !isKindOf(promise, promiseClass)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	flush(connection);
+	{
+		std::lock_guard<std::mutex> guard(connection->lock);
+
+		if (promise->vns->m_state.smi() != kPending)
+			return self;
+	}
+	/* (and pass the signal on, to any other waiting) */
+	vtrt_prim_semaphoreWait(
+	    { (vtrt_memoop_t)promise->vns->m_semaphore.m_ptr }, failed);
+	vtrt_prim_semaphoreSignal(
+	    { (vtrt_memoop_t)promise->vns->m_semaphore.m_ptr }, failed);
+	return self;
+}
+
+/*
+ * Tell the other side that the Promise will be sent no more messages, so its
+ * answer needn't be kept there; any sent after are answered as broken.
+ */
+oop
+vtrt_prim_promiseRelease(oop self, bool *failed)
+{
+	PromiseOop promise(self.ptr);
+	static const std::vector<Argument> none;
+	Connection *connection;
+
+	if ((connection = remoteConnectionOf(promise)) == NULL ||
+	    !isKindOf(promise, promiseClass)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	{
+		std::lock_guard<std::mutex> guard(connection->lock);
+
+		if (!connection->closed)
+			post(connection, kRelease, promise->vns->m_id.smi(), 0,
+			    none, NULL);
+		if (connection->outbox.size() < batchSize)
+			return self;
+	}
+	flush(connection);
+	return self;
+}
+
+/* Fails unless the answer was copied. */
+oop
+vtrt_prim_promiseValue(oop self, bool *failed)
+{
+	PromiseOop promise(self.ptr);
+
+	vtrt_prim_promiseWait(self, failed);
+	if (*failed || promise->vns->m_state.smi() != kCopied) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return { (vtrt_memoop_t)promise->vns->m_value.m_ptr };
+}
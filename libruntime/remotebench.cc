@@ -0,0 +1,226 @@
+/*!
+ * The cost of a chain of dependent remote sends (remote.cc), each waited for
+ * and pipelined, between two programs: remotebench [sends]
+ *
+ * The server is a child, forked before either program has started Processes,
+ * serving the SmallInteger 0 over loopback TCP and then a Unix-domain socket.
+ * The chain is of sends of + 1, each to the answer of the last: awaited, each
+ * is waited for before the next is sent, a round trip apiece; pipelined, they
+ * are sent as they are made and only the last waited for, in one. Each is
+ * timed, and its answer checked.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "runtime.hh"
+
+static struct vtrt_classTemplate object, smallInteger, symbol, string, array,
+    message, process, semaphore, fileDescriptor, connection, remoteObject,
+    promise;
+
+static oop
+add(void *sender, oop self, oop addend)
+{
+	return vtrt_smi(vtrt_smiValue(self) + vtrt_smiValue(addend));
+}
+
+static oop
+receive(void *sender, oop self)
+{
+	bool failed = false;
+
+	return vtrt_prim_connectionReceive(self, &failed);
+}
+
+static oop
+remoteSend(void *sender, oop self, oop message)
+{
+	bool failed = false;
+
+	return vtrt_prim_remoteSend_(self, message, &failed);
+}
+
+static struct vtrt_methodArray smallIntegerMethods[] = {
+	{ "+", (void *)add },
+}, connectionMethods[] = {
+	{ "receive", (void *)receive },
+}, remoteObjectMethods[] = {
+	{ "doesNotUnderstand:", (void *)remoteSend },
+};
+
+static void
+registerClass(struct vtrt_classTemplate &templ, const char *name,
+    const char *superName, size_t instanceSize, enum vtrt_slotsKind kind,
+    struct vtrt_methodArray *methods = NULL, size_t nMethods = 0)
+{
+	templ.name = name;
+	templ.superName = superName;
+	templ.instanceSize = instanceSize;
+	templ.instanceKind = kind;
+	templ.instanceMethods = methods;
+	templ.nInstanceMethods = nMethods;
+	vtrt_registerClass(name, &templ);
+}
+
+static oop
+newString(const std::string &contents)
+{
+	oop string = vtrt_alloc(::string.cls, contents.size(), kSlotsBytes);
+
+	memcpy(string.ptr->vns->oops, contents.data(), contents.size());
+	return string;
+}
+
+static oop
+newObject(struct vtrt_classTemplate &templ)
+{
+	bool failed = false;
+
+	return vtrt_prim_basicNew(templ.cls, &failed);
+}
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "remotebench: %s failed\n", what);
+		exit(1);
+	}
+}
+
+/* Serve 0 to one client of listener. */
+static void
+serve(oop listener)
+{
+	bool failed = false;
+	oop socket = vtrt_prim_fdAcceptInto_(listener, newObject(fileDescriptor),
+	    &failed);
+
+	check(!failed, "accept");
+	vtrt_prim_connectionServe_(
+	    vtrt_prim_connectionOn_(newObject(connection), socket, &failed),
+	    vtrt_smi(0), &failed);
+	check(!failed, "serve");
+}
+
+/* The answer to a chain of n sends of + 1 from root, waiting for each or not. */
+static intptr_t
+chain(oop root, intptr_t n, bool awaited)
+{
+	oop plus = { (vtrt_memoop_t)intern("+").m_ptr }, answer = root;
+	bool failed = false;
+
+	for (intptr_t i = 0; i < n; i++) {
+		answer = msgLookup(answer, plus)(NULL, answer, vtrt_smi(1));
+		if (awaited)
+			vtrt_prim_promiseWait(answer, &failed);
+	}
+	answer = vtrt_prim_promiseValue(answer, &failed);
+	check(!failed && VT_isSmi(answer.value), "chain");
+	return vtrt_smiValue(answer);
+}
+
+static void
+run(const char *transport, oop socket, intptr_t n)
+{
+	typedef std::chrono::steady_clock Clock;
+	bool failed = false;
+	oop client = vtrt_prim_connectionOn_(newObject(connection), socket,
+	    &failed), receiver, root;
+
+	check(!failed, "connect");
+	receiver = vtrt_prim_processReceiver_selector_(process.cls, client,
+	    { (vtrt_memoop_t)intern("receive").m_ptr }, &failed);
+	vtrt_prim_processResume(receiver, &failed);
+	root = newObject(remoteObject);
+	RemoteObjectOop(root.ptr)->vns->m_connection = client.ptr;
+	RemoteObjectOop(root.ptr)->vns->m_id = SmiOop((int64_t)0);
+
+	for (bool awaited : { true, false }) {
+		Clock::time_point start = Clock::now();
+		intptr_t answer = chain(root, n, awaited);
+		double seconds = std::chrono::duration<double>(Clock::now() -
+		    start)
+				     .count();
+
+		check(answer == n, "answer");
+		printf("%-5s %-10s %8ld sends %10.3f s %10.2f us/send\n",
+		    transport, awaited ? "awaited" : "pipelined", (long)n,
+		    seconds, seconds / n * 1e6);
+	}
+	vtrt_prim_connectionClose(client, &failed);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char directory[] = "/tmp/remotebenchXXXXXX";
+	intptr_t n = argc > 1 ? atol(argv[1]) : 10000;
+	std::string path;
+	bool failed = false;
+	oop tcpListener, unixListener, socket;
+	pid_t child;
+	int status;
+
+	registerClass(object, "Object", "nil", 0, kSlotsOops);
+	registerClass(smallInteger, "SmallInteger", "Object", 0, kSlotsOops,
+	    smallIntegerMethods, 1);
+	registerClass(symbol, "Symbol", "Object", 0, kSlotsBytes);
+	registerClass(string, "String", "Object", 0, kSlotsBytes);
+	registerClass(array, "Array", "Object", 0, kSlotsOops);
+	registerClass(message, "Message", "Object",
+	    sizeOfInstance<MessageDesc>(), kSlotsOops);
+	registerClass(process, "Process", "Object",
+	    sizeOfInstance<ProcessDesc>(), kSlotsOops);
+	registerClass(semaphore, "Semaphore", "Object",
+	    sizeOfInstance<SemaphoreDesc>(), kSlotsOops);
+	registerClass(fileDescriptor, "FileDescriptor", "Object",
+	    sizeOfInstance<FileDescriptorDesc>(), kSlotsOops);
+	registerClass(connection, "Connection", "Object",
+	    sizeOfInstance<ConnectionDesc>(), kSlotsOops, connectionMethods, 1);
+	registerClass(remoteObject, "RemoteObject", "Object",
+	    sizeOfInstance<RemoteObjectDesc>(), kSlotsOops,
+	    remoteObjectMethods, 1);
+	registerClass(promise, "Promise", "RemoteObject",
+	    sizeOfInstance<PromiseDesc>(), kSlotsOops);
+	vtrt_main(argc, argv);
+
+	check(mkdtemp(directory) != NULL, "mkdtemp");
+	path = std::string(directory) + "/socket";
+	tcpListener = vtrt_prim_fdListenOn_(newObject(fileDescriptor),
+	    vtrt_smi(0), &failed);
+	unixListener = vtrt_prim_fdListenOnPath_(newObject(fileDescriptor),
+	    newString(path), &failed);
+	check(!failed, "listen");
+	fflush(stdout);
+	if ((child = fork()) == 0) {
+		serve(tcpListener);
+		serve(unixListener);
+		_exit(0);
+	}
+	check(child > 0, "fork");
+
+	socket = vtrt_prim_fdConnectTo_port_(newObject(fileDescriptor),
+	    newString("127.0.0.1"), vtrt_prim_fdLocalPort(tcpListener, &failed),
+	    &failed);
+	check(!failed, "TCP connect");
+	run("tcp", socket, n);
+	socket = vtrt_prim_fdConnectToPath_(newObject(fileDescriptor),
+	    newString(path), &failed);
+	check(!failed, "Unix connect");
+	run("unix", socket, n);
+
+	check(waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+		WEXITSTATUS(status) == 0,
+	    "server");
+	unlink(path.c_str());
+	rmdir(directory);
+	return 0;
+}
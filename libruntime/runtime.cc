@@ -1,169 +1,221 @@
-/*!
- * The *Desc objects describe the layout of the von Neumann space of an object.
- */
-
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <new>
+#include <set>
 #include <stdexcept>
 #include <string>
 
-#include "vtrt.h"
+#include "runtime.hh"
 
 #define info(...) printf("Runtime: " __VA_ARGS__)
 
-struct NoDesc;
-struct MemDesc;
-struct ArrayDesc;
-struct ClassDesc;
-struct MethodDesc;
-
-template <class T> class OopRef;
-template <class DescT> class ObjectHeader;
-
-/* clang-format off */
-typedef OopRef <NoDesc>         Oop;
-typedef OopRef <NoDesc>         SmiOop;
-typedef OopRef <MemDesc>        MemOop;
-typedef OopRef <ArrayDesc>      ArrayOop;
-typedef OopRef <ClassDesc>      ClassOop;
-typedef OopRef <MethodDesc>     MethodOop;
-/* clang-format on */
-
-template <class T> class OopRef {
-    public:
-	// friend class OopRef<OopDesc>;
-
-	enum Tag {
-		kPtr = 0,
-		kSmi = 1,
-	};
-
-	ObjectHeader<T> *m_ptr;
-
-    public:
-	typedef ObjectHeader<T> PtrType;
-
-	inline OopRef()
-	    : m_ptr(NULL) {};
-	inline OopRef(int64_t smi)
-	    : m_ptr((ObjectHeader<T> *)VTRT_MAKESMI(smi)) {};
-	inline OopRef(void *ptr)
-	    : m_ptr((ObjectHeader<T> *)ptr) {};
-
-	static inline OopRef nil() { return OopRef(); }
-
-	inline bool isPtr() const { return VT_isPtr(m_ptr); }
-	inline bool isSmi() const { return VT_isSmi(m_ptr); }
-	inline bool isNil() const { return m_ptr == 0; }
-	inline int64_t smi() const { return VT_intValue(m_ptr); }
-	template <typename OT> inline OT &as()
-	{
-		return reinterpret_cast<OT &>(*this);
-	}
+/* compiled code accesses instance variables through vtrt.h's view of these */
+static_assert(offsetof(vtrt_objectHeader, vns) ==
+	offsetof(ObjectHeader<MemDesc>, vns),
+    "vtrt_objectHeader doesn't match ObjectHeader");
+static_assert(offsetof(vtrt_objectHeader, identityHash) ==
+	offsetof(ObjectHeader<MemDesc>, identityHash),
+    "vtrt_objectHeader doesn't match ObjectHeader");
+static_assert(offsetof(vtrt_slots, oops) == offsetof(MemDesc, oops),
+    "vtrt_slots doesn't match MemDesc");
+static_assert((int)kSlotsBytes == MemDesc::kBytes &&
+	(int)kSlotsOops == MemDesc::kOops,
+    "vtrt_slotsKind doesn't match MemDesc");
 
-	inline ClassOop isa();
+vtrt_memoop_t
+allocOopsObj(size_t nOops)
+{
+	return (vtrt_memoop_t)allocOopsObj<MemOop>(nOops).m_ptr;
+}
 
-	void print(size_t in);
+std::map<std::string, ClassMapEntry> classes;
+WellKnownClasses wellKnown;
+oop vtrt_trueObject, vtrt_falseObject;
+static std::set<ClassOop::PtrType *> bytesClasses;
+/* the entries of classes and metaclasses, by their objects */
+static std::map<ClassOop::PtrType *, ClassMapEntry *> classEntries;
+/*
+ * guards the class registry, as sends on any thread may search it while
+ * classes are registered
+ */
+static std::mutex classLock;
+static __thread struct vtrt_allocRegion allocRegion;
 
-	inline uint32_t hashCode()
-	{
-		return isSmi() ? smi() : as<MemOop>()->hashCode();
-	}
+/* Allocation regions are this big; bigger objects are allocated alone. */
+static const size_t regionSize = 1024 * 1024;
 
-	template <typename OT> inline bool operator==(const OT &other)
-	{
-		return !operator!=(other);
-	}
-	template <typename OT> inline bool operator!=(const OT &other)
-	{
-		return other.m_ptr != m_ptr;
+struct vtrt_allocRegion *
+vtrt_currentRegion(void)
+{
+	return &allocRegion;
+}
+
+oop
+vtrt_allocSlow(oop cls, size_t nSlots, enum vtrt_slotsKind kind)
+{
+	size_t size = vtrt_allocSize(nSlots, kind);
+	char *memory;
+
+	if (size > regionSize / 8) {
+		if (!(memory = (char *)calloc(1, size)))
+			throw std::bad_alloc();
+		return vtrt_initObject(memory, cls, nSlots, kind);
 	}
-	ObjectHeader<T> *operator->() const { return m_ptr; }
-	inline ObjectHeader<T> &operator*() const { return *m_ptr; }
-	inline operator Oop() const { return m_ptr; }
-};
 
-template <class DescT> struct ObjectHeader {
-	ClassOop isa;
-	DescT *vns;
-};
+	/* (the remainder of the old region is abandoned) */
+	if (!(memory = (char *)calloc(1, regionSize)))
+		throw std::bad_alloc();
+	allocRegion.cursor = memory;
+	allocRegion.limit = memory + regionSize;
+	return vtrt_alloc(cls, nSlots, kind);
+}
+
+/*
+ * Each thread draws identity hashes from its own xorshift generator, so
+ * assigning one takes no lock; the seeds only need to differ between threads.
+ */
+static uint32_t hashSeeds;
+static __thread uint32_t hashState;
+
+uint32_t
+vtrt_assignIdentityHash(struct vtrt_objectHeader *object)
+{
+	uint32_t hash = hashState, expected = 0;
+
+	if (hash == 0)
+		hash = (__atomic_add_fetch(&hashSeeds, 1, __ATOMIC_RELAXED) *
+			   0x9e3779b9) | 1;
+	hash ^= hash << 13;
+	hash ^= hash >> 17;
+	hash ^= hash << 5;
+	hashState = hash;
+
+	/* another thread may have assigned it first */
+	if (!__atomic_compare_exchange_n(&object->identityHash, &expected, hash,
+		false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return expected;
+	return hash;
+}
 
-struct MemDesc {
-	uintptr_t size;
-	enum {
-		kBytes,
-		kOops,
-	} kind : 8;
+ClassOop findClass(std::string name)
+{
+	std::lock_guard<std::mutex> guard(classLock);
+	auto entry = classes.find(name);
+	return entry == classes.end() ? ClassOop::nil() : entry->second.cls;
+}
 
-        union {
-                Oop oops[0];
-                uint8_t bytes[0];
-        };
-};
+/* (under a lock, as code running on the worker pool may intern too) */
+Oop
+intern(std::string string)
+{
+	static std::map<std::string, Oop> symbols;
+	static std::mutex lock;
+	std::lock_guard<std::mutex> guard(lock);
+	auto entry = symbols.find(string);
+
+	if (entry != symbols.end())
+		return entry->second;
+
+	/* (with a terminating NUL, not counted in its size) */
+	MemOop symbol = allocBytesObj<MemOop>(string.size() + 1);
+	symbol->vns->size = string.size();
+	/* (a literal: shared, so not to be stored into) */
+	symbol->vns->immutable = 1;
+	memcpy(symbol->vns->bytes, string.c_str(), string.size());
+	symbol->isa = findClass("Symbol");
+	return symbols[string] = symbol;
+}
 
-struct ClassDesc : public MemDesc {
-	/* keep in sync with libstern/Object.st class vars */
-	static const int instanceSize = 3;
+oop
+vtrt_boxFloat(double value)
+{
+	oop box = vtrt_alloc({ (vtrt_memoop_t)wellKnown.floatClass.m_ptr },
+	    sizeof(double), kSlotsBytes);
 
-	static ClassOop alloc() { return allocOopsObj(instanceSize); }
+	memcpy(box.ptr->vns->oops, &value, sizeof(double));
+	return box;
+}
 
-	ClassOop m_superclass;
-	ArrayOop m_methodArray;
-	SmiOop m_instanceSize;
-};
+bool
+vtrt_isBoxedFloat(oop value)
+{
+	return VT_isPtr(value.value) && value.ptr != NULL &&
+	    value.ptr->isa.ptr == (vtrt_memoop_t)wellKnown.floatClass.m_ptr;
+}
 
-struct ArrayDesc : public MemDesc {
-        static ArrayOop create(size_t nSlots);
-};
+bool
+isBytesClass(ClassOop cls)
+{
+	std::lock_guard<std::mutex> guard(classLock);
 
+	return bytesClasses.count(cls.m_ptr);
+}
 
-/*
- * sync libstkern/Method.st
- */
-struct MethodDesc : public MemDesc {
-        vtrt_method_fn_t implementation;
+ClassMapEntry *
+classEntry(ClassOop cls, bool &meta)
+{
+	std::lock_guard<std::mutex> guard(classLock);
+	auto entry = classEntries.find(cls.m_ptr);
 
-        static MethodOop create( vtrt_method_fn_t impl);
-};
+	if (entry == classEntries.end())
+		return NULL;
+	meta = entry->second->metacls == cls;
+	return entry->second;
+}
 
-template <class T>
-T
-allocOopsObj(size_t nOops)
+std::string
+className(ClassOop cls)
 {
-	ObjectHeader<MemDesc> *ote = new ObjectHeader<MemDesc>;
-	if (nOops != 0) {
-		ote->vns = (MemDesc *)malloc(
-		    sizeof(MemDesc) + nOops * sizeof(Oop));
-		ote->vns->size = nOops;
+	std::lock_guard<std::mutex> guard(classLock);
+
+	for (auto &entry : classes) {
+		if (entry.second.cls == cls)
+			return entry.first;
+		else if (entry.second.metacls == cls)
+			return entry.first + " class";
 	}
-	return T(ote);
+	return "nil";
 }
 
-vtrt_memoop_t
-allocOopsObj(size_t nOops)
+oop
+vtrt_classOf(oop value)
 {
-	return (vtrt_memoop_t)allocOopsObj<MemOop>(nOops).m_ptr;
+	return { (vtrt_memoop_t)Oop(value.ptr).isa().m_ptr };
 }
 
-struct ClassMapEntry {
-	struct vtrt_classTemplate *templ;
-	ClassOop cls;
-	ClassOop metacls;
-};
-
-std::map<std::string, ClassMapEntry> classes;
+void
+vtrt_typeError(oop value, oop expectedClass)
+{
+	fprintf(stderr, "Runtime: type error: a %s where a %s was required\n",
+	    className(Oop(value.ptr).isa()).c_str(),
+	    className(expectedClass.ptr).c_str());
+	abort();
+}
 
-template <class T> size_t sizeOfInstance()
+bool
+isKindOf(Oop value, ClassOop cls)
 {
-        return (sizeof(T) - sizeof(MemDesc)) / sizeof(Oop);
+	if (cls.isNil())
+		return false;
+	for (ClassOop aClass = value.isa(); !aClass.isNil();
+	     aClass = aClass->vns->m_superclass)
+		if (aClass == cls)
+			return true;
+	return false;
 }
 
-ClassOop findClass(std::string name)
+oop
+vtrt_checkClass(oop value, oop cls)
 {
-        return classes[name].cls;
+	/* declared types don't admit nil */
+	if (!Oop(value.ptr).isNil() && isKindOf(value.ptr, cls.ptr))
+		return value;
+	vtrt_typeError(value, cls);
 }
 
 ArrayOop ArrayDesc::create(size_t nSlots)
@@ -187,12 +239,25 @@ vtrt_registerClass(const char *name, struct vtrt_classTemplate *templ)
 {
 	info("Registering class %s (subclasses %s)\n", name, templ->superName);
 
-	ClassOop cls = allocOopsObj(templ->classSize),
+	/* a class is laid out as a ClassDesc followed by its class-side ivars */
+	ClassOop cls = allocOopsObj(ClassDesc::instanceSize + templ->classSize),
 	metacls = ClassDesc::alloc();
-	metacls->vns->m_instanceSize = templ->classSize;
+	metacls->vns->m_instanceSize = ClassDesc::instanceSize + templ->classSize;
 	cls->vns->m_instanceSize = templ->instanceSize;
         cls->isa = metacls;
-	classes[name] = { templ, cls, metacls };
+	templ->cls.ptr = (vtrt_memoop_t)cls.m_ptr;
+	{
+		std::lock_guard<std::mutex> guard(classLock);
+
+		if (templ->instanceKind == kSlotsBytes)
+			bytesClasses.insert(cls.m_ptr);
+		classes[name] = { templ, cls, metacls };
+		classEntries[cls.m_ptr] = classEntries[metacls.m_ptr] =
+		    &classes[name];
+	}
+
+	if (templ->profile)
+		registerProfile(templ->profile);
 
         metacls->vns->m_methodArray = ArrayDesc::create(templ->nClassMethods * 2);
         for (size_t i = 0; i < templ->nClassMethods; i++) {
@@ -203,6 +268,20 @@ vtrt_registerClass(const char *name, struct vtrt_classTemplate *templ)
 int
 vtrt_main(int argc, char *argv[])
 {
+	wellKnown.smallInteger = findClass("SmallInteger");
+	wellKnown.undefinedObject = findClass("UndefinedObject");
+	wellKnown.floatClass = findClass("Float");
+	wellKnown.largePositiveInteger = findClass("LargePositiveInteger");
+	wellKnown.largeNegativeInteger = findClass("LargeNegativeInteger");
+	wellKnown.stringClass = findClass("String");
+	wellKnown.character = findClass("Character");
+	wellKnown.symbol = findClass("Symbol");
+	wellKnown.orderedCollection = findClass("OrderedCollection");
+	wellKnown.process = findClass("Process");
+	wellKnown.semaphore = findClass("Semaphore");
+	wellKnown.array = findClass("Array");
+	wellKnown.message = findClass("Message");
+
         /* link up the classes */
 	for (auto &entry : classes) {
                 auto & superName = entry.second.templ->superName;
@@ -234,5 +313,50 @@ vtrt_main(int argc, char *argv[])
                 /* cls->isa was set to metacls during registration */
                 cls->vns->m_superclass = super->second.cls;
 	}
+
+	/*
+	 * fill in compiled code's symbol references and global binding cells,
+	 * and its literals' classes
+	 */
+	for (auto &entry : classes) {
+		auto templ = entry.second.templ;
+
+		for (size_t i = 0; i < templ->nSymbolReferences; i++) {
+			auto &ref = templ->symbolReferences[i];
+			ref.ref.ptr = (vtrt_memoop_t)intern(ref.string).m_ptr;
+		}
+		for (size_t i = 0; i < templ->nLiterals; i++) {
+			auto &literal = templ->literals[i];
+			ClassOop cls = findClass(literal.className);
+
+			if (cls.isNil())
+				throw std::runtime_error("Class " + entry.first +
+				    " has a literal of class " +
+				    literal.className +
+				    ", which was not found.\n");
+			literal.object->isa.ptr = (vtrt_memoop_t)cls.m_ptr;
+		}
+		for (size_t i = 0; i < templ->nLiteralSymbols; i++) {
+			auto &literal = templ->literalSymbols[i];
+			literal.slot->ptr = (vtrt_memoop_t)intern(
+			    literal.string).m_ptr;
+		}
+
+		for (size_t i = 0; i < templ->nGlobalReferences; i++) {
+			auto &ref = templ->globalReferences[i];
+			auto global = classes.find(ref.name);
+
+			if (global == classes.end())
+				throw std::runtime_error("Class " + entry.first +
+				    " refers to global " + ref.name +
+				    ", which was not found.\n");
+			ref.value.ptr = (vtrt_memoop_t)global->second.cls.m_ptr;
+		}
+	}
+
+	vtrt_trueObject.ptr = (vtrt_memoop_t)allocOopsObj<Oop>(0).m_ptr;
+	((Oop)vtrt_trueObject.ptr)->isa = findClass("True");
+	vtrt_falseObject.ptr = (vtrt_memoop_t)allocOopsObj<Oop>(0).m_ptr;
+	((Oop)vtrt_falseObject.ptr)->isa = findClass("False");
 	return 0;
 }
@@ -0,0 +1,381 @@
+/*!
+ * Runtime-internal declarations: the C++ view of the object model, shared by
+ * the runtime's translation units.
+ *
+ * The *Desc objects describe the layout of the von Neumann space of an object.
+ */
+
+#ifndef RUNTIME_HH_
+#define RUNTIME_HH_
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vtrt.h"
+
+struct NoDesc;
+struct MemDesc;
+struct ArrayDesc;
+struct ClassDesc;
+struct MethodDesc;
+struct ProcessDesc;
+struct SemaphoreDesc;
+struct DelayDesc;
+struct FileDescriptorDesc;
+struct MessageDesc;
+struct ConnectionDesc;
+struct RemoteObjectDesc;
+struct PromiseDesc;
+
+template <class T> class OopRef;
+template <class DescT> class ObjectHeader;
+
+/* clang-format off */
+typedef OopRef <NoDesc>         Oop;
+typedef OopRef <NoDesc>         SmiOop;
+typedef OopRef <MemDesc>        MemOop;
+typedef OopRef <ArrayDesc>      ArrayOop;
+typedef OopRef <ClassDesc>      ClassOop;
+typedef OopRef <MethodDesc>     MethodOop;
+typedef OopRef <ProcessDesc>    ProcessOop;
+typedef OopRef <SemaphoreDesc>  SemaphoreOop;
+typedef OopRef <DelayDesc>      DelayOop;
+typedef OopRef <FileDescriptorDesc> FileDescriptorOop;
+typedef OopRef <MessageDesc>    MessageOop;
+typedef OopRef <ConnectionDesc> ConnectionOop;
+typedef OopRef <RemoteObjectDesc> RemoteObjectOop;
+typedef OopRef <PromiseDesc>    PromiseOop;
+/* clang-format on */
+
+template <class T> class OopRef {
+    public:
+	// friend class OopRef<OopDesc>;
+
+	enum Tag {
+		kPtr = 0,
+		kSmi = 1,
+	};
+
+	ObjectHeader<T> *m_ptr;
+
+    public:
+	typedef ObjectHeader<T> PtrType;
+
+	inline OopRef()
+	    : m_ptr(NULL) {};
+	inline OopRef(int64_t smi)
+	    : m_ptr((ObjectHeader<T> *)VTRT_MAKESMI(smi)) {};
+	inline OopRef(void *ptr)
+	    : m_ptr((ObjectHeader<T> *)ptr) {};
+
+	static inline OopRef nil() { return OopRef(); }
+
+	inline bool isPtr() const { return VT_isPtr(m_ptr); }
+	inline bool isSmi() const { return VT_isSmi(m_ptr); }
+	inline bool isNil() const { return m_ptr == 0; }
+	inline int64_t smi() const { return VT_intValue(m_ptr); }
+	template <typename OT> inline OT &as()
+	{
+		return reinterpret_cast<OT &>(*this);
+	}
+
+	inline ClassOop isa();
+
+	void print(size_t in);
+
+	inline uint32_t hashCode()
+	{
+		if (!isPtr())
+			return (uintptr_t)m_ptr >> VT_tagBits;
+		else if (isNil())
+			return 0;
+		return vtrt_identityHash((vtrt_memoop_t)m_ptr);
+	}
+
+	template <typename OT> inline bool operator==(const OT &other)
+	{
+		return !operator!=(other);
+	}
+	template <typename OT> inline bool operator!=(const OT &other)
+	{
+		return other.m_ptr != m_ptr;
+	}
+	ObjectHeader<T> *operator->() const { return m_ptr; }
+	inline ObjectHeader<T> &operator*() const { return *m_ptr; }
+	inline operator Oop() const { return m_ptr; }
+};
+
+template <class DescT> struct ObjectHeader {
+	ClassOop isa;
+	DescT *vns;
+	uint32_t identityHash;
+};
+
+struct MemDesc {
+	uintptr_t size;
+	enum {
+		kBytes,
+		kOops,
+	} kind : 8;
+	/* as vtrt_slots::immutable */
+	unsigned immutable : 1;
+
+        union {
+                Oop oops[0];
+                uint8_t bytes[0];
+        };
+};
+
+struct ClassDesc : public MemDesc {
+	/* keep in sync with libstern/Object.st class vars */
+	static const int instanceSize = 3;
+
+	static ClassOop alloc() { return allocOopsObj(instanceSize); }
+
+	ClassOop m_superclass;
+	ArrayOop m_methodArray;
+	SmiOop m_instanceSize;
+};
+
+struct ArrayDesc : public MemDesc {
+        static ArrayOop create(size_t nSlots);
+};
+
+
+/*
+ * sync libstkern/Method.st
+ */
+struct MethodDesc : public MemDesc {
+        vtrt_method_fn_t implementation;
+
+        static MethodOop create( vtrt_method_fn_t impl);
+};
+
+/*
+ * sync libstkern/Process.st
+ */
+struct ProcessDesc : public MemDesc {
+	/* the next in the list it is in, ready or waiting */
+	ProcessOop m_nextLink;
+	/* the Semaphore it is waiting on, if any */
+	SemaphoreOop m_myList;
+	SmiOop m_priority;
+	/* it runs receiver selector */
+	Oop m_receiver;
+	Oop m_selector;
+	/* its native stack (see process.cc), tagged as a SmallInteger */
+	Oop m_stack;
+};
+
+/*
+ * sync libstkern/Semaphore.st
+ */
+struct SemaphoreDesc : public MemDesc {
+	/* the Processes waiting, in order */
+	ProcessOop m_firstLink;
+	ProcessOop m_lastLink;
+	SmiOop m_excessSignals;
+};
+
+/*
+ * sync libstkern/Delay.st
+ */
+struct DelayDesc : public MemDesc {
+	/* in milliseconds */
+	SmiOop m_duration;
+};
+
+/*
+ * sync libstkern/FileDescriptor.st
+ */
+struct FileDescriptorDesc : public MemDesc {
+	/* nil unless open */
+	SmiOop m_fd;
+};
+
+/*
+ * sync libstkern/Message.st
+ */
+struct MessageDesc : public MemDesc {
+	Oop m_selector;
+	/* an Array */
+	ArrayOop m_arguments;
+};
+
+/*
+ * sync libstkern/Connection.st
+ */
+struct ConnectionDesc : public MemDesc {
+	FileDescriptorOop m_socket;
+	/* its state (see remote.cc), tagged as a SmallInteger */
+	Oop m_state;
+};
+
+/*
+ * sync libstkern/RemoteObject.st
+ */
+struct RemoteObjectDesc : public MemDesc {
+	ConnectionOop m_connection;
+	/* what the other side knows it by (see remote.cc) */
+	SmiOop m_id;
+};
+
+/*
+ * sync libstkern/Promise.st
+ */
+struct PromiseDesc : public RemoteObjectDesc {
+	/* a copy of the answer, once it has come */
+	Oop m_value;
+	/* as Promise>>state */
+	SmiOop m_state;
+	/* signalled when the answer comes */
+	SemaphoreOop m_semaphore;
+};
+
+template <class T>
+T
+allocOopsObj(size_t nOops)
+{
+	ObjectHeader<MemDesc> *ote = new ObjectHeader<MemDesc>();
+	if (nOops != 0) {
+		ote->vns = (MemDesc *)calloc(1,
+		    sizeof(MemDesc) + nOops * sizeof(Oop));
+		ote->vns->size = nOops;
+		ote->vns->kind = MemDesc::kOops;
+	}
+	return T(ote);
+}
+
+template <class T>
+T
+allocBytesObj(size_t nBytes)
+{
+	ObjectHeader<MemDesc> *ote = new ObjectHeader<MemDesc>();
+	ote->vns = (MemDesc *)calloc(1, sizeof(MemDesc) + nBytes);
+	ote->vns->size = nBytes;
+	ote->vns->kind = MemDesc::kBytes;
+	return T(ote);
+}
+
+/* Classes the runtime itself must be able to name; set up by vtrt_main. */
+struct WellKnownClasses {
+	ClassOop smallInteger;
+	ClassOop undefinedObject;
+	ClassOop floatClass;
+	ClassOop largePositiveInteger;
+	ClassOop largeNegativeInteger;
+	ClassOop stringClass;
+	ClassOop character;
+	ClassOop symbol;
+	ClassOop orderedCollection;
+	ClassOop process;
+	ClassOop semaphore;
+	ClassOop array;
+	ClassOop message;
+};
+
+extern WellKnownClasses wellKnown;
+
+template <class T>
+inline ClassOop
+OopRef<T>::isa()
+{
+	if (isSmi())
+		return wellKnown.smallInteger;
+	else if (VT_isFloat(m_ptr))
+		return wellKnown.floatClass;
+	else if (VT_isChar(m_ptr))
+		return wellKnown.character;
+	else if (isNil())
+		return wellKnown.undefinedObject;
+	return m_ptr->isa;
+}
+
+struct ClassMapEntry {
+	struct vtrt_classTemplate *templ;
+	ClassOop cls;
+	ClassOop metacls;
+};
+
+extern std::map<std::string, ClassMapEntry> classes;
+
+template <class T> size_t sizeOfInstance()
+{
+        return (sizeof(T) - sizeof(MemDesc)) / sizeof(Oop);
+}
+
+ClassOop findClass(std::string name);
+/* Is value an instance of cls, or of a subclass of it? */
+bool isKindOf(Oop value, ClassOop cls);
+/* Are the indexed slots of the class's instances bytes? */
+bool isBytesClass(ClassOop cls);
+/* The unique Symbol for a string. */
+Oop intern(std::string string);
+/* The entry of a class or metaclass, or NULL; meta is set if a metaclass. */
+ClassMapEntry *classEntry(ClassOop cls, bool &meta);
+/* The name of a class or metaclass, e.g. "Object" or "Object class". */
+std::string className(ClassOop cls);
+
+/* the most arguments perform() can send */
+static const size_t maxPerformArguments = 6;
+
+/*
+ * Has receiver a method for selector? (Not counting doesNotUnderstand:, which
+ * it may have for any.)
+ */
+bool respondsTo(Oop receiver, Oop selector);
+/*
+ * Send selector to receiver with the arguments, as compiled code does; false
+ * if selector isn't a Symbol taking that many.
+ */
+bool perform(Oop receiver, Oop selector, const Oop *arguments,
+    size_t nArguments, Oop &result);
+
+/*
+ * Suspend the active Process until fd is ready to read (or write); false if
+ * it can't be waited on (see process.cc).
+ */
+bool waitForIO(int fd, bool write);
+
+/*
+ * Write the graph of objects reachable from root; false if it has any which
+ * can't be, such as Methods (see serialize.cc).
+ */
+bool storeGraph(Oop root, std::vector<uint8_t> &bytes);
+/*
+ * Read back a graph written by storeGraph(); false if bytes aren't one, or
+ * name a class not in this program. If share, byte objects' slots are in
+ * bytes, which must then outlive them.
+ */
+bool loadGraph(const uint8_t *bytes, size_t size, bool share, Oop &root);
+
+/*
+ * Are size bytes the magnitude of a LargeInteger as largeint.cc makes them:
+ * whole limbs, the most significant not zero, and out of SmallInteger range?
+ */
+bool isLargeIntegerMagnitude(bool negative, const uint8_t *bytes, size_t size);
+/*
+ * Rebuild the hash table of a Dictionary, IdentityDictionary or Set read from
+ * elsewhere, whose hashes (identity hashes, certainly) and tally can't be
+ * trusted; false if its slots aren't laid out as a table (see hashtable.cc).
+ */
+bool rehashTable(Oop object, bool identity);
+/*
+ * Are an OrderedCollection's slots laid out as a ring (see
+ * orderedcollection.cc)?
+ */
+bool isRing(Oop object);
+
+/* Arrange for an instrumented class's counters to be written out at exit. */
+void registerProfile(struct vtrt_profile *profile);
+
+/*
+ * Use the named set of byte object kernels ("scalar", "sse2" or "avx2") in
+ * place of the best the CPU supports; false if it can't run them.
+ */
+bool selectBytesKernels(const std::string &name);
+const char *bytesKernelsName();
+
+#endif /* RUNTIME_HH_ */
@@ -0,0 +1,761 @@
+/*!
+ * Object graphs serialized, to be stored or sent to another program.
+ *
+ * The format is position-independent, but of native words, so only for a
+ * program built for the same architecture (which the header records):
+ *
+ *   header      magic, version, word size, byte order, where the classes
+ *               are, the numbers of classes and of objects, and a reference
+ *               to the root
+ *   records     an object each, numbered from 0 in the order written
+ *   classes     a word of the length of each name, then the name, padded
+ *
+ * A reference is a word: a SmallInteger, Character or immediate Float as it is
+ * in memory, 0 for nil, or the number of an object (after true and false)
+ * shifted past the tag bits. A record is a word of its kind and the number of
+ * its class, then, but for a class:
+ *
+ *   oops        the number of slots, and a reference for each
+ *   bytes       a vtrt_slots header, marked immutable, and the bytes, padded
+ *               to a word (a Float's being exactly a double's)
+ *   symbol      as bytes, but read back as the Symbol interned for them (and
+ *               the only kind of record of a Symbol)
+ *   class       nothing: the class (or metaclass) itself, found by its name
+ *
+ * Objects are written after those their slots refer to, so a reader finds
+ * most references to objects it has already made, and need only fix up those
+ * closing a cycle, at the end of its one pass through the records. A graph
+ * read from a mapped file (ByteArray class>>loadGraphFile:) shares the bytes
+ * of its byte records rather than copying them, each being laid out as slots
+ * are in memory; those objects are then immutable, as mapped files are. (A
+ * record whose header isn't marked so is copied all the same.)
+ *
+ * Methods, Processes, FileDescriptors, Semaphores, Connections and
+ * RemoteObjects (Promises among them), and instances of their subclasses,
+ * stand for this program's code, stacks, open files and state, so can't be
+ * written; nor are they read, a graph from elsewhere not being trusted to
+ * make them. Nor is it trusted with the slots the runtime's primitives rely on:
+ * a LargeInteger read must be normalised, as largeint.cc makes them, and an
+ * OrderedCollection's ring well formed; and the table of a Dictionary or Set is
+ * rebuilt, as its keys' identity hashes are this program's.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "psc.hh"
+#include "runtime.hh"
+
+namespace {
+
+const char graphMagic[8] = { 'O', 'o', 'p', 's', 'G', 'r', 'p', 'h' };
+const uint32_t graphVersion = 1;
+
+struct GraphHeader {
+	char magic[8];
+	uint32_t version;
+	uint16_t wordSize;
+	/* 0x0102, as the writer stored it */
+	uint16_t byteOrder;
+	/* from the start, after the records */
+	uintptr_t classesOffset;
+	uintptr_t nClasses;
+	uintptr_t nObjects;
+	uintptr_t root;
+};
+
+enum RecordKind {
+	kRecordOops,
+	kRecordBytes,
+	kRecordSymbol,
+	kRecordClass,
+	kRecordMetaclass,
+};
+
+const size_t wordSize = sizeof(uintptr_t);
+const size_t slotsHeaderSize = offsetof(struct vtrt_slots, oops);
+const uintptr_t refTrue = 1 << VT_tagBits, refFalse = 2 << VT_tagBits;
+/* the number of an object's reference, less this, shifted */
+const uintptr_t firstObjectRef = 3;
+
+size_t
+padded(size_t size)
+{
+	return (size + wordSize - 1) & ~(wordSize - 1);
+}
+
+/* Do instances of cls stand for this program's code, stacks or state? */
+bool
+isUncopyable(ClassOop cls)
+{
+	static const ClassOop uncopyable[] = { findClass("Method"),
+		wellKnown.process, findClass("FileDescriptor"),
+		wellKnown.semaphore, findClass("Connection"),
+		findClass("RemoteObject") };
+
+	for (; !cls.isNil(); cls = cls->vns->m_superclass)
+		for (ClassOop each : uncopyable)
+			if (cls == each)
+				return true;
+	return false;
+}
+
+/* How the instances of a class read are checked, or rebuilt, if at all. */
+enum Layout {
+	kLayoutPlain,
+	kLayoutLargeInteger,
+	kLayoutTable,
+	kLayoutIdentityTable,
+	kLayoutRing,
+};
+
+Layout
+layoutOf(ClassOop cls)
+{
+	static const ClassOop dictionary = findClass("Dictionary"),
+			      identityDictionary = findClass("IdentityDictionary"),
+			      set = findClass("Set");
+
+	if (cls == wellKnown.largePositiveInteger ||
+	    cls == wellKnown.largeNegativeInteger)
+		return kLayoutLargeInteger;
+	for (; !cls.isNil(); cls = cls->vns->m_superclass)
+		if (cls == identityDictionary)
+			return kLayoutIdentityTable;
+		else if (cls == dictionary || cls == set)
+			return kLayoutTable;
+		else if (cls == wellKnown.orderedCollection)
+			return kLayoutRing;
+	return kLayoutPlain;
+}
+
+/*
+ * The references to objects, by address: open addressing, probing linearly,
+ * as the writer looks up every reference, and most are to objects it hasn't
+ * seen.
+ */
+class ReferenceMap {
+	struct Entry {
+		void *key;
+		uintptr_t ref;
+	};
+
+	std::vector<Entry> entries = std::vector<Entry>(64);
+	size_t count = 0;
+	int shift = 64 - 6;
+
+	/*
+	 * Objects allocated together are often written together, so the
+	 * entries of the objects of a page are kept together, at a place for
+	 * the page found by hashing.
+	 */
+	size_t
+	home(void *key) const
+	{
+		uintptr_t address = (uintptr_t)key;
+
+		return (((address >> 12) * 0x9e3779b97f4a7c15 >> shift) +
+			   (address >> 4)) &
+		    (entries.size() - 1);
+	}
+
+	void
+	grow()
+	{
+		std::vector<Entry> old(entries.size() * 2);
+
+		old.swap(entries);
+		shift--;
+		for (Entry &entry : old)
+			if (entry.key)
+				for (size_t i = home(entry.key);;
+				     i = (i + 1) & (entries.size() - 1))
+					if (!entries[i].key) {
+						entries[i] = entry;
+						break;
+					}
+	}
+
+    public:
+	/* The reference to key; added, as 0, if it wasn't there. */
+	uintptr_t &
+	find(void *key, bool &added)
+	{
+		size_t mask = entries.size() - 1;
+
+		for (size_t i = home(key);; i = (i + 1) & mask) {
+			if (entries[i].key == key) {
+				added = false;
+				return entries[i].ref;
+			} else if (entries[i].key)
+				continue;
+			else if (4 * (count + 1) > 3 * entries.size()) {
+				grow();
+				return find(key, added);
+			}
+			added = true;
+			count++;
+			entries[i].key = key;
+			return entries[i].ref = 0;
+		}
+	}
+};
+
+class Writer {
+	struct Frame {
+		MemOop object;
+		uintptr_t record;
+		/* the next slot to visit */
+		size_t next;
+		/* where in refs its slots' references start */
+		size_t refs;
+		/* where in refs the reference to it is to go, if anywhere */
+		size_t referrer;
+		/* where references to it were written before it was numbered */
+		std::vector<size_t> cycles;
+	};
+
+	/* of the objects the class of an object is an instance of */
+	struct Isa {
+		uintptr_t number;
+		/* a metaclass, whose instance may be written as a class */
+		bool meta;
+		bool writable;
+	};
+
+	/*
+	 * a reference to the object of a frame, not yet numbered: tagged as no
+	 * immediate is, over the frame's index
+	 */
+	static const uintptr_t kOnStack = 4;
+
+	ReferenceMap references;
+	std::unordered_map<void *, uintptr_t> classNumbers;
+	std::unordered_map<void *, Isa> isas;
+	/* (those last found in isas, as most objects are of a few classes) */
+	struct {
+		void *cls;
+		Isa *isa;
+	} recentIsas[8] = {};
+	std::vector<std::string> classNames;
+	std::vector<Frame> stack;
+	/* the references of the slots of the objects on the stack, so far */
+	std::vector<uintptr_t> refs;
+	/* written to in place, grown by doubling; only used bytes are yet */
+	std::vector<uint8_t> &out;
+	size_t used = 0;
+	uintptr_t nObjects = 0;
+
+	/* Room for size more bytes of records. */
+	uint8_t *
+	room(size_t size)
+	{
+		uint8_t *at;
+
+		if (out.size() - used < size)
+			out.resize(std::max(2 * out.size(), used + size));
+		at = &out[used];
+		used += size;
+		return at;
+	}
+
+	void
+	word(uintptr_t value)
+	{
+		memcpy(room(wordSize), &value, wordSize);
+	}
+
+	void
+	slotsHeader(size_t size)
+	{
+		struct vtrt_slots slots;
+
+		memset(&slots, 0, sizeof slots);
+		slots.size = size;
+		slots.kind = kSlotsBytes;
+		slots.immutable = 1;
+		memcpy(room(slotsHeaderSize), &slots, slotsHeaderSize);
+	}
+
+	uintptr_t
+	classNumber(ClassOop cls)
+	{
+		auto known = classNumbers.find(cls.m_ptr);
+
+		if (known != classNumbers.end())
+			return known->second;
+		classNames.push_back(className(cls));
+		return classNumbers[cls.m_ptr] = classNames.size() - 1;
+	}
+
+	Isa *
+	isaOf(ClassOop cls)
+	{
+		auto &recent = recentIsas[((uintptr_t)cls.m_ptr >> 4) & 7];
+		bool meta = false;
+
+		if (recent.cls == cls.m_ptr)
+			return recent.isa;
+		auto known = isas.find(cls.m_ptr);
+		if (known == isas.end()) {
+			bool registered = classEntry(cls, meta) != NULL;
+
+			known = isas.insert({ cls.m_ptr,
+					    { meta ? 0 : classNumber(cls), meta,
+						registered &&
+						    !isUncopyable(cls) } })
+				    .first;
+		}
+		recent.cls = cls.m_ptr;
+		return recent.isa = &known->second;
+	}
+
+	static uintptr_t
+	objectRef(uintptr_t number)
+	{
+		return (number + firstObjectRef) << VT_tagBits;
+	}
+
+	/* The reference to a value which isn't an object to be numbered. */
+	static bool
+	immediateRef(Oop value, uintptr_t &ref)
+	{
+		if (!value.isPtr() || value.isNil())
+			ref = (uintptr_t)value.m_ptr;
+		else if (value.m_ptr == (void *)vtrt_trueObject.ptr)
+			ref = refTrue;
+		else if (value.m_ptr == (void *)vtrt_falseObject.ptr)
+			ref = refFalse;
+		else
+			return false;
+		return true;
+	}
+
+	/* The record word of an object, or false if it can't be written. */
+	bool
+	classify(MemOop object, uintptr_t &record)
+	{
+		Isa *isa = isaOf(object->isa);
+		ClassMapEntry *entry;
+		bool meta;
+
+		if (!isa->writable)
+			return false;
+		else if (isa->meta && (entry = classEntry(object.m_ptr, meta))) {
+			record = (meta ? kRecordMetaclass : kRecordClass) |
+			    classNumber(entry->cls) << 8;
+			return true;
+		} else if (isa->meta)
+			return false;
+
+		if (object->vns == NULL || object->vns->kind == MemDesc::kOops)
+			record = kRecordOops;
+		else if (object->isa == wellKnown.symbol)
+			record = kRecordSymbol;
+		else
+			record = kRecordBytes;
+		record |= isa->number << 8;
+		return true;
+	}
+
+	/*
+	 * Find the reference to a value, numbering an object not yet seen:
+	 * writing it now if it has no references to follow, else pushing it to
+	 * write once their objects have been, to fill in the reference at
+	 * referrer then.
+	 */
+	bool
+	visit(Oop value, uintptr_t &ref, size_t referrer)
+	{
+		MemOop object = value.m_ptr;
+		uintptr_t record;
+		bool added;
+
+		if (immediateRef(value, ref))
+			return true;
+		uintptr_t &entry = references.find(object.m_ptr, added);
+		if (!added) {
+			ref = entry;
+			return true;
+		} else if (!classify(object, record))
+			return false;
+
+		if ((record & 0xff) == kRecordOops && object->vns != NULL) {
+			ref = entry = stack.size() << VT_tagBits | kOnStack;
+			stack.push_back(
+			    { object, record, 0, refs.size(), referrer, {} });
+			return true;
+		}
+
+		word(record);
+		if ((record & 0xff) == kRecordBytes ||
+		    (record & 0xff) == kRecordSymbol) {
+			size_t size = object->vns->size;
+
+			slotsHeader(size);
+			memcpy(room(padded(size)), object->vns->bytes, size);
+		} else if ((record & 0xff) == kRecordOops)
+			word(0);
+		ref = entry = objectRef(nObjects++);
+		return true;
+	}
+
+	/* Write the object atop the stack, now its slots' objects are. */
+	void
+	writeTop()
+	{
+		Frame &frame = stack.back();
+		size_t size = frame.object->vns->size;
+		uintptr_t ref = objectRef(nObjects++);
+		bool added;
+
+		word(frame.record);
+		word(size);
+		for (size_t i = frame.refs; i < frame.refs + size; i++) {
+			if ((refs[i] & VT_tagMask) == kOnStack) {
+				stack[refs[i] >> VT_tagBits].cycles.push_back(
+				    used);
+				word(0);
+			} else
+				word(refs[i]);
+		}
+		for (size_t at : frame.cycles)
+			memcpy(&out[at], &ref, wordSize);
+
+		references.find(frame.object.m_ptr, added) = ref;
+		refs.resize(frame.refs);
+		if (frame.referrer != SIZE_MAX)
+			refs[frame.referrer] = ref;
+		stack.pop_back();
+	}
+
+    public:
+	/* (out's memory is reused, the graph replacing what it held) */
+	Writer(std::vector<uint8_t> &out)
+	    : out(out)
+	{
+		out.resize(out.capacity());
+	}
+
+	bool
+	write(Oop root)
+	{
+		GraphHeader header;
+		bool added;
+
+		room(sizeof header);
+		if (!visit(root, header.root, SIZE_MAX))
+			return false;
+		while (!stack.empty()) {
+			Frame &frame = stack.back();
+			Oop value;
+
+			if (frame.next == frame.object->vns->size) {
+				writeTop();
+				continue;
+			}
+			value = frame.object->vns->oops[frame.next++];
+			refs.push_back(0);
+			if (!visit(value, refs.back(), refs.size() - 1))
+				return false;
+		}
+
+		memcpy(header.magic, graphMagic, sizeof header.magic);
+		header.version = graphVersion;
+		header.wordSize = wordSize;
+		header.byteOrder = 0x0102;
+		header.classesOffset = used;
+		header.nClasses = classNames.size();
+		header.nObjects = nObjects;
+		if ((header.root & VT_tagMask) == kOnStack)
+			header.root = references.find(root.m_ptr, added);
+		for (auto &name : classNames) {
+			size_t size = name.size();
+
+			word(size);
+			memcpy(room(padded(size)), name.data(), size);
+		}
+		memcpy(&out[0], &header, sizeof header);
+		out.resize(used);
+		return true;
+	}
+};
+
+class Reader {
+	const uint8_t *start, *at, *end;
+	bool share;
+	uintptr_t nObjects = 0;
+	struct Class {
+		ClassOop cls;
+		/* whether its instances' slots may be bytes, as a Float's are */
+		bool bytes;
+		size_t instanceSize;
+		/* whether it may have instances read (see isUncopyable()) */
+		bool readable;
+		Layout layout;
+	};
+
+	std::vector<Class> classes;
+	std::vector<Oop> objects;
+	/* slots referring to objects not yet read, and their numbers */
+	std::vector<std::pair<Oop *, uintptr_t>> fixups;
+	/* tables and rings, checked once their slots are all read */
+	std::vector<std::pair<Oop, Layout>> collections;
+
+	bool
+	word(uintptr_t &value)
+	{
+		if ((size_t)(end - at) < wordSize)
+			return false;
+		memcpy(&value, at, wordSize);
+		at += wordSize;
+		return true;
+	}
+
+	/*
+	 * Decode a reference into *slot; one to an object not yet read is
+	 * fixed up after the rest.
+	 */
+	bool
+	decode(uintptr_t ref, Oop *slot)
+	{
+		uintptr_t n;
+
+		if (VT_tag(ref) >= 1 && VT_tag(ref) <= 3)
+			*slot = Oop((void *)ref);
+		else if (VT_tag(ref) != 0)
+			return false;
+		else if (ref == 0)
+			*slot = Oop();
+		else if (ref == refTrue)
+			*slot = Oop(vtrt_trueObject.ptr);
+		else if (ref == refFalse)
+			*slot = Oop(vtrt_falseObject.ptr);
+		else if ((n = (ref >> VT_tagBits) - firstObjectRef) >= nObjects)
+			return false;
+		else if (n < objects.size())
+			*slot = objects[n];
+		else
+			fixups.push_back({ slot, n });
+		return true;
+	}
+
+	bool
+	readClasses(const uint8_t *at, uintptr_t nClasses)
+	{
+		for (uintptr_t i = 0; i < nClasses; i++) {
+			uintptr_t size;
+			ClassOop cls;
+
+			if ((size_t)(end - at) < wordSize)
+				return false;
+			memcpy(&size, at, wordSize);
+			at += wordSize;
+			if ((size_t)(end - at) < padded(size) ||
+			    (cls = findClass(std::string((const char *)at,
+				 size)))
+				.isNil())
+				return false;
+			classes.push_back({ cls,
+			    isBytesClass(cls) || cls == wellKnown.floatClass,
+			    (size_t)cls->vns->m_instanceSize.smi(),
+			    !isUncopyable(cls), layoutOf(cls) });
+			at += padded(size);
+		}
+		return true;
+	}
+
+	bool
+	readRecord()
+	{
+		struct vtrt_slots slots;
+		uintptr_t record, kind, size, ref;
+		oop object;
+		Class *cls;
+
+		if (!word(record) || (record >> 8) >= classes.size())
+			return false;
+		cls = &classes[record >> 8];
+		kind = record & 0xff;
+		if (kind == kRecordClass || kind == kRecordMetaclass) {
+			objects.push_back(
+			    kind == kRecordClass ? cls->cls : cls->cls->isa);
+			return true;
+		} else if (!cls->readable)
+			return false;
+		else if (kind == kRecordOops) {
+			if (!word(size) || cls->bytes ||
+			    size > (size_t)(end - at) / wordSize ||
+			    size < cls->instanceSize)
+				return false;
+			object = vtrt_alloc({ (vtrt_memoop_t)cls->cls.m_ptr },
+			    size, kSlotsOops);
+			objects.push_back(object.ptr);
+			if (cls->layout != kLayoutPlain)
+				collections.push_back(
+				    { object.ptr, cls->layout });
+			for (size_t i = 0; i < size; i++)
+				if (!word(ref) ||
+				    !decode(ref, (Oop *)&object.ptr->vns->oops[i]))
+					return false;
+			return true;
+		} else if (kind > kRecordSymbol || !cls->bytes ||
+		    (kind == kRecordSymbol) != (cls->cls == wellKnown.symbol) ||
+		    (size_t)(end - at) < slotsHeaderSize)
+			return false;
+
+		memcpy(&slots, at, slotsHeaderSize);
+		at += slotsHeaderSize;
+		if (slots.kind != kSlotsBytes ||
+		    padded(slots.size) > (size_t)(end - at) ||
+		    (cls->cls == wellKnown.floatClass &&
+			slots.size != sizeof(double)) ||
+		    (cls->layout == kLayoutLargeInteger &&
+			!isLargeIntegerMagnitude(
+			    cls->cls == wellKnown.largeNegativeInteger, at,
+			    slots.size)))
+			return false;
+		if (kind == kRecordSymbol)
+			objects.push_back(intern(std::string((const char *)at,
+			    slots.size)));
+		else if (share && slots.immutable) {
+			/* (a header with no slots, given the record's) */
+			object = vtrt_alloc({ (vtrt_memoop_t)cls->cls.m_ptr }, 0,
+			    kSlotsOops);
+			object.ptr->vns = (struct vtrt_slots *)(at -
+			    slotsHeaderSize);
+			objects.push_back(object.ptr);
+		} else {
+			object = vtrt_alloc({ (vtrt_memoop_t)cls->cls.m_ptr },
+			    slots.size, kSlotsBytes);
+			memcpy(object.ptr->vns->oops, at, slots.size);
+			objects.push_back(object.ptr);
+		}
+		at += padded(slots.size);
+		return true;
+	}
+
+    public:
+	Reader(const uint8_t *bytes, size_t size, bool share)
+	    : start(bytes)
+	    , at(bytes)
+	    , end(bytes + size)
+	    , share(share)
+	{
+	}
+
+	bool
+	read(Oop &root)
+	{
+		GraphHeader header;
+
+		if ((size_t)(end - at) < sizeof header)
+			return false;
+		memcpy(&header, at, sizeof header);
+		at += sizeof header;
+		if (memcmp(header.magic, graphMagic, sizeof header.magic) ||
+		    header.version != graphVersion ||
+		    header.wordSize != wordSize || header.byteOrder != 0x0102 ||
+		    header.classesOffset < sizeof header ||
+		    header.classesOffset > (size_t)(end - start) ||
+		    !readClasses(start + header.classesOffset,
+			header.nClasses))
+			return false;
+		end = start + header.classesOffset;
+		if (header.nObjects > (size_t)(end - at) / wordSize)
+			return false;
+
+		nObjects = header.nObjects;
+		objects.reserve(nObjects);
+		for (uintptr_t i = 0; i < nObjects; i++)
+			if (!readRecord())
+				return false;
+		for (auto &fixup : fixups)
+			*fixup.first = objects[fixup.second];
+		for (auto &each : collections)
+			if (each.second == kLayoutRing ? !isRing(each.first) :
+			    !rehashTable(each.first,
+				each.second == kLayoutIdentityTable))
+				return false;
+		return decode(header.root, &root);
+	}
+};
+
+} /* namespace */
+
+bool
+storeGraph(Oop root, std::vector<uint8_t> &bytes)
+{
+	return Writer(bytes).write(root);
+}
+
+bool
+loadGraph(const uint8_t *bytes, size_t size, bool share, Oop &root)
+{
+	return Reader(bytes, size, share).read(root);
+}
+
+/* The path a String names. */
+static bool
+pathOf(oop string, std::string &path)
+{
+	struct vtrt_slots *slots;
+
+	if (!VT_isPtr(string.value) || string.ptr == NULL ||
+	    (slots = string.ptr->vns) == NULL || slots->kind != kSlotsBytes)
+		return false;
+	path.assign((const char *)slots->oops, slots->size);
+	return true;
+}
+
+oop
+vtrt_prim_bytesGraphOf_(oop self, oop root, bool *failed)
+{
+	std::vector<uint8_t> bytes;
+	oop graph;
+
+	if (!isBytesClass(ClassOop(self.ptr)) || !storeGraph(root.ptr, bytes)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	graph = vtrt_alloc(self, bytes.size(), kSlotsBytes);
+	memcpy(graph.ptr->vns->oops, bytes.data(), bytes.size());
+	return graph;
+}
+
+oop
+vtrt_prim_bytesLoadGraph(oop self, bool *failed)
+{
+	struct vtrt_slots *slots = self.ptr->vns;
+	Oop root;
+
+	if (slots == NULL || slots->kind != kSlotsBytes ||
+	    !loadGraph((const uint8_t *)slots->oops, slots->size, false,
+		root)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return { (vtrt_memoop_t)root.m_ptr };
+}
+
+oop
+vtrt_prim_bytesLoadGraphFile_(oop self, oop path, bool *failed)
+{
+	struct vtrt_slots *slots;
+	std::string name;
+	Oop root;
+
+	(void)self;
+	if (!pathOf(path, name) || !(slots = pscMapFile(name.c_str())) ||
+	    !loadGraph((const uint8_t *)slots->oops, slots->size, true,
+		root)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return { (vtrt_memoop_t)root.m_ptr };
+}
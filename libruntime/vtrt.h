@@ -14,14 +14,14 @@ extern "C" {
 #define VT_tag(x) (((intptr_t)x) & VT_tagMask)
 #define VT_isPtr(x) (!VT_tag (x))
 #define VT_isSmi(x) (VT_tag (x) == 1)
+#define VT_isFloat(x) (VT_tag (x) == 2)
+#define VT_isChar(x) (VT_tag (x) == 3)
 #define VT_intValue(x) (((intptr_t)x) >> VT_tagBits)
 #define VTRT_MAKESMI(iVal) ((void *) (((iVal) << VT_tagBits) | 1))
 
 typedef uintptr_t vtrt_smi_t;
 
-struct vtrt_objectHeader {
-
-};
+struct vtrt_objectHeader;
 
 typedef struct vtrt_objectHeader * vtrt_memoop_t;
 
@@ -32,6 +32,217 @@ typedef union {
 
 typedef oop process_oop;
 
+static const oop vtrt_nil = { 0 };
+
+#ifndef __cplusplus
+/* generated code's name for it */
+typedef oop Oop;
+#endif
+
+/* layout hints from profile feedback */
+#define VTRT_HOT __attribute__((hot))
+#define VTRT_COLD __attribute__((cold))
+#define vtrt_likely(x) __builtin_expect(!!(x), 1)
+
+/*!
+ * @name objects
+ *
+ * The C view of the layout of an object: a header pointing to the object's
+ * slots. Keep in sync with ObjectHeader and MemDesc in runtime.hh.
+ * @{
+ */
+/* as MemDesc::kind */
+enum vtrt_slotsKind {
+	kSlotsBytes,
+	kSlotsOops,
+};
+
+struct vtrt_slots {
+	uintptr_t size;
+	unsigned kind : 8;
+	/* set for slots in read-only memory, which primitives mustn't store to */
+	unsigned immutable : 1;
+	oop oops[];
+};
+
+struct vtrt_objectHeader {
+	oop isa;
+	struct vtrt_slots *vns;
+	/* 0 until asked for; see vtrt_identityHash() */
+	uint32_t identityHash;
+};
+
+uint32_t vtrt_assignIdentityHash(struct vtrt_objectHeader *object);
+
+/*
+ * The identity hash of an object is kept in its header, so it is unaffected
+ * by the object being moved. It is assigned the first time it is asked for,
+ * from a per-thread generator, and is never 0.
+ */
+static inline uint32_t
+vtrt_identityHash(struct vtrt_objectHeader *object)
+{
+	uint32_t hash = __atomic_load_n(&object->identityHash, __ATOMIC_RELAXED);
+
+	if (vtrt_likely(hash != 0))
+		return hash;
+	return vtrt_assignIdentityHash(object);
+}
+
+/*
+ * The instance variables of an object, by index, as numbered by the compiler
+ * across the superclass chain.
+ */
+static inline oop *
+vtrt_ivars(oop object)
+{
+	return object.ptr->vns->oops;
+}
+
+/*
+ * Called on every store of a reference into an object. (There is not yet any
+ * collector which needs to know.)
+ */
+static inline void
+vtrt_writeBarrier(oop object, oop value)
+{
+	(void)object;
+	(void)value;
+}
+
+/* As vtrt_writeBarrier(), once for n references stored together. */
+static inline void
+vtrt_writeBarrierSlots(oop object, const oop *values, size_t n)
+{
+	(void)object;
+	(void)values;
+	(void)n;
+}
+
+static inline oop
+vtrt_storeIvar(oop object, oop *ivars, size_t index, oop value)
+{
+	vtrt_writeBarrier(object, value);
+	return ivars[index] = value;
+}
+/*!
+ * @} (objects)
+ */
+
+/*!
+ * @name allocation
+ *
+ * Each thread allocates by bumping a pointer through its own region of
+ * zero-filled memory, the header and slots of an object laid out together.
+ * Zero is nil, so the new object's slots need no initialising. When the region
+ * is exhausted, vtrt_allocSlow() sets up another.
+ * @{
+ */
+struct vtrt_allocRegion {
+	char *cursor;
+	char *limit;
+};
+
+oop vtrt_allocSlow(oop cls, size_t nSlots, enum vtrt_slotsKind kind);
+
+/*
+ * The running thread's region. A Process may be resumed on another thread by
+ * any send, so this is out of line, in runtime.cc: a compiler seeing the
+ * thread-local's address taken may otherwise keep it across calls, as if the
+ * thread couldn't change.
+ */
+__attribute__((noinline)) struct vtrt_allocRegion *vtrt_currentRegion(void);
+
+/* The bytes taken by an object with nSlots oops or bytes, rounded to oops. */
+static inline size_t
+vtrt_allocSize(size_t nSlots, enum vtrt_slotsKind kind)
+{
+	size_t size = sizeof(struct vtrt_objectHeader);
+
+	/* (an object with no slots of either kind has none allocated) */
+	if (kind == kSlotsOops && nSlots != 0)
+		size += sizeof(struct vtrt_slots) + nSlots * sizeof(oop);
+	else if (kind == kSlotsBytes)
+		size += (sizeof(struct vtrt_slots) + nSlots + sizeof(oop) - 1) &
+		    ~(sizeof(oop) - 1);
+	return size;
+}
+
+/* Make an object of zero-filled memory, of vtrt_allocSize(nSlots, kind). */
+static inline oop
+vtrt_initObject(char *memory, oop cls, size_t nSlots,
+    enum vtrt_slotsKind kind)
+{
+	struct vtrt_objectHeader *header = (struct vtrt_objectHeader *)memory;
+	oop object;
+
+	header->isa = cls;
+	if (kind == kSlotsBytes || nSlots != 0) {
+		header->vns = (struct vtrt_slots *)(header + 1);
+		header->vns->size = nSlots;
+		header->vns->kind = kind;
+	}
+	object.ptr = header;
+	return object;
+}
+
+/*
+ * Allocate an instance of cls with nSlots oops or bytes (its named instance
+ * variables included). Where those are constant, this compiles to a bounds
+ * check, an add, and the stores of the header.
+ */
+static inline oop
+vtrt_alloc(oop cls, size_t nSlots, enum vtrt_slotsKind kind)
+{
+	struct vtrt_allocRegion *region = vtrt_currentRegion();
+	size_t size = vtrt_allocSize(nSlots, kind);
+	char *memory = region->cursor;
+
+	if (!vtrt_likely((size_t)(region->limit - memory) >= size))
+		return vtrt_allocSlow(cls, nSlots, kind);
+	region->cursor = memory + size;
+	return vtrt_initObject(memory, cls, nSlots, kind);
+}
+/*!
+ * @} (allocation)
+ */
+
+/*!
+ * @name literals
+ *
+ * Literal strings and arrays, and Floats and integers which can't be
+ * immediate, are compiled to statically allocated objects. Their slots are
+ * const, and so are placed in read-only memory, and marked immutable so that
+ * storing into one fails the primitive; their headers' classes, and
+ * any Symbols in literal arrays, are filled in by the runtime at link time,
+ * from the tables in the unit's template.
+ * @{
+ */
+#define VTRT_OOP(object) ((oop){ .ptr = (vtrt_memoop_t)(object) })
+
+/* the slots of a literal: n elements of type */
+#define VTRT_LITERAL_SLOTS(type, n)	\
+	struct {			\
+		uintptr_t size;		\
+		unsigned kind : 8;	\
+		unsigned immutable : 1;	\
+		_Alignas(oop) type contents[n];	\
+	}
+
+struct vtrt_literal {
+	struct vtrt_objectHeader *object;
+	const char *className;
+};
+
+/* A slot of a literal array which holds a Symbol. */
+struct vtrt_literalSymbol {
+	oop *slot;
+	const char *string;
+};
+/*!
+ * @} (literals)
+ */
+
 typedef oop (*vtrt_method_fn_t)(void * __sender, oop __self,...);
 
 /*!
@@ -49,6 +260,44 @@ struct vtrt_symbolReference {
 	oop ref;
 };
 
+/* A binding cell for a global, filled in by the runtime at link time. */
+struct vtrt_globalReference {
+	const char *name;
+	oop value;
+};
+
+/*!
+ * A send site counting the classes of receivers it sees, in a build made with
+ * --instrument. Only the first few distinct classes are counted individually.
+ */
+#define VTRT_PROFILE_WIDTH 4
+
+struct vtrt_sendSite {
+	/* e.g. "Point>>dist2" or "Point class>>new" */
+	const char *method;
+	/* ordinal of the send within the method, as numbered by the compiler */
+	unsigned index;
+	const char *selector;
+	struct {
+		oop cls;
+		uint64_t count;
+	} receivers[VTRT_PROFILE_WIDTH];
+	/* sends whose receiver class didn't fit */
+	uint64_t megamorphic;
+};
+
+struct vtrt_entryCounter {
+	const char *method;
+	uint64_t count;
+};
+
+struct vtrt_profile {
+	struct vtrt_sendSite *sendSites;
+	struct vtrt_entryCounter *entryCounters;
+	size_t nSendSites;
+	size_t nEntryCounters;
+};
+
 struct vtrt_classTemplate {
 	/* fully-qualified name */
         const char *name;
@@ -57,11 +306,23 @@ struct vtrt_classTemplate {
         struct vtrt_methodArray *instanceMethods;
         struct vtrt_methodArray *classMethods;
         struct vtrt_symbolReference *symbolReferences;
+	struct vtrt_globalReference *globalReferences;
+	struct vtrt_literal *literals;
+	struct vtrt_literalSymbol *literalSymbols;
 	size_t nInstanceMethods;
 	size_t nClassMethods;
 	size_t nSymbolReferences;
+	size_t nGlobalReferences;
+	size_t nLiterals;
+	size_t nLiteralSymbols;
 	size_t instanceSize;
+	/* whether instances' indexed slots are oops or bytes */
+	enum vtrt_slotsKind instanceKind;
 	size_t classSize;
+	/* instrumentation counters, if built with --instrument; else NULL */
+	struct vtrt_profile *profile;
+	/* the class itself; set when the class is registered */
+	oop cls;
 };
 
 /*!
@@ -82,8 +343,935 @@ int vtrt_main(int argc, char *argv[]);
 vtrt_memoop_t allocOopsObj(size_t nOops);
 oop (*msgLookup(oop receiver, oop selector))(void * __sender, oop __self,...);
 oop vtrt_return(volatile void * context, oop value);
-bool vtrt_isTrue(oop value);
 oop makeSMI(uintptr_t value);
+oop vtrt_classOf(oop value);
+
+/*!
+ * @name booleans
+ * @{
+ */
+extern oop vtrt_trueObject, vtrt_falseObject;
+
+static inline bool
+vtrt_isTrue(oop value)
+{
+	return value.ptr == vtrt_trueObject.ptr;
+}
+
+static inline oop
+vtrt_bool(bool value)
+{
+	return value ? vtrt_trueObject : vtrt_falseObject;
+}
+/*!
+ * @} (booleans)
+ */
+
+/*!
+ * @name unboxed SmallInteger arithmetic
+ *
+ * Used where the compiler has proven the operands are SmallIntegers. The
+ * arithmetic is done on their intptr_t values; overflow of intptr_t (or
+ * division by zero) sets *overflow, as does a result out of SmallInteger range
+ * per vtrt_smiFits(), whereupon the compiled code redoes the operation with
+ * the vtrt_integer functions below, which answer a LargeInteger.
+ * @{
+ */
+#define VTRT_SMI_MIN (INTPTR_MIN >> VT_tagBits)
+#define VTRT_SMI_MAX (INTPTR_MAX >> VT_tagBits)
+
+static inline intptr_t
+vtrt_smiValue(oop value)
+{
+	return (intptr_t)value.value >> VT_tagBits;
+}
+
+static inline oop
+vtrt_smi(intptr_t value)
+{
+	oop result;
+	result.value = ((vtrt_smi_t)value << VT_tagBits) | 1;
+	return result;
+}
+
+static inline bool
+vtrt_smiFits(intptr_t value)
+{
+	return value >= VTRT_SMI_MIN && value <= VTRT_SMI_MAX;
+}
+
+static inline intptr_t
+vtrt_smiAdd(intptr_t a, intptr_t b, bool *overflow)
+{
+	intptr_t result;
+	*overflow |= __builtin_add_overflow(a, b, &result);
+	return result;
+}
+
+static inline intptr_t
+vtrt_smiSub(intptr_t a, intptr_t b, bool *overflow)
+{
+	intptr_t result;
+	*overflow |= __builtin_sub_overflow(a, b, &result);
+	return result;
+}
+
+static inline intptr_t
+vtrt_smiMul(intptr_t a, intptr_t b, bool *overflow)
+{
+	intptr_t result;
+	*overflow |= __builtin_mul_overflow(a, b, &result);
+	return result;
+}
+
+/* #//: quotient rounded towards negative infinity */
+static inline intptr_t
+vtrt_smiDiv(intptr_t a, intptr_t b, bool *overflow)
+{
+	intptr_t quo;
+
+	if (b == 0 || (b == -1 && a == INTPTR_MIN)) {
+		*overflow = true;
+		return 0;
+	}
+	quo = a / b;
+	if (a % b != 0 && (a < 0) != (b < 0))
+		quo--;
+	return quo;
+}
+
+/* #\\: remainder of #//, taking the sign of the divisor */
+static inline intptr_t
+vtrt_smiMod(intptr_t a, intptr_t b, bool *overflow)
+{
+	intptr_t rem;
+
+	if (b == 0) {
+		*overflow = true;
+		return 0;
+	} else if (b == -1)
+		return 0;
+	rem = a % b;
+	if (rem != 0 && (rem < 0) != (b < 0))
+		rem += b;
+	return rem;
+}
+/*!
+ * @} (unboxed SmallInteger arithmetic)
+ */
+
+/*!
+ * @name LargeIntegers
+ *
+ * Integers out of SmallInteger range are instances of LargePositiveInteger or
+ * LargeNegativeInteger, whose bytes are the magnitude (see largeint.cc). The
+ * functions here take any mix of SmallIntegers and LargeIntegers, and answer a
+ * SmallInteger wherever the result fits in one.
+ * @{
+ */
+bool vtrt_isLargeInteger(oop value);
+
+static inline bool
+vtrt_isInteger(oop value)
+{
+	return VT_isSmi(value.value) || vtrt_isLargeInteger(value);
+}
+
+oop vtrt_integerAdd(oop a, oop b);
+oop vtrt_integerSub(oop a, oop b);
+oop vtrt_integerMul(oop a, oop b);
+/* #// and #\\; dividing by zero is a fatal ZeroDivide */
+oop vtrt_integerDiv(oop a, oop b);
+oop vtrt_integerMod(oop a, oop b);
+/* Answer <0, 0 or >0 as a is less than, equal to or greater than b. */
+int vtrt_integerCompare(oop a, oop b);
+double vtrt_integerAsDouble(oop value);
+/* A new String of the digits of value in base (2 to 36). */
+oop vtrt_integerPrintString(oop value, int base);
+/* The integer of the digits in base, with an optional '-'; or set *failed. */
+oop vtrt_integerFromString(const char *string, size_t length, int base,
+    bool *failed);
+void vtrt_zeroDivide(oop value) __attribute__((noreturn));
+/*!
+ * @} (LargeIntegers)
+ */
+
+/*!
+ * @name Floats
+ *
+ * A Float is immediate (tagged 2) if its exponent is within that of a C float,
+ * so magnitudes from 2^-126 to 2^128, or it is zero. Its sign is rotated to
+ * the bottom of the double, and the exponent's bias reduced so that it takes
+ * only 8 bits; the top 3 then make way for the tag. Other Floats are boxed, as
+ * 8 bytes in an instance of Float. Keep in sync with immediateFloat() in
+ * vm/generate.cc.
+ * @{
+ */
+/* subtracted from the exponent of an immediate Float */
+#define VTRT_FLOAT_EXPONENT_OFFSET 896
+
+static inline uint64_t
+vtrt_doubleBits(double value)
+{
+	union {
+		double value;
+		uint64_t bits;
+	} u = { value };
+	return u.bits;
+}
+
+static inline double
+vtrt_bitsDouble(uint64_t bits)
+{
+	union {
+		uint64_t bits;
+		double value;
+	} u = { bits };
+	return u.value;
+}
+
+static inline bool
+vtrt_floatFits(double value)
+{
+	uint64_t bits = vtrt_doubleBits(value);
+	unsigned exponent = (bits >> 52) & 0x7ff;
+
+	return (exponent > VTRT_FLOAT_EXPONENT_OFFSET &&
+		   exponent < VTRT_FLOAT_EXPONENT_OFFSET + 256) ||
+	    (bits << 1) == 0;
+}
+
+/* An immediate Float; value must satisfy vtrt_floatFits(). */
+static inline oop
+vtrt_immediateFloat(double value)
+{
+	uint64_t bits = vtrt_doubleBits(value);
+	oop result;
+
+	bits = bits << 1 | bits >> 63;
+	/* (but zero stays so) */
+	if (bits > 1)
+		bits -= (uint64_t)VTRT_FLOAT_EXPONENT_OFFSET << 53;
+	result.value = bits << VT_tagBits | 2;
+	return result;
+}
+
+/* A new boxed Float. */
+oop vtrt_boxFloat(double value);
+
+static inline oop
+vtrt_float(double value)
+{
+	if (vtrt_likely(vtrt_floatFits(value)))
+		return vtrt_immediateFloat(value);
+	return vtrt_boxFloat(value);
+}
+
+/* The value of a Float, immediate or boxed. */
+static inline double
+vtrt_floatValue(oop value)
+{
+	uint64_t bits;
+
+	/* (copied out, as vtrt_boxFloat() copies it in) */
+	if (!VT_isFloat(value.value)) {
+		__builtin_memcpy(&bits, value.ptr->vns->oops, sizeof bits);
+		return vtrt_bitsDouble(bits);
+	}
+	bits = value.value >> VT_tagBits;
+	if (bits > 1)
+		bits += (uint64_t)VTRT_FLOAT_EXPONENT_OFFSET << 53;
+	return vtrt_bitsDouble(bits >> 1 | bits << 63);
+}
+
+/* The value of a SmallInteger, LargeInteger or Float as a double. */
+static inline double
+vtrt_numberValue(oop value)
+{
+	if (VT_isSmi(value.value))
+		return vtrt_smiValue(value);
+	else if (!VT_isFloat(value.value) && vtrt_isLargeInteger(value))
+		return vtrt_integerAsDouble(value);
+	return vtrt_floatValue(value);
+}
+/*!
+ * @} (Floats)
+ */
+
+/*!
+ * @name Characters
+ *
+ * A Character is immediate (tagged 3), its Unicode code point above the tag.
+ * Keep in sync with visitCharExpr() in vm/generate.cc.
+ * @{
+ */
+#define VTRT_CHAR_MAX 0x10ffff
+
+static inline oop
+vtrt_char(uint32_t value)
+{
+	oop result;
+	result.value = ((vtrt_smi_t)value << VT_tagBits) | 3;
+	return result;
+}
+
+static inline uint32_t
+vtrt_charValue(oop value)
+{
+	return value.value >> VT_tagBits;
+}
+/*!
+ * @} (Characters)
+ */
+
+/*!
+ * @name byte objects
+ *
+ * Comparing, hashing and searching the bytes of Strings and other byte
+ * objects, with vector code where the CPU has it (see bytes.cc).
+ * @{
+ */
+/* Answer <0, 0 or >0 as a is less than, equal to or greater than b. */
+int vtrt_bytesCompare(const uint8_t *a, size_t na, const uint8_t *b,
+    size_t nb);
+uint32_t vtrt_bytesHash(const uint8_t *bytes, size_t n);
+/* the index of the first c in bytes, or -1 */
+intptr_t vtrt_bytesIndexOf(const uint8_t *bytes, size_t n, uint8_t c);
+/* the index of the first occurrence of needle in haystack, or -1 */
+intptr_t vtrt_bytesFind(const uint8_t *haystack, size_t n,
+    const uint8_t *needle, size_t m);
+/*!
+ * @} (byte objects)
+ */
+
+/*!
+ * @name type checks
+ *
+ * Where a value isn't proven to be of a variable's declared type, the compiled
+ * code checks it at run time.
+ * @{
+ */
+void vtrt_typeError(oop value, oop expectedClass) __attribute__((noreturn));
+/* Answer value if it is an instance of cls or of a subclass; else fail. */
+oop vtrt_checkClass(oop value, oop cls);
+
+static inline oop
+vtrt_checkSmi(oop value)
+{
+	if (!vtrt_likely(VT_isSmi(value.value)))
+		return vtrt_checkClass(value, vtrt_classOf(vtrt_smi(0)));
+	return value;
+}
+
+static inline oop
+vtrt_checkChar(oop value)
+{
+	if (!vtrt_likely(VT_isChar(value.value)))
+		return vtrt_checkClass(value, vtrt_classOf(vtrt_char(0)));
+	return value;
+}
+
+static inline oop
+vtrt_checkFloat(oop value, oop floatClass)
+{
+	if (!vtrt_likely(VT_isFloat(value.value)))
+		return vtrt_checkClass(value, floatClass);
+	return value;
+}
+/*!
+ * @} (type checks)
+ */
+
+/*!
+ * @name primitives
+ *
+ * A method declared <#name> is implemented by the C function
+ * vtrt_prim_name (with colons in the name made underscores), which takes the
+ * receiver and the method's arguments. If it can't do what is asked it sets
+ * *failed, and the method's Smalltalk code is run instead.
+ *
+ * A send bound to a primitive method calls its primitive directly. The small
+ * primitives below are inline, so the call compiles to a few instructions;
+ * the others are in primitives.cc. All are listed in vtrt_primitives.
+ * @{
+ */
+struct vtrt_primitive {
+	const char *name;
+	void *function;
+};
+
+extern const struct vtrt_primitive vtrt_primitives[];
+extern const size_t vtrt_nPrimitives;
+
+/* The primitive named, or NULL if there is none. */
+void *vtrt_findPrimitive(const char *name);
+
+/* the slot of a class holding its instances' number of named slots */
+#define VTRT_CLASS_INSTANCE_SIZE 2
+
+/* The number of indexed slots (or bytes) of an object, or -1 if it has none. */
+static inline intptr_t
+vtrt_indexedSize(oop object)
+{
+	struct vtrt_slots *slots;
+
+	if (!VT_isPtr(object.value) || object.ptr == NULL ||
+	    (slots = object.ptr->vns) == NULL)
+		return 0;
+	else if (slots->kind == kSlotsBytes)
+		return slots->size;
+	return slots->size - vtrt_smiValue(
+	    vtrt_ivars(object.ptr->isa)[VTRT_CLASS_INSTANCE_SIZE]);
+}
+
+static inline oop
+vtrt_prim_identical_(oop self, oop other, bool *failed)
+{
+	return vtrt_bool(self.value == other.value);
+}
+
+/* (an immediate's is its value; nil's is 0) */
+static inline oop
+vtrt_prim_identityHash(oop self, bool *failed)
+{
+	if (!VT_isPtr(self.value))
+		return vtrt_smi((intptr_t)self.value >> VT_tagBits);
+	else if (self.ptr == NULL)
+		return vtrt_smi(0);
+	return vtrt_smi(vtrt_identityHash(self.ptr));
+}
+
+static inline oop
+vtrt_prim_class(oop self, bool *failed)
+{
+	return vtrt_classOf(self);
+}
+
+static inline oop
+vtrt_prim_basicSize(oop self, bool *failed)
+{
+	return vtrt_smi(vtrt_indexedSize(self));
+}
+
+static inline oop
+vtrt_prim_basicAt_(oop self, oop index, bool *failed)
+{
+	intptr_t size = vtrt_indexedSize(self), i;
+	struct vtrt_slots *slots;
+
+	if (!VT_isSmi(index.value) || (i = vtrt_smiValue(index)) < 1 ||
+	    i > size) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	slots = self.ptr->vns;
+	if (slots->kind == kSlotsBytes)
+		return vtrt_smi(((uint8_t *)slots->oops)[i - 1]);
+	return slots->oops[slots->size - size + i - 1];
+}
+
+static inline oop
+vtrt_prim_basicAt_put_(oop self, oop index, oop value, bool *failed)
+{
+	intptr_t size = vtrt_indexedSize(self), i;
+	struct vtrt_slots *slots;
+
+	if (!VT_isSmi(index.value) || (i = vtrt_smiValue(index)) < 1 ||
+	    i > size) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	slots = self.ptr->vns;
+	if (slots->immutable) {
+		*failed = true;
+		return vtrt_nil;
+	} else if (slots->kind == kSlotsBytes) {
+		if (!VT_isSmi(value.value) || vtrt_smiValue(value) < 0 ||
+		    vtrt_smiValue(value) > 255) {
+			*failed = true;
+			return vtrt_nil;
+		}
+		((uint8_t *)slots->oops)[i - 1] = vtrt_smiValue(value);
+		return value;
+	}
+	vtrt_writeBarrier(self, value);
+	return slots->oops[slots->size - size + i - 1] = value;
+}
+
+/*
+ * The i'th (from 0) of the size indexed slots of an object of oops, as the
+ * loops the compiler makes of an Array's do:, collect: and so on use them.
+ */
+static inline oop
+vtrt_indexedSlot(oop object, intptr_t size, intptr_t i)
+{
+	struct vtrt_slots *slots = object.ptr->vns;
+
+	return slots->oops[slots->size - size + i];
+}
+
+static inline void
+vtrt_indexedSlotPut(oop object, intptr_t size, intptr_t i, oop value)
+{
+	struct vtrt_slots *slots = object.ptr->vns;
+
+	vtrt_writeBarrier(object, value);
+	slots->oops[slots->size - size + i] = value;
+}
+
+/*
+ * Cut an object of oops with size indexed slots down to the first newSize of
+ * them, in place; the rest of its memory is left for the collector.
+ */
+static inline oop
+vtrt_truncateIndexed(oop object, intptr_t size, intptr_t newSize)
+{
+	if (newSize != size)
+		object.ptr->vns->size -= size - newSize;
+	return object;
+}
+
+/*
+ * The bytes of a String (or any byte object) as Characters: so scanning one
+ * allocates nothing.
+ */
+static inline oop
+vtrt_prim_characterAt_(oop self, oop index, bool *failed)
+{
+	struct vtrt_slots *slots;
+	intptr_t i;
+
+	if (!VT_isPtr(self.value) || self.ptr == NULL ||
+	    (slots = self.ptr->vns) == NULL || slots->kind != kSlotsBytes ||
+	    !VT_isSmi(index.value) || (i = vtrt_smiValue(index)) < 1 ||
+	    i > (intptr_t)slots->size) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_char(((uint8_t *)slots->oops)[i - 1]);
+}
+
+static inline oop
+vtrt_prim_characterAt_put_(oop self, oop index, oop value, bool *failed)
+{
+	struct vtrt_slots *slots;
+	intptr_t i;
+
+	if (!VT_isPtr(self.value) || self.ptr == NULL ||
+	    (slots = self.ptr->vns) == NULL || slots->kind != kSlotsBytes ||
+	    slots->immutable || !VT_isSmi(index.value) ||
+	    (i = vtrt_smiValue(index)) < 1 || i > (intptr_t)slots->size ||
+	    !VT_isChar(value.value) ||
+	    vtrt_charValue(value) > 255) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	((uint8_t *)slots->oops)[i - 1] = vtrt_charValue(value);
+	return value;
+}
+
+static inline oop
+vtrt_prim_charValue(oop self, bool *failed)
+{
+	return vtrt_smi(vtrt_charValue(self));
+}
+
+static inline oop
+vtrt_prim_smiAsCharacter(oop self, bool *failed)
+{
+	if (!VT_isSmi(self.value) || vtrt_smiValue(self) < 0 ||
+	    vtrt_smiValue(self) > VTRT_CHAR_MAX) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_char(vtrt_smiValue(self));
+}
+
+/* Character class>>value: */
+static inline oop
+vtrt_prim_characterValue_(oop self, oop value, bool *failed)
+{
+	return vtrt_prim_smiAsCharacter(value, failed);
+}
+
+/*
+ * An instance of cls with nNamed named slots, and as many indexed slots (or
+ * bytes) as size says; where the class is known, the compiler calls this in
+ * place of the basicNew: primitive.
+ */
+static inline oop
+vtrt_allocIndexed(oop cls, size_t nNamed, enum vtrt_slotsKind kind, oop size,
+    bool *failed)
+{
+	if (!VT_isSmi(size.value) || vtrt_smiValue(size) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_alloc(cls, nNamed + vtrt_smiValue(size), kind);
+}
+
+/*
+ * the integer primitives, for SmallIntegers and LargeIntegers alike, failing
+ * unless both are integers (or when dividing by zero)
+ */
+oop vtrt_prim_integerAdd_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerSub_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerMul_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerDiv_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerMod_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerLess_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerGreater_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerLessOrEqual_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerGreaterOrEqual_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerEqual_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerNotEqual_(oop self, oop arg, bool *failed);
+oop vtrt_prim_integerAsFloat(oop self, bool *failed);
+oop vtrt_prim_integerPrintString_(oop self, oop base, bool *failed);
+/* the integer of a String's digits in base */
+oop vtrt_prim_stringAsInteger_(oop self, oop base, bool *failed);
+
+/*
+ * SmallInteger arithmetic, done inline where both are SmallIntegers and the
+ * result is one too; else by the integer primitive, so promoting the result to
+ * a LargeInteger
+ */
+#define VTRT_SMI_ARITHMETIC_PRIMITIVE(name, function, integerName)	\
+	static inline oop						\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		bool overflow = false;					\
+		intptr_t value;						\
+									\
+		if (vtrt_likely(VT_isSmi(self.value) &&			\
+			VT_isSmi(arg.value))) {				\
+			value = function(vtrt_smiValue(self),		\
+			    vtrt_smiValue(arg), &overflow);		\
+			if (vtrt_likely(!overflow &&			\
+				vtrt_smiFits(value)))			\
+				return vtrt_smi(value);			\
+		}							\
+		return vtrt_prim_##integerName(self, arg, failed);	\
+	}
+#define VTRT_SMI_COMPARISON_PRIMITIVE(name, operator, integerName)	\
+	static inline oop						\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!vtrt_likely(VT_isSmi(self.value) &&		\
+			VT_isSmi(arg.value)))				\
+			return vtrt_prim_##integerName(self, arg,	\
+			    failed);					\
+		return vtrt_bool(vtrt_smiValue(self) operator		\
+		    vtrt_smiValue(arg));				\
+	}
+
+VTRT_SMI_ARITHMETIC_PRIMITIVE(smiAdd_, vtrt_smiAdd, integerAdd_)
+VTRT_SMI_ARITHMETIC_PRIMITIVE(smiSub_, vtrt_smiSub, integerSub_)
+VTRT_SMI_ARITHMETIC_PRIMITIVE(smiMul_, vtrt_smiMul, integerMul_)
+VTRT_SMI_ARITHMETIC_PRIMITIVE(smiDiv_, vtrt_smiDiv, integerDiv_)
+VTRT_SMI_ARITHMETIC_PRIMITIVE(smiMod_, vtrt_smiMod, integerMod_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiLess_, <, integerLess_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiGreater_, >, integerGreater_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiLessOrEqual_, <=, integerLessOrEqual_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiGreaterOrEqual_, >=, integerGreaterOrEqual_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiEqual_, ==, integerEqual_)
+VTRT_SMI_COMPARISON_PRIMITIVE(smiNotEqual_, !=, integerNotEqual_)
+
+/*
+ * Float arithmetic, with a Float receiver and a Float or integer argument,
+ * failing if the argument is anything else
+ */
+#define VTRT_FLOAT_ARITHMETIC_PRIMITIVE(name, operator)			\
+	static inline oop						\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!VT_isFloat(arg.value) && !vtrt_isInteger(arg) &&	\
+		    !vtrt_isBoxedFloat(arg)) {				\
+			*failed = true;					\
+			return vtrt_nil;				\
+		}							\
+		return vtrt_float(vtrt_floatValue(self) operator	\
+		    vtrt_numberValue(arg));				\
+	}
+#define VTRT_FLOAT_COMPARISON_PRIMITIVE(name, operator)			\
+	static inline oop						\
+	vtrt_prim_##name(oop self, oop arg, bool *failed)		\
+	{								\
+		if (!VT_isFloat(arg.value) && !vtrt_isInteger(arg) &&	\
+		    !vtrt_isBoxedFloat(arg)) {				\
+			*failed = true;					\
+			return vtrt_nil;				\
+		}							\
+		return vtrt_bool(vtrt_floatValue(self) operator		\
+		    vtrt_numberValue(arg));				\
+	}
+
+/* Is value a boxed Float? (That is, 8 bytes of an instance of Float.) */
+bool vtrt_isBoxedFloat(oop value);
+
+VTRT_FLOAT_ARITHMETIC_PRIMITIVE(floatAdd_, +)
+VTRT_FLOAT_ARITHMETIC_PRIMITIVE(floatSub_, -)
+VTRT_FLOAT_ARITHMETIC_PRIMITIVE(floatMul_, *)
+VTRT_FLOAT_ARITHMETIC_PRIMITIVE(floatDiv_, /)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatLess_, <)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatGreater_, >)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatLessOrEqual_, <=)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatGreaterOrEqual_, >=)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatEqual_, ==)
+VTRT_FLOAT_COMPARISON_PRIMITIVE(floatNotEqual_, !=)
+
+static inline oop
+vtrt_prim_floatSqrt(oop self, bool *failed)
+{
+	return vtrt_float(__builtin_sqrt(vtrt_floatValue(self)));
+}
+
+static inline oop
+vtrt_prim_smiAsFloat(oop self, bool *failed)
+{
+	if (!VT_isSmi(self.value)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_float(vtrt_smiValue(self));
+}
+
+/*
+ * the byte object primitives, for Strings and the like; indices are 1-based,
+ * and an index of 0 means not found
+ */
+oop vtrt_prim_bytesEqual_(oop self, oop arg, bool *failed);
+oop vtrt_prim_bytesCompare_(oop self, oop arg, bool *failed);
+oop vtrt_prim_bytesHash(oop self, bool *failed);
+/* the index of a Character (or byte value) at or after start */
+oop vtrt_prim_bytesIndexOf_startingAt_(oop self, oop value, oop start,
+    bool *failed);
+oop vtrt_prim_bytesIndexOfSubCollection_startingAt_(oop self, oop sub,
+    oop start, bool *failed);
+oop vtrt_prim_bytesReplaceFrom_to_with_startingAt_(oop self, oop start,
+    oop stop, oop replacement, oop repStart, bool *failed);
+oop vtrt_prim_bytesFill_(oop self, oop value, bool *failed);
+
+/*
+ * the hash table primitives of Dictionary and Set (by equality) and of
+ * IdentityDictionary (by identity), failing if a key is not found, or is nil;
+ * see hashtable.cc
+ */
+#define VTRT_HASH_TABLE_PRIMITIVES(prefix)				\
+	oop vtrt_prim_##prefix##At_(oop self, oop key, bool *failed);	\
+	oop vtrt_prim_##prefix##At_ifAbsent_(oop self, oop key,		\
+	    oop block, bool *failed);					\
+	oop vtrt_prim_##prefix##At_put_(oop self, oop key, oop value,	\
+	    bool *failed);						\
+	oop vtrt_prim_##prefix##Add_(oop self, oop key, bool *failed);	\
+	oop vtrt_prim_##prefix##RemoveKey_(oop self, oop key,		\
+	    bool *failed);						\
+	oop vtrt_prim_##prefix##RemoveKey_ifAbsent_(oop self, oop key,	\
+	    oop block, bool *failed);					\
+	oop vtrt_prim_##prefix##IncludesKey_(oop self, oop key,		\
+	    bool *failed);
+
+VTRT_HASH_TABLE_PRIMITIVES(hash)
+VTRT_HASH_TABLE_PRIMITIVES(identity)
+oop vtrt_prim_hashTally(oop self, bool *failed);
+oop vtrt_prim_hashCapacity(oop self, bool *failed);
+/* the key and value of an entry, by index from 1; the key is nil if empty */
+oop vtrt_prim_hashKeyAt_(oop self, oop index, bool *failed);
+oop vtrt_prim_hashValueAt_(oop self, oop index, bool *failed);
+
+/*
+ * the ring buffer primitives of OrderedCollection (see orderedcollection.cc);
+ * collections added or copied in bulk may be OrderedCollections or Arrays
+ */
+oop vtrt_prim_orderedSize(oop self, bool *failed);
+oop vtrt_prim_orderedAt_(oop self, oop index, bool *failed);
+oop vtrt_prim_orderedAt_put_(oop self, oop index, oop value, bool *failed);
+oop vtrt_prim_orderedAddFirst_(oop self, oop value, bool *failed);
+oop vtrt_prim_orderedAddLast_(oop self, oop value, bool *failed);
+oop vtrt_prim_orderedRemoveFirst(oop self, bool *failed);
+oop vtrt_prim_orderedRemoveLast(oop self, bool *failed);
+oop vtrt_prim_orderedAddAll_(oop self, oop collection, bool *failed);
+oop vtrt_prim_orderedCopyFrom_to_(oop self, oop start, oop stop,
+    bool *failed);
+oop vtrt_prim_orderedReplaceFrom_to_with_(oop self, oop start, oop stop,
+    oop replacement, bool *failed);
+
+/* the generic instantiation primitives, for a class not known statically */
+oop vtrt_prim_basicNew(oop self, bool *failed);
+oop vtrt_prim_basicNew_(oop self, oop size, bool *failed);
+
+/*
+ * send selector to self with the arguments, an Array; failing unless they are
+ * as many as it takes (see lookup.cc)
+ */
+oop vtrt_prim_perform_withArguments_(oop self, oop selector, oop arguments,
+    bool *failed);
+/* Report that self has no method for the selector of message, and abort. */
+oop vtrt_prim_doesNotUnderstand_(oop self, oop message, bool *failed);
+
+/* Report that a primitive failed with no fallback, and abort. */
+oop vtrt_prim_primitiveFailed(oop self, bool *failed)
+    __attribute__((noreturn));
+/*!
+ * @} (primitives)
+ */
+
+/*!
+ * @name parallel loops
+ *
+ * An Array's parallelDo:, parallelCollect: or parallelInject:into: is compiled
+ * to a function running the block over a chunk of the Array's elements, in a
+ * copy of the method's context, and the pool of worker threads (see pool.cc)
+ * runs that over every chunk. How an Array is cut into chunks depends on its
+ * size alone, so a reduction's partial results are the same, and combined in
+ * the same order, however many threads there are.
+ * @{
+ */
+#define VTRT_PARALLEL_MAX_CHUNKS 256
+
+struct vtrt_parallelLoop {
+	/* the context of the method, which each chunk runs in a copy of */
+	volatile void *context;
+	void *sender;
+	oop source;
+	intptr_t size;
+	/* the Array collected into, if any */
+	oop result;
+	/*
+	 * a reduction's partial result for each chunk; the first starts out
+	 * as the initial value
+	 */
+	oop *partials;
+};
+
+typedef void (*vtrt_chunkFunction)(struct vtrt_parallelLoop *loop,
+    size_t chunk, intptr_t begin, intptr_t end);
+
+/* The number of chunks a loop over size elements is cut into. */
+size_t vtrt_parallelChunks(intptr_t size);
+/*
+ * Run body on every chunk of the loop, on the pool and this thread, and
+ * return once all are done. (On a worker, or while another thread's loop
+ * has the pool, the chunks are run in order on this thread.)
+ */
+void vtrt_parallelFor(struct vtrt_parallelLoop *loop,
+    vtrt_chunkFunction body);
+/*!
+ * @} (parallel loops)
+ */
+
+/*!
+ * @name processes
+ *
+ * Processes are green threads, each on a small stack of its own, which worker
+ * threads switch between as they wait, yield or resume others (see
+ * process.cc). Priorities run from 1 to VTRT_PROCESS_PRIORITIES; keep in
+ * sync with libstkern/Processor.st.
+ * @{
+ */
+#define VTRT_PROCESS_PRIORITIES 8
+
+/* Process class>>receiver:selector:, a suspended Process to send the one */
+oop vtrt_prim_processReceiver_selector_(oop self, oop receiver, oop selector,
+    bool *failed);
+/* failing if the Process is not suspended */
+oop vtrt_prim_processResume(oop self, bool *failed);
+oop vtrt_prim_processSuspend(oop self, bool *failed);
+oop vtrt_prim_processTerminate(oop self, bool *failed);
+oop vtrt_prim_processPriority_(oop self, oop priority, bool *failed);
+oop vtrt_prim_processorYield(oop self, bool *failed);
+oop vtrt_prim_processorActiveProcess(oop self, bool *failed);
+oop vtrt_prim_semaphoreWait(oop self, bool *failed);
+oop vtrt_prim_semaphoreSignal(oop self, bool *failed);
+oop vtrt_prim_delayWait(oop self, bool *failed);
+/*!
+ * @} (processes)
+ */
+
+/*!
+ * @name I/O
+ *
+ * FileDescriptors: files, pipes, and TCP and Unix-domain sockets (see
+ * psc/io.cc). Reading or
+ * writing one which isn't ready suspends only the active Process. Bytes are
+ * read into and written from byte objects in place, from a 1-based start.
+ * @{
+ */
+oop vtrt_prim_fdOpenRead_(oop self, oop path, bool *failed);
+/* creating or truncating the file */
+oop vtrt_prim_fdOpenWrite_(oop self, oop path, bool *failed);
+/* self the reading end, writer the writing */
+oop vtrt_prim_fdPipeTo_(oop self, oop writer, bool *failed);
+/* on every address; port 0 for any free port */
+oop vtrt_prim_fdListenOn_(oop self, oop port, bool *failed);
+/* host a dotted IPv4 address */
+oop vtrt_prim_fdConnectTo_port_(oop self, oop host, oop port, bool *failed);
+/* a Unix-domain socket at path, which mustn't exist */
+oop vtrt_prim_fdListenOnPath_(oop self, oop path, bool *failed);
+oop vtrt_prim_fdConnectToPath_(oop self, oop path, bool *failed);
+oop vtrt_prim_fdAcceptInto_(oop self, oop connection, bool *failed);
+oop vtrt_prim_fdLocalPort(oop self, bool *failed);
+oop vtrt_prim_fdReadInto_startingAt_count_(oop self, oop bytes, oop start,
+    oop count, bool *failed);
+oop vtrt_prim_fdWrite_startingAt_count_(oop self, oop bytes, oop start,
+    oop count, bool *failed);
+oop vtrt_prim_fdClose(oop self, bool *failed);
+/*
+ * an instance of the byte class self whose bytes are those of the file at
+ * path, mapped read-only (see psc/map.cc)
+ */
+oop vtrt_prim_bytesMapFile_(oop self, oop path, bool *failed);
+/*!
+ * @} (I/O)
+ */
+
+/*!
+ * @name object graphs
+ *
+ * Graphs of objects written to the bytes of a byte object, to be stored or
+ * sent, and read back as copies (see serialize.cc).
+ * @{
+ */
+/* an instance of the byte class self holding the graph from root */
+oop vtrt_prim_bytesGraphOf_(oop self, oop root, bool *failed);
+/* the root of a copy of the graph self holds */
+oop vtrt_prim_bytesLoadGraph(oop self, bool *failed);
+/* as bytesLoadGraph, of the file at path, mapped */
+oop vtrt_prim_bytesLoadGraphFile_(oop self, oop path, bool *failed);
+/*!
+ * @} (object graphs)
+ */
+
+/*!
+ * @name remote sends
+ *
+ * Connections over sockets, on which RemoteObjects send the messages they
+ * don't understand to the objects another program serves, answering Promises
+ * (see remote.cc).
+ * @{
+ */
+/* self, on the connected socket */
+oop vtrt_prim_connectionOn_(oop self, oop socket, bool *failed);
+oop vtrt_prim_connectionFlush(oop self, bool *failed);
+/* sends made already are still answered */
+oop vtrt_prim_connectionClose(oop self, bool *failed);
+/* resolve Promises as their answers come, until the socket closes */
+oop vtrt_prim_connectionReceive(oop self, bool *failed);
+/* perform the sends which come, until the socket closes */
+oop vtrt_prim_connectionServe_(oop self, oop root, bool *failed);
+/* a Promise of the answer to message, sent to the object self stands for */
+oop vtrt_prim_remoteSend_(oop self, oop message, bool *failed);
+/* self, once its answer has come */
+oop vtrt_prim_promiseWait(oop self, bool *failed);
+/* a copy of the answer, waiting for it; failing if it couldn't be copied */
+oop vtrt_prim_promiseValue(oop self, bool *failed);
+/* self, its answer no longer kept on the other side; sends after are broken */
+oop vtrt_prim_promiseRelease(oop self, bool *failed);
+/*!
+ * @} (remote sends)
+ */
+
+/* Count the receiver of a send at an instrumented send site. */
+void vtrt_profileSend(struct vtrt_sendSite *site, oop receiver);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,335 @@
+/*!
+ * The primitives of FileDescriptors: files, pipes, and TCP and Unix-domain
+ * sockets.
+ *
+ * Pipes and sockets are non-blocking. An operation which would block waits for
+ * the descriptor to be ready (waitForIO(), in libruntime/process.cc), which
+ * suspends only the active Process, then tries again; so a Process may finish
+ * one on another worker than it started on, and the bytes of the object it
+ * reads into or writes from are found afresh each time. They are read and
+ * written in place, with no buffer between.
+ *
+ * Errors fail the primitive; writing to a pipe or socket closed at the other
+ * end is one (SIGPIPE is ignored, as the first descriptor is opened).
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "runtime.hh"
+
+/* connections waiting to be accepted */
+static const int listenBacklog = 128;
+
+static std::once_flag sigpipeIgnored;
+
+static void
+ignoreSigpipe()
+{
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/* The descriptor of a FileDescriptor, or -1 if it isn't open. */
+static int
+fdOf(oop self)
+{
+	SmiOop fd = FileDescriptorOop(self.ptr)->vns->m_fd;
+
+	return fd.isSmi() ? fd.smi() : -1;
+}
+
+/* Answer self, now open on fd; failing if fd is -1. */
+static oop
+opened(oop self, int fd, bool *failed)
+{
+	if (fd < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	std::call_once(sigpipeIgnored, ignoreSigpipe);
+	FileDescriptorOop(self.ptr)->vns->m_fd = SmiOop(fd);
+	return self;
+}
+
+/* A path from a String, or false if it isn't one. */
+static bool
+pathOf(oop string, std::string &path)
+{
+	if (!VT_isPtr(string.value) || string.ptr == NULL ||
+	    string.ptr->vns == NULL || string.ptr->vns->kind != kSlotsBytes)
+		return false;
+	path.assign((const char *)string.ptr->vns->oops,
+	    string.ptr->vns->size);
+	return path.find('\0') == std::string::npos;
+}
+
+/*
+ * The bytes of a byte object from start (1-based) for count, or NULL if they
+ * aren't all there, or are to be stored into and are immutable.
+ */
+static uint8_t *
+bytesAt(oop object, oop start, oop count, bool store)
+{
+	struct vtrt_slots *slots;
+
+	if (!VT_isPtr(object.value) || object.ptr == NULL ||
+	    (slots = object.ptr->vns) == NULL || slots->kind != kSlotsBytes ||
+	    (store && slots->immutable) || !VT_isSmi(start.value) ||
+	    !VT_isSmi(count.value) || vtrt_smiValue(start) < 1 ||
+	    vtrt_smiValue(count) < 0 ||
+	    vtrt_smiValue(start) - 1 + vtrt_smiValue(count) >
+		(intptr_t)slots->size)
+		return NULL;
+	return (uint8_t *)slots->oops + vtrt_smiValue(start) - 1;
+}
+
+/* Has an operation on fd which failed with errno waited to be tried again? */
+static bool
+waited(int fd, bool write)
+{
+	if (errno == EINTR)
+		return true;
+	return (errno == EAGAIN || errno == EWOULDBLOCK) &&
+	    waitForIO(fd, write);
+}
+
+oop
+vtrt_prim_fdOpenRead_(oop self, oop path, bool *failed)
+{
+	std::string name;
+
+	return opened(self,
+	    pathOf(path, name) ? open(name.c_str(), O_RDONLY | O_CLOEXEC) : -1,
+	    failed);
+}
+
+oop
+vtrt_prim_fdOpenWrite_(oop self, oop path, bool *failed)
+{
+	std::string name;
+
+	return opened(self,
+	    pathOf(path, name) ?
+		open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0666) :
+		-1,
+	    failed);
+}
+
+oop
+vtrt_prim_fdPipeTo_(oop self, oop writer, bool *failed)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	opened(writer, fds[1], failed);
+	return opened(self, fds[0], failed);
+}
+
+/* A descriptor of a socket bound to address and listening, or -1. */
+static int
+listening(const struct sockaddr *address, socklen_t length)
+{
+	int fd, on = 1;
+
+	if ((fd = socket(address->sa_family,
+		 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (address->sa_family == AF_INET)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, address, length) < 0 || listen(fd, listenBacklog) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* A descriptor of a socket connected to address, or -1. */
+static int
+connected(const struct sockaddr *address, socklen_t length)
+{
+	int fd, error = 0;
+	socklen_t errorLength = sizeof(error);
+
+	if ((fd = socket(address->sa_family,
+		 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(fd, address, length) < 0 &&
+	    (errno != EINPROGRESS || !waitForIO(fd, true) ||
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 ||
+		error != 0)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* The address of a Unix-domain socket at a path, or false if it can't be. */
+static bool
+unixAddress(oop path, struct sockaddr_un &address)
+{
+	std::string name;
+
+	if (!pathOf(path, name) || name.empty() ||
+	    name.size() >= sizeof(address.sun_path))
+		return false;
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, name.c_str(), name.size() + 1);
+	return true;
+}
+
+oop
+vtrt_prim_fdListenOn_(oop self, oop port, bool *failed)
+{
+	struct sockaddr_in address = {};
+
+	if (!VT_isSmi(port.value) || vtrt_smiValue(port) < 0 ||
+	    vtrt_smiValue(port) > 65535) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(vtrt_smiValue(port));
+	return opened(self,
+	    listening((struct sockaddr *)&address, sizeof(address)), failed);
+}
+
+oop
+vtrt_prim_fdConnectTo_port_(oop self, oop host, oop port, bool *failed)
+{
+	struct sockaddr_in address = {};
+	std::string name;
+
+	if (!pathOf(host, name) || !VT_isSmi(port.value) ||
+	    vtrt_smiValue(port) < 1 || vtrt_smiValue(port) > 65535 ||
+	    inet_pton(AF_INET, name.c_str(), &address.sin_addr) != 1) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	address.sin_family = AF_INET;
+	address.sin_port = htons(vtrt_smiValue(port));
+	return opened(self,
+	    connected((struct sockaddr *)&address, sizeof(address)), failed);
+}
+
+oop
+vtrt_prim_fdListenOnPath_(oop self, oop path, bool *failed)
+{
+	struct sockaddr_un address = {};
+
+	return opened(self,
+	    unixAddress(path, address) ?
+		listening((struct sockaddr *)&address, sizeof(address)) :
+		-1,
+	    failed);
+}
+
+oop
+vtrt_prim_fdConnectToPath_(oop self, oop path, bool *failed)
+{
+	struct sockaddr_un address = {};
+
+	return opened(self,
+	    unixAddress(path, address) ?
+		connected((struct sockaddr *)&address, sizeof(address)) :
+		-1,
+	    failed);
+}
+
+/* Answer connection, open on the next connection to the socket self. */
+oop
+vtrt_prim_fdAcceptInto_(oop self, oop connection, bool *failed)
+{
+	int fd;
+
+	while ((fd = accept4(fdOf(self), NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0 &&
+	    waited(fdOf(self), false))
+		;
+	return opened(connection, fd, failed);
+}
+
+oop
+vtrt_prim_fdLocalPort(oop self, bool *failed)
+{
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+
+	if (getsockname(fdOf(self), (struct sockaddr *)&address, &length) < 0 ||
+	    address.sin_family != AF_INET) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(ntohs(address.sin_port));
+}
+
+/* Answers the number of bytes read, up to count; 0 at the end. */
+oop
+vtrt_prim_fdReadInto_startingAt_count_(oop self, oop bytes, oop start,
+    oop count, bool *failed)
+{
+	uint8_t *into;
+	ssize_t n;
+
+	while ((into = bytesAt(bytes, start, count, true)) != NULL &&
+	    (n = read(fdOf(self), into, vtrt_smiValue(count))) < 0 &&
+	    waited(fdOf(self), false))
+		;
+	if (into == NULL || n < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return vtrt_smi(n);
+}
+
+/* Writes all count bytes, waiting for room as need be. */
+oop
+vtrt_prim_fdWrite_startingAt_count_(oop self, oop bytes, oop start,
+    oop count, bool *failed)
+{
+	intptr_t done = 0;
+	uint8_t *from;
+
+	while ((from = bytesAt(bytes, start, count, false)) != NULL &&
+	    done < vtrt_smiValue(count)) {
+		ssize_t n = write(fdOf(self), from + done,
+		    vtrt_smiValue(count) - done);
+
+		if (n >= 0)
+			done += n;
+		else if (!waited(fdOf(self), true))
+			break;
+	}
+	if (from == NULL || done < vtrt_smiValue(count)) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	return count;
+}
+
+oop
+vtrt_prim_fdClose(oop self, bool *failed)
+{
+	int fd = fdOf(self);
+
+	if (fd < 0 || close(fd) < 0) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	FileDescriptorOop(self.ptr)->vns->m_fd = SmiOop::nil();
+	return self;
+}
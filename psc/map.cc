@@ -0,0 +1,86 @@
+/*!
+ * Files mapped into byte objects.
+ *
+ * A mapped file's bytes are the slots of a byte object, outside the heap: the
+ * file is mapped read-only just after a page whose end holds the slots' size
+ * and kind, so the object's header points into the mapping as into any other
+ * slots. Both are read-only, as literals' slots are, and are marked immutable
+ * as theirs are, so that storing into the object fails the primitive rather
+ * than faulting. Pages are read in as they are first touched, and ahead of a
+ * sequential scan, without being copied.
+ *
+ * Nothing is unmapped, there being no collector to say when the object is
+ * gone.
+ */
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "psc.hh"
+#include "runtime.hh"
+
+struct vtrt_slots *
+pscMapFile(const char *path)
+{
+	size_t page = sysconf(_SC_PAGESIZE), size;
+	struct vtrt_slots *slots;
+	struct stat status;
+	char *memory;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &status) < 0 || !S_ISREG(status.st_mode) ||
+	    (memory = (char *)mmap(NULL, page + status.st_size, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) ==
+		MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	size = status.st_size;
+	if ((size != 0 &&
+		mmap(memory + page, size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+		    fd, 0) == MAP_FAILED) ||
+	    mprotect(memory, page, PROT_READ | PROT_WRITE) < 0) {
+		munmap(memory, page + size);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	slots = (struct vtrt_slots *)(memory + page -
+	    offsetof(struct vtrt_slots, oops));
+	slots->size = size;
+	slots->kind = kSlotsBytes;
+	slots->immutable = 1;
+	mprotect(memory, page, PROT_READ);
+	if (size != 0)
+		madvise(memory + page, size, MADV_SEQUENTIAL);
+	return slots;
+}
+
+oop
+vtrt_prim_bytesMapFile_(oop self, oop path, bool *failed)
+{
+	struct vtrt_slots *string, *slots = NULL;
+	oop object;
+
+	if (!VT_isPtr(path.value) || path.ptr == NULL ||
+	    (string = path.ptr->vns) == NULL || string->kind != kSlotsBytes ||
+	    !isBytesClass(ClassOop(self.ptr)) ||
+	    !(slots = pscMapFile(std::string((const char *)string->oops,
+		    string->size)
+				     .c_str()))) {
+		*failed = true;
+		return vtrt_nil;
+	}
+	/* (a header with no slots, given the mapped ones) */
+	object = vtrt_alloc(self, 0, kSlotsOops);
+	object.ptr->vns = slots;
+	return object;
+}
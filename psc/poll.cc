@@ -0,0 +1,96 @@
+/*!
+ * The poller, on epoll.
+ *
+ * Descriptors are watched one-shot, so each readiness wakes its waiter once
+ * and is re-armed by the next wait; a closed descriptor leaves the epoll set by
+ * itself. pscInterrupt() writes an eventfd which is always watched, and which
+ * the poller empties again.
+ *
+ * (io_uring would let regular files be read without blocking a worker too, but
+ * isn't in every kernel this runs on; regular files are always ready, so are
+ * just read.)
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "psc.hh"
+
+/* events taken from the kernel at once */
+static const int maxEvents = 64;
+
+static int epollFd = -1, interruptFd = -1;
+static std::once_flag opened;
+
+static void
+openPoller()
+{
+	struct epoll_event event = {};
+
+	if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    (interruptFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("Runtime: can't make the poller");
+		abort();
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, interruptFd, &event);
+}
+
+static int
+poller()
+{
+	std::call_once(opened, openPoller);
+	return epollFd;
+}
+
+bool
+pscWatch(int fd, bool write, void *waiter)
+{
+	struct epoll_event event = {};
+	int epoll = poller();
+
+	event.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = waiter;
+	if (epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event) == 0)
+		return true;
+	return errno == ENOENT && epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void
+pscPoll(int64_t timeout, void (*ready)(void *waiter))
+{
+	struct epoll_event events[maxEvents];
+	int n;
+
+	/* (rounding up, so as not to wake before a deadline) */
+	n = epoll_wait(poller(), events, maxEvents,
+	    timeout < 0 ? -1 :
+			  (int)std::min<int64_t>((timeout + 999999) / 1000000,
+			      INT_MAX));
+	for (int i = 0; i < n; i++) {
+		uint64_t count;
+
+		if (events[i].data.ptr == NULL)
+			(void)!read(interruptFd, &count, sizeof(count));
+		else
+			ready(events[i].data.ptr);
+	}
+}
+
+void
+pscInterrupt()
+{
+	uint64_t one = 1;
+
+	poller();
+	(void)!write(interruptFd, &one, sizeof(one));
+}
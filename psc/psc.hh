@@ -0,0 +1,36 @@
+/*!
+ * Platform-Specific Code: the interface between the runtime and the system.
+ *
+ * The poller tells the scheduler (libruntime/process.cc) when a descriptor a
+ * Process is waiting on is ready. A waiter is whatever the scheduler passes to
+ * pscWatch(), handed back to it by pscPoll().
+ *
+ * Files can also be mapped as the slots of byte objects (see map.cc).
+ */
+
+#ifndef PSC_HH_
+#define PSC_HH_
+
+#include <cstdint>
+
+struct vtrt_slots;
+
+/*
+ * Hand waiter back from pscPoll() once fd is ready to read (or write), or has
+ * been closed at the other end. A descriptor has one waiter at a time. False
+ * if fd can't be waited on.
+ */
+bool pscWatch(int fd, bool write, void *waiter);
+/*
+ * Wait up to timeout nanoseconds (forever if negative) for descriptors being
+ * watched, calling ready with the waiter of each that is. Returns early if
+ * pscInterrupt() is called, even before.
+ */
+void pscPoll(int64_t timeout, void (*ready)(void *waiter));
+/* Make a thread in pscPoll() return. */
+void pscInterrupt();
+
+/* The bytes of a regular file as read-only, immutable byte slots, or NULL. */
+struct vtrt_slots *pscMapFile(const char *path);
+
+#endif /* PSC_HH_ */
@@ -0,0 +1,167 @@
+/*!
+ * Throughput of scanning a file for a byte pattern, mapped (as
+ * ByteArray class>>mapFile: does) and read through a buffer:
+ * scanbench [file [pattern]]
+ *
+ * Without a file, one of 256 MiB of log lines is written to scan, and removed
+ * after. Each way is timed on its best of a few scans, the file being in the
+ * page cache after the first; both count the occurrences of the pattern, which
+ * must agree.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "psc.hh"
+#include "runtime.hh"
+
+/* the size of the file written to scan */
+static const size_t defaultSize = 256 << 20;
+/* the buffer read through */
+static const size_t bufferSize = 1 << 20;
+static const int nScans = 5;
+
+/* Occurrences of pattern in bytes, not overlapping. */
+static size_t
+count(const uint8_t *bytes, size_t size, const std::string &pattern)
+{
+	const uint8_t *needle = (const uint8_t *)pattern.data();
+	size_t n = 0, from = 0;
+	intptr_t found;
+
+	while ((found = vtrt_bytesFind(bytes + from, size - from, needle,
+		    pattern.size())) >= 0) {
+		n++;
+		from += found + pattern.size();
+	}
+	return n;
+}
+
+static size_t
+scanMapped(const char *path, const std::string &pattern)
+{
+	struct vtrt_slots *slots = pscMapFile(path);
+
+	if (!slots) {
+		perror(path);
+		exit(1);
+	}
+	return count((const uint8_t *)slots->oops, slots->size, pattern);
+}
+
+/*
+ * Each buffer full is scanned after the end of the last, less all but the one
+ * byte of a match it can't have, so none is missed across a boundary.
+ */
+static size_t
+scanRead(const char *path, const std::string &pattern)
+{
+	std::vector<uint8_t> buffer(bufferSize + pattern.size());
+	size_t n = 0, kept = 0;
+	ssize_t got;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	while ((got = read(fd, buffer.data() + kept, bufferSize)) > 0) {
+		size_t size = kept + got, from = 0;
+		intptr_t found;
+
+		while ((found = vtrt_bytesFind(buffer.data() + from,
+			    size - from, (const uint8_t *)pattern.data(),
+			    pattern.size())) >= 0) {
+			n++;
+			from += found + pattern.size();
+		}
+		kept = std::min(size - from, pattern.size() - 1);
+		memmove(buffer.data(), buffer.data() + size - kept, kept);
+	}
+	close(fd);
+	return n;
+}
+
+/* The best rate of scan over path, of size bytes, in bytes per second. */
+template <class Scan>
+static double
+bytesPerSecond(size_t size, size_t &found, Scan scan)
+{
+	typedef std::chrono::steady_clock Clock;
+	double best = 0;
+
+	for (int i = 0; i < nScans; i++) {
+		Clock::time_point start = Clock::now();
+
+		found = scan();
+		best = std::max(best, size /
+			std::chrono::duration<double>(Clock::now() - start)
+			    .count());
+	}
+	return best;
+}
+
+/* Write a file of log lines, one in 100 an error. */
+static void
+writeLog(const char *path, size_t size)
+{
+	FILE *file = fopen(path, "w");
+	size_t written = 0;
+
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	for (unsigned long line = 0; written < size; line++)
+		written += fprintf(file,
+		    "2024-01-01T00:00:%02lu host%lu %s request %lu served\n",
+		    line % 60, line % 16,
+		    line % 100 == 99 ? "ERROR 503" : "INFO 200", line);
+	fclose(file);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char scratch[] = "/tmp/scanbenchXXXXXX";
+	const char *path = argc > 1 ? argv[1] : scratch;
+	std::string pattern = argc > 2 ? argv[2] : "ERROR 503";
+	size_t size, mapped, read;
+	double mapRate, readRate;
+	int fd;
+
+	if (argc < 2) {
+		if ((fd = mkstemp(scratch)) < 0) {
+			perror(scratch);
+			return 1;
+		}
+		close(fd);
+		writeLog(scratch, defaultSize);
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return 1;
+	}
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	mapRate = bytesPerSecond(size, mapped,
+	    [&]() { return scanMapped(path, pattern); });
+	readRate = bytesPerSecond(size, read,
+	    [&]() { return scanRead(path, pattern); });
+	printf("%-8s %12zu bytes %10zu found %8.2f GB/s\n", "mapped", size,
+	    mapped, mapRate / 1e9);
+	printf("%-8s %12zu bytes %10zu found %8.2f GB/s\n", "read", size, read,
+	    readRate / 1e9);
+	if (argc < 2)
+		unlink(scratch);
+	return mapped == read ? 0 : 1;
+}
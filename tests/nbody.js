@@ -0,0 +1,94 @@
+// The n-body benchmark, as tests/nbody.st
+
+var PI = 3.141592653589793
+var SOLAR_MASS = 4 * PI * PI
+var DAYS_PER_YEAR = 365.24
+
+function Body(x, y, z, vx, vy, vz, mass) {
+	this.x = x
+	this.y = y
+	this.z = z
+	this.vx = vx * DAYS_PER_YEAR
+	this.vy = vy * DAYS_PER_YEAR
+	this.vz = vz * DAYS_PER_YEAR
+	this.mass = mass * SOLAR_MASS
+}
+
+var bodies = [
+	// Sun
+	new Body(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0),
+	// Jupiter
+	new Body(4.84143144246472090e+00, -1.16032004402742839e+00,
+	    -1.03622044471123109e-01, 1.66007664274403694e-03,
+	    7.69901118419740425e-03, -6.90460016972063023e-05,
+	    9.54791938424326609e-04),
+	// Saturn
+	new Body(8.34336671824457987e+00, 4.12479856412430479e+00,
+	    -4.03523417114321381e-01, -2.76742510726862411e-03,
+	    4.99852801234917238e-03, 2.30417297573763929e-05,
+	    2.85885980666130812e-04),
+	// Uranus
+	new Body(1.28943695621391310e+01, -1.51111514016986312e+01,
+	    -2.23307578892655734e-01, 2.96460137564761618e-03,
+	    2.37847173959480950e-03, -2.96589568540237556e-05,
+	    4.36624404335156298e-05),
+	// Neptune
+	new Body(1.53796971148509165e+01, -2.59193146099879641e+01,
+	    1.79258772950371181e-01, -2.68067772490389322e-03,
+	    1.62824170038242295e-03, -9.51592254519715870e-05,
+	    5.15138902046611451e-05)
+]
+
+function offsetMomentum() {
+	var px = 0.0, py = 0.0, pz = 0.0
+	for (var i = 0; i < bodies.length; i++) {
+		px += bodies[i].vx * bodies[i].mass
+		py += bodies[i].vy * bodies[i].mass
+		pz += bodies[i].vz * bodies[i].mass
+	}
+	bodies[0].vx = -px / SOLAR_MASS
+	bodies[0].vy = -py / SOLAR_MASS
+	bodies[0].vz = -pz / SOLAR_MASS
+}
+
+function advance(dt) {
+	for (var i = 0; i < bodies.length; i++) {
+		var a = bodies[i]
+		for (var j = i + 1; j < bodies.length; j++) {
+			var b = bodies[j]
+			var dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z
+			var d2 = dx * dx + dy * dy + dz * dz
+			var mag = dt / (d2 * Math.sqrt(d2))
+			a.vx -= dx * b.mass * mag
+			a.vy -= dy * b.mass * mag
+			a.vz -= dz * b.mass * mag
+			b.vx += dx * a.mass * mag
+			b.vy += dy * a.mass * mag
+			b.vz += dz * a.mass * mag
+		}
+	}
+	for (var i = 0; i < bodies.length; i++) {
+		bodies[i].x += dt * bodies[i].vx
+		bodies[i].y += dt * bodies[i].vy
+		bodies[i].z += dt * bodies[i].vz
+	}
+}
+
+function energy() {
+	var e = 0.0
+	for (var i = 0; i < bodies.length; i++) {
+		var a = bodies[i]
+		e += 0.5 * a.mass * (a.vx * a.vx + a.vy * a.vy + a.vz * a.vz)
+		for (var j = i + 1; j < bodies.length; j++) {
+			var b = bodies[j]
+			var dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z
+			e -= a.mass * b.mass / Math.sqrt(dx * dx + dy * dy + dz * dz)
+		}
+	}
+	return e
+}
+
+offsetMomentum()
+for (var i = 0; i < 100000; i++)
+	advance(0.01)
+console.log(energy().toFixed(9))
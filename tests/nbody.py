@@ -0,0 +1,81 @@
+# The n-body benchmark, as tests/nbody.st
+
+PI = 3.141592653589793
+SOLAR_MASS = 4 * PI * PI
+DAYS_PER_YEAR = 365.24
+
+class Body:
+	def __init__(self, x, y, z, vx, vy, vz, mass):
+		self.x, self.y, self.z = x, y, z
+		self.vx = vx * DAYS_PER_YEAR
+		self.vy = vy * DAYS_PER_YEAR
+		self.vz = vz * DAYS_PER_YEAR
+		self.mass = mass * SOLAR_MASS
+
+bodies = [
+	# Sun
+	Body(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0),
+	# Jupiter
+	Body(4.84143144246472090e+00, -1.16032004402742839e+00,
+	    -1.03622044471123109e-01, 1.66007664274403694e-03,
+	    7.69901118419740425e-03, -6.90460016972063023e-05,
+	    9.54791938424326609e-04),
+	# Saturn
+	Body(8.34336671824457987e+00, 4.12479856412430479e+00,
+	    -4.03523417114321381e-01, -2.76742510726862411e-03,
+	    4.99852801234917238e-03, 2.30417297573763929e-05,
+	    2.85885980666130812e-04),
+	# Uranus
+	Body(1.28943695621391310e+01, -1.51111514016986312e+01,
+	    -2.23307578892655734e-01, 2.96460137564761618e-03,
+	    2.37847173959480950e-03, -2.96589568540237556e-05,
+	    4.36624404335156298e-05),
+	# Neptune
+	Body(1.53796971148509165e+01, -2.59193146099879641e+01,
+	    1.79258772950371181e-01, -2.68067772490389322e-03,
+	    1.62824170038242295e-03, -9.51592254519715870e-05,
+	    5.15138902046611451e-05),
+]
+
+def offsetMomentum():
+	px = py = pz = 0.0
+	for b in bodies:
+		px += b.vx * b.mass
+		py += b.vy * b.mass
+		pz += b.vz * b.mass
+	bodies[0].vx = -px / SOLAR_MASS
+	bodies[0].vy = -py / SOLAR_MASS
+	bodies[0].vz = -pz / SOLAR_MASS
+
+def advance(dt):
+	for i in range(len(bodies)):
+		a = bodies[i]
+		for b in bodies[i + 1:]:
+			dx, dy, dz = a.x - b.x, a.y - b.y, a.z - b.z
+			d2 = dx * dx + dy * dy + dz * dz
+			mag = dt / (d2 * d2 ** 0.5)
+			a.vx -= dx * b.mass * mag
+			a.vy -= dy * b.mass * mag
+			a.vz -= dz * b.mass * mag
+			b.vx += dx * a.mass * mag
+			b.vy += dy * a.mass * mag
+			b.vz += dz * a.mass * mag
+	for b in bodies:
+		b.x += dt * b.vx
+		b.y += dt * b.vy
+		b.z += dt * b.vz
+
+def energy():
+	e = 0.0
+	for i in range(len(bodies)):
+		a = bodies[i]
+		e += 0.5 * a.mass * (a.vx * a.vx + a.vy * a.vy + a.vz * a.vz)
+		for b in bodies[i + 1:]:
+			dx, dy, dz = a.x - b.x, a.y - b.y, a.z - b.z
+			e -= a.mass * b.mass / (dx * dx + dy * dy + dz * dz) ** 0.5
+	return e
+
+offsetMomentum()
+for i in range(100000):
+	advance(0.01)
+print("%.9f" % energy())
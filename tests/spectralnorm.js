@@ -0,0 +1,49 @@
+// The spectral-norm benchmark, as tests/spectralnorm.st
+
+function a(i, j) {
+	return 1.0 / ((i + j) * (i + j + 1) / 2 + i + 1)
+}
+
+function multiplyAv(v, av, n) {
+	for (var i = 0; i < n; i++) {
+		var sum = 0.0
+		for (var j = 0; j < n; j++)
+			sum += a(i, j) * v[j]
+		av[i] = sum
+	}
+}
+
+function multiplyAtv(v, atv, n) {
+	for (var i = 0; i < n; i++) {
+		var sum = 0.0
+		for (var j = 0; j < n; j++)
+			sum += a(j, i) * v[j]
+		atv[i] = sum
+	}
+}
+
+function multiplyAtAv(v, atAv, temp, n) {
+	multiplyAv(v, temp, n)
+	multiplyAtv(temp, atAv, n)
+}
+
+function run(n) {
+	var u = [], v = [], temp = []
+	for (var i = 0; i < n; i++) {
+		u.push(1.0)
+		v.push(0.0)
+		temp.push(0.0)
+	}
+	for (var i = 0; i < 10; i++) {
+		multiplyAtAv(u, v, temp, n)
+		multiplyAtAv(v, u, temp, n)
+	}
+	var vBv = 0.0, vv = 0.0
+	for (var i = 0; i < n; i++) {
+		vBv += u[i] * v[i]
+		vv += v[i] * v[i]
+	}
+	return Math.sqrt(vBv / vv)
+}
+
+console.log(run(1000).toFixed(9))
@@ -0,0 +1,50 @@
+-- The spectral-norm benchmark, as tests/spectralnorm.st
+
+local function a(i, j)
+	local ij = i + j - 2
+	return 1.0 / (ij * (ij + 1) // 2 + i)
+end
+
+local function multiplyAv(v, av, n)
+	for i = 1, n do
+		local sum = 0.0
+		for j = 1, n do
+			sum = sum + a(i, j) * v[j]
+		end
+		av[i] = sum
+	end
+end
+
+local function multiplyAtv(v, atv, n)
+	for i = 1, n do
+		local sum = 0.0
+		for j = 1, n do
+			sum = sum + a(j, i) * v[j]
+		end
+		atv[i] = sum
+	end
+end
+
+local function multiplyAtAv(v, atAv, temp, n)
+	multiplyAv(v, temp, n)
+	multiplyAtv(temp, atAv, n)
+end
+
+local function run(n)
+	local u, v, temp = {}, {}, {}
+	for i = 1, n do
+		u[i], v[i], temp[i] = 1.0, 0.0, 0.0
+	end
+	for i = 1, 10 do
+		multiplyAtAv(u, v, temp, n)
+		multiplyAtAv(v, u, temp, n)
+	end
+	local vBv, vv = 0.0, 0.0
+	for i = 1, n do
+		vBv = vBv + u[i] * v[i]
+		vv = vv + v[i] * v[i]
+	end
+	return math.sqrt(vBv / vv)
+end
+
+print(string.format("%.9f", run(1000)))
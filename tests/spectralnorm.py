@@ -0,0 +1,37 @@
+# The spectral-norm benchmark, as tests/spectralnorm.st
+
+def a(i, j):
+	return 1.0 / ((i + j) * (i + j + 1) // 2 + i + 1)
+
+def multiplyAv(v, av, n):
+	for i in range(n):
+		sum = 0.0
+		for j in range(n):
+			sum += a(i, j) * v[j]
+		av[i] = sum
+
+def multiplyAtv(v, atv, n):
+	for i in range(n):
+		sum = 0.0
+		for j in range(n):
+			sum += a(j, i) * v[j]
+		atv[i] = sum
+
+def multiplyAtAv(v, atAv, temp, n):
+	multiplyAv(v, temp, n)
+	multiplyAtv(temp, atAv, n)
+
+def run(n):
+	u = [1.0] * n
+	v = [0.0] * n
+	temp = [0.0] * n
+	for i in range(10):
+		multiplyAtAv(u, v, temp, n)
+		multiplyAtAv(v, u, temp, n)
+	vBv = vv = 0.0
+	for i in range(n):
+		vBv += u[i] * v[i]
+		vv += v[i] * v[i]
+	return (vBv / vv) ** 0.5
+
+print("%.9f" % run(1000))
@@ -11,6 +11,9 @@ using compile_error = std::runtime_error;
 
 NamespaceScope rootScope("", NULL);
 NamespaceScope smalltalkScope("Smalltalk", &rootScope);
+Variable nilVar = { "nil", NULL, Variable::kNil };
+Variable trueVar = { "true", NULL, Variable::kTrue };
+Variable falseVar = { "false", NULL, Variable::kFalse };
 
 /*
  * registration
@@ -59,6 +62,7 @@ LinkupVisitor::visitClass(AST::ClassNode *node)
 	}
 
 	node->m_superClass = super->klass();
+	node->m_superClass->m_subClasses.push_back(node);
 }
 
 /*
@@ -72,17 +76,23 @@ Scope::lookup(std::string name, bool forWrite, bool remoteAccess)
 }
 
 void
-InstanceScope::addIvar(std::string name, int index)
+InstanceScope::addIvar(std::string name, int index, AST::Type *type)
 {
-	instanceVars.emplace_back(InstanceVariable(name, index, this));
+	instanceVars.emplace_back(InstanceVariable(name, index, this, type));
 }
 
 Variable *
 InstanceScope::lookup(std::string name, bool forWrite, bool remoteAccess)
 {
-	if (name == "self") {
+	/* super is self, with lookup starting in the superclass */
+	if (name == "self" || name == "super") {
 		return &selfVar;
-	}
+	} else if (name == "nil")
+		return &nilVar;
+	else if (name == "true")
+		return &trueVar;
+	else if (name == "false")
+		return &falseVar;
 
 	for (auto &ivar : instanceVars) {
 		if (ivar.name == name)
@@ -119,10 +129,13 @@ CodeScope::lookup(std::string name, bool forWrite, bool remoteAccess)
 		}
 	for (auto &local : locals)
 		if (local.name == name) {
-			if (local.kind == Variable::kInlinedBlockLocal)
-				local = *local.real;
-			local.markRemoteAccess(remoteAccess, forWrite);
-			return &local;
+			/* (the entry itself stays, for later lookups) */
+			Variable *var = local.kind == Variable::kInlinedBlockLocal ?
+				  local.real :
+				  &local;
+
+			var->markRemoteAccess(remoteAccess, forWrite);
+			return var;
 		}
 	if (lexicalOuter == NULL) {
 		assert(kind == kMethod);
@@ -136,27 +149,29 @@ CodeScope::lookup(std::string name, bool forWrite, bool remoteAccess)
 }
 
 void
-CodeScope::addArg(std::string name)
+CodeScope::addArg(std::string name, AST::Type *type)
 {
 	arguments.push_back({ name, this, Variable::kArgument });
+	arguments.back().declaredType = type;
 }
 
 void
-CodeScope::addLocal(std::string name)
+CodeScope::addLocal(std::string name, AST::Type *type)
 {
 	locals.push_back({ name, this, Variable::kLocal });
+	locals.back().declaredType = type;
 }
 
 void
-CodeScope::addInlinedBlockLocal(std::string name, bool isArg)
+CodeScope::addInlinedBlockLocal(std::string name, bool isArg, AST::Type *type)
 {
 	assert(kind == kOptimisedBlock);
 	std::string scopeVariableName = "blockLocal" +
 	    std::to_string((uintptr_t)this) + "_" + name;
-	realScope()->addLocal(scopeVariableName);
+	realScope()->addLocal(scopeVariableName, type);
 	(isArg ? arguments : locals)
 	    .push_back({ name, this, Variable::kInlinedBlockLocal,
-		Variable::kNone, realScope()->lookup(scopeVariableName) });
+		Variable::kNone, realScope()->lookup(scopeVariableName), type });
 }
 
 void
@@ -164,13 +179,14 @@ CodeScope::moveRemotelyAccessedToHeapvars()
 {
 	for (auto &arg : arguments)
 		if (arg.remoteAccess == Variable::kWrittenRemotely) {
-			heapvars.push_back(
-			    { arg.name, this, Variable::kHeapvar });
+			heapvars.push_back({ arg.name, this, Variable::kHeapvar,
+			    Variable::kNone, NULL, arg.declaredType });
 		}
 	for (auto &local : locals)
 		if (local.remoteAccess == Variable::kWrittenRemotely) {
-			heapvars.push_back(
-			    { local.name, this, Variable::kHeapvar });
+			heapvars.push_back({ local.name, this,
+			    Variable::kHeapvar, Variable::kNone, NULL,
+			    local.declaredType });
 		}
 }
 
@@ -194,8 +210,8 @@ AnalysisVisitor::visitClass(AST::ClassNode *node)
 	std::cout << "Analyse class " << node->m_name << "\n";
 
 	methodClass = node;
-	node->m_classScope = new InstanceScope(node);
-	node->m_instanceScope = new InstanceScope(node);
+	node->m_classScope = new InstanceScope(node, &smalltalkScope);
+	node->m_instanceScope = new InstanceScope(node, &smalltalkScope);
 
 	for (auto klass = node; klass != NULL; klass = klass->m_superClass) {
 		for (auto ivarIter = klass->m_instanceVars.rbegin();
@@ -209,9 +225,14 @@ AnalysisVisitor::visitClass(AST::ClassNode *node)
 	}
 
 	for (auto &ivar : allIvarDecls)
-		node->m_instanceScope->addIvar(ivar->name, i++);
+		node->m_instanceScope->addIvar(ivar->name, i++, ivar->type);
+	/*
+	 * a class' own slots are numbered separately; the first are the
+	 * ClassDesc fields, as Object declares
+	 */
+	i = 0;
 	for (auto &cvar : allCvarDecls)
-		node->m_classScope->addIvar(cvar->name, i++);
+		node->m_classScope->addIvar(cvar->name, i++, cvar->type);
 
 
 	AST::Visitor::visitClass(node);
@@ -221,12 +242,24 @@ void
 AnalysisVisitor::visitMethod(AST::MethodNode *node)
 {
 	method = node;
+	sendSiteCount = 0;
 	node->m_class = methodClass;
 	node->scope = new CodeScope(node->m_isClassMethod ?
 		methodClass->m_classScope :
 		methodClass->m_instanceScope,
 	    Scope::kMethod);
 	scopeStack.push(node->scope);
+
+	/* a primitive takes the method's arguments */
+	if (!node->m_primitive.empty() &&
+	    (size_t)std::count(node->m_primitive.begin(),
+		node->m_primitive.end(), ':') != node->m_parameters.size()) {
+		std::cerr << node->qualifiedName() << ": primitive <#"
+			  << node->m_primitive << "> doesn't take "
+			  << node->m_parameters.size() << " arguments\n";
+		throw 0;
+	}
+
 	AST::Visitor::visitMethod(node);
 	for (auto &local : node->scope->locals)
 		std::cout << "Local <" << local.name
@@ -238,9 +271,10 @@ void
 AnalysisVisitor::visitParameterDecl(AST::VarDecl &node)
 {
 	if (scopeStack.top()->inOptimisedBlock())
-		scopeStack.top()->addInlinedBlockLocal(node.name, true);
+		scopeStack.top()->addInlinedBlockLocal(node.name, true,
+		    node.type);
 	else
-		scopeStack.top()->addArg(node.name);
+		scopeStack.top()->addArg(node.name, node.type);
 }
 
 void
@@ -249,9 +283,18 @@ AnalysisVisitor::visitLocalDecl(AST::VarDecl &node)
 	std::cout << "add local <" << node.name << ">!\n";
 
 	if (scopeStack.top()->inOptimisedBlock())
-		scopeStack.top()->addInlinedBlockLocal(node.name);
+		scopeStack.top()->addInlinedBlockLocal(node.name, false,
+		    node.type);
 	else
-		scopeStack.top()->addLocal(node.name);
+		scopeStack.top()->addLocal(node.name, node.type);
+}
+
+void
+AnalysisVisitor::visitExprStmt(AST::ExprStmtNode *node)
+{
+	/* (the last statement of a block is visited as its value instead) */
+	discardedExpr = node->expr;
+	AST::Visitor::visitExprStmt(node);
 }
 
 void
@@ -272,9 +315,123 @@ AnalysisVisitor::visitInlinedBlockExpr(AST::BlockExprNode *node)
 	scopeStack.pop();
 }
 
+/* Is the argument a literal block taking nArgs arguments? */
+static bool
+isBlockOf(AST::ExprNode *node, size_t nArgs)
+{
+	auto block = dynamic_cast<AST::BlockExprNode *>(node);
+
+	return block && block->m_args.size() == nArgs;
+}
+
+/* Does an Array loop answer a new Array, so may be fused into another? */
+static bool
+isArrayStage(AST::MessageExprNode *node)
+{
+	return node && node->specialKind == AST::MessageExprNode::kArrayLoop &&
+	    (node->selector == "collect:" || node->selector == "select:" ||
+		node->selector == "reject:");
+}
+
+/*
+ * Can a block be run on many threads at once, each in a copy of its method's
+ * context? So long as it assigns to no variable but its own (and those of the
+ * blocks inlined in it), returns from nothing, and makes no real block.
+ */
+class ParallelBlockChecker : public AST::Visitor {
+	std::vector<CodeScope *> scopes;
+
+	bool isOwn(Variable *var)
+	{
+		for (auto scope : scopes) {
+			for (auto &arg : scope->arguments)
+				if (&arg == var)
+					return true;
+			for (auto &local : scope->locals)
+				if (&local == var || local.real == var)
+					return true;
+		}
+		return false;
+	}
+
+    public:
+	bool safe = true;
+
+	void visitInlinedBlockExpr(AST::BlockExprNode *node)
+	{
+		scopes.push_back(node->scope);
+		AST::Visitor::visitBlockExpr(node);
+	}
+	void visitBlockExpr(AST::BlockExprNode *node) { safe = false; }
+	void visitReturnStmt(AST::ReturnStmtNode *node) { safe = false; }
+	void visitAssignExpr(AST::AssignExprNode *node)
+	{
+		safe &= isOwn(node->left->variable);
+		AST::Visitor::visitAssignExpr(node);
+	}
+};
+
+/*
+ * Is the node (whose receiver has been analysed) an enumeration of an Array
+ * which can be made a loop over its slots? That is so if its blocks are
+ * literals, and its receiver is known to be an Array whose class has Array's
+ * own method for it: for a literal Array, the result of another such loop, or
+ * self, or a variable, declared an Array.
+ */
+bool
+AnalysisVisitor::isArrayLoop(AST::MessageExprNode *node)
+{
+	auto &sel = node->selector;
+	auto ident = dynamic_cast<AST::IdentExprNode *>(node->receiver);
+	auto rcv = dynamic_cast<AST::MessageExprNode *>(node->receiver);
+	NamespaceMemberVariable *member = smalltalkScope.lookup("Array");
+	AST::ClassNode *array, *klass = NULL;
+	AST::MethodNode *target;
+
+	if (!((sel == "do:" || sel == "collect:" || sel == "select:" ||
+		  sel == "reject:" || sel == "detect:" ||
+		  sel == "parallelDo:" || sel == "parallelCollect:") &&
+		isBlockOf(node->args[0], 1)) &&
+	    !(sel == "detect:ifNone:" && isBlockOf(node->args[0], 1) &&
+		isBlockOf(node->args[1], 0)) &&
+	    !((sel == "inject:into:" || sel == "parallelInject:into:") &&
+		isBlockOf(node->args[1], 2)))
+		return false;
+	if (!member || !member->isClass())
+		return false;
+	array = member->klass();
+
+	if (dynamic_cast<AST::ArrayExprNode *>(node->receiver) ||
+	    isArrayStage(rcv) ||
+	    (rcv && rcv->specialKind == AST::MessageExprNode::kArrayLoop &&
+		rcv->selector == "parallelCollect:"))
+		klass = array;
+	else if (ident && ident->variable->kind == Variable::kSelf &&
+	    !method->m_isClassMethod)
+		klass = methodClass;
+	else if (ident && !ident->isSuper() && ident->variable->declaredType &&
+	    ident->variable->declaredType->m_kind == AST::Type::kIdent &&
+	    (member = smalltalkScope.lookup(
+		 ident->variable->declaredType->m_name)) &&
+	    member->isClass())
+		klass = member->klass();
+
+	if (!klass || !klass->isKindOf(array) ||
+	    klass->isOverriddenBelow(sel, false))
+		return false;
+	target = klass->lookupMethod(sel, false);
+	return std::count(array->m_instanceMethods.begin(),
+	    array->m_instanceMethods.end(), target);
+}
+
 void
 AnalysisVisitor::visitMessageExpr(AST::MessageExprNode *node)
 {
+	/*
+	 * Numbered before any transformation, so that sites are named alike
+	 * in an instrumented build and the build reading its profile.
+	 */
+	node->siteIndex = sendSiteCount++;
 	if (node->selector == "ifTrue:ifFalse:" && node->args[0]->isBlock() &&
 	    node->args[1]->isBlock()) {
 		node->specialKind = AST::MessageExprNode::kIfTrueIfFalse;
@@ -286,10 +443,52 @@ AnalysisVisitor::visitMessageExpr(AST::MessageExprNode *node)
 		node->specialKind = AST::MessageExprNode::kToDo;
 		dynamic_cast<AST::BlockExprNode *>(node->args[1])->isInlined =
 		    true;
+	} else if (!node->args.empty() && node->args.back()->isBlock()) {
+		bool discarded = node == discardedExpr;
+
+		/* (the receiver must be known first) */
+		node->receiver->accept(*this);
+		if (isArrayLoop(node)) {
+			auto rcv = dynamic_cast<AST::MessageExprNode *>(
+			    node->receiver);
+
+			node->specialKind = AST::MessageExprNode::kArrayLoop;
+			for (auto arg : node->args)
+				if (arg->isBlock())
+					static_cast<AST::BlockExprNode *>(arg)
+					    ->isInlined = true;
+			/*
+			 * There is no Array for do: to answer if its receiver
+			 * is fused, so then its value mustn't be wanted.
+			 */
+			node->fusesReceiver = isArrayStage(rcv) &&
+			    (node->selector != "do:" || discarded);
+		}
+		for (auto arg : node->args)
+			arg->accept(*this);
+
+		/* (and a block within a real block has no context to copy) */
+		if (node->specialKind == AST::MessageExprNode::kArrayLoop &&
+		    node->selector.compare(0, 8, "parallel") == 0 &&
+		    scopeStack.top()->realScope()->kind == Scope::kMethod) {
+			ParallelBlockChecker checker;
+
+			node->args.back()->accept(checker);
+			node->parallel = checker.safe;
+		}
+		return;
 	}
 	AST::Visitor::visitMessageExpr(node);
 }
 
+void
+AnalysisVisitor::visitPrimitiveExpr(AST::PrimitiveExprNode *node)
+{
+	std::cerr << method->qualifiedName() << ": primitive <#" << node->name
+		  << "> must begin the method, with no arguments\n";
+	throw 0;
+}
+
 void
 AnalysisVisitor::visitAssignExpr(AST::AssignExprNode *node)
 {
@@ -298,6 +497,9 @@ AnalysisVisitor::visitAssignExpr(AST::AssignExprNode *node)
 		std::cerr << "Reference to undeclared name " << node->left->id
 			  << "\n";
 		throw 0;
+	} else if (var->kind >= Variable::kSelf) {
+		std::cerr << "Cannot assign to " << node->left->id << "\n";
+		throw 0;
 	}
 #if 0
 	else if (var->kind == Variable::kArgument) {
@@ -6,6 +6,7 @@
 #ifndef ANALYSE_H_
 #define ANALYSE_H_
 
+#include <deque>
 #include <stack>
 
 #include "ast.hh"
@@ -28,6 +29,9 @@ struct Variable {
 
 		/* pseudos */
 		kSelf,
+		kNil,
+		kTrue,
+		kFalse,
 	} kind;
 
 	/*
@@ -43,6 +47,9 @@ struct Variable {
 	/* for kind = kInlinedBlockLocal, its true variable */
 	Variable *real = NULL;
 
+	/* type annotation from the declaration, if there was one */
+	AST::Type *declaredType = NULL;
+
 	void markRemoteAccess(bool isRemotelyAccessed, bool isWritten);
 };
 
@@ -50,12 +57,14 @@ struct InstanceVariable : public Variable {
 	/* index, 0-based */
 	size_t index;
 
-	InstanceVariable(std::string aName, size_t index, InstanceScope *aScope)
+	InstanceVariable(std::string aName, size_t index, InstanceScope *aScope,
+	    AST::Type *type = NULL)
 	    : index(index)
 	{
 		kind = kInstanceVariable;
 		name = aName;
 		scope = (Scope *)aScope;
+		declaredType = type;
 	};
 };
 
@@ -97,9 +106,16 @@ class Scope {
 	/* only for kMethod scopes. whether a heap context is needed. */
 	bool needsHeapContext = false;
 
-	virtual void addLocal(std::string name) { throw 0; }
-	virtual void addArg(std::string name) { throw 0; }
-	virtual void addInlinedBlockLocal(std::string name, bool isArg = false)
+	virtual void addLocal(std::string name, AST::Type *type = NULL)
+	{
+		throw 0;
+	}
+	virtual void addArg(std::string name, AST::Type *type = NULL)
+	{
+		throw 0;
+	}
+	virtual void addInlinedBlockLocal(std::string name, bool isArg = false,
+	    AST::Type *type = NULL)
 	{
 		throw 0;
 	}
@@ -125,9 +141,10 @@ class InstanceScope : public Scope {
 	Variable selfVar;
 	std::vector<InstanceVariable> instanceVars;
 
-	InstanceScope(AST::ClassNode *cls)
+	/* outerScope is the namespace the class is in */
+	InstanceScope(AST::ClassNode *cls, Scope *outerScope)
 	    : cls(cls)
-	    , Scope(NULL, kClass)
+	    , Scope(outerScope, kClass)
 	{
 		// TODO(ASAP): refactor
 		selfVar.name = "self";
@@ -135,7 +152,7 @@ class InstanceScope : public Scope {
 		selfVar.scope = this;
 	};
 
-	void addIvar(std::string name, int index);
+	void addIvar(std::string name, int index, AST::Type *type = NULL);
 	Variable *lookup(std::string name, bool forWrite = false,
 	    bool remoteAccess = false);
 };
@@ -164,7 +181,11 @@ class NamespaceScope : public Scope {
  */
 class CodeScope : public Scope {
     public:
-	std::vector<Variable> arguments, locals, heapvars;
+	/*
+	 * (deques, as Variables are referred to by pointer and later passes
+	 * may add more locals.)
+	 */
+	std::deque<Variable> arguments, locals, heapvars;
 	/* variables from earlier scopes which must be copied in this scope */
 	std::vector<Variable *> copyingVars;
 	/* scopes whose heapvars must be passed to this scope */
@@ -175,9 +196,10 @@ class CodeScope : public Scope {
 	/* Scope name, used for e.g. struct declarations in the C generator. */
 	std::string name;
 
-	void addLocal(std::string name);
-	void addArg(std::string name);
-	void addInlinedBlockLocal(std::string name, bool isArg);
+	void addLocal(std::string name, AST::Type *type = NULL);
+	void addArg(std::string name, AST::Type *type = NULL);
+	void addInlinedBlockLocal(std::string name, bool isArg,
+	    AST::Type *type = NULL);
 	void moveRemotelyAccessedToHeapvars();
 
 	Variable *lookup(std::string name, bool forWrite = false,
@@ -191,6 +213,10 @@ class CodeScope : public Scope {
 	    : Scope(outerScope, kind) {};
 };
 
+extern NamespaceScope smalltalkScope;
+/* the pseudo-variables nil, true and false */
+extern Variable nilVar, trueVar, falseVar;
+
 class RegistrarVisitor : public AST::Visitor {
 	void visitClass(AST::ClassNode *node);
 };
@@ -202,7 +228,13 @@ class LinkupVisitor : public AST::Visitor {
 class AnalysisVisitor : public AST::Visitor {
 	AST::ClassNode *methodClass;
 	AST::MethodNode *method;
+	/* for numbering the send sites of the method */
+	int sendSiteCount;
 	std::stack<Scope *> scopeStack;
+	/* the expression of the statement being visited, if its value is unused */
+	AST::ExprNode *discardedExpr = NULL;
+
+	bool isArrayLoop(AST::MessageExprNode *node);
 
 	void visitClass(AST::ClassNode *node);
 	void visitMethod(AST::MethodNode *node);
@@ -211,7 +243,7 @@ class AnalysisVisitor : public AST::Visitor {
 	void visitLocalDecl(AST::VarDecl &node);
 
 	//  void visitReturnStmt(AST::ReturnStmtNode *node);
-	//  void visitExprStmt(AST::ExprStmtNode *node);
+	void visitExprStmt(AST::ExprStmtNode *node);
 	void visitBlockExpr(AST::BlockExprNode *node);
 	void visitInlinedBlockExpr(AST::BlockExprNode *node);
 	//  void visitCascadeExpr(AST::CascadeExprNode *node);
@@ -219,6 +251,7 @@ class AnalysisVisitor : public AST::Visitor {
 	void visitAssignExpr(AST::AssignExprNode *node);
 	void visitIdentExpr(AST::IdentExprNode *node);
 	//  void visitIntExpr(AST::IntExprNode *node);
+	void visitPrimitiveExpr(AST::PrimitiveExprNode *node);
 };
 
 class ClosureAnalysisVisitor : public AST::Visitor {
@@ -140,4 +140,68 @@ ClassNode::addMethods(std::vector<MethodNode *> meths)
 			m_instanceMethods.push_back(m);
 }
 
+std::string
+MethodNode::qualifiedName()
+{
+	return m_class->m_name + (m_isClassMethod ? " class" : "") + ">>" +
+	    m_selector;
+}
+
+static MethodNode *
+findIn(std::vector<MethodNode *> &meths, const std::string &selector)
+{
+	for (auto m : meths)
+		if (m->m_selector == selector)
+			return m;
+	return NULL;
+}
+
+MethodNode *
+ClassNode::lookupMethod(const std::string &selector, bool classSide)
+{
+	ClassNode *root = this;
+
+	for (auto klass = this; klass != NULL; klass = klass->m_superClass) {
+		MethodNode *meth = findIn(classSide ? klass->m_classMethods :
+							    klass->m_instanceMethods,
+		    selector);
+		if (meth)
+			return meth;
+		root = klass;
+	}
+
+	/* the root metaclass inherits from the root class */
+	if (classSide)
+		return findIn(root->m_instanceMethods, selector);
+
+	return NULL;
+}
+
+bool
+ClassNode::isOverriddenBelow(const std::string &selector, bool classSide)
+{
+	for (auto sub : m_subClasses)
+		if (findIn(classSide ? sub->m_classMethods :
+					     sub->m_instanceMethods,
+			selector) ||
+		    sub->isOverriddenBelow(selector, classSide))
+			return true;
+	return false;
+}
+
+bool
+ClassNode::isKindOf(ClassNode *klass)
+{
+	for (auto aClass = this; aClass != NULL; aClass = aClass->m_superClass)
+		if (aClass == klass)
+			return true;
+	return false;
+}
+
+bool
+StaticType::is(const std::string &className) const
+{
+	return klass && !classSide && !maybeNil && klass->m_name == className;
+}
+
 }
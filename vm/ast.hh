@@ -1,7 +1,10 @@
 #ifndef AST_H_
 #define AST_H_
 
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <string>
 #include <typeinfo>
 #include <vector>
@@ -61,7 +64,7 @@ struct Token {
 	Token(Position pos, double f)
 	    : m_pos(pos)
 	    , floatValue(f) {};
-	Token(Position pos, int i)
+	Token(Position pos, int64_t i)
 	    : m_pos(pos)
 	    , intValue(i) {};
 	Token(Position pos, const std::string &s)
@@ -80,7 +83,7 @@ struct Token {
 	const Position &pos() const { return m_pos; }
 
 	double floatValue = 0.0;
-	int intValue = 0;
+	int64_t intValue = 0;
 	std::string stringValue;
 };
 
@@ -94,6 +97,12 @@ class MessageExprNode;
 class AssignExprNode;
 class IdentExprNode;
 class IntExprNode;
+class CharExprNode;
+class SymbolExprNode;
+class StringExprNode;
+class FloatExprNode;
+class ArrayExprNode;
+class PrimitiveExprNode;
 class ExprNode;
 class VarDecl;
 
@@ -113,6 +122,12 @@ class Visitor {
 	virtual void visitAssignExpr(AssignExprNode *node);
 	virtual void visitIdentExpr(IdentExprNode *node) {}
 	virtual void visitIntExpr(IntExprNode *node) {}
+	virtual void visitCharExpr(CharExprNode *node) {}
+	virtual void visitSymbolExpr(SymbolExprNode *node) {}
+	virtual void visitStringExpr(StringExprNode *node) {}
+	virtual void visitFloatExpr(FloatExprNode *node) {}
+	virtual void visitArrayExpr(ArrayExprNode *node) {}
+	virtual void visitPrimitiveExpr(PrimitiveExprNode *node) {}
 };
 
 struct Node {
@@ -143,10 +158,38 @@ struct Type {
 		kUnknown
 	} m_kind;
 
+	/* for kIdent, the class named */
+	std::string m_name;
+	/*
+	 * for kIdent, the type arguments (e.g. Array<Symbol>); for kBlock, the
+	 * return type followed by the argument types
+	 */
+	std::vector<Type *> m_args;
 	std::vector<Type *> m_unionMembers;
 
 	Type()
 	    : m_kind(kUnknown) {};
+	Type(std::string name, std::vector<Type *> args)
+	    : m_kind(kIdent)
+	    , m_name(name)
+	    , m_args(args) {};
+};
+
+/*
+ * What is known at compile time of the class of a value: nothing if klass is
+ * NULL; otherwise that it is an instance of klass (of its metaclass, if
+ * classSide) or, unless exact, of some subclass. Unless maybeNil is false, it
+ * may also be nil.
+ */
+struct StaticType {
+	ClassNode *klass = NULL;
+	bool classSide = false;
+	bool exact = false;
+	bool maybeNil = true;
+
+	bool isKnown() const { return klass != NULL; }
+	/* Is the value certainly a (non-nil) instance of the named class? */
+	bool is(const std::string &className) const;
 };
 
 /*
@@ -181,6 +224,9 @@ class ExprNode : public Node {
 	ExprNode(Position pos)
 	    : Node(pos) {};
 
+	/* type inference */
+	StaticType staticType;
+
 	virtual bool isIdent() { return false; };
 	virtual bool isSuper() { return false; };
 	virtual bool isSelf() { return false; };
@@ -206,6 +252,8 @@ struct CharExprNode : public LiteralExprNode {
 	    , khar(aChar)
 	{
 	}
+
+	void accept(Visitor &visitor) { visitor.visitCharExpr(this); }
 };
 
 /* Symbol literal */
@@ -217,17 +265,50 @@ struct SymbolExprNode : public LiteralExprNode {
 	    , sym(aSymbol)
 	{
 	}
+
+	void accept(Visitor &visitor) { visitor.visitSymbolExpr(this); }
 };
 
 /* Integer literal */
 struct IntExprNode : public LiteralExprNode {
-	int num;
+	int64_t num;
+	/* for one beyond 64 bits, its decimal digits (and any -); num is 0 */
+	std::string digits;
 
-	IntExprNode(Position pos, int aNum)
+	IntExprNode(Position pos, int64_t aNum)
 	    : LiteralExprNode(pos)
 	    , num(aNum)
 	{
 	}
+	/* as written, in decimal */
+	IntExprNode(Position pos, const std::string &literal)
+	    : LiteralExprNode(pos)
+	{
+		errno = 0;
+		num = strtoll(literal.c_str(), NULL, 10);
+		if (errno == ERANGE) {
+			num = 0;
+			digits = literal;
+		}
+	}
+
+	/* beyond 64 bits, so held as digits? */
+	bool isWide() const { return !digits.empty(); }
+	/* in range of a SmallInteger, per VT_tagBits in libruntime/vtrt.h? */
+	bool isSmallInteger() const
+	{
+		return !isWide() && num >= INT64_MIN >> 3 &&
+		    num <= INT64_MAX >> 3;
+	}
+	/* else a LargePositiveInteger or LargeNegativeInteger */
+	std::string className() const
+	{
+		bool negative = isWide() ? digits[0] == '-' : num < 0;
+
+		return isSmallInteger() ? "SmallInteger" :
+		    negative		    ? "LargeNegativeInteger" :
+					      "LargePositiveInteger";
+	}
 
 	void accept(Visitor &visitor) { visitor.visitIntExpr(this); }
 };
@@ -241,6 +322,8 @@ struct StringExprNode : public LiteralExprNode {
 	    , str(aString)
 	{
 	}
+
+	void accept(Visitor &visitor) { visitor.visitStringExpr(this); }
 };
 
 /* Integer literal */
@@ -252,6 +335,8 @@ struct FloatExprNode : public LiteralExprNode {
 	    , num(aNum)
 	{
 	}
+
+	void accept(Visitor &visitor) { visitor.visitFloatExpr(this); }
 };
 
 /* Array literal */
@@ -263,6 +348,8 @@ struct ArrayExprNode : public LiteralExprNode {
 	    , elements(exprs)
 	{
 	}
+
+	void accept(Visitor &visitor) { visitor.visitArrayExpr(this); }
 };
 
 struct IdentExprNode : ExprNode {
@@ -270,6 +357,11 @@ struct IdentExprNode : ExprNode {
 
 	/* semantic analysis */
 	Variable * variable;
+	/*
+	 * literal propagation: the constant (see constantValue()) the variable
+	 * is known to hold here, if any
+	 */
+	ExprNode *constant = NULL;
 
 	IdentExprNode(Position pos, std::string id)
 	    : ExprNode(pos)
@@ -287,6 +379,13 @@ struct AssignExprNode : ExprNode {
 	IdentExprNode *left;
 	ExprNode *right;
 
+	/*
+	 * type inference: if the variable has a declared type which the value
+	 * is not proven to conform to, the class to check it against at run
+	 * time
+	 */
+	ClassNode *checkClass = NULL;
+
 	AssignExprNode(IdentExprNode *l, ExprNode *r)
 	    : ExprNode(l->m_pos)
 	    , left(l)
@@ -312,7 +411,79 @@ struct MessageExprNode : ExprNode {
 		 * 	do:<[ ^id, :<SmallInteger> ]
 		 */
 		kToDo,
-	} specialKind;
+		/*
+		 * <Array>#do:/collect:/select:/reject:/detect:[ifNone:]/
+		 * inject:into: with literal blocks, made one loop over the
+		 * Array's slots; see fusesReceiver. Likewise parallelDo:,
+		 * parallelCollect: and parallelInject:into:; see parallel.
+		 */
+		kArrayLoop,
+		/*
+		 * statically-bound send to a small method whose body has been
+		 * spliced in as inlinedBody
+		 */
+		kInlinedSend,
+		/*
+		 * send evaluated at compile time, to foldedTo: a literal, or
+		 * the branch an ifTrue:ifFalse: with a constant condition takes
+		 */
+		kFolded,
+	} specialKind = kNotSpecial;
+
+	/* for kFolded */
+	ExprNode *foldedTo = NULL;
+
+	/*
+	 * for kArrayLoop, whether the receiver (itself a collect:, select: or
+	 * reject: loop) is fused into this one, its blocks run on each element
+	 * before ours and no Array made of its results
+	 */
+	bool fusesReceiver = false;
+	/*
+	 * for a kArrayLoop parallelDo: etc., whether its block can be run on
+	 * the worker pool; else the loop is run as do: etc. would be
+	 */
+	bool parallel = false;
+
+	/* for kInlinedSend */
+	MethodNode *inlinedMethod = NULL;
+	BlockExprNode *inlinedBody = NULL;
+	/* temporary bound to the receiver, or NULL if the receiver is self */
+	Variable *inlinedSelf = NULL;
+	/*
+	 * type inference: the class to check the inlined body's value against,
+	 * as the method's return would be, if its declared type isn't proven
+	 */
+	ClassNode *inlinedCheckClass = NULL;
+	/*
+	 * if the inlining is speculative (from profile feedback), the class
+	 * the receiver must be of for the inlined body to be used
+	 */
+	ClassNode *guardClass = NULL;
+
+	/* ordinal of this send within its method; -1 for synthesised sends */
+	int siteIndex = -1;
+
+	/* type inference: the method invoked, if proven from the receiver */
+	MethodNode *directTarget = NULL;
+	/*
+	 * type inference: an arithmetic operation or comparison whose operands
+	 * are both proven SmallIntegers (or are themselves such operations)
+	 */
+	bool unboxedSmi = false;
+	/*
+	 * type inference: an arithmetic operation, comparison or sqrt on Floats
+	 * (or on a Float and a SmallInteger), or on such operations
+	 */
+	bool unboxedFloat = false;
+	/*
+	 * type inference: a send of the selector of the method it is in, which
+	 * may reenter that method - as it will if directTarget is the method,
+	 * else if the receiver is of exactly the method's class
+	 */
+	bool selfRecursive = false;
+	/* ... which is returned from directly, so can reuse its context */
+	bool tailCall = false;
 
 	MessageExprNode(ExprNode *receiver, std::string selector,
 	    std::vector<ExprNode *> args = {})
@@ -337,6 +508,26 @@ struct MessageExprNode : ExprNode {
 	void accept(Visitor &visitor) { visitor.visitMessageExpr(this); }
 };
 
+/*!
+ * A primitive, <#name args...>. As the first statement of a method, with no
+ * arguments, it declares the method a primitive method; nothing else is yet
+ * supported.
+ */
+struct PrimitiveExprNode : ExprNode {
+	std::string name;
+	std::vector<ExprNode *> args;
+
+	PrimitiveExprNode(Position pos, std::string name,
+	    std::vector<ExprNode *> args)
+	    : ExprNode(pos)
+	    , name(name)
+	    , args(args)
+	{
+	}
+
+	void accept(Visitor &visitor) { visitor.visitPrimitiveExpr(this); }
+};
+
 struct CascadeExprNode : ExprNode {
 	ExprNode *receiver;
 	std::vector<MessageExprNode *> messages;
@@ -403,6 +594,8 @@ struct ExprStmtNode : public StmtNode {
 struct ReturnStmtNode : public StmtNode {
 	ExprNode *expr;
 	bool isNonLocalReturn = false;
+	/* type inference: as for AssignExprNode, for a declared return type */
+	ClassNode *checkClass = NULL;
 
 	ReturnStmtNode(ExprNode *e)
 	    : StmtNode(e->m_pos)
@@ -424,10 +617,19 @@ class MethodNode : public DeclNode {
 	std::vector<VarDecl> m_parameters;
 	std::vector<VarDecl> m_locals;
 	std::vector<StmtNode *> m_statements;
+	/* declared return type, or NULL */
+	Type *m_returnType = NULL;
+	/*
+	 * primitive implementing the method, if any; its statements are then
+	 * run only if the primitive fails
+	 */
+	std::string m_primitive;
 
 	/* semantic analysis */
 	ClassNode *m_class;
 	CodeScope * scope;
+	/* type inference: does it contain any tailCall sends? */
+	bool hasTailCalls = false;
 
 	MethodNode(bool isClassMethod, std::string selector,
 	    std::vector<VarDecl> parameters, std::vector<VarDecl> locals,
@@ -440,6 +642,9 @@ class MethodNode : public DeclNode {
 	    , m_statements(statements) {};
 
 	void accept(Visitor &visitor) { visitor.visitMethod(this); }
+
+	/* e.g. "Point>>x" or "Point class>>new" */
+	std::string qualifiedName();
 };
 
 /*!
@@ -457,7 +662,9 @@ class ClassNode : public DeclNode {
 
 	/* -- decorations after semantic analysis -- */
 	/* The superclass node, if there is one. */
-	ClassNode * m_superClass;
+	ClassNode * m_superClass = NULL;
+	/* Classes directly inheriting from this one. */
+	std::vector<ClassNode *> m_subClasses;
 	/* Name scopes for class methods and instance methods. */
 	InstanceScope * m_classScope,*  m_instanceScope;
 
@@ -474,6 +681,15 @@ class ClassNode : public DeclNode {
 
 	void addMethods(std::vector<MethodNode *> meths);
 
+	/*
+	 * Find the method which a send of selector to an instance of this
+	 * class (or, if classSide, to the class itself) will invoke.
+	 */
+	MethodNode *lookupMethod(const std::string &selector, bool classSide);
+	/* Does any subclass (transitively) define selector on the given side? */
+	bool isOverriddenBelow(const std::string &selector, bool classSide);
+	/* Is this class the given one, or (transitively) a subclass of it? */
+	bool isKindOf(ClassNode *klass);
 };
 
 } /* namespace AST */
@@ -0,0 +1,384 @@
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+#include "analyse.hh"
+#include "ast.hh"
+#include "fold.hh"
+
+/*
+ * constants
+ */
+AST::ExprNode *
+constantValue(AST::ExprNode *node)
+{
+	if (auto ident = dynamic_cast<AST::IdentExprNode *>(node)) {
+		switch (ident->variable->kind) {
+		case Variable::kNil:
+		case Variable::kTrue:
+		case Variable::kFalse:
+			return ident;
+		default:
+			return ident->constant;
+		}
+	} else if (auto msg = dynamic_cast<AST::MessageExprNode *>(node)) {
+		if (msg->specialKind == AST::MessageExprNode::kFolded)
+			return constantValue(msg->foldedTo);
+	} else if (auto block = dynamic_cast<AST::BlockExprNode *>(node)) {
+		AST::ExprStmtNode *stmt;
+
+		/* the branch taken by a folded ifTrue:ifFalse: */
+		if (block->isInlined && block->m_stmts.size() == 1 &&
+		    (stmt = dynamic_cast<AST::ExprStmtNode *>(
+			 block->m_stmts.front())))
+			return constantValue(stmt->expr);
+	} else if (dynamic_cast<AST::IntExprNode *>(node) ||
+	    dynamic_cast<AST::FloatExprNode *>(node) ||
+	    dynamic_cast<AST::SymbolExprNode *>(node))
+		return node;
+
+	return NULL;
+}
+
+static AST::ExprNode *
+boolean(AST::Position pos, bool value)
+{
+	auto ident = new AST::IdentExprNode(pos, value ? "true" : "false");
+	ident->variable = value ? &trueVar : &falseVar;
+	return ident;
+}
+
+static AST::ExprNode *
+integer(AST::Position pos, int64_t value)
+{
+	/* (out of SmallInteger range, a LargeInteger literal) */
+	return new AST::IntExprNode(pos, value);
+}
+
+static AST::ExprNode *
+foldInteger(AST::Position pos, int64_t a, const std::string &sel, int64_t b)
+{
+	bool divisible = b != 0 && !(a == INT64_MIN && b == -1);
+	int64_t result;
+
+	if (sel == "+")
+		return __builtin_add_overflow(a, b, &result) ?
+			  NULL :
+			  integer(pos, result);
+	else if (sel == "-")
+		return __builtin_sub_overflow(a, b, &result) ?
+			  NULL :
+			  integer(pos, result);
+	else if (sel == "*")
+		return __builtin_mul_overflow(a, b, &result) ?
+			  NULL :
+			  integer(pos, result);
+	/*
+	 * Division by zero is left for the real send to signal, as is the one
+	 * quotient beyond 64 bits for it to make a LargeInteger of.
+	 */
+	else if (sel == "//" && divisible) {
+		result = a / b;
+		if (a % b != 0 && (a < 0) != (b < 0))
+			result--;
+		return integer(pos, result);
+	} else if (sel == "\\\\" && divisible) {
+		result = a % b;
+		if (result != 0 && (result < 0) != (b < 0))
+			result += b;
+		return integer(pos, result);
+	} else if (sel == "/" && divisible && a % b == 0)
+		return integer(pos, a / b);
+	else if (sel == "bitAnd:")
+		return integer(pos, a & b);
+	else if (sel == "bitOr:")
+		return integer(pos, a | b);
+	else if (sel == "bitXor:")
+		return integer(pos, a ^ b);
+	else if (sel == "max:")
+		return integer(pos, a > b ? a : b);
+	else if (sel == "min:")
+		return integer(pos, a < b ? a : b);
+	else if (sel == "<")
+		return boolean(pos, a < b);
+	else if (sel == ">")
+		return boolean(pos, a > b);
+	else if (sel == "<=")
+		return boolean(pos, a <= b);
+	else if (sel == ">=")
+		return boolean(pos, a >= b);
+	else if (sel == "=" || sel == "==")
+		return boolean(pos, a == b);
+	else if (sel == "~=" || sel == "~~")
+		return boolean(pos, a != b);
+	return NULL;
+}
+
+static AST::ExprNode *
+foldFloat(AST::Position pos, double a, const std::string &sel, double b)
+{
+	if (sel == "+")
+		return new AST::FloatExprNode(pos, a + b);
+	else if (sel == "-")
+		return new AST::FloatExprNode(pos, a - b);
+	else if (sel == "*")
+		return new AST::FloatExprNode(pos, a * b);
+	else if (sel == "/" && b != 0.0)
+		return new AST::FloatExprNode(pos, a / b);
+	else if (sel == "<")
+		return boolean(pos, a < b);
+	else if (sel == ">")
+		return boolean(pos, a > b);
+	else if (sel == "<=")
+		return boolean(pos, a <= b);
+	else if (sel == ">=")
+		return boolean(pos, a >= b);
+	else if (sel == "=")
+		return boolean(pos, a == b);
+	else if (sel == "~=")
+		return boolean(pos, a != b);
+	return NULL;
+}
+
+/* Is node the constant true or false? If so, which is it? */
+static bool
+isBoolean(AST::ExprNode *node, bool &value)
+{
+	auto ident = dynamic_cast<AST::IdentExprNode *>(node);
+
+	if (!ident || (ident->variable->kind != Variable::kTrue &&
+			  ident->variable->kind != Variable::kFalse))
+		return false;
+	value = ident->variable->kind == Variable::kTrue;
+	return true;
+}
+
+/*
+ * Evaluate a send of sel to the constant rcv, with the constant argument arg
+ * (if sel isn't unary), returning its value, or NULL if it can't be.
+ */
+static AST::ExprNode *
+evaluate(AST::Position pos, AST::ExprNode *rcv, const std::string &sel,
+    AST::ExprNode *arg)
+{
+	auto rcvInt = dynamic_cast<AST::IntExprNode *>(rcv);
+	auto rcvFloat = dynamic_cast<AST::FloatExprNode *>(rcv);
+	auto rcvSym = dynamic_cast<AST::SymbolExprNode *>(rcv);
+	bool rcvBool, argBool;
+
+	if (sel == "isNil" || sel == "notNil") {
+		auto ident = dynamic_cast<AST::IdentExprNode *>(rcv);
+		bool isNil = ident && ident->variable->kind == Variable::kNil;
+		return boolean(pos, isNil == (sel == "isNil"));
+	}
+
+	/* (those beyond 64 bits are left to the runtime) */
+	if (rcvInt && rcvInt->isWide())
+		return NULL;
+	else if (!arg) {
+		if (rcvInt && rcvInt->num == INT64_MIN)
+			return NULL;
+		else if (rcvInt && sel == "negated")
+			return integer(pos, -rcvInt->num);
+		else if (rcvInt && sel == "abs")
+			return integer(pos, std::abs(rcvInt->num));
+		else if (isBoolean(rcv, rcvBool) && sel == "not")
+			return boolean(pos, !rcvBool);
+		return NULL;
+	}
+
+	auto argInt = dynamic_cast<AST::IntExprNode *>(arg);
+	auto argFloat = dynamic_cast<AST::FloatExprNode *>(arg);
+	auto argSym = dynamic_cast<AST::SymbolExprNode *>(arg);
+
+	if (argInt && argInt->isWide())
+		return NULL;
+	else if (rcvInt && argInt)
+		return foldInteger(pos, rcvInt->num, sel, argInt->num);
+	else if ((rcvInt || rcvFloat) && (argInt || argFloat))
+		return foldFloat(pos, rcvInt ? rcvInt->num : rcvFloat->num, sel,
+		    argInt ? argInt->num : argFloat->num);
+	else if (rcvSym && argSym) {
+		if (sel == "=" || sel == "==")
+			return boolean(pos, rcvSym->sym == argSym->sym);
+		else if (sel == "~=" || sel == "~~")
+			return boolean(pos, rcvSym->sym != argSym->sym);
+	} else if (isBoolean(rcv, rcvBool) && isBoolean(arg, argBool)) {
+		if (sel == "&")
+			return boolean(pos, rcvBool && argBool);
+		else if (sel == "|")
+			return boolean(pos, rcvBool || argBool);
+		else if (sel == "=" || sel == "==")
+			return boolean(pos, rcvBool == argBool);
+		else if (sel == "~=" || sel == "~~")
+			return boolean(pos, rcvBool != argBool);
+	}
+	return NULL;
+}
+
+/*
+ * the pass
+ */
+class AssignmentCounter : public AST::Visitor {
+	std::map<Variable *, int> &counts;
+
+    public:
+	AssignmentCounter(std::map<Variable *, int> &counts)
+	    : counts(counts)
+	{
+	}
+
+	void visitMessageExpr(AST::MessageExprNode *node)
+	{
+		AST::Visitor::visitMessageExpr(node);
+		if (node->specialKind == AST::MessageExprNode::kInlinedSend)
+			node->inlinedBody->accept(*this);
+	}
+
+	void visitAssignExpr(AST::AssignExprNode *node)
+	{
+		counts[node->left->variable]++;
+		AST::Visitor::visitAssignExpr(node);
+	}
+};
+
+void
+ConstantFoldingVisitor::bind(Variable *var, AST::ExprNode *value)
+{
+	AST::ExprNode *constant = constantValue(value);
+
+	/* (any send may change an instance variable) */
+	if (var->kind == Variable::kInstanceVariable)
+		return;
+	if (constant && assignmentCounts[var] <= 1)
+		constants[var] = constant;
+}
+
+void
+ConstantFoldingVisitor::fold(AST::MessageExprNode *node)
+{
+	AST::ExprNode *rcv, *arg = NULL, *result;
+
+	if (!(rcv = constantValue(node->receiver)) || node->args.size() > 1 ||
+	    (node->args.size() == 1 && !(arg = constantValue(node->args[0]))))
+		return;
+
+	if ((result = evaluate(node->m_pos, rcv, node->selector, arg))) {
+		node->specialKind = AST::MessageExprNode::kFolded;
+		node->foldedTo = result;
+	}
+}
+
+void
+ConstantFoldingVisitor::visitMethod(AST::MethodNode *node)
+{
+	AssignmentCounter counter(assignmentCounts);
+
+	assignmentCounts.clear();
+	constants.clear();
+	conditionalDepth = 0;
+
+	for (auto stmt : node->m_statements)
+		stmt->accept(counter);
+	AST::Visitor::visitMethod(node);
+}
+
+void
+ConstantFoldingVisitor::visitBlockExpr(AST::BlockExprNode *node)
+{
+	conditionalDepth++;
+	AST::Visitor::visitBlockExpr(node);
+	conditionalDepth--;
+}
+
+void
+ConstantFoldingVisitor::visitInlinedBlockExpr(AST::BlockExprNode *node)
+{
+	conditionalDepth++;
+	AST::Visitor::visitBlockExpr(node);
+	conditionalDepth--;
+}
+
+void
+ConstantFoldingVisitor::visitMessageExpr(AST::MessageExprNode *node)
+{
+	switch (node->specialKind) {
+	case AST::MessageExprNode::kIfTrueIfFalse: {
+		bool condition;
+
+		node->receiver->accept(*this);
+		if (!isBoolean(constantValue(node->receiver), condition)) {
+			for (auto arg : node->args)
+				arg->accept(*this);
+			return;
+		}
+
+		/* the branch taken runs just once; the other, never */
+		auto branch = static_cast<AST::BlockExprNode *>(
+		    node->args[condition ? 0 : 1]);
+		AST::Visitor::visitBlockExpr(branch);
+		node->specialKind = AST::MessageExprNode::kFolded;
+		node->foldedTo = branch;
+		return;
+	}
+
+	case AST::MessageExprNode::kInlinedSend: {
+		auto body = node->inlinedBody;
+		size_t firstArg = 0;
+		bool pure = true;
+
+		AST::Visitor::visitMessageExpr(node);
+		/* the temporaries are bound once, before the body is run */
+		if (node->inlinedSelf) {
+			bind(node->inlinedSelf, node->receiver);
+			firstArg = 1;
+		}
+		for (size_t i = 0; i < node->args.size(); i++)
+			bind(&body->scope->arguments[firstArg + i],
+			    node->args[i]);
+		AST::Visitor::visitBlockExpr(body);
+
+		/*
+		 * If the body reduced to a constant, and evaluating the
+		 * receiver and arguments can have no effect, so may the send.
+		 */
+		pure = !node->guardClass && body->m_stmts.size() == 1;
+		pure &= constantValue(node->receiver) ||
+		    dynamic_cast<AST::IdentExprNode *>(node->receiver);
+		for (auto arg : node->args)
+			pure &= constantValue(arg) ||
+			    dynamic_cast<AST::IdentExprNode *>(arg);
+		if (pure && constantValue(body)) {
+			node->specialKind = AST::MessageExprNode::kFolded;
+			node->foldedTo = constantValue(body);
+		}
+		return;
+	}
+
+	case AST::MessageExprNode::kNotSpecial:
+		AST::Visitor::visitMessageExpr(node);
+		fold(node);
+		return;
+
+	default:
+		AST::Visitor::visitMessageExpr(node);
+	}
+}
+
+void
+ConstantFoldingVisitor::visitAssignExpr(AST::AssignExprNode *node)
+{
+	/* (not the variable assigned, which is no use of its value) */
+	node->right->accept(*this);
+	if (conditionalDepth == 0)
+		bind(node->left->variable, node->right);
+}
+
+void
+ConstantFoldingVisitor::visitIdentExpr(AST::IdentExprNode *node)
+{
+	auto constant = constants.find(node->variable);
+
+	if (constant != constants.end())
+		node->constant = constant->second;
+}
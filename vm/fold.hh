@@ -0,0 +1,62 @@
+/*!
+ * Constant folding and literal propagation.
+ */
+
+#ifndef FOLD_H_
+#define FOLD_H_
+
+#include <map>
+
+#include "analyse.hh"
+#include "ast.hh"
+
+/*!
+ * Evaluates at compile time those sends whose receiver and arguments are all
+ * constants - SmallInteger, Float and Symbol literals, true, false and nil -
+ * and whose result is, such as `3 + 4`, `1.5 * 2` or `#a == #b`; and reduces
+ * an ifTrue:ifFalse: whose condition is constant to the branch it takes.
+ *
+ * The arithmetic and comparison selectors of the literal classes are assumed
+ * to have their usual meanings, as for the special selectors of any Smalltalk
+ * compiler. Arithmetic whose result doesn't fit in a SmallInteger is not
+ * folded, and so remains a real send.
+ *
+ * Constants are propagated through locals (and the temporaries of inlined
+ * sends) assigned just once, unconditionally: reads of them which follow the
+ * assignment are marked with the constant.
+ *
+ * Folded sends become kFolded, with foldedTo what they evaluate to. This runs
+ * after inlining, so that the bodies of inlined sends are folded in their
+ * callers' contexts, and before type inference, which then sees the results.
+ */
+class ConstantFoldingVisitor : public AST::Visitor {
+	/* how many times each variable is assigned within the method */
+	std::map<Variable *, int> assignmentCounts;
+	/* constants which variables assigned just once are known to hold */
+	std::map<Variable *, AST::ExprNode *> constants;
+	/*
+	 * how many blocks, which may not run or may run repeatedly, we are
+	 * within
+	 */
+	int conditionalDepth;
+
+	/* Note the binding of a value to a variable. */
+	void bind(Variable *var, AST::ExprNode *value);
+	void fold(AST::MessageExprNode *node);
+
+	void visitMethod(AST::MethodNode *node);
+	void visitBlockExpr(AST::BlockExprNode *node);
+	void visitInlinedBlockExpr(AST::BlockExprNode *node);
+	void visitMessageExpr(AST::MessageExprNode *node);
+	void visitAssignExpr(AST::AssignExprNode *node);
+	void visitIdentExpr(AST::IdentExprNode *node);
+};
+
+/*!
+ * The constant an expression is known to evaluate to, if it does so without
+ * side effects; else NULL. A constant is an IntExprNode, FloatExprNode or
+ * SymbolExprNode, or an IdentExprNode for true, false or nil.
+ */
+AST::ExprNode *constantValue(AST::ExprNode *node);
+
+#endif /* FOLD_H_ */
@@ -1,12 +1,19 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <fstream>
 
 #include "analyse.hh"
 #include "ast.hh"
+#include "fold.hh"
 #include "generate.hh"
+#include "options.hh"
+#include "profile.hh"
+#include "typecheck.hh"
 
 void
 generateScopeName(Scope *scope, std::string &name)
@@ -32,13 +39,405 @@ useCrossesBlock(Scope *useScope, Scope *defScope)
 	return false;
 }
 
+/*
+ * A selector made part of a C identifier: colons become underscores, and the
+ * characters of a binary selector are spelt out, so #<= is _less_equal.
+ */
 std::string
 escape(std::string string)
 {
-	std::replace_if(
-	    string.begin(), string.end(),
-	    [](std::string::value_type v) { return v == ':'; }, '_');
-	return string;
+	static const std::map<char, const char *> binaryChars = {
+		{ '+', "plus" }, { '-', "minus" }, { '*', "star" },
+		{ '/', "slash" }, { '\\', "backslash" }, { '<', "less" },
+		{ '>', "greater" }, { '=', "equal" }, { '~', "tilde" },
+		{ '@', "at" }, { '%', "percent" }, { '|', "bar" },
+		{ '&', "and" }, { '?', "query" }, { ',', "comma" },
+	};
+	std::string result;
+
+	for (char c : string) {
+		auto name = binaryChars.find(c);
+
+		if (c == ':')
+			result += '_';
+		else if (name != binaryChars.end())
+			result += std::string("_") + name->second;
+		else
+			result += c;
+	}
+	return result;
+}
+
+/* A C string literal of some bytes. */
+std::string
+cString(const std::string &string)
+{
+	std::string result = "\"";
+	char octal[5];
+
+	for (unsigned char c : string) {
+		if (c == '"' || c == '\\')
+			result += std::string("\\") + (char)c;
+		else if (c >= ' ' && c < 0x7f)
+			result += c;
+		else {
+			snprintf(octal, sizeof octal, "\\%03o", c);
+			result += octal;
+		}
+	}
+	return result + "\"";
+}
+
+std::string
+methodFunctionName(AST::MethodNode *method)
+{
+	return (method->m_isClassMethod ? "_c_" : "_i_") +
+	    method->m_class->m_name + "__" + escape(method->m_selector);
+}
+
+/*
+ * The C function of a primitive method's Smalltalk code alone, which its
+ * function calls if the primitive fails, as do sends inlining the primitive.
+ */
+static std::string
+fallbackFunctionName(AST::MethodNode *method)
+{
+	return methodFunctionName(method) + "__fallback";
+}
+
+/* The C function implementing a primitive, as named in libruntime/vtrt.h. */
+std::string
+primitiveFunctionName(const std::string &primitive)
+{
+	return "vtrt_prim_" + escape(primitive);
+}
+
+/* Are the indexed slots of the class's instances bytes? */
+static bool
+isBytesClass(AST::ClassNode *klass)
+{
+	for (; klass != NULL; klass = klass->m_superClass)
+		if (klass->m_kind == AST::ClassNode::kBytes)
+			return true;
+	return false;
+}
+
+/*
+ * Encode a Float as immediate, if it can be; as vtrt_immediateFloat() in
+ * libruntime/vtrt.h.
+ */
+static bool
+immediateFloat(double value, uint64_t &encoded)
+{
+	static const uint64_t exponentOffset = 896;
+	uint64_t bits;
+	unsigned exponent;
+
+	memcpy(&bits, &value, sizeof bits);
+	exponent = (bits >> 52) & 0x7ff;
+	if ((exponent <= exponentOffset || exponent >= exponentOffset + 256) &&
+	    (bits << 1) != 0)
+		return false;
+
+	bits = bits << 1 | bits >> 63;
+	if (bits > 1)
+		bits -= exponentOffset << 53;
+	encoded = bits << 3 | 2;
+	return true;
+}
+
+/*
+ * The magnitude of an integer literal, as 64-bit limbs, least significant
+ * first, as libruntime/largeint.cc holds it.
+ */
+static std::vector<uint64_t>
+integerMagnitude(AST::IntExprNode *integer)
+{
+	std::vector<uint64_t> limbs;
+
+	if (!integer->isWide()) {
+		limbs.push_back(integer->num < 0 ? -(uint64_t)integer->num :
+						   (uint64_t)integer->num);
+		return limbs;
+	}
+	/* (times ten plus each digit in turn) */
+	for (char digit : integer->digits) {
+		unsigned __int128 carry;
+
+		if (digit == '-')
+			continue;
+		carry = digit - '0';
+		for (auto &limb : limbs) {
+			carry += (unsigned __int128)limb * 10;
+			limb = (uint64_t)carry;
+			carry >>= 64;
+		}
+		if (carry != 0)
+			limbs.push_back((uint64_t)carry);
+	}
+	return limbs;
+}
+
+/* A double as a C literal, in hexadecimal to have exactly the same value. */
+static std::string
+doubleLiteral(double value)
+{
+	char literal[32];
+
+	snprintf(literal, sizeof literal, "%a", value);
+	return literal;
+}
+
+std::string
+methodSignature(AST::MethodNode *method, const std::string &name)
+{
+	std::string sig = "Oop " + name + "(void *__sender, Oop __self";
+	for (auto &param : method->m_parameters)
+		sig += ", Oop " + param.name;
+	return sig + ")";
+}
+
+std::string
+CodeGeneratorVisitor::genSendSite(AST::MessageExprNode *node)
+{
+	sendSites.push_back({ method->qualifiedName(), node->siteIndex,
+	    node->selector });
+	return "&__sendSites[" + std::to_string(sendSites.size() - 1) + "]";
+}
+
+std::string
+CodeGeneratorVisitor::genGlobalReference(std::string name)
+{
+	auto it = std::find(globalNames.begin(), globalNames.end(), name);
+	size_t index;
+
+	if (it != globalNames.end())
+		index = it - globalNames.begin();
+	else {
+		index = globalNames.size();
+		globalNames.push_back(name);
+	}
+
+	return "__globalReferences[" + std::to_string(index) + "].value";
+}
+
+std::string
+CodeGeneratorVisitor::genLiteralObject(const std::string &key,
+    std::string name, const std::string &className,
+    const std::string &slotsType, const std::string &slots, bool isConst)
+{
+	auto it = literalNames.find(key);
+
+	if (it != literalNames.end())
+		return it->second;
+
+	if (name.empty())
+		name = "__literal" + std::to_string(literalCount++);
+	literalsOut << "static " << (isConst ? "const " : "") << slotsType << " "
+		    << name << "_slots = " << slots << ";\n";
+	literalsOut << "static struct vtrt_objectHeader " << name
+		    << " = { { 0 }, (struct vtrt_slots *)&" << name
+		    << "_slots };\n";
+	literals.push_back({ name, className });
+	return literalNames[key] = name;
+}
+
+/* The Unicode code point of a Character literal. */
+static uint32_t
+codePoint(AST::CharExprNode *node)
+{
+	unsigned char c = node->khar[0];
+	uint32_t value = c;
+	size_t more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+
+	/* the character may be UTF-8 encoded */
+	if (more) {
+		value = c & (0x3f >> more);
+		for (size_t i = 1; i <= more && i < node->khar.size(); i++)
+			value = value << 6 | (node->khar[i] & 0x3f);
+	}
+	return value;
+}
+
+std::string
+CodeGeneratorVisitor::genLiteralElement(AST::ExprNode *node,
+    const std::string &slot, bool &isConst)
+{
+	auto number = dynamic_cast<AST::FloatExprNode *>(node);
+	auto integer = dynamic_cast<AST::IntExprNode *>(node);
+	uint64_t encoded;
+
+	if (integer && integer->isSmallInteger())
+		return "{ .value = " +
+		    std::to_string(((uint64_t)integer->num << 3) | 1) + "u }";
+	else if (number && immediateFloat(number->num, encoded))
+		return "{ .value = " + std::to_string(encoded) + "u }";
+	else if (auto character = dynamic_cast<AST::CharExprNode *>(node))
+		return "{ .value = " +
+		    std::to_string(((uint64_t)codePoint(character) << 3) | 3) +
+		    "u }";
+	else if (auto symbol = dynamic_cast<AST::SymbolExprNode *>(node)) {
+		/* Symbols are unique, so interned at link time */
+		literalSymbols.push_back({ slot, symbol->sym });
+		isConst = false;
+		return "{ 0 }";
+	}
+	return "{ .ptr = (vtrt_memoop_t)&" +
+	    genLiteral(static_cast<AST::LiteralExprNode *>(node)) + " }";
+}
+
+std::string
+CodeGeneratorVisitor::genLiteral(AST::LiteralExprNode *node)
+{
+	std::stringstream slots;
+
+	if (auto string = dynamic_cast<AST::StringExprNode *>(node)) {
+		std::string bytes;
+
+		/* quotes are doubled within a literal */
+		for (size_t i = 0; i < string->str.size(); i++) {
+			bytes += string->str[i];
+			if (string->str[i] == '\'' && i + 1 < string->str.size() &&
+			    string->str[i + 1] == '\'')
+				i++;
+		}
+		/* (with a terminating NUL, not counted in its size) */
+		slots << "{ " << bytes.size() << ", kSlotsBytes, 1, "
+		      << cString(bytes) << " }";
+		return genLiteralObject("string " + bytes, "", "String",
+		    "VTRT_LITERAL_SLOTS(char, " +
+			std::to_string(bytes.size() + 1) + ")",
+		    slots.str());
+	} else if (auto integer = dynamic_cast<AST::IntExprNode *>(node)) {
+		/* (for those beyond SmallIntegers: the magnitude, in limbs) */
+		std::vector<uint64_t> magnitude = integerMagnitude(integer);
+
+		slots << "{ " << magnitude.size()
+		      << " * sizeof(uint64_t), kSlotsBytes, 1, { ";
+		for (auto limb : magnitude)
+			slots << limb << "u, ";
+		slots << "} }";
+		return genLiteralObject("integer " +
+			(integer->isWide() ? integer->digits :
+					     std::to_string(integer->num)),
+		    "", integer->className(),
+		    "VTRT_LITERAL_SLOTS(uint64_t, " +
+			std::to_string(magnitude.size()) + ")",
+		    slots.str());
+	} else if (auto number = dynamic_cast<AST::FloatExprNode *>(node)) {
+		/* (for those which can't be immediate) */
+		std::string value = doubleLiteral(number->num);
+
+		slots << "{ sizeof(double), kSlotsBytes, 1, { " << value << " } }";
+		return genLiteralObject("float " + value, "", "Float",
+		    "VTRT_LITERAL_SLOTS(double, 1)", slots.str());
+	} else if (auto array = dynamic_cast<AST::ArrayExprNode *>(node)) {
+		std::string name = "__literal" + std::to_string(literalCount++);
+		std::vector<std::string> elements;
+		bool isConst = true;
+
+		/* (the elements first, as they are referred to) */
+		for (size_t i = 0; i < array->elements.size(); i++)
+			elements.push_back(genLiteralElement(array->elements[i],
+			    name + "_slots.contents[" + std::to_string(i) + "]",
+			    isConst));
+
+		slots << "{ " << elements.size() << ", kSlotsOops, 1, { ";
+		for (auto &element : elements)
+			slots << element << ", ";
+		slots << "} }";
+		return genLiteralObject("array " + std::to_string(uintptr_t(node)),
+		    name, "Array",
+		    "VTRT_LITERAL_SLOTS(oop, " +
+			std::to_string(elements.size()) + ")",
+		    slots.str(), isConst);
+	}
+
+	assert(!"not a literal to be generated as an object");
+}
+
+std::string
+CodeGeneratorVisitor::genClassReference(AST::ClassNode *klass)
+{
+	return genGlobalReference(klass->m_name);
+}
+
+std::string
+CodeGeneratorVisitor::genExpr(AST::ExprNode *node)
+{
+	std::string code;
+
+	funStack.push({});
+	node->accept(*this);
+	code = fun().str();
+	funStack.pop();
+	return code;
+}
+
+std::string
+CodeGeneratorVisitor::genTypeCheck(AST::ClassNode *klass, std::string value)
+{
+	if (klass->m_name == "SmallInteger")
+		return "vtrt_checkSmi(" + value + ")";
+	else if (klass->m_name == "Character")
+		return "vtrt_checkChar(" + value + ")";
+	else if (klass->m_name == "Float")
+		return "vtrt_checkFloat(" + value + ", " +
+		    genClassReference(klass) + ")";
+	return "vtrt_checkClass(" + value + ", " + genClassReference(klass) +
+	    ")";
+}
+
+std::string
+CodeGeneratorVisitor::genIvars(Scope *useScope)
+{
+	/* a block has no copy of its method's */
+	if (useCrossesBlock(useScope, method->scope))
+		return "vtrt_ivars(thisBlock->self)";
+	usesIvars = true;
+	return "__ivars";
+}
+
+std::string
+CodeGeneratorVisitor::genClassTest(AST::ClassNode *klass, std::string value)
+{
+	/* SmallIntegers are told apart by their tag alone */
+	if (klass->m_name == "SmallInteger")
+		return "VT_isSmi(" + value + ".value)";
+	else if (klass->m_name == "Character")
+		return "VT_isChar(" + value + ".value)";
+	/* (as are immediate Floats, but not boxed ones) */
+	else if (klass->m_name == "Float")
+		return "(VT_isFloat(" + value + ".value) || vtrt_classOf(" +
+		    value + ").ptr == " + genClassReference(klass) + ".ptr)";
+	return "vtrt_classOf(" + value + ").ptr == " +
+	    genClassReference(klass) + ".ptr";
+}
+
+std::string
+CodeGeneratorVisitor::genPrimitiveCall(AST::MessageExprNode *node,
+    std::string rcv, std::string argList, std::string failed)
+{
+	const std::string &primitive = node->directTarget->m_primitive;
+	AST::StaticType rcvType = node->receiver->staticType;
+
+	if ((primitive == "basicNew" || primitive == "basicNew:") &&
+	    rcvType.isKnown() && rcvType.classSide && rcvType.exact) {
+		std::string kind = isBytesClass(rcvType.klass) ? "kSlotsBytes" :
+								 "kSlotsOops";
+		size_t nNamed =
+		    rcvType.klass->m_instanceScope->instanceVars.size();
+
+		if (primitive == "basicNew")
+			return "vtrt_alloc(" + rcv + ", " +
+			    std::to_string(nNamed) + ", " + kind + ")";
+		return "vtrt_allocIndexed(" + rcv + ", " +
+		    std::to_string(nNamed) + ", " + kind + argList + ", &" +
+		    failed + ")";
+	}
+
+	return primitiveFunctionName(primitive) + "(" + rcv + argList + ", &" +
+	    failed + ")";
 }
 
 std::string
@@ -142,11 +541,16 @@ CodeGeneratorVisitor::genMoveArgumentsToHeapvars(CodeScope *scope,
 	bool didMoveAny = false;
 	for (auto &arg : scope->arguments)
 		if (arg.remoteAccess == Variable::kWrittenRemotely) {
+			AST::StaticType declared = resolveType(
+			    arg.declaredType);
+
 			stream << "  " << heapvarsNameForScope(scope) << "->";
 			emitVariableAccess(scope, &arg, stream, true);
-			stream << " = ";
-			emitVariableAccess(scope, &arg, stream, true);
-			stream << ";\n";
+			stream << " = "
+			       << (declared.isKnown() ?
+					genTypeCheck(declared.klass, arg.name) :
+					arg.name)
+			       << ";\n";
 			didMoveAny = true;
 		}
 	if (didMoveAny)
@@ -173,7 +577,30 @@ CodeGeneratorVisitor::genContextCreation(CodeScope *scope,
 		      << heapvarsNameForScope(scope) << "));\n";
 	}
 
+	/* tail calls rebind the receiver and arguments, and jump back here */
+	if (scope->kind == Scope::kMethod && method->hasTailCalls)
+		fun() << "__tailCall:\n";
 	fun() << "  thisContext->self = __self;\n";
+	/* the receiver's slots, for instance variable access */
+	if (scope->kind == Scope::kMethod && usesIvars)
+		fun() << "  oop *const __ivars = vtrt_ivars(__self);\n";
+
+	/* a method's arguments, checked against their declared types */
+	if (scope->kind == Scope::kMethod)
+		for (auto &arg : scope->arguments) {
+			AST::StaticType declared = resolveType(
+			    arg.declaredType);
+
+			if (arg.remoteAccess == Variable::kWrittenRemotely)
+				continue;
+			fun() << "  ";
+			emitVariableAccess(scope, &arg, fun());
+			fun() << " = "
+			      << (declared.isKnown() ?
+				       genTypeCheck(declared.klass, arg.name) :
+				       arg.name)
+			      << ";\n";
+		}
 
 	fun() << "\n";
 }
@@ -192,10 +619,62 @@ CodeGeneratorVisitor::CodeGeneratorVisitor(
 	out << "static struct vtrt_symbolReference __symbolReferences["
 		  << symbolNames.size() << "] = {\n";
 	for (auto &symbol : symbolNames) {
-		out << "  {\"" << symbol << "\", NULL },\n";
+		out << "  {" << cString(symbol) << ", NULL },\n";
+	}
+	out << "};\n\n";
+
+	out << "static struct vtrt_globalReference __globalReferences["
+	    << globalNames.size() << "] = {\n";
+	for (auto &global : globalNames)
+		out << "  { \"" << global << "\" },\n";
+	out << "};\n\n";
+
+	for (auto &callee : directCallees) {
+		out << methodSignature(callee, methodFunctionName(callee))
+		    << ";\n";
+		if (!callee->m_primitive.empty())
+			out << methodSignature(callee,
+				   fallbackFunctionName(callee))
+			    << ";\n";
 	}
+	out << "\n";
+
+	out << literalsOut.str();
+	out << "static struct vtrt_literal __literals[" << literals.size()
+	    << "] = {\n";
+	for (auto &literal : literals)
+		out << "  { &" << literal.first << ", \"" << literal.second
+		    << "\" },\n";
+	out << "};\n";
+	out << "static struct vtrt_literalSymbol __literalSymbols["
+	    << literalSymbols.size() << "] = {\n";
+	for (auto &symbol : literalSymbols)
+		out << "  { &" << symbol.first << ", " << cString(symbol.second)
+		    << " },\n";
 	out << "};\n\n";
 
+	if (options.instrument) {
+		out << "static struct vtrt_sendSite __sendSites["
+		    << sendSites.size() << "] = {\n";
+		for (auto &site : sendSites)
+			out << "  { \"" << site.method << "\", " << site.index
+			    << ", \"" << site.selector << "\" },\n";
+		out << "};\n";
+		out << "static struct vtrt_entryCounter __entryCounters["
+		    << entryCounters.size() << "] = {\n";
+		for (auto &method : entryCounters)
+			out << "  { \"" << method << "\" },\n";
+		out << "};\n";
+		out << "static struct vtrt_profile __profile = {"
+		       "\n  .sendSites = __sendSites,"
+		       "\n  .entryCounters = __entryCounters,"
+		       "\n  .nSendSites = "
+		    << sendSites.size()
+		    << ","
+		       "\n  .nEntryCounters = "
+		    << entryCounters.size() << ",\n};\n\n";
+	}
+
 	out << translationUnitOut.str();
 
 	out << "static struct vtrt_methodArray __classMethods["
@@ -223,15 +702,26 @@ CodeGeneratorVisitor::CodeGeneratorVisitor(
 	       "\n  .instanceMethods = __instanceMethods,"
 	       "\n  .classMethods = __classMethods,"
 	       "\n  .symbolReferences = __symbolReferences,"
+	       "\n  .globalReferences = __globalReferences,"
+	       "\n  .literals = __literals,"
+	       "\n  .literalSymbols = __literalSymbols,"
 	       "\n  .nInstanceMethods = "
 	    << node->m_instanceMethods.size()
-	    << "\n  .nClassMethods = " << node->m_classMethods.size()
-	    << "\n  .nSymbolReferences = " << symbolNames.size()
-	    << "\n  .instanceSize = "
+	    << ",\n  .nClassMethods = " << node->m_classMethods.size()
+	    << ",\n  .nSymbolReferences = " << symbolNames.size()
+	    << ",\n  .nGlobalReferences = " << globalNames.size()
+	    << ",\n  .nLiterals = " << literals.size()
+	    << ",\n  .nLiteralSymbols = " << literalSymbols.size()
+	    << ",\n  .instanceSize = "
 	    << node->m_instanceScope->instanceVars.size()
+	    << ",\n  .instanceKind = "
+	    << (isBytesClass(node) ? "kSlotsBytes" : "kSlotsOops")
 	    << ","
 	       "\n  .classSize = "
 	    << node->m_classScope->instanceVars.size()
+	    << ","
+	       "\n  .profile = "
+	    << (options.instrument ? "&__profile" : "NULL")
 	    << ","
 	       "\n"
 	       "};\n";
@@ -240,30 +730,72 @@ CodeGeneratorVisitor::CodeGeneratorVisitor(
 void
 CodeGeneratorVisitor::visitMethod(AST::MethodNode *node)
 {
+	std::string body;
+
 	std::cout << "Visiting method called " << node->m_selector << "\n";
 
-	node->scope->name = (node->m_isClassMethod ? "_c_" : "_i_") +
-	    node->m_class->m_name + "__" + escape(node->m_selector);
+	method = node;
+	node->scope->name = methodFunctionName(node);
 	genHeapvarsType(node->scope);
 	genContextType(node->scope->name, node->scope);
 
 	scope.push(node->scope);
+
+	/* the body first, to know what its prologue must set up */
+	usesIvars = false;
 	funStack.push({});
+	AST::Visitor::visitMethod(node);
+	body = fun().str();
+	funStack.pop();
 
-	/* method function signature */
-	fun() << "Oop " << node->scope->name << "(void *__sender, Oop __self";
-	if (!node->scope->arguments.empty())
-		for (auto &arg : node->scope->arguments)
-			fun() << ", Oop " << arg.name;
-	fun() << ")\n{\n";
+	funStack.push({});
+
+	if (!node->m_primitive.empty())
+		fun() << methodSignature(node, fallbackFunctionName(node))
+		      << ";\n";
+
+	/* method function signature, placed by profile feedback */
+	if (options.profile && options.profile->isHot(node))
+		fun() << "VTRT_HOT ";
+	else if (options.profile && options.profile->isCold(node))
+		fun() << "VTRT_COLD ";
+	fun() << methodSignature(node, methodFunctionName(node)) << "\n{\n";
+
+	/*
+	 * A primitive runs first; the Smalltalk code, in a function of its own,
+	 * only if it fails.
+	 */
+	if (!node->m_primitive.empty()) {
+		std::string args;
+
+		for (auto &param : node->m_parameters)
+			args += ", " + param.name;
+		fun() << "  bool __failed = false;\n  Oop __value = "
+		      << primitiveFunctionName(node->m_primitive) << "(__self"
+		      << args
+		      << ", &__failed);\n\n  if (vtrt_likely(!__failed))\n"
+			 "    return __value;\n  return "
+		      << fallbackFunctionName(node) << "(__sender, __self"
+		      << args << ");\n}\n\n";
+		fun() << methodSignature(node, fallbackFunctionName(node))
+		      << "\n{\n";
+	}
 
 	/* method body */
 #if 0
 	fun() << "  Oop __retVal = self;\n";
 #endif
+
 	genContextCreation(node->scope, node->scope->name + "_context", fun());
 	genMoveArgumentsToHeapvars(node->scope, fun());
 
+	if (options.instrument) {
+		fun() << "  __atomic_fetch_add(&__entryCounters["
+		      << entryCounters.size()
+		      << "].count, 1, __ATOMIC_RELAXED);\n\n";
+		entryCounters.push_back(node->qualifiedName());
+	}
+
 	if (node->scope->needsHeapContext) {
 		fun()
 		    << "  if (vtrt_setjmp(thisContext->returnBuf) != 0) {"
@@ -283,8 +815,12 @@ CodeGeneratorVisitor::visitMethod(AST::MethodNode *node)
 #else
 
 #endif
-	fun() << "/* code */\n";
-	AST::Visitor::visitMethod(node);
+	fun() << "/* code */\n" << body;
+
+	/* falling off the end of a method returns self */
+	if (node->m_statements.empty() ||
+	    !dynamic_cast<AST::ReturnStmtNode *>(node->m_statements.back()))
+		fun() << "return vtrt_return(thisContext, thisContext->self);\n";
 
 	/* end of method */
 	fun() << "}\n";
@@ -293,9 +829,10 @@ CodeGeneratorVisitor::visitMethod(AST::MethodNode *node)
 	scope.pop();
 
 	translationUnitOut << types.str() << "\n";
-	types.clear();
+	types.str("");
 	for (auto &fun : funcs)
 		translationUnitOut << fun << "\n";
+	funcs.clear();
 }
 
 void
@@ -306,7 +843,10 @@ CodeGeneratorVisitor::visitReturnStmt(AST::ReturnStmtNode *node)
 		fun() << "return vtrt_nonLocalReturn(thisContext, ";
 	else
 		fun() << "return vtrt_return(thisContext, ";
-	AST::Visitor::visitReturnStmt(node);
+	if (node->checkClass)
+		fun() << genTypeCheck(node->checkClass, genExpr(node->expr));
+	else
+		AST::Visitor::visitReturnStmt(node);
 	fun() << ");\n";
 }
 
@@ -443,10 +983,26 @@ CodeGeneratorVisitor::visitMessageExpr(AST::MessageExprNode *node)
 {
 	std::cout << "Visiting message expression #" << node->selector << "\n";
 
-	if (node->specialKind == AST::MessageExprNode::kIfTrueIfFalse) {
-		fun() << "(vtrt_isTrue(";
-		node->receiver->accept(*this);
-		fun() << ") ?\n    ";
+	if (node->specialKind == AST::MessageExprNode::kFolded) {
+		node->foldedTo->accept(*this);
+		return;
+	} else if (node->specialKind == AST::MessageExprNode::kIfTrueIfFalse) {
+		auto cond = dynamic_cast<AST::MessageExprNode *>(
+		    node->receiver);
+
+		fun() << "(";
+		if (cond && cond->unboxedSmi &&
+		    smiComparisonOperator(cond->selector))
+			emitSmiOperation(cond, true);
+		else if (cond && cond->unboxedFloat &&
+		    smiComparisonOperator(cond->selector))
+			emitFloatOperation(cond, true);
+		else {
+			fun() << "vtrt_isTrue(";
+			node->receiver->accept(*this);
+			fun() << ")";
+		}
+		fun() << " ?\n    ";
 		node->args[0]->accept(*this);
 		fun() << " :\n    ";
 		node->args[1]->accept(*this);
@@ -458,16 +1014,57 @@ CodeGeneratorVisitor::visitMessageExpr(AST::MessageExprNode *node)
 
 		assert(block != NULL);
 
+		if (node->receiver->staticType.is("SmallInteger") &&
+		    node->args[0]->staticType.is("SmallInteger")) {
+			std::string n = std::to_string(tempCount++);
+			std::string from, to, boxed;
+
+			fun() << "({"
+				 "\n\toop __result = vtrt_nil;\n";
+			/* (constant bounds come out as C constants) */
+			genSmiTree(node->receiver, "", from, boxed);
+			genSmiTree(node->args[0], "", to, boxed);
+			fun() << "\tfor (intptr_t __counter" << n << " = " << from
+			      << ", __limit" << n << " = " << to << "; __counter"
+			      << n << " <= __limit" << n << "; __counter" << n
+			      << "++) {\n\t";
+			emitVariableAccess(scope.top(),
+			    &block->scope->arguments[0], fun());
+			fun() << " = vtrt_smi(__counter" << n << ");\n\t";
+			fun() << "__result = ";
+			block->accept(*this);
+			fun() << ";\n\t}"
+				 "\n\t__result;"
+				 "\n})\n";
+			return;
+		}
+
+		/*
+		 * Otherwise the bounds are tested each time round, and the
+		 * comparison and increment sent as messages unless they are
+		 * SmallIntegers.
+		 */
 		fun() << "({"
-			 "\n\toop __result = nil;"
+			 "\n\toop __result = vtrt_nil;"
 			 "\n\toop __counter = ";
 		node->receiver->accept(*this);
 		fun() << ";"
 			 "\n\toop __comparator = ";
 		node->args[0]->accept(*this);
 		fun() << ";"
-			 "\n\tfor(; smiIsLessThan(__counter, __comparator); "
-			 "__counter = smiAdd(__counter, 1)) {\n\t";
+			 "\n\tfor (; vtrt_likely(VT_isSmi(__counter.value) && "
+			 "VT_isSmi(__comparator.value)) ?"
+			 "\n\t    vtrt_smiValue(__counter) <= "
+			 "vtrt_smiValue(__comparator) :"
+			 "\n\t    vtrt_isTrue(msgLookup(__counter, "
+		      << genSymbolReference("<=")
+		      << ")(__sender, __counter, __comparator));"
+			 "\n\t    __counter = vtrt_likely(VT_isSmi(__counter.value) "
+			 "&& vtrt_smiValue(__counter) < VTRT_SMI_MAX) ?"
+			 "\n\t    vtrt_smi(vtrt_smiValue(__counter) + 1) :"
+			 "\n\t    msgLookup(__counter, "
+		      << genSymbolReference("+")
+		      << ")(__sender, __counter, vtrt_smi(1))) {\n\t";
 
 		/* assign the counter's value to the block's first
 		 * argument */
@@ -482,26 +1079,586 @@ CodeGeneratorVisitor::visitMessageExpr(AST::MessageExprNode *node)
 			 "\n\t__result;"
 			 "\n})\n";
 		return;
+	} else if (node->specialKind == AST::MessageExprNode::kArrayLoop) {
+		emitArrayLoop(node);
+		return;
+	} else if (node->specialKind == AST::MessageExprNode::kInlinedSend) {
+		AST::BlockExprNode *body = node->inlinedBody;
+		size_t firstArg = 0;
+
+		fun() << "({\n\t";
+
+		/* bind the receiver, unless it is our own self */
+		if (node->inlinedSelf) {
+			emitVariableAccess(scope.top(), node->inlinedSelf, fun());
+			fun() << " = ";
+			node->receiver->accept(*this);
+			fun() << ";\n\t";
+			firstArg = 1;
+		}
+
+		/* then the arguments, and clear the callee's locals */
+		for (size_t i = 0; i < node->args.size(); i++) {
+			emitVariableAccess(scope.top(),
+			    &body->scope->arguments[firstArg + i], fun());
+			fun() << " = ";
+			node->args[i]->accept(*this);
+			fun() << ";\n\t";
+		}
+		for (auto &local : body->scope->locals) {
+			emitVariableAccess(scope.top(), &local, fun());
+			fun() << " = vtrt_nil;\n\t";
+		}
+
+		fun() << "/* inlined " << node->inlinedMethod->qualifiedName()
+		      << " */\n\t";
+		if (node->guardClass) {
+			std::string rcv, args;
+			std::stringstream temp;
+
+			emitVariableAccess(scope.top(), node->inlinedSelf, temp);
+			rcv = temp.str();
+			for (size_t i = 0; i < node->args.size(); i++) {
+				temp.str("");
+				emitVariableAccess(scope.top(),
+				    &body->scope->arguments[1 + i], temp);
+				args += ", " + temp.str();
+			}
+
+			if (options.instrument)
+				fun() << "vtrt_profileSend(" << genSendSite(node)
+				      << ", " << rcv << ");\n\t";
+			fun() << "vtrt_likely("
+			      << genClassTest(node->guardClass, rcv) << ") ?\n\t";
+			emitInlinedBody(node);
+			fun() << " :\n\tmsgLookup(" << rcv << ", "
+			      << genSymbolReference(node->selector)
+			      << ")(__sender, " << rcv << args << ")";
+		} else
+			emitInlinedBody(node);
+		fun() << ";\n})";
+		return;
+	} else if (node->unboxedSmi) {
+		emitSmiOperation(node);
+		return;
+	} else if (node->unboxedFloat) {
+		emitFloatOperation(node);
+		return;
+	}
+
+	emitSend(node);
+}
+
+/* The serial loop an Array loop is: do: for parallelDo:, and so on. */
+static std::string
+serialSelector(AST::MessageExprNode *node)
+{
+	std::string sel = node->selector;
+
+	if (sel.compare(0, 8, "parallel") == 0) {
+		sel.erase(0, 8);
+		sel[0] = tolower(sel[0]);
+	}
+	return sel;
+}
+
+std::string
+CodeGeneratorVisitor::genArrayValue(AST::ExprNode *node)
+{
+	AST::ClassNode *array = smalltalkScope.lookup("Array")->klass();
+	auto &type = node->staticType;
+
+	if (type.isKnown() && !type.classSide && !type.maybeNil &&
+	    type.klass->isKindOf(array))
+		return genExpr(node);
+	return genTypeCheck(array, genExpr(node));
+}
+
+void
+CodeGeneratorVisitor::emitParallelLoop(AST::MessageExprNode *node)
+{
+	AST::ClassNode *array = smalltalkScope.lookup("Array")->klass();
+	std::string sel = serialSelector(node);
+	auto block = static_cast<AST::BlockExprNode *>(node->args.back());
+	std::string n = std::to_string(tempCount++);
+	std::string function = method->scope->name + "_parallel" + n;
+	std::string context = "struct " + method->scope->name + "_context";
+	std::string loop = "__loop" + n, partials = "__partials" + n,
+		    result = "__result" + n;
+
+	/*
+	 * The function running the block over a chunk, in its own copy of
+	 * the context, so the block's variables are its own. A reduction
+	 * starts a chunk from its first element, but the first chunk from
+	 * the initial value.
+	 */
+	funStack.push({});
+	fun() << "static void\n"
+	      << function
+	      << "(struct vtrt_parallelLoop *__loop, size_t __chunk,"
+		 "\n    intptr_t __begin, intptr_t __end)\n{\n  "
+	      << context << " __context = *(" << context
+	      << " *)__loop->context;\n  volatile " << context
+	      << " *thisContext = &__context;"
+		 "\n  void *__sender = __loop->sender;"
+		 "\n  Oop __self = thisContext->self;"
+		 "\n  oop *const __ivars = vtrt_ivars(__self);"
+		 "\n  (void)__sender;\n  (void)__ivars;\n";
+	if (sel == "inject:into:")
+		fun() << "  oop __value = __chunk == 0 ? __loop->partials[0] :"
+			 "\n      vtrt_indexedSlot(__loop->source, __loop->size, "
+			 "__begin++);\n";
+	fun() << "\n  for (intptr_t __index = __begin; __index < __end; "
+		 "__index++) {\n\t";
+	if (sel == "inject:into:") {
+		emitVariableAccess(scope.top(), &block->scope->arguments[0],
+		    fun());
+		fun() << " = __value;\n\t";
+		emitVariableAccess(scope.top(), &block->scope->arguments[1],
+		    fun());
+	} else
+		emitVariableAccess(scope.top(), &block->scope->arguments[0],
+		    fun());
+	fun() << " = vtrt_indexedSlot(__loop->source, __loop->size, "
+		 "__index);\n\t";
+	if (sel == "inject:into:")
+		fun() << "__value = ";
+	else if (sel == "collect:")
+		fun() << "vtrt_indexedSlotPut(__loop->result, __loop->size, "
+			 "__index, ";
+	block->accept(*this);
+	fun() << (sel == "collect:" ? ")" : "") << ";\n  }\n";
+	if (sel == "inject:into:")
+		fun() << "  __loop->partials[__chunk] = __value;\n";
+	fun() << "}\n";
+	funcs.push_back(fun().str());
+	funStack.pop();
+
+	fun() << "({\n\tstruct vtrt_parallelLoop " << loop << " = { thisContext"
+	      << ", __sender, " << genArrayValue(node->receiver) << " };\n\t";
+	fun() << loop << ".size = vtrt_indexedSize(" << loop << ".source);\n\t";
+	if (sel == "collect:")
+		fun() << loop << ".result = vtrt_alloc("
+		      << genClassReference(array) << ", "
+		      << array->m_instanceScope->instanceVars.size() << " + "
+		      << loop << ".size, kSlotsOops);\n\t";
+	else if (sel == "inject:into:")
+		fun() << "oop " << partials << "[VTRT_PARALLEL_MAX_CHUNKS];\n\t"
+		      << loop << ".partials = " << partials << ";\n\t"
+		      << partials << "[0] = " << genExpr(node->args[0])
+		      << ";\n\t";
+	fun() << "vtrt_parallelFor(&" << loop << ", " << function
+	      << ");\n\t";
+
+	/* the partial results are combined in order, as the chunks are */
+	if (sel == "inject:into:") {
+		fun() << "oop " << result << " = " << partials
+		      << "[0];\n\tfor (size_t __k" << n << " = 1; __k" << n
+		      << " < vtrt_parallelChunks(" << loop << ".size); __k" << n
+		      << "++) {\n\t";
+		emitVariableAccess(scope.top(), &block->scope->arguments[0],
+		    fun());
+		fun() << " = " << result << ";\n\t";
+		emitVariableAccess(scope.top(), &block->scope->arguments[1],
+		    fun());
+		fun() << " = " << partials << "[__k" << n << "];\n\t" << result
+		      << " = ";
+		block->accept(*this);
+		fun() << ";\n\t}\n\t" << result << ";\n})";
+	} else
+		fun() << loop << "." << (sel == "collect:" ? "result" : "source")
+		      << ";\n})";
+}
+
+void
+CodeGeneratorVisitor::emitArrayLoop(AST::MessageExprNode *node)
+{
+	AST::ClassNode *array = smalltalkScope.lookup("Array")->klass();
+	std::vector<AST::MessageExprNode *> loops;
+	AST::MessageExprNode *last = node;
+	std::string lastSel = serialSelector(last);
+	std::string n = std::to_string(tempCount++);
+	std::string source = "__source" + n, size = "__size" + n,
+		    count = "__count" + n, element = "__element" + n,
+		    result = "__result" + n;
+	bool collects, filters = false;
+
+	if (node->parallel && !method->scope->needsHeapContext &&
+	    method->scope->heapvars.empty()) {
+		emitParallelLoop(node);
+		return;
 	}
 
-plain:
-	fun() << "msgLookup(";
+	/* the loops fused, in the order they run */
+	for (auto loop = node;;
+	     loop = static_cast<AST::MessageExprNode *>(loop->receiver)) {
+		loops.insert(loops.begin(), loop);
+		if (!loop->fusesReceiver)
+			break;
+	}
+	for (auto loop : loops)
+		filters |= loop->selector == "select:" ||
+		    loop->selector == "reject:";
+	collects = lastSel == "collect:" ||
+	    lastSel == "select:" || lastSel == "reject:";
+
+	fun() << "({\n\toop " << source << " = "
+	      << genArrayValue(loops.front()->receiver)
+	      << ";\n\tintptr_t " << size << " = vtrt_indexedSize(" << source
+	      << ");\n\t";
+	if (collects)
+		fun() << "intptr_t " << count << " = 0;\n\t";
+	else if (lastSel == "detect:ifNone:")
+		fun() << "bool __found" << n << " = false;\n\t";
+
+	/*
+	 * A collecting loop fills an Array as big as the source, cut down at
+	 * the end if elements were filtered out.
+	 */
+	fun() << "oop " << result << " = ";
+	if (collects)
+		fun() << "vtrt_alloc(" << genClassReference(array) << ", "
+		      << array->m_instanceScope->instanceVars.size() << " + "
+		      << size << ", kSlotsOops)";
+	else if (lastSel == "do:" && !last->fusesReceiver)
+		fun() << source;
+	else if (lastSel == "inject:into:")
+		last->args[0]->accept(*this);
+	else
+		fun() << "vtrt_nil";
+	fun() << ";\n";
+
+	fun() << "\tfor (intptr_t __index" << n << " = 0; __index" << n
+	      << " < " << size << "; __index" << n << "++) {\n\toop "
+	      << element << " = vtrt_indexedSlot(" << source << ", " << size
+	      << ", __index" << n << ");\n\t";
+
+	for (auto loop : loops) {
+		auto sel = serialSelector(loop);
+		auto block = static_cast<AST::BlockExprNode *>(
+		    loop->args[sel == "inject:into:" ? 1 : 0]);
+
+		if (sel == "inject:into:") {
+			emitVariableAccess(scope.top(),
+			    &block->scope->arguments[0], fun());
+			fun() << " = " << result << ";\n\t";
+			emitVariableAccess(scope.top(),
+			    &block->scope->arguments[1], fun());
+		} else
+			emitVariableAccess(scope.top(),
+			    &block->scope->arguments[0], fun());
+		fun() << " = " << element << ";\n\t";
+
+		if (sel == "do:") {
+			block->accept(*this);
+			fun() << ";\n\t";
+			continue;
+		} else if (sel == "inject:into:") {
+			fun() << result << " = ";
+			block->accept(*this);
+			fun() << ";\n\t";
+			continue;
+		} else if (sel == "collect:") {
+			fun() << element << " = ";
+			block->accept(*this);
+			fun() << ";\n\t";
+		} else {
+			fun() << "if (" << (sel == "reject:" ? "" : "!")
+			      << "vtrt_isTrue(";
+			block->accept(*this);
+			fun() << "))\n\t\tcontinue;\n\t";
+		}
+
+		if (loop != last)
+			continue;
+		else if (collects)
+			fun() << "vtrt_indexedSlotPut(" << result << ", " << size
+			      << ", " << count << "++, " << element << ");\n\t";
+		else {
+			/* detect: */
+			fun() << result << " = " << element << ";\n\t";
+			if (sel == "detect:ifNone:")
+				fun() << "__found" << n << " = true;\n\t";
+			fun() << "break;\n\t";
+		}
+	}
+	fun() << "}\n\t";
+
+	if (collects && filters)
+		fun() << "vtrt_truncateIndexed(" << result << ", " << size
+		      << ", " << count << ");\n\t";
+	else if (lastSel == "detect:ifNone:") {
+		fun() << "if (!__found" << n << ")\n\t\t" << result << " = ";
+		last->args[1]->accept(*this);
+		fun() << ";\n\t";
+	}
+	fun() << result << ";\n})";
+}
+
+void
+CodeGeneratorVisitor::emitInlinedBody(AST::MessageExprNode *node)
+{
+	if (node->inlinedCheckClass)
+		fun() << genTypeCheck(node->inlinedCheckClass,
+		    genExpr(node->inlinedBody));
+	else
+		node->inlinedBody->accept(*this);
+}
+
+void
+CodeGeneratorVisitor::genSmiTree(AST::ExprNode *node,
+    const std::string &overflow, std::string &unboxed, std::string &boxed)
+{
+	auto msg = dynamic_cast<AST::MessageExprNode *>(node);
+	auto integer = dynamic_cast<AST::IntExprNode *>(constantValue(node));
+
+	if (msg && msg->unboxedSmi && smiArithmeticFunction(msg->selector)) {
+		std::string rcvUnboxed, rcvBoxed, argUnboxed, argBoxed;
+
+		genSmiTree(msg->receiver, overflow, rcvUnboxed, rcvBoxed);
+		genSmiTree(msg->args[0], overflow, argUnboxed, argBoxed);
+		unboxed = std::string(smiArithmeticFunction(msg->selector)) +
+		    "(" + rcvUnboxed + ", " + argUnboxed + ", &" + overflow +
+		    ")";
+		boxed = std::string(integerArithmeticFunction(msg->selector)) +
+		    "(" + rcvBoxed + ", " + argBoxed + ")";
+	} else if (integer) {
+		unboxed = std::to_string(integer->num);
+		boxed = "vtrt_smi(" + unboxed + ")";
+	} else {
+		std::string temp = "__smi" + std::to_string(tempCount++);
+
+		fun() << "\tOop " << temp << " = ";
+		node->accept(*this);
+		fun() << ";\n";
+		unboxed = "vtrt_smiValue(" + temp + ")";
+		boxed = temp;
+	}
+}
+
+void
+CodeGeneratorVisitor::emitSmiOperation(AST::MessageExprNode *node,
+    bool asCondition)
+{
+	std::string n = std::to_string(tempCount++);
+	std::string overflow = "__overflow" + n, value = "__value" + n;
+	std::string rcvUnboxed, rcvBoxed, argUnboxed, argBoxed, boxed;
+	const char *comparison = smiComparisonOperator(node->selector);
+	/* can anything overflow? */
+	bool mayOverflow = !comparison;
+
+	for (auto operand : { node->receiver, node->args[0] }) {
+		auto msg = dynamic_cast<AST::MessageExprNode *>(operand);
+		mayOverflow |= msg && msg->unboxedSmi;
+	}
+
+	fun() << "({\n";
+	if (mayOverflow)
+		fun() << "\tbool " << overflow << " = false;\n";
+	genSmiTree(node->receiver, overflow, rcvUnboxed, rcvBoxed);
+	genSmiTree(node->args[0], overflow, argUnboxed, argBoxed);
+
+	/* on overflow, it is redone on the (Large)Integers */
+	if (!comparison) {
+		boxed = std::string(integerArithmeticFunction(node->selector)) +
+		    "(" + rcvBoxed + ", " + argBoxed + ")";
+		fun() << "\tintptr_t " << value << " = "
+		      << smiArithmeticFunction(node->selector) << "("
+		      << rcvUnboxed << ", " << argUnboxed << ", &" << overflow
+		      << ");\n";
+		fun() << "\tvtrt_likely(!" << overflow << " && vtrt_smiFits("
+		      << value << ")) ?\n\t    vtrt_smi(" << value
+		      << ") :\n\t    " << boxed << ";\n})";
+		return;
+	}
+
+	std::string test = rcvUnboxed + " " + comparison + " " + argUnboxed;
+	if (mayOverflow) {
+		boxed = "vtrt_integerCompare(" + rcvBoxed + ", " + argBoxed +
+		    ") " + comparison + " 0";
+		fun() << "\tbool " << value << " = vtrt_likely(!" << overflow
+		      << ") ?\n\t    " << test << " :\n\t    " << boxed
+		      << ";\n";
+		fun() << "\t" << (asCondition ? value : "vtrt_bool(" + value + ")");
+	} else
+		fun() << "\t" << (asCondition ? test : "vtrt_bool(" + test + ")");
+	fun() << ";\n})";
+}
+
+std::string
+CodeGeneratorVisitor::genFloatTree(AST::ExprNode *node)
+{
+	auto msg = dynamic_cast<AST::MessageExprNode *>(node);
+	AST::ExprNode *constant = constantValue(node);
+	auto integer = dynamic_cast<AST::IntExprNode *>(constant);
+	std::string temp;
+
+	if (msg && msg->unboxedFloat && msg->selector == "sqrt")
+		return "__builtin_sqrt(" + genFloatTree(msg->receiver) + ")";
+	else if (msg && msg->unboxedFloat &&
+	    floatArithmeticOperator(msg->selector)) {
+		std::string rcv = genFloatTree(msg->receiver);
+		std::string arg = genFloatTree(msg->args[0]);
+
+		return "(" + rcv + " " + floatArithmeticOperator(msg->selector) +
+		    " " + arg + ")";
+	} else if (auto number = dynamic_cast<AST::FloatExprNode *>(constant))
+		return doubleLiteral(number->num);
+	else if (integer && !integer->isWide())
+		return "(double)" + std::to_string(integer->num);
+
+	temp = "__number" + std::to_string(tempCount++);
+	fun() << "\tOop " << temp << " = ";
+	node->accept(*this);
+	fun() << ";\n";
+	if (node->staticType.is("Float"))
+		return "vtrt_floatValue(" + temp + ")";
+	/* a variable declared Float may yet be nil */
+	else if (node->staticType.klass &&
+	    node->staticType.klass->m_name == "Float")
+		return "vtrt_floatValue(" +
+		    genTypeCheck(node->staticType.klass, temp) + ")";
+	else if (node->staticType.is("SmallInteger"))
+		return "(double)vtrt_smiValue(" + temp + ")";
+	/* (the value of an unboxedSmi operation) */
+	return "vtrt_numberValue(" + temp + ")";
+}
+
+void
+CodeGeneratorVisitor::emitFloatOperation(AST::MessageExprNode *node,
+    bool asCondition)
+{
+	const char *comparison = smiComparisonOperator(node->selector);
+	std::string rcv, arg;
+
+	fun() << "({\n";
+	if (!comparison) {
+		std::string value = genFloatTree(node);
+
+		fun() << "\tvtrt_float(" << value << ");\n})";
+		return;
+	}
+
+	rcv = genFloatTree(node->receiver);
+	arg = genFloatTree(node->args[0]);
+	std::string test = rcv + " " + comparison + " " + arg;
+	fun() << "\t" << (asCondition ? test : "vtrt_bool(" + test + ")")
+	      << ";\n})";
+}
+
+void
+CodeGeneratorVisitor::emitSend(AST::MessageExprNode *node)
+{
+	std::string rcv = "__rcv" + std::to_string(tempCount++);
+	std::vector<std::string> args;
+	std::string argList;
+	AST::ClassNode *guard = NULL;
+	AST::MethodNode *target = NULL;
+
+	/*
+	 * Unless type inference proved the method invoked, speculate on the
+	 * class the profile says the receiver usually is, or, for a recursive
+	 * send, on the receiver being of the same class as the sender.
+	 */
+	if (node->directTarget)
+		target = node->directTarget;
+	else if (options.profile &&
+	    (guard = options.profile->dominantClass(method, node->siteIndex)))
+		target = guard->lookupMethod(node->selector, false);
+	else if (node->selfRecursive) {
+		guard = method->m_class;
+		target = method;
+	}
+
+	fun() << "({\n\tOop " << rcv << " = ";
 	node->receiver->accept(*this);
-	fun() << ", " << genSymbolReference(node->selector) << ")";
-	fun() << "(__sender, thisContext->self";
+	fun() << ";\n";
 	for (auto &arg : node->args) {
-			fun() << ", ";
+		std::string argName = "__arg" + std::to_string(tempCount++);
+		fun() << "\tOop " << argName << " = ";
 		arg->accept(*this);
+		fun() << ";\n";
+		args.push_back(argName);
+		argList += ", " + argName;
 	}
-	fun() << ")";
+
+	if (options.instrument && node->siteIndex >= 0 && !node->directTarget)
+		fun() << "\tvtrt_profileSend(" << genSendSite(node) << ", "
+		      << rcv << ");\n";
+
+	fun() << "\t";
+	/*
+	 * A tail call to this method rebinds its parameters and starts it
+	 * over, with its locals nil again.
+	 */
+	if (node->tailCall && target == method) {
+		if (!node->directTarget)
+			fun() << "if (vtrt_likely(" << genClassTest(guard, rcv)
+			      << ")) ";
+		fun() << "{\n\t\t__self = " << rcv << ";\n";
+		for (size_t i = 0; i < args.size(); i++)
+			fun() << "\t\t" << method->m_parameters[i].name << " = "
+			      << args[i] << ";\n";
+		for (auto &local : method->scope->locals) {
+			fun() << "\t\t";
+			emitVariableAccess(scope.top(), &local, fun());
+			fun() << " = vtrt_nil;\n";
+		}
+		fun() << "\t\tgoto __tailCall;\n\t}\n\t";
+		if (node->directTarget) {
+			fun() << rcv << "; /* (not reached) */\n})";
+			return;
+		}
+	} else if (node->directTarget && !target->m_primitive.empty()) {
+		/* the primitive, inline; the Smalltalk code alone if it fails */
+		std::string failed = "__failed" + std::to_string(tempCount++);
+		std::string value = "__value" + std::to_string(tempCount++);
+
+		directCallees.insert(target);
+		fun() << "bool " << failed << " = false;\n\tOop " << value
+		      << " = " << genPrimitiveCall(node, rcv, argList, failed)
+		      << ";\n\tvtrt_likely(!" << failed << ") ? " << value
+		      << " :\n\t    " << fallbackFunctionName(target)
+		      << "(__sender, " << rcv << argList << ");\n})";
+		return;
+	} else if (node->directTarget) {
+		directCallees.insert(target);
+		fun() << methodFunctionName(target) << "(__sender, " << rcv
+		      << argList << ");\n})";
+		return;
+	} else if (target) {
+		directCallees.insert(target);
+		fun() << "vtrt_likely(" << genClassTest(guard, rcv)
+		      << ") ?\n\t    " << methodFunctionName(target)
+		      << "(__sender, " << rcv << argList << ") :\n\t    ";
+	}
+	fun() << "msgLookup(" << rcv << ", "
+	      << genSymbolReference(node->selector) << ")(__sender, " << rcv
+	      << argList << ");\n})";
 }
 
 void
 CodeGeneratorVisitor::visitAssignExpr(AST::AssignExprNode *node)
 {
-	node->left->accept(*this);
-	fun() << " = ";
-	node->right->accept(*this);
+	Variable *var = node->left->variable;
+	std::string value = node->checkClass ?
+		  genTypeCheck(node->checkClass, genExpr(node->right)) :
+		  genExpr(node->right);
+
+	/* stores into the receiver pass its write barrier */
+	if (var->kind == Variable::kInstanceVariable) {
+		fun() << "vtrt_storeIvar("
+		      << (useCrossesBlock(scope.top(), method->scope) ?
+				 "thisBlock->self" :
+				 "__self")
+		      << ", " << genIvars(scope.top()) << ", "
+		      << static_cast<InstanceVariable *>(var)->index << ", "
+		      << value << ")";
+		return;
+	}
+
+	emitVariableAccess(scope.top(), var, fun());
+	fun() << " = " << value;
 }
 
 void
@@ -528,10 +1685,20 @@ CodeGeneratorVisitor::emitVariableAccess(Scope *scope, Variable *var,
 	case Variable::kInlinedBlockLocal:
 		return emitVariableAccess(scope, var->real, stream);
 	case Variable::kNamespaceMember:
-		stream << "%{namespace member " << var->name << "}%";
+		stream << genGlobalReference(var->name);
 		break;
 	case Variable::kInstanceVariable:
-		stream << "%{instance variable " << var->name << "}%";
+		stream << genIvars(scope) << "["
+		       << static_cast<InstanceVariable *>(var)->index << "]";
+		break;
+	case Variable::kNil:
+		stream << "vtrt_nil";
+		break;
+	case Variable::kTrue:
+		stream << "vtrt_trueObject";
+		break;
+	case Variable::kFalse:
+		stream << "vtrt_falseObject";
 		break;
 	case Variable::kSelf: {
 		if (useCrossesBlock(scope, var->scope))
@@ -547,12 +1714,50 @@ void
 CodeGeneratorVisitor::visitIdentExpr(AST::IdentExprNode *node)
 {
 	std::cout << "Visiting identifier expression <" << node->id << ">\n";
-	emitVariableAccess(scope.top(), node->variable, fun());
+	/* a propagated literal */
+	if (node->constant)
+		node->constant->accept(*this);
+	else
+		emitVariableAccess(scope.top(), node->variable, fun());
 }
 
 void
 CodeGeneratorVisitor::visitIntExpr(AST::IntExprNode *node)
 {
-	std::cout << "Visiting integer literal " << node->num << "\n";
-	fun() << "makeSMI(" << node->num << ")";
+	std::cout << "Visiting integer literal "
+		  << (node->isWide() ? node->digits : std::to_string(node->num))
+		  << "\n";
+	if (node->isSmallInteger())
+		fun() << "vtrt_smi(" << node->num << ")";
+	else
+		visitLiteral(node);
+}
+
+void
+CodeGeneratorVisitor::visitFloatExpr(AST::FloatExprNode *node)
+{
+	uint64_t encoded;
+
+	if (immediateFloat(node->num, encoded))
+		fun() << "vtrt_float(" << doubleLiteral(node->num) << ")";
+	else
+		visitLiteral(node);
+}
+
+void
+CodeGeneratorVisitor::visitCharExpr(AST::CharExprNode *node)
+{
+	fun() << "vtrt_char(" << codePoint(node) << ")";
+}
+
+void
+CodeGeneratorVisitor::visitLiteral(AST::LiteralExprNode *node)
+{
+	fun() << "VTRT_OOP(&" << genLiteral(node) << ")";
+}
+
+void
+CodeGeneratorVisitor::visitSymbolExpr(AST::SymbolExprNode *node)
+{
+	fun() << genSymbolReference(node->sym);
 }
@@ -2,6 +2,7 @@
 #define GENERATE_H_
 
 #include <map>
+#include <set>
 #include <sstream>
 #include <filesystem>
 #include <stack>
@@ -20,6 +21,12 @@ class CodeGeneratorVisitor : public AST::Visitor {
 	std::stringstream translationUnitOut;
 
 	std::stack<Scope *> scope;
+	/* method presently being generated */
+	AST::MethodNode *method;
+	/* for naming temporaries */
+	size_t tempCount = 0;
+	/* does the method presently being generated access instance vars? */
+	bool usesIvars;
 
 	/*!
 	 * @name per-translation unit
@@ -49,6 +56,94 @@ class CodeGeneratorVisitor : public AST::Visitor {
 	 * Generate a reference to the Symbol for a given string.
 	 */
 	std::string genSymbolReference(std::string string);
+
+	/*!
+	 * Global name vector.
+	 *
+	 * Likewise, every translation unit gets a static array of binding
+	 * cells:
+	 *   static struct vtrt_globalReference {
+	 *	const char *name;
+	 *	oop value;
+	 *    } __globalReferences[n];
+	 * one for each global (so far, each class) the unit's code refers to,
+	 * which refers to it as:
+	 *	__globalReferences[i].value
+	 *
+	 * The runtime fills in the cells from the namespace when it links up
+	 * the classes, so a reference costs a load and never a lookup.
+	 */
+	std::vector<std::string> globalNames;
+
+	/*!
+	 * Generate a reference to (the binding cell of) a global.
+	 */
+	std::string genGlobalReference(std::string name);
+	/*!
+	 * Generate a reference to (the binding cell of) a class.
+	 */
+	std::string genClassReference(AST::ClassNode *klass);
+
+	/*!
+	 * Literal objects.
+	 *
+	 * Literal strings, floats, characters and arrays are emitted into
+	 * literalsOut as statically allocated objects, named __literalN, with
+	 * their slots const. Their classes are filled in at link time from the
+	 * unit's table of them:
+	 *   static struct vtrt_literal __literals[n];
+	 * as are the Symbols in literal arrays, from __literalSymbols. Equal
+	 * strings, floats and characters within a unit share an object.
+	 */
+	std::stringstream literalsOut;
+	size_t literalCount = 0;
+	/* names of the objects, and of their classes */
+	std::vector<std::pair<std::string, std::string>> literals;
+	/* slots of literal arrays holding Symbols, and the Symbols' strings */
+	std::vector<std::pair<std::string, std::string>> literalSymbols;
+	/* the object for each distinct literal */
+	std::map<std::string, std::string> literalNames;
+
+	/*!
+	 * Generate a literal object, returning its name. Its slots are marked
+	 * immutable.
+	 */
+	std::string genLiteral(AST::LiteralExprNode *node);
+	/*!
+	 * Emit a literal object (unless there is already one for key) of a
+	 * class, with slots of the C type slotsType initialised to slots.
+	 */
+	std::string genLiteralObject(const std::string &key, std::string name,
+	    const std::string &className, const std::string &slotsType,
+	    const std::string &slots, bool isConst = true);
+	/*!
+	 * Generate the initialiser of a slot of a literal array.
+	 */
+	std::string genLiteralElement(AST::ExprNode *node,
+	    const std::string &slot, bool &isConst);
+
+	/*!
+	 * Methods called directly rather than by message send. These are
+	 * declared at the head of the unit.
+	 */
+	std::set<AST::MethodNode *> directCallees;
+
+	/*!
+	 * In an instrumented build (--instrument), the send sites and method
+	 * entry counters to be emitted into the unit's vtrt_profile.
+	 */
+	struct SendSite {
+		std::string method;
+		int index;
+		std::string selector;
+	};
+	std::vector<SendSite> sendSites;
+	std::vector<std::string> entryCounters;
+
+	/*!
+	 * Generate a reference to a new instrumented send site.
+	 */
+	std::string genSendSite(AST::MessageExprNode *node);
 	/*!
 	 * @} 
 	 */
@@ -89,6 +184,86 @@ class CodeGeneratorVisitor : public AST::Visitor {
 	void emitVariableAccess(Scope *scope, Variable *var,
 	    std::stringstream &stream, bool elideThisContext = false);
 
+	/*
+	 * Generate the code of an expression, returning it rather than
+	 * emitting it.
+	 */
+	std::string genExpr(AST::ExprNode *node);
+	/*
+	 * Generate a check that a value is of a class (or subclass).
+	 */
+	std::string genTypeCheck(AST::ClassNode *klass, std::string value);
+	/*
+	 * Generate a reference to the receiver's instance variables, as seen
+	 * from some scope.
+	 */
+	std::string genIvars(Scope *useScope);
+	/*
+	 * Generate a C truth value testing whether a value is of exactly a
+	 * class.
+	 */
+	std::string genClassTest(AST::ClassNode *klass, std::string value);
+	/*
+	 * Generate a call of a send's target primitive, with a flag to set on
+	 * failure. Instantiation of a class known statically is an inline
+	 * allocation of its instances' size.
+	 */
+	std::string genPrimitiveCall(AST::MessageExprNode *node,
+	    std::string rcv, std::string argList, std::string failed);
+
+	/*
+	 * Generate a full message send: a direct call if type inference proved
+	 * the method invoked, else a lookup, speculating on the receiver's
+	 * class if profile feedback is available or the send is recursive.
+	 * Tail calls to the method itself become jumps back to its start.
+	 */
+	void emitSend(AST::MessageExprNode *node);
+	/*
+	 * Generate the body spliced in for an inlined send, checking its value
+	 * against the inlined method's declared return type if need be.
+	 */
+	void emitInlinedBody(AST::MessageExprNode *node);
+	/*
+	 * Generate a kArrayLoop send, with the loops fused into it, as one
+	 * loop over the slots of the Array the first of them enumerates.
+	 */
+	void emitArrayLoop(AST::MessageExprNode *node);
+	/*
+	 * Generate a parallel kArrayLoop send, its block made a function the
+	 * worker pool runs over chunks of the Array.
+	 */
+	void emitParallelLoop(AST::MessageExprNode *node);
+	/*
+	 * Generate the value of an expression which should be an Array, checked
+	 * to be one unless it is known to be.
+	 */
+	std::string genArrayValue(AST::ExprNode *node);
+	/*
+	 * Generate an unboxedSmi operation. The leaves of the tree of such
+	 * operations it heads are bound to temporaries first; if the operation
+	 * overflows, it is redone on them by message sends. A comparison
+	 * answers a Boolean, or a C truth value if asCondition.
+	 */
+	void emitSmiOperation(AST::MessageExprNode *node,
+	    bool asCondition = false);
+	/*
+	 * Emit bindings of the leaves of a tree of unboxedSmi operations, and
+	 * generate C expressions computing it unboxed and by message sends.
+	 */
+	void genSmiTree(AST::ExprNode *node, const std::string &overflow,
+	    std::string &unboxed, std::string &boxed);
+	/*
+	 * Generate an unboxedFloat operation, computed on C doubles. Arithmetic
+	 * answers a Float; a comparison, as emitSmiOperation().
+	 */
+	void emitFloatOperation(AST::MessageExprNode *node,
+	    bool asCondition = false);
+	/*
+	 * Emit bindings of the leaves of a tree of unboxedFloat operations, and
+	 * generate a C double expression computing it.
+	 */
+	std::string genFloatTree(AST::ExprNode *node);
+
 	std::stringstream &fun() { return funStack.top(); };
 
 	//void visitClass(AST::ClassNode *node);
@@ -103,9 +278,18 @@ class CodeGeneratorVisitor : public AST::Visitor {
 	void visitAssignExpr(AST::AssignExprNode *node);
 	void visitIdentExpr(AST::IdentExprNode *node);
 	void visitIntExpr(AST::IntExprNode *node);
+	void visitLiteral(AST::LiteralExprNode *node);
+	void visitCharExpr(AST::CharExprNode *node);
+	void visitSymbolExpr(AST::SymbolExprNode *node);
+	void visitStringExpr(AST::StringExprNode *node) { visitLiteral(node); }
+	void visitFloatExpr(AST::FloatExprNode *node);
+	void visitArrayExpr(AST::ArrayExprNode *node) { visitLiteral(node); }
 
 	public:
 	CodeGeneratorVisitor(std::filesystem::path outputDirectory, AST::ClassNode *klass);
 };
 
+/* Name of the C function implementing a method. */
+std::string methodFunctionName(AST::MethodNode *method);
+
 #endif /* GENERATE_H_ */
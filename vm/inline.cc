@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <map>
+
+#include "analyse.hh"
+#include "ast.hh"
+#include "inline.hh"
+#include "options.hh"
+#include "profile.hh"
+
+/*
+ * eligibility
+ */
+static int
+exprSize(AST::ExprNode *node, std::string &reason)
+{
+	if (auto ident = dynamic_cast<AST::IdentExprNode *>(node)) {
+		if (ident->isSuper()) {
+			reason = "sends to super";
+			return -1;
+		}
+		switch (ident->variable->kind) {
+		case Variable::kArgument:
+		case Variable::kLocal:
+		case Variable::kSelf:
+		case Variable::kNil:
+		case Variable::kTrue:
+		case Variable::kFalse:
+		case Variable::kInstanceVariable:
+		case Variable::kNamespaceMember:
+			return 1;
+		default:
+			reason = "refers to block-captured state";
+			return -1;
+		}
+	} else if (dynamic_cast<AST::LiteralExprNode *>(node)) {
+		return 1;
+	} else if (auto assign = dynamic_cast<AST::AssignExprNode *>(node)) {
+		int size = exprSize(assign->right, reason);
+		return size < 0 ? -1 : size + 1;
+	} else if (auto msg = dynamic_cast<AST::MessageExprNode *>(node)) {
+		int size = 1, argSize;
+
+		if (msg->specialKind != AST::MessageExprNode::kNotSpecial &&
+		    msg->specialKind != AST::MessageExprNode::kInlinedSend) {
+			reason = "contains an optimised control structure";
+			return -1;
+		}
+		if ((argSize = exprSize(msg->receiver, reason)) < 0)
+			return -1;
+		size += argSize;
+		for (auto arg : msg->args) {
+			if ((argSize = exprSize(arg, reason)) < 0)
+				return -1;
+			size += argSize;
+		}
+		return size;
+	} else if (node->isBlock()) {
+		reason = "contains a block";
+		return -1;
+	}
+
+	reason = "contains a cascade or other complex expression";
+	return -1;
+}
+
+class InstanceVariableUseFinder : public AST::Visitor {
+    public:
+	bool found = false;
+
+	void visitIdentExpr(AST::IdentExprNode *node)
+	{
+		found |= node->variable->kind == Variable::kInstanceVariable;
+	}
+};
+
+static bool
+usesInstanceVariables(AST::MethodNode *method)
+{
+	InstanceVariableUseFinder finder;
+	for (auto stmt : method->m_statements)
+		stmt->accept(finder);
+	return finder.found;
+}
+
+int
+inlinableSize(AST::MethodNode *method, std::string &reason)
+{
+	int size = 0;
+
+	if (method->scope->needsHeapContext) {
+		reason = "needs a heap context";
+		return -1;
+	} else if (!method->m_primitive.empty()) {
+		/* (the call site calls the primitive itself instead) */
+		reason = "is a primitive";
+		return -1;
+	}
+
+	for (auto stmt : method->m_statements) {
+		AST::ExprNode *expr;
+		int stmtSize;
+
+		if (auto ret = dynamic_cast<AST::ReturnStmtNode *>(stmt)) {
+			if (stmt != method->m_statements.back()) {
+				reason = "returns before its last statement";
+				return -1;
+			}
+			expr = ret->expr;
+		} else
+			expr = dynamic_cast<AST::ExprStmtNode *>(stmt)->expr;
+
+		if ((stmtSize = exprSize(expr, reason)) < 0)
+			return -1;
+		size += stmtSize;
+	}
+
+	return size;
+}
+
+/*
+ * cloning of the callee's body into the caller
+ */
+class BodyCloner {
+	/* callee variables -> their renamings in the caller */
+	std::map<Variable *, Variable *> &vars;
+	/* the caller's instance scope, wherein to find instance variables */
+	InstanceScope *instanceScope;
+	/* what self in the callee becomes */
+	Variable *self;
+
+	Variable *mapVariable(AST::IdentExprNode *ident)
+	{
+		auto it = vars.find(ident->variable);
+
+		if (it != vars.end())
+			return it->second;
+		else if (ident->variable->kind == Variable::kSelf)
+			return self;
+		else if (ident->variable->kind == Variable::kInstanceVariable) {
+			for (auto &ivar : instanceScope->instanceVars)
+				if (ivar.name == ident->variable->name)
+					return &ivar;
+			assert(!"Instance variable missing from subclass");
+		}
+		/* namespace members are the same everywhere */
+		return ident->variable;
+	}
+
+	AST::IdentExprNode *clone(AST::IdentExprNode *ident)
+	{
+		auto copy = new AST::IdentExprNode(ident->m_pos, ident->id);
+		copy->variable = mapVariable(ident);
+		return copy;
+	}
+
+    public:
+	BodyCloner(std::map<Variable *, Variable *> &vars,
+	    InstanceScope *instanceScope, Variable *self)
+	    : vars(vars)
+	    , instanceScope(instanceScope)
+	    , self(self)
+	{
+	}
+
+	AST::ExprNode *clone(AST::ExprNode *node)
+	{
+		if (auto ident = dynamic_cast<AST::IdentExprNode *>(node))
+			return clone(ident);
+		else if (auto assign = dynamic_cast<AST::AssignExprNode *>(
+			     node))
+			return new AST::AssignExprNode(clone(assign->left),
+			    clone(assign->right));
+		else if (auto msg = dynamic_cast<AST::MessageExprNode *>(
+			     node)) {
+			std::vector<AST::ExprNode *> args;
+
+			/*
+			 * Any inlining already done within the callee is
+			 * dropped; the clone is itself visited for inlining.
+			 */
+			for (auto arg : msg->args)
+				args.push_back(clone(arg));
+			return new AST::MessageExprNode(clone(msg->receiver),
+			    msg->selector, args);
+		}
+		/* literals are immutable and may be shared */
+		assert(dynamic_cast<AST::LiteralExprNode *>(node));
+		return node;
+	}
+};
+
+/*
+ * the inliner
+ */
+void
+InliningVisitor::log(AST::MessageExprNode *node, const std::string &decision)
+{
+	if (!options.inlineLog)
+		return;
+	*options.inlineLog << method->qualifiedName() << ": #" << node->selector
+			   << (inlineStack.empty() ? "" : " (nested)") << ": "
+			   << decision << "\n";
+}
+
+AST::MethodNode *
+InliningVisitor::staticTarget(AST::MessageExprNode *node,
+    bool &receiverIsSelf, std::string &reason)
+{
+	AST::ClassNode *klass = method->m_class;
+	bool classSide = method->m_isClassMethod;
+	auto ident = dynamic_cast<AST::IdentExprNode *>(node->receiver);
+	AST::MethodNode *target = NULL;
+
+	receiverIsSelf = false;
+
+	if (ident && ident->isSuper()) {
+		receiverIsSelf = true;
+		if (klass->m_superClass)
+			target = klass->m_superClass->lookupMethod(
+			    node->selector, classSide);
+	} else if (ident && ident->variable->kind == Variable::kSelf) {
+		/*
+		 * The whole program is visible to us, so a send to self is
+		 * bound unless some subclass redefines the selector.
+		 */
+		receiverIsSelf = true;
+		if (klass->isOverriddenBelow(node->selector, classSide)) {
+			reason = "overridden in a subclass";
+			return NULL;
+		}
+		target = klass->lookupMethod(node->selector, classSide);
+	} else if (auto integer =
+		       dynamic_cast<AST::IntExprNode *>(node->receiver)) {
+		auto cls = smalltalkScope.lookup(integer->className());
+		if (cls && cls->isClass())
+			target = cls->klass()->lookupMethod(node->selector,
+			    false);
+	} else if (ident &&
+	    ident->variable->kind == Variable::kNamespaceMember &&
+	    static_cast<NamespaceMemberVariable *>(ident->variable)
+		->isClass()) {
+		target = static_cast<NamespaceMemberVariable *>(
+		    ident->variable)
+			     ->klass()
+			     ->lookupMethod(node->selector, true);
+	} else {
+		reason = "receiver class not statically known";
+		return NULL;
+	}
+
+	if (!target)
+		reason = "no method found";
+	return target;
+}
+
+void
+InliningVisitor::inlineSend(AST::MessageExprNode *node,
+    AST::MethodNode *target, bool receiverIsSelf)
+{
+	std::map<Variable *, Variable *> vars;
+	Scope *instanceScope;
+	Variable *self;
+	auto body = new AST::BlockExprNode(target->m_parameters,
+	    target->m_locals, {});
+	auto bodyScope = new CodeScope(scope, Scope::kOptimisedBlock);
+
+	body->isInlined = true;
+	body->scope = bodyScope;
+
+	for (instanceScope = scope; instanceScope->kind != Scope::kClass;
+	     instanceScope = instanceScope->lexicalOuter)
+		;
+
+	if (receiverIsSelf)
+		self = instanceScope->lookup("self");
+	else {
+		bodyScope->addInlinedBlockLocal("self", true);
+		self = node->inlinedSelf = &bodyScope->arguments.back();
+	}
+
+	/* rename the callee's own arguments and locals into the caller */
+	for (auto &param : target->m_parameters) {
+		bodyScope->addInlinedBlockLocal(param.name, true);
+		for (auto &arg : target->scope->arguments)
+			if (arg.name == param.name)
+				vars[&arg] = &bodyScope->arguments.back();
+	}
+	for (auto &decl : target->m_locals) {
+		bodyScope->addInlinedBlockLocal(decl.name, false, decl.type);
+		for (auto &local : target->scope->locals)
+			if (local.name == decl.name)
+				vars[&local] = &bodyScope->locals.back();
+	}
+
+	BodyCloner cloner(vars, static_cast<InstanceScope *>(instanceScope),
+	    self);
+	for (auto stmt : target->m_statements) {
+		auto ret = dynamic_cast<AST::ReturnStmtNode *>(stmt);
+		auto expr = ret ? ret->expr :
+				  dynamic_cast<AST::ExprStmtNode *>(stmt)->expr;
+		body->m_stmts.push_back(
+		    new AST::ExprStmtNode(cloner.clone(expr)));
+	}
+	/* falling off the end of a method answers self */
+	if (target->m_statements.empty() ||
+	    !dynamic_cast<AST::ReturnStmtNode *>(target->m_statements.back())) {
+		auto selfIdent = new AST::IdentExprNode(node->m_pos, "self");
+		selfIdent->variable = self;
+		body->m_stmts.push_back(new AST::ExprStmtNode(selfIdent));
+	}
+
+	node->specialKind = AST::MessageExprNode::kInlinedSend;
+	node->inlinedMethod = target;
+	node->inlinedBody = body;
+
+	/* and now consider the sends within the spliced-in body */
+	inlineStack.push_back(target);
+	body->accept(*this);
+	inlineStack.pop_back();
+}
+
+void
+InliningVisitor::visitMethod(AST::MethodNode *node)
+{
+	method = node;
+	scope = node->scope;
+	AST::Visitor::visitMethod(node);
+	scope = node->scope->lexicalOuter;
+}
+
+void
+InliningVisitor::visitBlockExpr(AST::BlockExprNode *node)
+{
+	scope = node->scope;
+	AST::Visitor::visitBlockExpr(node);
+	scope = node->scope->lexicalOuter;
+}
+
+void
+InliningVisitor::visitInlinedBlockExpr(AST::BlockExprNode *node)
+{
+	scope = node->scope;
+	AST::Visitor::visitBlockExpr(node);
+	scope = node->scope->lexicalOuter;
+}
+
+void
+InliningVisitor::visitMessageExpr(AST::MessageExprNode *node)
+{
+	AST::MethodNode *target;
+	AST::ClassNode *guard = NULL;
+	std::string reason;
+	bool receiverIsSelf;
+	int size;
+
+	AST::Visitor::visitMessageExpr(node);
+
+	if (options.inlineThreshold == 0 ||
+	    node->specialKind != AST::MessageExprNode::kNotSpecial)
+		return;
+
+	if (!(target = staticTarget(node, receiverIsSelf, reason))) {
+		/*
+		 * Failing that, speculate on the class profile feedback says
+		 * the receiver usually is; the inlined body is then guarded by
+		 * a test of the receiver's class.
+		 */
+		if (options.profile &&
+		    (guard = options.profile->dominantClass(method,
+			 node->siteIndex)) &&
+		    (target = guard->lookupMethod(node->selector, false)))
+			receiverIsSelf = false;
+		else {
+			log(node, "not inlined: " + reason);
+			return;
+		}
+	}
+
+	std::string targetName = target->qualifiedName();
+
+	if (target == method ||
+	    std::find(inlineStack.begin(), inlineStack.end(), target) !=
+		inlineStack.end())
+		reason = "recursive";
+	else if (inlineStack.size() >= options.inlineDepth)
+		reason = "nested too deeply";
+	else if ((size = inlinableSize(target, reason)) < 0)
+		;
+	else if ((size_t)size > options.inlineThreshold)
+		reason = "too large (" + std::to_string(size) + " nodes)";
+	/*
+	 * Unless the receiver is our own self, the body may only use its
+	 * arguments, locals and self.
+	 */
+	else if (!receiverIsSelf && usesInstanceVariables(target))
+		reason = "uses instance variables of another object";
+	else
+		reason.clear();
+
+	if (!reason.empty()) {
+		log(node, "not inlined " + targetName + ": " + reason);
+		return;
+	}
+
+	log(node, "inlined " + targetName + " (" + std::to_string(size) +
+		" nodes)" + (guard ? ", guarded by class" : ""));
+	node->guardClass = guard;
+	inlineSend(node, target, receiverIsSelf);
+}
@@ -0,0 +1,54 @@
+/*!
+ * Inlining of small methods at statically-bound call sites.
+ */
+
+#ifndef INLINE_H_
+#define INLINE_H_
+
+#include <string>
+#include <vector>
+
+#include "analyse.hh"
+#include "ast.hh"
+
+/*!
+ * Splices the bodies of small leaf methods (accessors, #yourself, simple
+ * arithmetic wrappers and the like) into their callers wherever the method a
+ * send will invoke is known at compile time.
+ *
+ * This runs after closure analysis. An inlined call site becomes a
+ * kInlinedSend whose inlinedBody is an optimised block, cloned from the
+ * callee; the callee's arguments and locals are renamed into locals of the
+ * caller's CodeScope, in the same way as an optimised block's own locals.
+ */
+class InliningVisitor : public AST::Visitor {
+	AST::MethodNode *method;
+	/* current scope */
+	Scope *scope;
+	/* methods whose bodies we are currently within, innermost last */
+	std::vector<AST::MethodNode *> inlineStack;
+
+	/*
+	 * Determine the method a send will invoke, if it can be known at
+	 * compile time. Sets receiverIsSelf if the receiver is this method's
+	 * own self (or super); sets reason and returns NULL otherwise.
+	 */
+	AST::MethodNode *staticTarget(AST::MessageExprNode *node,
+	    bool &receiverIsSelf, std::string &reason);
+	void inlineSend(AST::MessageExprNode *node, AST::MethodNode *target,
+	    bool receiverIsSelf);
+	void log(AST::MessageExprNode *node, const std::string &decision);
+
+	void visitMethod(AST::MethodNode *node);
+	void visitBlockExpr(AST::BlockExprNode *node);
+	void visitInlinedBlockExpr(AST::BlockExprNode *node);
+	void visitMessageExpr(AST::MessageExprNode *node);
+};
+
+/*!
+ * The size of a method's body, counted in expression nodes, or -1 if it
+ * cannot be inlined at all (in which case reason says why).
+ */
+int inlinableSize(AST::MethodNode *method, std::string &reason);
+
+#endif /* INLINE_H_ */
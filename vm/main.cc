@@ -7,7 +7,23 @@
 #include "analyse.hh"
 #include "ast.hh"
 #include "driver.hh"
+#include "fold.hh"
 #include "generate.hh"
+#include "inline.hh"
+#include "options.hh"
+#include "profile.hh"
+#include "typecheck.hh"
+
+CompilerOptions options;
+
+static void
+usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0
+		  << " [--inline-threshold=N] [--inline-log=FILE]"
+		     " [--instrument | --profile=FILE] file.st...\n";
+	exit(EXIT_FAILURE);
+}
 
 template <typename T>void visit(std::vector<AST::DeclNode*>& decls)
 {
@@ -20,16 +36,40 @@ template <typename T>void visit(std::vector<AST::DeclNode*>& decls)
 int
 main(int argc, char *argv[])
 {
-	assert(argc >= 2);
+	std::ofstream inlineLog;
+	int firstFile;
+
+	for (firstFile = 1; firstFile < argc; firstFile++) {
+		std::string arg = argv[firstFile];
+
+		if (arg.compare(0, 2, "--") != 0)
+			break;
+		else if (arg.compare(0, 19, "--inline-threshold=") == 0)
+			options.inlineThreshold = std::stoul(arg.substr(19));
+		else if (arg.compare(0, 13, "--inline-log=") == 0) {
+			inlineLog.open(arg.substr(13));
+			options.inlineLog = &inlineLog;
+		} else if (arg == "--instrument")
+			options.instrument = true;
+		else if (arg.compare(0, 10, "--profile=") == 0) {
+			if (!options.profile)
+				options.profile = new Profile;
+			options.profile->load(arg.substr(10));
+		} else
+			usage(argv[0]);
+	}
+
+	if (firstFile == argc)
+		usage(argv[0]);
 
 	std::cout << "NetaScale(tm) Optimising Compiler for Valutron\n";
-	std::cout << "Compiling " << argc - 1 << " files\n";
+	std::cout << "Compiling " << argc - firstFile << " files\n";
 
 	auto outDir = std::filesystem::current_path() / "valuout";
 
 	std::vector<AST::DeclNode *> decls;
 
-	for (int i = 1; i < argc; i++) {
+	for (int i = firstFile; i < argc; i++) {
 		std::cout << "Parsing " << argv[i] << "...\n";
 		std::string fname = argv[i];
 		std::ifstream t(fname);
@@ -54,6 +94,15 @@ main(int argc, char *argv[])
 		decl->accept(visitor);
 	}
 
+	std::cout << "Optimising (inlining)...\n";
+	visit<InliningVisitor>(decls);
+
+	std::cout << "Optimising (constant folding)...\n";
+	visit<ConstantFoldingVisitor>(decls);
+
+	std::cout << "Analysing (types)...\n";
+	visit<TypeInferenceVisitor>(decls);
+
 	std::cout << "Generating code...\n";
 	std::vector<std::string> classes;
 	for (auto decl : decls) {
@@ -0,0 +1,34 @@
+/*!
+ * Options controlling the compiler, as set from the command line.
+ */
+
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <cstddef>
+#include <ostream>
+
+class Profile;
+
+struct CompilerOptions {
+	/*
+	 * Largest method body (counted in expression nodes) which the inliner
+	 * will splice into a caller. 0 disables inlining.
+	 */
+	size_t inlineThreshold = 12;
+	/* How many levels of inlined bodies may themselves be inlined into. */
+	size_t inlineDepth = 3;
+	/* If non-NULL, the inliner reports each of its decisions here. */
+	std::ostream *inlineLog = NULL;
+	/*
+	 * Whether to generate code which counts the receiver classes seen at
+	 * each send site, and how often each method is entered.
+	 */
+	bool instrument = false;
+	/* Profile from an instrumented run to guide optimisation, or NULL. */
+	Profile *profile = NULL;
+};
+
+extern CompilerOptions options;
+
+#endif /* OPTIONS_H_ */
@@ -183,7 +183,23 @@ method_defs(L) ::= method_defs(l) method_def(d). {
 method_def(D) ::= opt_class_meth_spec(isClass) selector_pattern(s)
     type_params_opt(tyParams) SQB_OPEN var_defs_opt(locals) statements(stmts)
 	dot_opt SQB_CLOSE. {
+	ExprStmtNode *first = dynamic_cast<ExprStmtNode *>(stmts.front());
+	PrimitiveExprNode *prim = first ?
+	    dynamic_cast<PrimitiveExprNode *>(first->expr) : NULL;
+
+	/* <#name> first: a primitive method, the rest its failure code */
+	if (prim && prim->args.empty())
+		stmts.erase(stmts.begin());
 	D = new MethodNode(isClass, s.m_sel, s.m_params, locals, stmts);
+	D->m_returnType = s.m_retType;
+	if (prim && prim->args.empty())
+		D->m_primitive = prim->name;
+}
+/* an empty body, which answers self */
+method_def(D) ::= opt_class_meth_spec(isClass) selector_pattern(s)
+    type_params_opt(tyParams) SQB_OPEN var_defs_opt(locals) SQB_CLOSE. {
+	D = new MethodNode(isClass, s.m_sel, s.m_params, locals, {});
+	D->m_returnType = s.m_retType;
 }
 
 %type opt_class_meth_spec { bool }
@@ -279,7 +295,7 @@ primary_expr(S) ::= LBRACKET assign_expr(s) RBRACKET.
 primary_expr ::= block_expr.
 primary_expr ::= literal_expr.
 primary_expr(S) ::= PRIMNUM(n) primary_list_opt(l) RCARET.
-		{ /*S = new PrimitiveExprNode(n.stringValue, l);*/ }
+		{ S = new PrimitiveExprNode(n.pos(), n.stringValue, l); }
 
 %type primary_list_opt { std::vector<ExprNode *> }
 %type primary_list { std::vector<ExprNode *> }
@@ -340,7 +356,7 @@ basic_literal_expr(S) ::= SYMBOL(s). {
 	S = new SymbolExprNode(s.pos(), removeFirstChar(s));
 }
 basic_literal_expr(S) ::= INTEGER(i). {
-	S = new IntExprNode(i.pos(), i.intValue);
+	S = new IntExprNode(i.pos(), i.stringValue);
 }
 basic_literal_expr(S) ::= FLOAT(f). {
 	S = new FloatExprNode(f.pos(), f);
@@ -452,14 +468,15 @@ binary_op_part(B) ::= COMMA.
 %type type_params_opt { std::vector<VarDecl> }
 %type type_param_parts { std::vector<VarDecl> }
 
-type_spec_opt ::= type_spec.
+type_spec_opt(T) ::= type_spec(t).
+		{ T = t; }
 type_spec_opt ::= .
 type_spec(T) ::= LBRACKET type(t) RBRACKET.
 		{ T = t; }
 
 /* basic or parameterised type */
 type(T) ::= identifier(ident) type_args_opt(args).
-		{ T = new Type(/*ident, args*/); }
+		{ T = new Type(ident, args); }
 /* union type */
 type(T) ::= type(t1) BAR type(t2). {
 	if (t1->m_kind == Type::kUnion) {
@@ -475,6 +492,9 @@ type(T) ::= type(t1) BAR type(t2). {
 /* block type */
 type(T) ::= SQB_OPEN UP type(r) block_arg_types_opt(a) SQB_CLOSE. {
 	T = new Type;
+	T->m_kind = Type::kBlock;
+	T->m_args = a;
+	T->m_args.insert(T->m_args.begin(), r);
 }
 
 %type block_arg_types_opt { std::vector<Type *> }
@@ -0,0 +1,89 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "analyse.hh"
+#include "profile.hh"
+
+/* a site is monomorphic enough to speculate on at this fraction of sends */
+static const double kDominantFraction = 0.9;
+/* nor do we speculate on sites seen fewer times than this */
+static const uint64_t kMinimumSends = 32;
+/* a method is hot if entered at least 1/kHotFraction as often as the most */
+static const uint64_t kHotFraction = 64;
+
+void
+Profile::load(const std::string &path)
+{
+	std::ifstream in(path);
+	std::string line;
+
+	if (!in.is_open())
+		throw std::runtime_error("Couldn't open profile " + path);
+
+	while (std::getline(in, line)) {
+		std::vector<std::string> fields;
+		std::stringstream stream(line);
+		std::string field;
+
+		while (std::getline(stream, field, '\t'))
+			fields.push_back(field);
+
+		if (fields.size() == 6 && fields[0] == "send") {
+			Site &site = sites[{ fields[1], std::stoi(fields[2]) }];
+			uint64_t count = std::stoull(fields[5]);
+
+			site.receivers[fields[4]] += count;
+			site.total += count;
+		} else if (fields.size() == 3 && fields[0] == "entry") {
+			uint64_t &count = entries[fields[1]];
+
+			count += std::stoull(fields[2]);
+			maxEntries = std::max(maxEntries, count);
+		}
+	}
+}
+
+const Profile::Site *
+Profile::site(AST::MethodNode *method, int index)
+{
+	auto it = sites.find({ method->qualifiedName(), index });
+	return it == sites.end() ? NULL : &it->second;
+}
+
+AST::ClassNode *
+Profile::dominantClass(AST::MethodNode *method, int index)
+{
+	const Site *aSite = site(method, index);
+
+	if (!aSite || aSite->total < kMinimumSends)
+		return NULL;
+
+	for (auto &receiver : aSite->receivers) {
+		NamespaceMemberVariable *member;
+
+		if (receiver.second < aSite->total * kDominantFraction)
+			continue;
+		/* only instance-side speculation is supported */
+		if ((member = smalltalkScope.lookup(receiver.first)) &&
+		    member->isClass())
+			return member->klass();
+	}
+
+	return NULL;
+}
+
+bool
+Profile::isHot(AST::MethodNode *method)
+{
+	auto it = entries.find(method->qualifiedName());
+	return it != entries.end() && it->second * kHotFraction >= maxEntries;
+}
+
+bool
+Profile::isCold(AST::MethodNode *method)
+{
+	return maxEntries != 0 &&
+	    entries.find(method->qualifiedName()) == entries.end();
+}
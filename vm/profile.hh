@@ -0,0 +1,47 @@
+/*!
+ * Receiver-class profiles, as written by a program compiled with --instrument,
+ * read back to guide optimisation of a later compilation.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "ast.hh"
+
+class Profile {
+    public:
+	struct Site {
+		/* receiver class name -> number of sends */
+		std::map<std::string, uint64_t> receivers;
+		uint64_t total = 0;
+	};
+
+    private:
+	/* (method, site index) -> site */
+	std::map<std::pair<std::string, int>, Site> sites;
+	/* method -> number of times entered */
+	std::map<std::string, uint64_t> entries;
+	uint64_t maxEntries = 0;
+
+    public:
+	/* Read a profile file, adding its counts to those already loaded. */
+	void load(const std::string &path);
+
+	const Site *site(AST::MethodNode *method, int index);
+	/*
+	 * The class to which (nearly) all the sends at a site were made, if
+	 * there was such a class and it was seen often enough to be worth
+	 * speculating on.
+	 */
+	AST::ClassNode *dominantClass(AST::MethodNode *method, int index);
+	/* Was the method among the most frequently entered? */
+	bool isHot(AST::MethodNode *method);
+	/* Was the method never entered at all? */
+	bool isCold(AST::MethodNode *method);
+};
+
+#endif /* PROFILE_H_ */
@@ -53,7 +53,6 @@ using namespace AST;
 
 #define p(x) yyextra->parse(TOK_##x)
 #define ps(x) yyextra->parse(TOK_##x, Token(yyextra->pos(), yytext))
-#define pi(x) yyextra->parse(TOK_##x, Token(yyextra->pos(), atoi(yytext)))
 #define pf(x) yyextra->parse(TOK_##x, Token(yyextra->pos(), strtod(yytext, NULL)))
 
 %}
@@ -87,17 +86,17 @@ RadixInteger [0-9]+r-?[0-9A-Z]+
 ${CharacterConstant}				{ ps(CHAR); }
 #{RegularChar}+					{ ps(SYMBOL); }
 {RadixInteger}(\.[0-9A-Z]+)?{Exponent}?		{ pf(FLOAT); }
--[0-9]+						{ pi(INTEGER); }
-[0-9]+						{ pi(INTEGER); }
+-[0-9]+						{ ps(INTEGER); }
+[0-9]+						{ ps(INTEGER); }
 [0-9]+(\.[0-9]+)?{Exponent}?			{ pf(FLOAT); }
 :{Identifier}					{ ps(COLONVAR); }
 {Identifier}:					{ ps(KEYWORD); }
 {Identifier}"."{Identifier}			{ ps(NAMESPACENAME); }
 {Identifier}					{ ps(IDENTIFIER); }
 '''(.*)'''					{ ps(STRING); }
-[']([^']|\\.)*[']			 	{ ps(STRING); }
+[']([^']|\\.|'')*[']		 	{ ps(STRING); }
 
-"<#"{RegularChar}+		{ yyextra->parse(TOK_PRIMNUM, yytext + 2); }
+"<#"({Letter}|{Digit}|:)+	{ yyextra->parse(TOK_PRIMNUM, yytext + 2); }
 
 "^"				{ p(UP); }
 "."				{ p(DOT); }
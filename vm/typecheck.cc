@@ -0,0 +1,546 @@
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+#include "analyse.hh"
+#include "ast.hh"
+#include "typecheck.hh"
+
+using compile_error = std::runtime_error;
+
+/*
+ * helpers
+ */
+static AST::StaticType
+classType(const std::string &name, bool exact)
+{
+	auto member = smalltalkScope.lookup(name);
+	AST::StaticType type;
+
+	if (member && member->isClass()) {
+		type.klass = member->klass();
+		type.exact = exact;
+		type.maybeNil = false;
+	}
+	return type;
+}
+
+/* The type of a value which may come from either of two places. */
+static AST::StaticType
+join(const AST::StaticType &a, const AST::StaticType &b)
+{
+	AST::StaticType type;
+
+	if (a.klass && a.klass == b.klass && a.classSide == b.classSide) {
+		type = a;
+		type.exact = a.exact && b.exact;
+		type.maybeNil = a.maybeNil || b.maybeNil;
+	}
+	return type;
+}
+
+/* The type of the value an inlined block answers. */
+static AST::StaticType
+lastType(AST::BlockExprNode *block)
+{
+	AST::ExprStmtNode *last;
+
+	if (block->m_stmts.empty() ||
+	    !(last = dynamic_cast<AST::ExprStmtNode *>(block->m_stmts.back())))
+		return {};
+	return last->expr->staticType;
+}
+
+/*
+ * Mark the self-recursive sends whose values a method returns as tail calls.
+ * They may be in the branches of inlined conditionals.
+ */
+static void
+markTailCalls(AST::MethodNode *method, AST::ExprNode *node)
+{
+	auto msg = dynamic_cast<AST::MessageExprNode *>(node);
+	auto block = dynamic_cast<AST::BlockExprNode *>(node);
+	AST::ExprStmtNode *last;
+
+	if (block && block->isInlined && !block->m_stmts.empty() &&
+	    (last = dynamic_cast<AST::ExprStmtNode *>(block->m_stmts.back())))
+		markTailCalls(method, last->expr);
+	else if (!msg)
+		return;
+	else if (msg->specialKind == AST::MessageExprNode::kFolded)
+		markTailCalls(method, msg->foldedTo);
+	else if (msg->specialKind == AST::MessageExprNode::kIfTrueIfFalse)
+		for (auto arg : msg->args)
+			markTailCalls(method, arg);
+	else if (msg->selfRecursive) {
+		msg->tailCall = true;
+		method->hasTailCalls = true;
+	}
+}
+
+static bool
+isSmiOperand(AST::ExprNode *node)
+{
+	auto msg = dynamic_cast<AST::MessageExprNode *>(node);
+
+	return node->staticType.is("SmallInteger") ||
+	    (msg && msg->unboxedSmi && smiArithmeticFunction(msg->selector));
+}
+
+/*
+ * Is node proven a Float (but for being nil; see genFloatTree()), or an
+ * unboxedFloat operation, which is typed as answering one?
+ */
+static bool
+isFloatOperand(AST::ExprNode *node)
+{
+	AST::StaticType type = node->staticType;
+
+	type.maybeNil = false;
+	return type.is("Float");
+}
+
+/* Can node be a SmallInteger or Float operand of an unboxedFloat operation? */
+static bool
+isNumberOperand(AST::ExprNode *node)
+{
+	return isFloatOperand(node) || isSmiOperand(node);
+}
+
+AST::StaticType
+resolveType(AST::Type *type)
+{
+	if (!type)
+		return {};
+
+	switch (type->m_kind) {
+	case AST::Type::kIdent:
+		/* type arguments don't concern us (yet) */
+		return classType(type->m_name, false);
+
+	case AST::Type::kUnion: {
+		AST::StaticType result = resolveType(type->m_unionMembers[0]);
+
+		for (auto member : type->m_unionMembers) {
+			AST::StaticType memberType = resolveType(member);
+
+			if (!memberType.isKnown())
+				return {};
+			while (result.klass &&
+			    !memberType.klass->isKindOf(result.klass))
+				result.klass = result.klass->m_superClass;
+		}
+		return result;
+	}
+
+	default:
+		return {};
+	}
+}
+
+const char *
+smiComparisonOperator(const std::string &selector)
+{
+	if (selector == "<" || selector == ">" || selector == "<=" ||
+	    selector == ">=")
+		return selector.c_str();
+	else if (selector == "=")
+		return "==";
+	else if (selector == "~=")
+		return "!=";
+	return NULL;
+}
+
+const char *
+smiArithmeticFunction(const std::string &selector)
+{
+	if (selector == "+")
+		return "vtrt_smiAdd";
+	else if (selector == "-")
+		return "vtrt_smiSub";
+	else if (selector == "*")
+		return "vtrt_smiMul";
+	else if (selector == "//")
+		return "vtrt_smiDiv";
+	else if (selector == "\\\\")
+		return "vtrt_smiMod";
+	return NULL;
+}
+
+const char *
+integerArithmeticFunction(const std::string &selector)
+{
+	if (selector == "+")
+		return "vtrt_integerAdd";
+	else if (selector == "-")
+		return "vtrt_integerSub";
+	else if (selector == "*")
+		return "vtrt_integerMul";
+	else if (selector == "//")
+		return "vtrt_integerDiv";
+	else if (selector == "\\\\")
+		return "vtrt_integerMod";
+	return NULL;
+}
+
+const char *
+floatArithmeticOperator(const std::string &selector)
+{
+	if (selector == "+" || selector == "-" || selector == "*" ||
+	    selector == "/")
+		return selector.c_str();
+	return NULL;
+}
+
+/*
+ * the pass
+ */
+AST::StaticType
+TypeInferenceVisitor::typeOf(Variable *var)
+{
+	AST::StaticType type;
+	auto bound = boundTypes.find(var);
+
+	if (bound != boundTypes.end())
+		return bound->second;
+
+	switch (var->kind) {
+	case Variable::kSelf:
+		type.klass = method->m_class;
+		type.classSide = method->m_isClassMethod;
+		type.maybeNil = false;
+		return type;
+
+	case Variable::kNil:
+		return classType("UndefinedObject", true);
+	case Variable::kTrue:
+		return classType("True", true);
+	case Variable::kFalse:
+		return classType("False", true);
+
+	case Variable::kNamespaceMember: {
+		auto member = static_cast<NamespaceMemberVariable *>(var);
+
+		if (member->isClass()) {
+			type.klass = member->klass();
+			type.classSide = true;
+			type.exact = true;
+			type.maybeNil = false;
+		}
+		return type;
+	}
+
+	default:
+		type = resolveType(var->declaredType);
+		if (!type.isKnown())
+			return type;
+
+		/* arguments are checked on entry to the method */
+		if (var->kind == Variable::kArgument)
+			type.maybeNil = false;
+		else if (var->kind == Variable::kLocal ||
+		    var->kind == Variable::kInlinedBlockLocal)
+			type.maybeNil = !assigned.count(var);
+		else
+			type.maybeNil = true;
+		return type;
+	}
+}
+
+AST::ClassNode *
+TypeInferenceVisitor::check(AST::StaticType declared, AST::StaticType actual,
+    AST::Node *where, const std::string &what)
+{
+	if (!declared.isKnown())
+		return NULL;
+
+	if (actual.isKnown() && !actual.maybeNil) {
+		/* metaclasses all inherit from the root class */
+		bool conforms = actual.classSide ?
+			  declared.klass->m_superClass == NULL :
+			  actual.klass->isKindOf(declared.klass);
+
+		if (conforms)
+			return NULL;
+		else if (actual.exact || actual.classSide ||
+		    !declared.klass->isKindOf(actual.klass))
+			throw compile_error(method->qualifiedName() + ": " +
+			    what + " is " +
+			    (actual.classSide ? "the class " : "a ") +
+			    actual.klass->m_name + ", not the declared " +
+			    declared.klass->m_name);
+	}
+
+	return declared.klass;
+}
+
+void
+TypeInferenceVisitor::visitMethod(AST::MethodNode *node)
+{
+	method = node;
+	scope = node->scope;
+	boundTypes.clear();
+	assigned.clear();
+	conditionalDepth = 0;
+	node->hasTailCalls = false;
+	AST::Visitor::visitMethod(node);
+	scope = node->scope->lexicalOuter;
+}
+
+void
+TypeInferenceVisitor::visitReturnStmt(AST::ReturnStmtNode *node)
+{
+	AST::Visitor::visitReturnStmt(node);
+	node->checkClass = check(resolveType(method->m_returnType),
+	    node->expr->staticType, node, "value returned");
+
+	/*
+	 * A call which can reuse the context must not leave it referenced
+	 * from elsewhere.
+	 */
+	if (!node->isNonLocalReturn && !method->scope->needsHeapContext &&
+	    method->scope->heapvars.empty())
+		markTailCalls(method, node->expr);
+}
+
+void
+TypeInferenceVisitor::visitBlockExpr(AST::BlockExprNode *node)
+{
+	/* a block may run any number of times, at any time */
+	scope = node->scope;
+	conditionalDepth++;
+	AST::Visitor::visitBlockExpr(node);
+	conditionalDepth--;
+	scope = node->scope->lexicalOuter;
+}
+
+void
+TypeInferenceVisitor::visitInlinedBlockExpr(AST::BlockExprNode *node)
+{
+	scope = node->scope;
+	conditionalDepth++;
+	AST::Visitor::visitBlockExpr(node);
+	conditionalDepth--;
+	scope = node->scope->lexicalOuter;
+	node->staticType = lastType(node);
+}
+
+void
+TypeInferenceVisitor::visitMessageExpr(AST::MessageExprNode *node)
+{
+	auto &rcvType = node->receiver->staticType;
+	auto ident = dynamic_cast<AST::IdentExprNode *>(node->receiver);
+	AST::MethodNode *target = NULL;
+
+	switch (node->specialKind) {
+	case AST::MessageExprNode::kFolded:
+		node->foldedTo->accept(*this);
+		node->staticType = node->foldedTo->staticType;
+		return;
+
+	case AST::MessageExprNode::kIfTrueIfFalse:
+		AST::Visitor::visitMessageExpr(node);
+		node->staticType = join(node->args[0]->staticType,
+		    node->args[1]->staticType);
+		return;
+
+	case AST::MessageExprNode::kToDo: {
+		auto block = static_cast<AST::BlockExprNode *>(node->args[1]);
+
+		node->receiver->accept(*this);
+		node->args[0]->accept(*this);
+		/* the counter runs from the receiver up to the limit */
+		if (rcvType.is("SmallInteger") &&
+		    node->args[0]->staticType.is("SmallInteger"))
+			boundTypes[&block->scope->arguments[0]] = rcvType;
+		block->accept(*this);
+		return;
+	}
+
+	case AST::MessageExprNode::kArrayLoop:
+		/* (the elements are of no known class) */
+		AST::Visitor::visitMessageExpr(node);
+		if (node->selector == "collect:" || node->selector == "select:" ||
+		    node->selector == "reject:" ||
+		    node->selector == "parallelCollect:")
+			node->staticType = classType("Array", true);
+		else if ((node->selector == "do:" && !node->fusesReceiver) ||
+		    node->selector == "parallelDo:")
+			node->staticType = rcvType;
+		else if (node->selector == "inject:into:" ||
+		    node->selector == "parallelInject:into:")
+			node->staticType = join(node->args[0]->staticType,
+			    node->args[1]->staticType);
+		return;
+
+	case AST::MessageExprNode::kInlinedSend: {
+		auto body = node->inlinedBody;
+		size_t firstArg = 0;
+		AST::StaticType declared;
+
+		AST::Visitor::visitMessageExpr(node);
+		if (node->inlinedSelf) {
+			AST::StaticType selfType = rcvType;
+
+			/* the body only runs if the guard succeeds */
+			if (node->guardClass) {
+				selfType.klass = node->guardClass;
+				selfType.classSide = false;
+				selfType.exact = true;
+				selfType.maybeNil = false;
+			}
+			boundTypes[node->inlinedSelf] = selfType;
+			firstArg = 1;
+		}
+		for (size_t i = 0; i < node->args.size(); i++)
+			boundTypes[&body->scope->arguments[firstArg + i]] =
+			    node->args[i]->staticType;
+
+		/* the body of an inlined send always runs (once) */
+		scope = body->scope;
+		AST::Visitor::visitBlockExpr(body);
+		scope = body->scope->lexicalOuter;
+		if (!node->guardClass)
+			node->staticType = lastType(body);
+
+		/* the value is as the method's return would have checked it */
+		declared = resolveType(node->inlinedMethod->m_returnType);
+		if (declared.isKnown()) {
+			node->inlinedCheckClass = check(declared, lastType(body),
+			    node, "value returned by inlined " +
+				node->inlinedMethod->qualifiedName());
+			if (node->inlinedCheckClass && !node->guardClass)
+				node->staticType = declared;
+		}
+		return;
+	}
+
+	default:
+		AST::Visitor::visitMessageExpr(node);
+	}
+
+	if (node->args.size() == 1 &&
+	    (smiComparisonOperator(node->selector) ||
+		smiArithmeticFunction(node->selector)) &&
+	    isSmiOperand(node->receiver) && isSmiOperand(node->args[0])) {
+		/*
+		 * The result may overflow into a LargeInteger, or be a Boolean,
+		 * so its class is not known.
+		 */
+		node->unboxedSmi = true;
+		return;
+	}
+
+	if ((node->args.size() == 1 &&
+		(smiComparisonOperator(node->selector) ||
+		    floatArithmeticOperator(node->selector)) &&
+		(isFloatOperand(node->receiver) ||
+		    isFloatOperand(node->args[0])) &&
+		isNumberOperand(node->receiver) &&
+		isNumberOperand(node->args[0])) ||
+	    (node->args.empty() && node->selector == "sqrt" &&
+		isFloatOperand(node->receiver))) {
+		/* arithmetic on Floats can't fail, and answers a Float */
+		node->unboxedFloat = true;
+		if (!smiComparisonOperator(node->selector))
+			node->staticType = classType("Float", true);
+		return;
+	}
+
+	if (ident && ident->isSuper()) {
+		if (method->m_class->m_superClass)
+			target = method->m_class->m_superClass->lookupMethod(
+			    node->selector, method->m_isClassMethod);
+	} else if (rcvType.isKnown() && !rcvType.maybeNil &&
+	    (rcvType.exact ||
+		!rcvType.klass->isOverriddenBelow(node->selector,
+		    rcvType.classSide)))
+		target = rcvType.klass->lookupMethod(node->selector,
+		    rcvType.classSide);
+
+	if (target) {
+		node->directTarget = target;
+		node->staticType = resolveType(target->m_returnType);
+	}
+
+	/* instantiating a known class answers an instance of exactly it */
+	if (target && rcvType.classSide && rcvType.exact &&
+	    (target->m_primitive == "basicNew" ||
+		target->m_primitive == "basicNew:")) {
+		node->staticType = AST::StaticType();
+		node->staticType.klass = rcvType.klass;
+		node->staticType.exact = true;
+		node->staticType.maybeNil = false;
+	}
+
+	/* the receiver's class is checked at run time if not known */
+	if (target == method ||
+	    (!target && node->selector == method->m_selector &&
+		!method->m_isClassMethod && !(ident && ident->isSuper())))
+		node->selfRecursive = true;
+}
+
+void
+TypeInferenceVisitor::visitAssignExpr(AST::AssignExprNode *node)
+{
+	Variable *var = node->left->variable;
+	AST::StaticType declared = resolveType(var->declaredType);
+
+	node->right->accept(*this);
+	node->checkClass = check(declared, node->right->staticType, node,
+	    "value assigned to " + node->left->id);
+	node->staticType = node->checkClass ? declared :
+						    node->right->staticType;
+	node->left->staticType = node->staticType;
+
+	if (conditionalDepth == 0)
+		assigned.insert(var);
+}
+
+void
+TypeInferenceVisitor::visitIdentExpr(AST::IdentExprNode *node)
+{
+	/* a propagated literal */
+	if (node->constant) {
+		node->constant->accept(*this);
+		if ((node->staticType = node->constant->staticType).isKnown())
+			return;
+	}
+	node->staticType = typeOf(node->variable);
+}
+
+void
+TypeInferenceVisitor::visitIntExpr(AST::IntExprNode *node)
+{
+	node->staticType = classType(node->className(), true);
+}
+
+void
+TypeInferenceVisitor::visitCharExpr(AST::CharExprNode *node)
+{
+	node->staticType = classType("Character", true);
+}
+
+void
+TypeInferenceVisitor::visitSymbolExpr(AST::SymbolExprNode *node)
+{
+	node->staticType = classType("Symbol", true);
+}
+
+void
+TypeInferenceVisitor::visitStringExpr(AST::StringExprNode *node)
+{
+	node->staticType = classType("String", true);
+}
+
+void
+TypeInferenceVisitor::visitFloatExpr(AST::FloatExprNode *node)
+{
+	node->staticType = classType("Float", true);
+}
+
+void
+TypeInferenceVisitor::visitArrayExpr(AST::ArrayExprNode *node)
+{
+	node->staticType = classType("Array", true);
+}
@@ -0,0 +1,105 @@
+/*!
+ * Type checking and inference from declared Type annotations.
+ */
+
+#ifndef TYPECHECK_H_
+#define TYPECHECK_H_
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "analyse.hh"
+#include "ast.hh"
+
+/*!
+ * Propagates the classes of values through each method, starting from
+ * literals, self, references to classes, and the declared types of variables
+ * and method returns, and decorates the tree with what it proves:
+ *
+ * - the staticType of each expression;
+ * - a directTarget for each send whose receiver's class is known well enough
+ *   to tell which method it will invoke;
+ * - unboxedSmi, for arithmetic and comparisons on proven SmallIntegers;
+ * - unboxedFloat, for arithmetic and comparisons on proven Floats;
+ * - selfRecursive, for sends which may reenter the method they are in, and
+ *   tailCall, for those of them whose value it returns;
+ * - a checkClass for each assignment or return whose value isn't proven to
+ *   conform to the declared type, which then must be checked at run time.
+ *
+ * Declared types don't admit nil, but a variable may yet be nil before it is
+ * first assigned: instance variables are always assumed possibly nil, and
+ * locals until assigned unconditionally. Arguments are checked on entry to a
+ * method. Values which are proven to be of the wrong class are reported as
+ * compile errors.
+ *
+ * This runs after inlining, so that it sees the bodies spliced into callers.
+ * The temporaries an inlined callee's arguments are bound to take the types of
+ * the actual arguments.
+ */
+class TypeInferenceVisitor : public AST::Visitor {
+	AST::MethodNode *method;
+	/* current scope */
+	Scope *scope;
+	/* types of the temporaries bound by inlining and optimised loops */
+	std::map<Variable *, AST::StaticType> boundTypes;
+	/* declared locals which have by now been unconditionally assigned */
+	std::set<Variable *> assigned;
+	/*
+	 * how many blocks, which may not run or may run repeatedly, we are
+	 * within
+	 */
+	int conditionalDepth;
+
+	AST::StaticType typeOf(Variable *var);
+	/*
+	 * Check a value of type actual is acceptable where declared is
+	 * required. Returns NULL if proven, else the class to check it against
+	 * at run time; fails if it can never be.
+	 */
+	AST::ClassNode *check(AST::StaticType declared, AST::StaticType actual,
+	    AST::Node *where, const std::string &what);
+
+	void visitMethod(AST::MethodNode *node);
+	void visitReturnStmt(AST::ReturnStmtNode *node);
+	void visitBlockExpr(AST::BlockExprNode *node);
+	void visitInlinedBlockExpr(AST::BlockExprNode *node);
+	void visitMessageExpr(AST::MessageExprNode *node);
+	void visitAssignExpr(AST::AssignExprNode *node);
+	void visitIdentExpr(AST::IdentExprNode *node);
+	void visitIntExpr(AST::IntExprNode *node);
+	void visitCharExpr(AST::CharExprNode *node);
+	void visitSymbolExpr(AST::SymbolExprNode *node);
+	void visitStringExpr(AST::StringExprNode *node);
+	void visitFloatExpr(AST::FloatExprNode *node);
+	void visitArrayExpr(AST::ArrayExprNode *node);
+};
+
+/*!
+ * The StaticType of a value of a declared type: unknown unless the type names
+ * a class we know of. Union types give their members' common superclass.
+ */
+AST::StaticType resolveType(AST::Type *type);
+
+/*!
+ * The C operator implementing a comparison between SmallIntegers, or NULL if
+ * the selector isn't one.
+ */
+const char *smiComparisonOperator(const std::string &selector);
+/*!
+ * The name of the vtrt.h helper implementing an arithmetic operation on
+ * SmallIntegers (with overflow detection), or NULL if the selector isn't one.
+ */
+const char *smiArithmeticFunction(const std::string &selector);
+/*!
+ * The name of the vtrt.h function doing the same on any integers, by which an
+ * operation on SmallIntegers that overflows is redone, or NULL.
+ */
+const char *integerArithmeticFunction(const std::string &selector);
+/*!
+ * The C operator implementing an arithmetic operation on Floats, or NULL if the
+ * selector isn't one. (Comparisons are as smiComparisonOperator().)
+ */
+const char *floatArithmeticOperator(const std::string &selector);
+
+#endif /* TYPECHECK_H_ */